@@ -0,0 +1,56 @@
+/**
+ * Example: WWDiskCacheOpenW
+ *
+ * Opens an on-disk HTTP cache under %LOCALAPPDATA% and uses it for both a
+ * query and a download. Run the example twice: the second run (or a second
+ * process started in parallel) is served from the cache while the entries
+ * are fresh, and revalidated with If-None-Match / If-Modified-Since after.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void)
+{
+    WCHAR directory[MAX_PATH];
+    _snwprintf_s(directory, MAX_PATH, _TRUNCATE, L"%s\\WinWebCache",
+                 _wgetenv(L"LOCALAPPDATA"));
+
+    WW_DISKCACHE* cache = WWDiskCacheOpenW(directory, 256ULL * 1024 * 1024, 0);
+    if (cache == NULL)
+    {
+        wprintf(L"Could not open disk cache in %s\n", directory);
+        return 1;
+    }
+
+    WW_REQUESTW request = {
+        .url       = L"https://httpbin.org/cache/300",
+        .verb      = L"GET",
+        .diskCache = cache
+    };
+    WW_RESPONSEW response = {0};
+
+    if (WWQueryExW(&request, &response) == WW_SUCCESS)
+    {
+        wprintf(L"query: status %lu, %zu bytes\n",
+                response.statusCode, response.dataSize);
+    }
+    WWFreeResponseW(&response);
+
+    WW_PARAMSW params = {
+        .url              = L"https://httpbin.org/image/png",
+        .dstPath          = L".\\",
+        .outFileName      = L"cached.png",
+        .userAgent        = WW_DEFAULT_USER_AGENTW,
+        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
+        .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+        .diskCache        = cache
+    };
+
+    int result = WWDownloadExW(&params);
+    wprintf(L"download: %s\n", result == WW_SUCCESS ? L"ok" : L"failed");
+
+    WWDiskCacheClose(cache);
+    return result;
+}
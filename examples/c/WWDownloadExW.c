@@ -2,7 +2,8 @@
  * Example: WWDownloadExW
  *
  * Downloads a file using the extended WW_PARAMSW struct, giving full control
- * over user agent, redirect limit, progress callback, and more.
+ * over user agent, redirect limit, progress callback, and more. The SHA-256
+ * of the file is computed while it is written and printed when done.
  */
 
 #include "../../source/winweb.h"
@@ -38,14 +39,20 @@ int main(void)
         .progressBarFlags   = pbFlags,
         .progressBarData    = {0},
         .progressCallback   = progressCallback,
-        .pCallbackData      = NULL
+        .pCallbackData      = NULL,
+        .hashAlgorithm      = WW_HASH_SHA256
     };
 
     int result = WWDownloadExW(&params);
 
     wprintf(L"\n");
     if (result == WW_SUCCESS)
-        wprintf(L"Download complete.\n");
+    {
+        wprintf(L"Download complete. SHA-256: ");
+        for (DWORD i = 0; i < params.digestSize; i++)
+            wprintf(L"%02x", params.digest[i]);
+        wprintf(L"\n");
+    }
     else
         wprintf(L"Download failed (errorcode %d)\n", params.errorcode);
 
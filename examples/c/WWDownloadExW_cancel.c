@@ -0,0 +1,69 @@
+/**
+ * Example: WWDownloadExW with a cancellation token
+ *
+ * Downloads an installer and a release manifest on behalf of a UI that has a
+ * Cancel button. Both calls share one token. Pressing the button (simulated
+ * here with a timer thread) closes their connections at once, even while a
+ * read is blocked on a server that stopped sending, and both calls fail with
+ * WW_ERR_CANCELLED instead of waiting out the receive timeout.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static DWORD WINAPI cancelButton(LPVOID param)
+{
+    Sleep(5000);
+    WWCancel((WW_CANCEL*)param);
+    return 0;
+}
+
+int main(void)
+{
+    WW_CANCEL* cancel = WWCancelOpen();
+    if (cancel == NULL)
+    {
+        return 1;
+    }
+
+    HANDLE hThread = CreateThread(NULL, 0, cancelButton, cancel, 0, NULL);
+
+    WW_REQUESTW request = {
+        .url    = L"https://releases.example.com/latest.json",
+        .cancel = cancel,
+        .retry  = { .maxAttempts = 3 }
+    };
+    WW_RESPONSEW response = {0};
+    if (WWQueryExW(&request, &response) != WW_SUCCESS &&
+        response.errorcode == WW_ERR_CANCELLED)
+    {
+        wprintf(L"Manifest request cancelled\n");
+    }
+    WWFreeResponseW(&response);
+
+    WW_PARAMSW params = {
+        .url           = L"https://releases.example.com/setup.exe",
+        .dstPath       = L"C:\\Downloads\\",
+        .outFileName   = L"setup.exe",
+        .headerLength  = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload = TRUE,
+        .cancel        = cancel,
+        .retry         = { .maxAttempts = 3 }
+    };
+
+    int result = WWDownloadExW(&params);
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete\n");
+    else if (params.errorcode == WW_ERR_CANCELLED)
+        wprintf(L"Download cancelled\n");
+    else
+        wprintf(L"Download failed (errorcode %d)\n", params.errorcode);
+
+    if (hThread != NULL)
+    {
+        WaitForSingleObject(hThread, INFINITE);
+        CloseHandle(hThread);
+    }
+    WWCancelClose(cancel);
+    return result;
+}
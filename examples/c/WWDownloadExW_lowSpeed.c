@@ -0,0 +1,37 @@
+/**
+ * Example: WWDownloadExW with low-speed detection
+ *
+ * Fetches a nightly build from a server whose connections sometimes degrade
+ * to a trickle without ever going silent. When a connection stays below
+ * 50 KB/s for 20 s, it is closed and the download continues at once from
+ * the current offset on a new one. After ten such restarts the download
+ * fails with WW_ERR_STALLED, and the retry policy takes over.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_PARAMSW params = {
+        .url              = L"https://builds.example.com/nightly/build.zip",
+        .dstPath          = L"C:\\Downloads\\",
+        .outFileName      = L"build.zip",
+        .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload    = TRUE,
+        .lowSpeedLimit    = 50 * 1000,
+        .lowSpeedTimeMs   = 20000,
+        .maxStallRestarts = 10,
+        .retry            = { .maxAttempts = 3 }
+    };
+
+    int result = WWDownloadExW(&params);
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete; %u stalled connection(s) restarted\n",
+                params.stallRestarts);
+    else
+        wprintf(L"Download failed (errorcode %d) after %u attempt(s)\n",
+                params.errorcode, params.attempts);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+/**
+ * Example: WWDownloadExW with mirrors
+ *
+ * Fetches a release image from its primary server and two mirrors at once,
+ * over 6 connections in total. Faster mirrors are given more of the ranges,
+ * and when one mirror is done early it takes over half of what a slower one
+ * still has to send. A mirror that fails or serves a different file is
+ * dropped; the download carries on as long as one source is left.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    LPCWSTR mirrors[] = {
+        L"https://mirror-eu.example.org/releases/ubuntu.iso",
+        L"https://mirror-us.example.net/pub/ubuntu/ubuntu.iso"
+    };
+
+    WW_PARAMSW params = {
+        .url           = L"https://example.com/releases/ubuntu.iso",
+        .dstPath       = L"C:\\Downloads\\",
+        .outFileName   = L"ubuntu.iso",
+        .headerLength  = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload = TRUE,
+        .segments      = 6,
+        .mirrors       = mirrors,
+        .mirrorCount   = ARRAYSIZE(mirrors),
+        .journal       = TRUE
+    };
+
+    int result = WWDownloadExW(&params);
+
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete\n");
+    else
+        wprintf(L"Download failed (errorcode %d)\n", params.errorcode);
+
+    return result;
+}
@@ -0,0 +1,56 @@
+/**
+ * Example: WWDownloadExW with bandwidth limits
+ *
+ * Keeps nightly mirror jobs from saturating a shared WAN link. The whole
+ * process may use 8 MB/s, downloads from the package host at most 4 MB/s
+ * together, and the ISO job shares a 2 MB/s limiter with nobody. After the
+ * business day the ISO limit is lifted to 6 MB/s while the download runs.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static WW_RATELIMIT* isoLimit;
+
+static void progressCallback(const WWPBARINFO* info, LPVOID userData)
+{
+    (void)userData;
+    if (info->szTotalInBytes > 0 &&
+        info->szDownloadedInBytes * 2 >= info->szTotalInBytes)
+    {
+        // Takes effect within 100 ms, also for reads waiting on the limiter
+        WWRateLimitSet(isoLimit, 6 * 1000 * 1000, 0);
+    }
+}
+
+int main(void)
+{
+    WWSetGlobalRateLimit(8 * 1000 * 1000, 256 * 1024);
+    WWSetHostRateLimitW(L"packages.example.com", 4 * 1000 * 1000, 0);
+
+    isoLimit = WWRateLimitOpen(2 * 1000 * 1000, 64 * 1024);
+    if (isoLimit == NULL)
+    {
+        return 1;
+    }
+
+    WW_PARAMSW params = {
+        .url              = L"https://releases.example.com/ubuntu.iso",
+        .dstPath          = L"C:\\Downloads\\",
+        .outFileName      = L"ubuntu.iso",
+        .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload    = TRUE,
+        .segments         = 4,
+        .rateLimit        = isoLimit,
+        .progressCallback = progressCallback
+    };
+
+    int result = WWDownloadExW(&params);
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete\n");
+    else
+        wprintf(L"Download failed (errorcode %d)\n", params.errorcode);
+
+    WWRateLimitClose(isoLimit);
+    return result;
+}
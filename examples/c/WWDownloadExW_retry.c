@@ -0,0 +1,52 @@
+/**
+ * Example: WWDownloadExW with a retry policy
+ *
+ * Downloads a large file over a flaky link. Up to 8 attempts are made with
+ * exponential backoff between them. When the connection drops mid-transfer,
+ * the next attempt keeps what is already in the temporary file and asks the
+ * server for the rest with Range and If-Range. A failed 3-hour download does
+ * not start over from zero.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static void progressCallback(const WWPBARINFO* info, LPVOID userData)
+{
+    (void)userData;
+    if (info->szTotalInBytes > 0)
+    {
+        int pct = (int)((info->szDownloadedInBytes * 100) / info->szTotalInBytes);
+        wprintf(L"\rProgress: %d%%   ", pct);
+    }
+}
+
+int main(void)
+{
+    WW_PARAMSW params = {
+        .url              = L"https://example.com/large.iso",
+        .dstPath          = L"C:\\Downloads\\",
+        .outFileName      = L"large.iso",
+        .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload    = TRUE,
+        .receiveTimeoutMs = 60000,
+        .progressCallback = progressCallback,
+        .retry            = {
+            .maxAttempts = 8,
+            .baseDelayMs = 1000,
+            .maxDelayMs  = 60000,
+            .retryOn     = WW_RETRY_NETWORK | WW_RETRY_5XX | WW_RETRY_429
+        }
+    };
+
+    int result = WWDownloadExW(&params);
+
+    wprintf(L"\n");
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete after %u attempt(s)\n", params.attempts);
+    else
+        wprintf(L"Download failed after %u attempt(s) (errorcode %d)\n",
+                params.attempts, params.errorcode);
+
+    return result;
+}
@@ -0,0 +1,49 @@
+/**
+ * Example: WWDownloadExW with segments and a journal
+ *
+ * Fetches a large file as 8 parallel byte ranges. Progress of every range is
+ * recorded in "ubuntu.iso~journal" next to the temporary file. If the process
+ * is killed or the machine reboots, running the program again fetches only
+ * the ranges the journal does not cover, as long as the server still has the
+ * same file (same ETag or Last-Modified and size).
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static void progressCallback(const WWPBARINFO* info, LPVOID userData)
+{
+    (void)userData;
+    if (info->szTotalInBytes > 0)
+    {
+        int pct = (int)((info->szDownloadedInBytes * 100) / info->szTotalInBytes);
+        wprintf(L"\rProgress: %d%%   ", pct);
+    }
+}
+
+int main(void)
+{
+    WW_PARAMSW params = {
+        .url              = L"https://example.com/releases/ubuntu.iso",
+        .dstPath          = L"C:\\Downloads\\",
+        .outFileName      = L"ubuntu.iso",
+        .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+        .forceDownload    = TRUE,
+        .segments         = 8,
+        .journal          = TRUE,
+        .hashAlgorithm    = WW_HASH_SHA256,
+        .progressCallback = progressCallback,
+        .retry            = { .maxAttempts = 5 }
+    };
+
+    int result = WWDownloadExW(&params);
+
+    wprintf(L"\n");
+    if (result == WW_SUCCESS)
+        wprintf(L"Download complete after %u attempt(s)\n", params.attempts);
+    else
+        wprintf(L"Download interrupted (errorcode %d); run again to resume\n",
+                params.errorcode);
+
+    return result;
+}
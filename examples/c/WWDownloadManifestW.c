@@ -0,0 +1,45 @@
+/**
+ * Example: WWDownloadManifestW
+ *
+ * Mirrors a release tree listed in a TSV manifest, for example:
+ *
+ *   # path              size     sha256     url            mirror
+ *   tools/setup.exe     1048576  9f86d0...  https://...    https://...
+ *   docs/manual.pdf     20480    2c26b4...  https://...
+ *
+ * 32 files are fetched at a time. Files whose local copy already has the
+ * listed size and SHA-256 are skipped, so running the program again only
+ * fetches what changed or failed.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static void fileCallback(const WW_MANIFEST_RESULTW* result, LPVOID userData)
+{
+    (void)userData;
+    if (result->result != WW_SUCCESS)
+        wprintf(L"FAILED  %s (errorcode %d)\n", result->path, result->errorcode);
+    else if (!result->skipped)
+        wprintf(L"fetched %s\n", result->path);
+}
+
+int main(void)
+{
+    WW_MANIFEST_OPTIONSW options = {
+        .manifestPath   = L"C:\\Releases\\manifest.tsv",
+        .dstPath        = L"C:\\Releases\\tree\\",
+        .maxConcurrency = 32,
+        .retry          = { .maxAttempts = 3 },
+        .fileCallback   = fileCallback
+    };
+
+    int result = WWDownloadManifestW(&options);
+
+    wprintf(L"%llu fetched, %llu up to date, %llu failed\n",
+            options.filesDownloaded, options.filesSkipped, options.filesFailed);
+    if (options.errorcode == WW_ERR_MANIFEST)
+        wprintf(L"The manifest could not be read to the end\n");
+
+    return result;
+}
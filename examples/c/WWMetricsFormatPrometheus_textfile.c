@@ -0,0 +1,69 @@
+/**
+ * Example: exporting WinWeb metrics to Prometheus
+ *
+ * Runs a few queries, then renders the process-wide metrics in the
+ * Prometheus text format and writes them where the node_exporter (or
+ * windows_exporter) textfile collector picks them up. An HTTP endpoint the
+ * application already serves can return the same text from its handler.
+ * The file is replaced in one step so the collector never reads half of it.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static BOOL WriteMetricsFile(LPCWSTR path, LPCWSTR tempPath)
+{
+    SIZE_T length = WWMetricsFormatPrometheus(NULL, NULL, 0);
+    // Counters may grow between the two calls; leave some room
+    SIZE_T size = length + 4096;
+    LPSTR text = (LPSTR)malloc(size);
+    if (NULL == text)
+        return FALSE;
+    length = WWMetricsFormatPrometheus(NULL, text, size);
+
+    BOOL ok = FALSE;
+    HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE != hFile)
+    {
+        DWORD written = 0;
+        ok = length < size &&
+             WriteFile(hFile, text, (DWORD)length, &written, NULL) &&
+             written == length;
+        CloseHandle(hFile);
+        ok = ok && MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING);
+    }
+    free(text);
+    return ok;
+}
+
+int main(void)
+{
+    LPCWSTR urls[] = {
+        L"https://httpbin.org/get",
+        L"https://httpbin.org/status/404",
+        L"https://httpbin.org/redirect/2"
+    };
+
+    for (int i = 0; i < 3; i++)
+    {
+        WW_REQUESTW request = { .url = urls[i], .maxRedirectLimit = 5 };
+        WW_RESPONSEW response = {0};
+        WWQueryExW(&request, &response);
+        WWFreeResponseW(&response);
+    }
+
+    WW_METRICS metrics;
+    WWMetricsSnapshot(&metrics);
+    wprintf(L"%llu request(s) answered 2xx, %llu redirect(s) followed\n",
+            metrics.requests[WW_STATUS_CLASS_2XX], metrics.redirects);
+
+    if (FALSE == WriteMetricsFile(L"C:\\metrics\\winweb.prom",
+                                  L"C:\\metrics\\winweb.prom.tmp"))
+    {
+        wprintf(L"Writing the metrics failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * Example: WWMultipartUploadW
+ *
+ * Uploads a large file with the S3 multipart API: one POST starts the upload
+ * and returns an UploadId, each part is PUT on its own connection, and a final
+ * POST lists the part ETags. Requests are not signed, so point it at an
+ * S3-compatible server that accepts anonymous writes (such as a local MinIO
+ * bucket with a public policy) or at a signing proxy.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+#include <string.h>
+
+#define OBJECT_URL L"http://localhost:9000/backups/disk.vhdx"
+
+typedef struct {
+    WCHAR uploadId[256];
+    char completeXml[256 * 1024];
+} S3_UPLOAD;
+
+// Response bodies are not NUL-terminated
+static const char* FindText(const WW_RESPONSEW* response, const char* text)
+{
+    SIZE_T len = strlen(text);
+    for (SIZE_T i = 0; i + len <= response->dataSize; i++)
+    {
+        if (memcmp(response->data + i, text, len) == 0)
+        {
+            return (const char*)response->data + i;
+        }
+    }
+    return NULL;
+}
+
+static BOOL S3Prepare(WW_MULTIPART_CALL* call, LPVOID pUserData)
+{
+    S3_UPLOAD* s3 = (S3_UPLOAD*)pUserData;
+
+    switch (call->phase)
+    {
+        case WW_MULTIPART_INITIATE:
+            call->request.url = OBJECT_URL L"?uploads";
+            return TRUE;
+
+        case WW_MULTIPART_UPLOAD_PART:
+            _snwprintf_s(call->url, INTERNET_MAX_URL_LENGTH, _TRUNCATE,
+                         OBJECT_URL L"?partNumber=%u&uploadId=%ls",
+                         call->part->partNumber, s3->uploadId);
+            call->request.url = call->url;
+            return TRUE;
+
+        case WW_MULTIPART_COMPLETE:
+        {
+            int used = _snprintf_s(s3->completeXml, sizeof(s3->completeXml), _TRUNCATE,
+                                   "<CompleteMultipartUpload>");
+            for (UINT i = 0; i < call->partCount && used > 0; i++)
+            {
+                int n = _snprintf_s(s3->completeXml + used, sizeof(s3->completeXml) - used,
+                                    _TRUNCATE,
+                                    "<Part><PartNumber>%u</PartNumber><ETag>%ls</ETag></Part>",
+                                    call->parts[i].partNumber, call->parts[i].tag);
+                used = (n < 0) ? -1 : used + n;
+            }
+            if (used < 0 ||
+                _snprintf_s(s3->completeXml + used, sizeof(s3->completeXml) - used,
+                            _TRUNCATE, "</CompleteMultipartUpload>") < 0)
+            {
+                return FALSE;
+            }
+
+            _snwprintf_s(call->url, INTERNET_MAX_URL_LENGTH, _TRUNCATE,
+                         OBJECT_URL L"?uploadId=%ls", s3->uploadId);
+            call->request.url = call->url;
+            call->request.contentType = L"application/xml";
+            call->request.body = s3->completeXml;
+            call->request.bodySize = (DWORD)strlen(s3->completeXml);
+            return TRUE;
+        }
+
+        case WW_MULTIPART_ABORT:
+            _snwprintf_s(call->url, INTERNET_MAX_URL_LENGTH, _TRUNCATE,
+                         OBJECT_URL L"?uploadId=%ls", s3->uploadId);
+            call->request.url = call->url;
+            call->request.verb = L"DELETE";
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static BOOL S3Response(WW_MULTIPART_CALL* call, const WW_RESPONSEW* response,
+                       LPVOID pUserData)
+{
+    S3_UPLOAD* s3 = (S3_UPLOAD*)pUserData;
+
+    if (call->phase == WW_MULTIPART_INITIATE)
+    {
+        const char* start = FindText(response, "<UploadId>");
+        const char* end = FindText(response, "</UploadId>");
+        if (start == NULL || end == NULL || end < start)
+        {
+            return FALSE;
+        }
+        start += strlen("<UploadId>");
+        int n = MultiByteToWideChar(CP_UTF8, 0, start, (int)(end - start),
+                                    s3->uploadId, ARRAYSIZE(s3->uploadId) - 1);
+        s3->uploadId[n] = L'\0';
+        return n > 0;
+    }
+
+    if (call->phase == WW_MULTIPART_UPLOAD_PART)
+    {
+        // CompleteMultipartUpload needs every part's ETag, quotes included
+        return WWGetResponseHeaderW(response, L"ETag", call->part->tag,
+                                    ARRAYSIZE(call->part->tag));
+    }
+
+    // CompleteMultipartUpload can fail with a 200 status and an error body
+    if (call->phase == WW_MULTIPART_COMPLETE)
+    {
+        return FindText(response, "<Error>") == NULL;
+    }
+    return TRUE;
+}
+
+static VOID OnProgress(ULONGLONG sentBytes, ULONGLONG totalBytes, LPVOID pUserData)
+{
+    wprintf(L"\r%llu / %llu bytes", sentBytes, totalBytes);
+}
+
+int main(void)
+{
+    static S3_UPLOAD s3 = {0};
+
+    WW_MULTIPART_OPTIONSW options = {
+        .filePath         = L"C:\\Temp\\disk.vhdx",
+        .partSize         = 16 * 1024 * 1024,
+        .maxConcurrency   = 6,
+        .hashAlgorithm    = WW_HASH_SHA256,
+        .adapter          = { S3Prepare, S3Response, &s3 },
+        .progressCallback = OnProgress
+    };
+
+    int result = WWMultipartUploadW(&options);
+    if (result == WW_SUCCESS)
+    {
+        wprintf(L"\nUploaded, %u attempts retried\n", options.retries);
+    }
+    else
+    {
+        wprintf(L"\nUpload failed (errorcode %d, status %lu)\n",
+                options.errorcode, options.statusCode);
+    }
+    return result;
+}
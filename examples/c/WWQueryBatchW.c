@@ -0,0 +1,45 @@
+/**
+ * Example: WWQueryBatchW
+ *
+ * Fetches several URLs concurrently. The batch shares connections per
+ * origin and reports per-request status and timing.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+#define REQUEST_COUNT 8
+
+int main(void)
+{
+    WW_REQUESTW requests[REQUEST_COUNT] = {0};
+    WW_RESPONSEW responses[REQUEST_COUNT] = {0};
+    WW_BATCH_RESULT results[REQUEST_COUNT] = {0};
+    WCHAR urls[REQUEST_COUNT][64];
+
+    for (int i = 0; i < REQUEST_COUNT; i++)
+    {
+        _snwprintf_s(urls[i], 64, _TRUNCATE, L"https://httpbin.org/delay/%d", i % 3);
+        requests[i].url  = urls[i];
+        requests[i].verb = L"GET";
+    }
+
+    WW_BATCH_OPTIONS options = {
+        .maxConcurrency = 4,
+        .session        = NULL,
+        .results        = results
+    };
+
+    int result = WWQueryBatchW(requests, responses, REQUEST_COUNT, &options);
+
+    for (int i = 0; i < REQUEST_COUNT; i++)
+    {
+        wprintf(L"%-36s status %3lu  start %6llu ms  took %6llu ms%s\n",
+                urls[i], responses[i].statusCode,
+                results[i].startUs / 1000, results[i].elapsedUs / 1000,
+                results[i].result == WW_SUCCESS ? L"" : L"  FAILED");
+        WWFreeResponseW(&responses[i]);
+    }
+
+    return result;
+}
@@ -0,0 +1,51 @@
+/**
+ * Example: tracing a batch run into a Chrome trace file
+ *
+ * Runs a batch with the built-in trace sink installed, then writes
+ * batch-trace.json. Load it in chrome://tracing or https://ui.perfetto.dev:
+ * each worker thread shows its queries as nested spans (URL cracking,
+ * connect, send, header queries, redirects and every body read), so idle
+ * workers and requests waiting on one another stand out.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+#define REQUEST_COUNT 16
+
+int main(void)
+{
+    WW_REQUESTW requests[REQUEST_COUNT] = {0};
+    WW_RESPONSEW responses[REQUEST_COUNT] = {0};
+    WCHAR urls[REQUEST_COUNT][64];
+
+    for (int i = 0; i < REQUEST_COUNT; i++)
+    {
+        _snwprintf_s(urls[i], 64, _TRUNCATE, L"https://httpbin.org/bytes/%d",
+                     (i + 1) * 4096);
+        requests[i].url = urls[i];
+    }
+
+    WW_TRACESINK* sink = WWTraceSinkOpenW(L"batch-trace.json");
+    if (sink == NULL)
+    {
+        return 1;
+    }
+    WWSetTraceCallback(WWTraceSinkEvent, sink);
+
+    WW_BATCH_OPTIONS options = { .maxConcurrency = 4 };
+    int result = WWQueryBatchW(requests, responses, REQUEST_COUNT, &options);
+
+    // Waits for events still being written before the sink goes away
+    WWSetTraceCallback(NULL, NULL);
+    if (WWTraceSinkClose(sink) != WW_SUCCESS)
+        wprintf(L"Writing the trace failed\n");
+    else
+        wprintf(L"Trace written to batch-trace.json\n");
+
+    for (int i = 0; i < REQUEST_COUNT; i++)
+    {
+        WWFreeResponseW(&responses[i]);
+    }
+    return result;
+}
@@ -2,7 +2,8 @@
  * Example: WWQueryExW
  *
  * Sends an HTTP request using the full WW_REQUESTW struct, giving control
- * over user agent, custom headers, redirect limit, and logging.
+ * over user agent, custom headers, redirect limit, and logging. The response
+ * is requested compressed and decoded on the fly.
  */
 
 #include "../../source/winweb.h"
@@ -21,7 +22,8 @@ int main(void)
         .bodySize         = (DWORD)(sizeof(body) - 1),
         .headers          = L"X-Custom-Header: example\r\n",
         .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
-        .logEnabled       = FALSE
+        .logEnabled       = FALSE,
+        .acceptEncoding   = TRUE
     };
 
     WW_RESPONSEW response = {0};
@@ -30,7 +32,8 @@ int main(void)
 
     if (result == WW_SUCCESS)
     {
-        wprintf(L"Status: %lu\n", response.statusCode);
+        wprintf(L"Status: %lu (%llu bytes on the wire)\n",
+                response.statusCode, response.wireSize);
         wprintf(L"Body (%zu bytes):\n%.*S\n",
                 response.dataSize, (int)response.dataSize,
                 (const char*)response.data);
@@ -0,0 +1,110 @@
+/**
+ * Example: WWQueryExW with compressLevel
+ *
+ * Benchmarks gzip request-body compression. A JSON batch of about 4 MiB is
+ * POSTed once per compression level and the bytes sent and the upload time
+ * are printed, so the right level for a given link can be picked. Pass a URL
+ * that accepts large POSTs as the first argument.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RECORD_COUNT 40000
+#define RUNS_PER_LEVEL 3
+
+static char* MakeJsonBatch(DWORD* size)
+{
+    static const char* names[] = { "alpha", "beta", "gamma", "delta" };
+    SIZE_T capacity = (SIZE_T)RECORD_COUNT * 128;
+    char* json = (char*)malloc(capacity);
+    if (json == NULL)
+    {
+        return NULL;
+    }
+
+    SIZE_T used = 0;
+    json[used++] = '[';
+    srand(7);
+    for (int i = 0; i < RECORD_COUNT; i++)
+    {
+        used += _snprintf_s(json + used, capacity - used, _TRUNCATE,
+                            "%s{\"id\":%d,\"name\":\"%s%d\",\"ts\":%d,"
+                            "\"value\":%d.%03d,\"ok\":%s}",
+                            i ? "," : "", i, names[rand() % 4], rand() % 1000,
+                            1700000000 + i * 13, rand() % 1000, rand() % 1000,
+                            (rand() & 1) ? "true" : "false");
+    }
+    json[used++] = ']';
+    *size = (DWORD)used;
+    return json;
+}
+
+int main(int argc, char** argv)
+{
+    WCHAR url[INTERNET_MAX_URL_LENGTH] = L"https://httpbin.org/anything";
+    if (argc > 1)
+    {
+        MultiByteToWideChar(CP_UTF8, 0, argv[1], -1, url, INTERNET_MAX_URL_LENGTH);
+    }
+
+    DWORD bodySize = 0;
+    char* body = MakeJsonBatch(&bodySize);
+    if (body == NULL)
+    {
+        return 1;
+    }
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    wprintf(L"Payload: %lu bytes of JSON\n", bodySize);
+    wprintf(L"level      sent  ratio   best ms\n");
+
+    for (int level = 0; level <= 9; level++)
+    {
+        double bestMs = 0.0;
+        ULONGLONG sent = 0;
+
+        for (int run = 0; run < RUNS_PER_LEVEL; run++)
+        {
+            WW_REQUESTW request = {
+                .url           = url,
+                .verb          = L"POST",
+                .contentType   = L"application/json",
+                .body          = body,
+                .bodySize      = bodySize,
+                .compressLevel = level
+            };
+            WW_RESPONSEW response = {0};
+
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            int result = WWQueryExW(&request, &response);
+            QueryPerformanceCounter(&end);
+
+            if (result != WW_SUCCESS)
+            {
+                wprintf(L"Level %d failed (errorcode %d)\n", level, response.errorcode);
+                WWFreeResponseW(&response);
+                free(body);
+                return result;
+            }
+
+            double ms = (end.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart;
+            if (run == 0 || ms < bestMs)
+            {
+                bestMs = ms;
+            }
+            sent = response.sentSize;
+            WWFreeResponseW(&response);
+        }
+
+        wprintf(L"%5d %9llu %5.1f%% %9.1f\n", level, sent,
+                100.0 * sent / bodySize, bestMs);
+    }
+
+    free(body);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * Example: WWQueryExW with a whole-request deadline
+ *
+ * Calls a pricing backend from an RPC handler that must answer within
+ * 250 ms. The deadline covers name resolution, connecting, TLS, redirects,
+ * retries and reading the body together. Every step gets only the time that
+ * is left, and the call fails with WW_ERR_TIMEOUT once it is used up, so the
+ * handler can still serve a cached price in time.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_REQUESTW request = {
+        .url              = L"https://pricing.example.com/v2/quote?sku=4711",
+        .receiveTimeoutMs = 100,
+        .retry            = { .maxAttempts = 3, .baseDelayMs = 20 },
+        .deadlineMs       = GetTickCount64() + 250
+    };
+    WW_RESPONSEW response = {0};
+
+    int result = WWQueryExW(&request, &response);
+    if (result == WW_SUCCESS)
+        wprintf(L"Status %lu after %u attempt(s)\n", response.statusCode,
+                response.attempts);
+    else if (response.errorcode == WW_ERR_TIMEOUT)
+        wprintf(L"No quote within 250 ms; serving the cached price\n");
+    else
+        wprintf(L"Request failed (errorcode %d)\n", response.errorcode);
+
+    WWFreeResponseW(&response);
+    return result;
+}
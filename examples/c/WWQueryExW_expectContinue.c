@@ -0,0 +1,49 @@
+/**
+ * Example: WWQueryExW with expectContinueSize
+ *
+ * POSTs a 64 MiB body to a plain-http endpoint, asking the server for
+ * 100 Continue first. If the server refuses the body as too large (413), the
+ * refusal comes back before any of the body is sent and sentSize stays 0.
+ * Any other answer only advises; the request is then sent as usual.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BODY_SIZE (64 * 1024 * 1024)
+
+int main(void)
+{
+    char* body = (char*)calloc(1, BODY_SIZE);
+    if (body == NULL)
+    {
+        return 1;
+    }
+
+    WW_REQUESTW request = {
+        .url                     = L"http://localhost:8080/ingest",
+        .verb                    = L"POST",
+        .contentType             = L"application/octet-stream",
+        .body                    = body,
+        .bodySize                = BODY_SIZE,
+        .expectContinueSize      = 1024 * 1024,
+        .expectContinueTimeoutMs = 2000
+    };
+    WW_RESPONSEW response = {0};
+
+    int result = WWQueryExW(&request, &response);
+    if (result == WW_SUCCESS)
+    {
+        wprintf(L"Status: %lu, %llu body bytes sent\n",
+                response.statusCode, response.sentSize);
+    }
+    else
+    {
+        wprintf(L"Request failed (errorcode %d)\n", response.errorcode);
+    }
+
+    WWFreeResponseW(&response);
+    free(body);
+    return result;
+}
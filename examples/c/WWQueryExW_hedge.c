@@ -0,0 +1,51 @@
+/**
+ * Example: WWQueryExW with hedged requests
+ *
+ * Polls a small JSON endpoint through a session. When a request has no
+ * response headers after 80 ms (about the endpoint's usual p95), a second copy
+ * goes to one of two replicas. Whichever copy answers first is used and the
+ * other is closed. The session counters show how much extra load the hedges
+ * add and how often they pay off.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_SESSION* session = WWSessionOpenW(NULL);
+    if (session == NULL)
+    {
+        return 1;
+    }
+
+    LPCWSTR replicas[] = { L"api-b.example.com", L"api-c.example.com" };
+
+    for (int i = 0; i < 100; i++)
+    {
+        WW_REQUESTW request = {
+            .url            = L"https://api-a.example.com/v1/status",
+            .session        = session,
+            .hedgeDelayMs   = 80,
+            .hedgeHosts     = replicas,
+            .hedgeHostCount = ARRAYSIZE(replicas)
+        };
+        WW_RESPONSEW response = {0};
+
+        if (WWQueryExW(&request, &response) == WW_SUCCESS && response.hedgeWon)
+        {
+            wprintf(L"Request %d: answered by a replica\n", i);
+        }
+        WWFreeResponseW(&response);
+    }
+
+    WW_SESSION_STATS stats;
+    if (WWSessionGetStats(session, &stats) == WW_SUCCESS)
+    {
+        wprintf(L"Hedges issued: %llu, won: %llu\n",
+                stats.hedgesIssued, stats.hedgesWon);
+    }
+
+    WWSessionClose(session);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Example: WWQueryExW phase timings
+ *
+ * Shows where the time of a slow request went. Each phase field is the time
+ * from the start of the request to the end of that phase, so subtracting one
+ * from the next gives the duration of a phase. On a reused connection the
+ * resolve, connect and TLS phases take no time.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+// Phases a failed request never reached are 0
+static double ms(ULONGLONG from, ULONGLONG to)
+{
+    return (to > from) ? (to - from) / 1000.0 : 0.0;
+}
+
+int main(void)
+{
+    WW_REQUESTW request = {
+        .url              = L"https://api.example.com/v1/status",
+        .maxRedirectLimit = 5
+    };
+    WW_RESPONSEW response = {0};
+
+    int result = WWQueryExW(&request, &response);
+    const WW_TIMINGS* t = &response.timings;
+
+    wprintf(L"DNS         %8.3f ms\n", ms(0, t->resolveUs));
+    wprintf(L"Connect     %8.3f ms\n", ms(t->resolveUs, t->connectUs));
+    wprintf(L"TLS         %8.3f ms\n", ms(t->connectUs, t->tlsUs));
+    wprintf(L"Send        %8.3f ms\n", ms(t->tlsUs, t->requestSentUs));
+    if (t->firstByteUs != 0)
+    {
+        wprintf(L"Wait (TTFB) %8.3f ms\n", ms(t->requestSentUs, t->firstByteUs));
+    }
+    if (t->bodyUs != 0)
+    {
+        wprintf(L"Headers     %8.3f ms\n", ms(t->firstByteUs, t->headersUs));
+        wprintf(L"Body        %8.3f ms\n", ms(t->headersUs, t->bodyUs));
+    }
+    wprintf(L"%u redirect(s) took %.3f ms; connection %ls\n", t->redirects,
+            t->redirectUs / 1000.0, t->connectionReused ? L"reused" : L"new");
+
+    if (result != WW_SUCCESS)
+        wprintf(L"Request failed (errorcode %d)\n", response.errorcode);
+
+    WWFreeResponseW(&response);
+    return result;
+}
@@ -0,0 +1,57 @@
+/**
+ * Example: WWQueryExW with an upload source
+ *
+ * PUTs a file of any size without loading it into memory. The body is read
+ * and sent in fixed blocks with Content-Length, and progress is reported
+ * after each block.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+static VOID OnUploadProgress(ULONGLONG sentBytes, ULONGLONG totalBytes,
+                             LPVOID pUserData)
+{
+    wprintf(L"\r%llu / %llu bytes", sentBytes, totalBytes);
+}
+
+int main(void)
+{
+    HANDLE hFile = CreateFileW(L"C:\\Temp\\backup.vhdx", GENERIC_READ,
+                               FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        wprintf(L"Could not open the file\n");
+        return 1;
+    }
+
+    WW_UPLOAD_SOURCE upload = {
+        .type             = WW_UPLOAD_FILE,
+        .hFile            = hFile,
+        .progressCallback = OnUploadProgress
+    };
+
+    WW_REQUESTW request = {
+        .url         = L"https://example.com/uploads/backup.vhdx",
+        .verb        = L"PUT",
+        .contentType = L"application/octet-stream",
+        .upload      = &upload
+    };
+    WW_RESPONSEW response = {0};
+
+    int result = WWQueryExW(&request, &response);
+    if (result == WW_SUCCESS)
+    {
+        wprintf(L"\nStatus: %lu, %llu bytes sent\n",
+                response.statusCode, response.sentSize);
+    }
+    else
+    {
+        wprintf(L"\nUpload failed (errorcode %d)\n", response.errorcode);
+    }
+
+    WWFreeResponseW(&response);
+    CloseHandle(hFile);
+    return result;
+}
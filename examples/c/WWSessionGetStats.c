@@ -0,0 +1,54 @@
+/**
+ * Example: WWSessionGetStats
+ *
+ * Opens a session with a 4 MiB in-memory response cache and requests the
+ * same URL several times. Responses the server marks as cacheable are served
+ * from memory while fresh; the counters show how many requests hit the cache.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_SESSION_OPTIONSW options = {
+        .userAgent  = L"MyApp/1.0",
+        .flags      = WW_SESSION_HTTP2,
+        .cacheBytes = 4 * 1024 * 1024
+    };
+
+    WW_SESSION* session = WWSessionOpenW(&options);
+    if (session == NULL)
+    {
+        wprintf(L"Could not open session\n");
+        return 1;
+    }
+
+    for (int i = 0; i < 5; i++)
+    {
+        WW_REQUESTW request = {
+            .url     = L"https://httpbin.org/cache/60",
+            .verb    = L"GET",
+            .session = session
+        };
+        WW_RESPONSEW response = {0};
+
+        if (WWQueryExW(&request, &response) == WW_SUCCESS)
+        {
+            wprintf(L"#%d: status %lu, %zu bytes\n", i,
+                    response.statusCode, response.dataSize);
+        }
+        WWFreeResponseW(&response);
+    }
+
+    WW_SESSION_STATS stats = {0};
+    WWSessionGetStats(session, &stats);
+    wprintf(L"hits %llu, misses %llu, revalidations %llu, evictions %llu\n",
+            stats.cacheHits, stats.cacheMisses,
+            stats.cacheRevalidations, stats.cacheEvictions);
+    wprintf(L"%zu entries, %zu bytes cached\n",
+            stats.cacheEntries, stats.cacheBytesUsed);
+
+    WWSessionClose(session);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Example: WWSessionOpenW
+ *
+ * Opens an HTTP/2-capable session and sends several requests through it.
+ * Requests that share a session reuse one connection per origin instead of
+ * opening a fresh one each time.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_SESSION_OPTIONSW options = {
+        .userAgent = L"MyApp/1.0",
+        .flags     = WW_SESSION_HTTP2
+    };
+
+    WW_SESSION* session = WWSessionOpenW(&options);
+    if (session == NULL)
+    {
+        wprintf(L"Could not open session\n");
+        return 1;
+    }
+
+    for (int i = 0; i < 5; i++)
+    {
+        WW_REQUESTW request = {
+            .url     = L"https://httpbin.org/get",
+            .verb    = L"GET",
+            .session = session
+        };
+        WW_RESPONSEW response = {0};
+
+        if (WWQueryExW(&request, &response) == WW_SUCCESS)
+        {
+            wprintf(L"#%d: status %lu, %zu bytes, %s\n", i,
+                    response.statusCode, response.dataSize,
+                    response.http2 ? L"HTTP/2" : L"HTTP/1.1");
+        }
+        else
+        {
+            wprintf(L"#%d: failed (errorcode %d)\n", i, response.errorcode);
+        }
+
+        WWFreeResponseW(&response);
+    }
+
+    WWSessionClose(session);
+    return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * Example: WWSessionOpenW with a circuit breaker and a concurrency limit
+ *
+ * Calls an upstream API from a session that guards each origin. Once half of
+ * at least 20 recent requests fail or take longer than 2 s, the breaker opens
+ * and calls fail at once with WW_ERR_CIRCUIT_OPEN for 10 s. After that, three
+ * probe requests decide whether it closes again. At most 32 requests run
+ * against the origin at a time. The limit halves as soon as responses slow
+ * past 500 ms, and callers wait up to 100 ms for a slot.
+ */
+
+#include "../../source/winweb.h"
+#include <stdio.h>
+
+int main(void)
+{
+    WW_SESSION_OPTIONSW options = {
+        .breaker = {
+            .minRequests    = 20,
+            .failurePercent = 50,
+            .slowCallMs     = 2000,
+            .windowMs       = 30000,
+            .openMs         = 10000,
+            .halfOpenProbes = 3
+        },
+        .limiter = {
+            .initialLimit    = 8,
+            .maxLimit        = 32,
+            .latencyTargetMs = 500,
+            .queueTimeoutMs  = 100
+        }
+    };
+
+    WW_SESSION* session = WWSessionOpenW(&options);
+    if (session == NULL)
+    {
+        return 1;
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        WW_REQUESTW request = {
+            .url              = L"https://upstream.example.com/v1/items",
+            .session          = session,
+            .receiveTimeoutMs = 5000
+        };
+        WW_RESPONSEW response = {0};
+
+        if (WWQueryExW(&request, &response) != WW_SUCCESS &&
+            (response.errorcode == WW_ERR_CIRCUIT_OPEN ||
+             response.errorcode == WW_ERR_CONCURRENCY_LIMIT))
+        {
+            // Serve a fallback instead of waiting on the upstream
+        }
+        WWFreeResponseW(&response);
+    }
+
+    WW_ORIGIN_STATS stats;
+    if (WWSessionGetOriginStatsW(session, L"https://upstream.example.com/",
+                                 &stats) == WW_SUCCESS)
+    {
+        wprintf(L"Breaker state %d, opened %llu times, %llu rejected\n",
+                stats.breakerState, stats.breakerOpens, stats.breakerRejections);
+        wprintf(L"Concurrency limit %u, %llu shed, average latency %lu ms\n",
+                stats.concurrencyLimit, stats.limiterRejections, stats.latencyMs);
+    }
+
+    WWSessionClose(session);
+    return 0;
+}
@@ -11,9 +11,12 @@
 
 /****************************** MAIN DEFINITIONS ******************************/
 #include "winweb.h"
+#include <bcrypt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <wchar.h>
+#include <wctype.h>
 
 /**
  * @brief Macro definitions.
@@ -30,6 +33,37 @@
 #pragma warning(disable: 4996)
 #endif
 
+// SIMD helpers for the HTTP parser; define WW_NO_SIMD to force the scalar path
+#if !defined(WW_NO_SIMD) && (defined(_M_X64) || defined(_M_IX86) || \
+                             defined(__x86_64__) || defined(__i386__))
+#define WW_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define WW_TARGET(isa) __attribute__((target(isa)))
+#else
+#define WW_TARGET(isa)
+#endif
+
+// HTTP/2 over WinInet needs the Windows 10 SDK; keep older SDKs building
+#ifndef INTERNET_OPTION_ENABLE_HTTP_PROTOCOL
+#define INTERNET_OPTION_ENABLE_HTTP_PROTOCOL 148
+#endif
+#ifndef INTERNET_OPTION_HTTP_PROTOCOL_USED
+#define INTERNET_OPTION_HTTP_PROTOCOL_USED 149
+#endif
+#ifndef HTTP_PROTOCOL_FLAG_HTTP2
+#define HTTP_PROTOCOL_FLAG_HTTP2 0x2
+#endif
+
+#ifndef PF_SSE4_2_INSTRUCTIONS_AVAILABLE
+#define PF_SSE4_2_INSTRUCTIONS_AVAILABLE 38
+#endif
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
 #define WW_COUNTOF(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define WW_STR_SYMSA(str) WW_COUNTOF(str) - strlen(str)
 #define WW_STR_SYMSW(str) WW_COUNTOF(str) - wcslen(str)
@@ -74,6 +108,262 @@ struct {
     { 1.0, L"B" }
 };
 
+typedef struct WW_HEDGELEGW_S WW_HEDGELEGW;
+
+/**
+ * @brief Per-call query state that is not part of the public request.
+ */
+typedef struct {
+    LPCWSTR extraHeaders;         /**< Appended to the request headers (e.g. validators) */
+    WW_HEDGELEGW* hedge;          /**< Set while the query races a hedged copy of itself */
+    BOOL cacheInfoValid;          /**< The fields below describe the final response */
+    BOOL hasCacheControl;         /**< The response carried Cache-Control */
+    BOOL noStore;                 /**< no-store, or a caching header that could not be kept */
+    BOOL noCache;
+    LONGLONG maxAgeSecs;          /**< max-age, or -1 if absent */
+    WCHAR etag[256];
+    WCHAR lastModified[64];
+    WCHAR vary[256];
+    LONGLONG expiresSecs;         /**< Expires minus Date, or -1 if absent */
+    ULONGLONG ageSecs;            /**< Age header, or 0 */
+} WW_PRIVATEQUERYW;
+
+#define WW_UPLOAD_BLOCK 0x40000 // 256 KiB per InternetWriteFile
+#define WW_UPLOAD_GZIP 0x100    // Internal WW_UPLOAD_SOURCE.type: request body gzipped as it is sent
+#define WW_MULTIPART_BACKOFF_MS 250 // First retry delay, doubled per attempt
+#define WW_MIN_SEGMENT_SIZE (1024 * 1024)     // Smaller ranges cost more in requests than they gain
+#define WW_JOURNAL_INTERVAL (8 * 1024 * 1024) // Bytes a segment writes between journal checkpoints
+#define WW_JOURNAL_MAGIC 0x314A5757           // "WWJ1"
+#define WW_EXPECT_HEAD_MAX 16384     // Request head and interim response buffer
+#define WW_EXPECT_BODY_MAX 0x10000   // Body kept from an early final response
+
+enum E_WW_EXPECT_RESULT {
+    WW_EXPECT_SEND,          // Any other answer, timeout or no handshake: send the body
+    WW_EXPECT_FINAL          // 413 received instead; the body is not sent
+};
+
+/**
+ * @brief Read position within a WW_UPLOAD_SOURCE while it is being sent.
+ */
+typedef struct {
+    const WW_UPLOAD_SOURCE* source;
+    ULONGLONG total;              /**< Bytes to send; unused when chunked */
+    BOOL chunked;                 /**< Size unknown: Transfer-Encoding: chunked */
+    ULONGLONG sent;               /**< Body bytes sent so far */
+    LARGE_INTEGER fileStart;      /**< WW_UPLOAD_FILE: offset the body starts at */
+    SIZE_T bufIndex;              /**< WW_UPLOAD_BUFFERS: current piece */
+    SIZE_T bufOffset;             /**< WW_UPLOAD_BUFFERS: offset within it */
+} WW_UPLOADSTATE;
+
+/**
+ * @brief Streaming hash state: CNG for SHA-256, computed in place for CRC-32C.
+ */
+typedef struct {
+    INT algorithm;                /**< E_WW_HASH_ALGORITHM; WW_HASH_NONE when idle */
+    BCRYPT_ALG_HANDLE hAlg;
+    BCRYPT_HASH_HANDLE hHash;
+    UINT crc;
+} WW_HASHCTX;
+
+#define WW_SHA256_SIZE 32
+#define WW_CRC32C_SIZE 4
+
+typedef UINT (*WW_CRC32C_FN)(UINT crc, const BYTE* p, SIZE_T size);
+
+static WW_CRC32C_FN g_wwCrc32c = NULL;
+
+#define WW_ACCEPT_ENCODINGW L"Accept-Encoding: gzip, deflate\r\n"
+
+#define WW_INFLATE_WINDOW   32768
+#define WW_INFLATE_INPUT    0x4000
+#define WW_HUFF_FAST_BITS   10
+#define WW_HUFF_MAX_SYMBOLS 288
+
+// Deflate length and distance codes (RFC 1951, 3.2.5)
+static const USHORT g_wwLenBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE g_wwLenExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const USHORT g_wwDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const BYTE g_wwDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const BYTE g_wwCodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/**
+ * @brief Canonical Huffman decoding table. Codes up to WW_HUFF_FAST_BITS long
+ *        resolve with one lookup; longer ones walk the per-length counts.
+ */
+typedef struct {
+    USHORT fast[1 << WW_HUFF_FAST_BITS]; /**< (length << 9) | symbol; 0 = slow path */
+    USHORT count[16];                    /**< Number of codes of each length */
+    USHORT symbol[WW_HUFF_MAX_SYMBOLS];  /**< Symbols in canonical code order */
+} WW_HUFFMAN;
+
+enum E_WW_INFLATE_FORMAT {
+    WW_INFLATE_GZIP,              /**< RFC 1952, Content-Encoding: gzip */
+    WW_INFLATE_DEFLATE            /**< RFC 1950 zlib, or raw RFC 1951 as sent by some servers */
+};
+
+enum E_WW_INFLATE_STATE {
+    WW_INFLATE_HEADER,
+    WW_INFLATE_BLOCK,
+    WW_INFLATE_STORED,
+    WW_INFLATE_CODES,
+    WW_INFLATE_TRAILER,
+    WW_INFLATE_DONE
+};
+
+/**
+ * @brief Streaming decoder for a gzip or deflate response body. Compressed
+ *        input is pulled from the request handle as needed, so memory use
+ *        is fixed no matter how large the body is.
+ */
+typedef struct {
+    HINTERNET hReq;
+    INT format;
+    INT state;
+    BOOL zlib;                    /**< DEFLATE body has a zlib wrapper */
+    BOOL lastBlock;
+    BOOL failed;                  /**< Reading from the network failed */
+    BYTE in[WW_INFLATE_INPUT];
+    DWORD inPos;
+    DWORD inLen;
+    BOOL inEof;
+    ULONGLONG wireBytes;          /**< Compressed bytes received so far */
+    ULONGLONG bitBuf;
+    UINT bitCnt;
+    UINT padBits;                 /**< Zero bits appended past the end of input */
+    DWORD storedLeft;
+    UINT copyLen;
+    UINT copyDist;
+    UINT check;                   /**< Running CRC-32 (gzip) or Adler-32 (zlib) */
+    ULONGLONG total;              /**< Decoded bytes so far */
+    BYTE window[WW_INFLATE_WINDOW];
+    WW_HUFFMAN lencode;
+    WW_HUFFMAN distcode;
+} WW_INFLATE;
+
+#define WW_CONTENT_ENCODING_GZIPW L"Content-Encoding: gzip\r\n"
+
+#define WW_DEFLATE_HASH_BITS 15
+#define WW_DEFLATE_BLOCK     16384 // Symbols buffered per emitted block
+#define WW_DEFLATE_MAX_MATCH 258
+#define WW_DEFLATE_MAX_DIST  32768
+
+/**
+ * @brief Match search effort per compression level, after zlib's table.
+ */
+static const struct {
+    USHORT chain;                 /**< Hash chain entries to try per position */
+    USHORT nice;                  /**< Stop searching at a match this long */
+    USHORT lazy;                  /**< Look one byte ahead below this length; 0 = greedy */
+} g_wwDeflateLevels[10] = {
+    { 0, 0, 0 },
+    { 4, 8, 0 }, { 8, 16, 0 }, { 32, 32, 0 },
+    { 16, 16, 4 }, { 32, 32, 16 }, { 128, 128, 16 },
+    { 256, 128, 32 }, { 1024, 258, 128 }, { 4096, 258, 258 }
+};
+
+/**
+ * @brief Literal (dist == 0) or length/distance pair found by the matcher.
+ */
+typedef struct {
+    USHORT dist;
+    USHORT value;                 /**< Literal byte or match length */
+} WW_LZSYMBOL;
+
+/**
+ * @brief Deflate encoder for a request body. Symbols are emitted one block
+ *        at a time as the matcher advances, and the matcher can stop and
+ *        resume, so a streamed body needs only a bounded output buffer.
+ */
+typedef struct {
+    const BYTE* src;
+    DWORD srcSize;
+    INT level;
+    DWORD blockStart;             /**< First input byte covered by the pending block */
+    DWORD blockEnd;               /**< One past the last input byte covered so far */
+    UINT maxChain;
+    UINT niceLen;
+    UINT lazyLen;
+    DWORD pos;                    /**< Next input byte for the matcher */
+    UINT prevLen;                 /**< Match at pos - 1 held back by lazy matching */
+    DWORD prevDist;
+    BOOL pending;                 /**< src[pos - 1] has not been emitted yet */
+    BOOL ended;                   /**< Final block and gzip trailer written */
+    DWORD head[1 << WW_DEFLATE_HASH_BITS]; /**< Latest position + 1 per hash; 0 = none */
+    DWORD prev[WW_DEFLATE_MAX_DIST];       /**< Previous position + 1 with the same hash */
+    WW_LZSYMBOL syms[WW_DEFLATE_BLOCK];
+    UINT symCount;
+    LPBYTE out;
+    SIZE_T outCap;
+    SIZE_T outLen;
+    SIZE_T outRead;               /**< Streaming: bytes of out already handed on */
+    BOOL full;                    /**< Output reached outCap; the result is discarded */
+    ULONGLONG bitBuf;
+    UINT bitCnt;
+} WW_DEFLATE;
+
+/**
+ * @brief Disk cache index layout, shared through a file mapping.
+ */
+#define WW_DISKCACHE_MAGIC   0x43445757   // "WWDC"
+#define WW_DISKCACHE_VERSION 2
+#define WW_DISKCACHE_SLOTS   4096
+
+enum E_WW_DISKSLOT_STATE {
+    WW_DISKSLOT_EMPTY = 0,   /**< Never used; ends a probe sequence */
+    WW_DISKSLOT_USED,        /**< Holds an entry */
+    WW_DISKSLOT_DELETED      /**< Evicted; probing continues past it */
+};
+
+typedef struct {
+    DWORD state;                          /**< E_WW_DISKSLOT_STATE */
+    DWORD reserved;
+    BYTE urlKey[WW_SHA256_SIZE];          /**< SHA-256 of the URL */
+    BYTE blob[WW_SHA256_SIZE];            /**< SHA-256 of the body; names the blob file */
+    ULONGLONG size;                       /**< Body size in bytes */
+    ULONGLONG storedAt;                   /**< FILETIME of the store or last revalidation */
+    ULONGLONG freshFor;                   /**< Freshness lifetime in FILETIME units */
+    ULONGLONG lastUsed;                   /**< FILETIME of the last hit, for LRU eviction */
+    WCHAR etag[128];
+    WCHAR lastModified[64];
+    WCHAR fileName[128];                  /**< File name captured by a download, or empty */
+} WW_DISKSLOT;
+
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    DWORD slotCount;
+    DWORD entryCount;
+    ULONGLONG totalBytes;                 /**< Sum of the sizes of used slots */
+    DWORD locked;                         /**< Set while a process holds the lock; still set if it died */
+    DWORD reserved;
+    WW_DISKSLOT slots[WW_DISKCACHE_SLOTS];
+} WW_DISKINDEX;
+
+struct WW_DISKCACHE_S {
+    WCHAR directory[MAX_PATH];            /**< Full path with a trailing backslash */
+    ULONGLONG maxBytes;
+    DWORD flags;
+    SRWLOCK lock;                         /**< Serialises the threads sharing the file lock */
+    HANDLE hIndexFile;                    /**< A byte lock past the index guards it across processes */
+    HANDLE hMapping;
+    WW_DISKINDEX* index;
+};
+
 /**
  * @brief Structures and functions (ANSI version).
  */
@@ -84,6 +374,7 @@ typedef struct {
     UINT redirectCount;
     CHAR capturedFileName[MAX_PATH];
     CHAR fullFilePath[MAX_PATH];
+    WW_RATELIMIT* hostRate;       /**< Limit of the host the body comes from; NULL = none */
 } WW_PRIVATEPARAMSA;
 
 
@@ -91,1734 +382,14329 @@ typedef struct {
  * @brief Structures and functions (Unicode version).
  */
 
+/**
+ * @brief Bytes received on one connection in the current low-speed window.
+ */
+typedef struct {
+    ULONGLONG startMs;
+    ULONGLONG bytes;
+    ULONGLONG lastMs;             /**< When bytes last arrived */
+} WW_SPEEDCHECK;
+
+/**
+ * @brief Phases of a WW_TIMINGS, in the order a request passes them.
+ */
+enum E_WW_PHASE {
+    WW_PHASE_RESOLVE,
+    WW_PHASE_CONNECT,
+    WW_PHASE_TLS,
+    WW_PHASE_SENT,
+    WW_PHASE_FIRST_BYTE,
+    WW_PHASE_HEADERS,
+    WW_PHASE_BODY,
+    WW_PHASE_COUNT
+};
+
+/**
+ * @brief Phase clock of one request handle, fed by WinInet status callbacks.
+ *        Another thread may close the handle after the request returned, so
+ *        the handle holds a reference of its own until HANDLE_CLOSING.
+ */
+typedef struct {
+    volatile LONG refs;
+    ULONGLONG startUs;            /**< WWGetTimeUs when the hop started */
+    BOOL secure;                  /**< https; a new connection starts with a TLS handshake */
+    BOOL connected;               /**< A new connection was made for the request */
+    ULONGLONG marks[WW_PHASE_COUNT]; /**< End of each phase after startUs; 0 = not reached */
+} WW_PHASECLOCK;
+
 typedef struct {
     LPWSTR szHeader;
     SIZE_T headerSize;
     UINT redirectCount;
     WCHAR capturedFileName[MAX_PATH];
     WCHAR fullFilePath[MAX_PATH];
+    LPCWSTR cacheUrl;             /**< URL before redirects; the disk cache key */
+    BOOL hasCachedSlot;           /**< cachedSlot is a stale entry being revalidated */
+    WW_DISKSLOT cachedSlot;
+    WW_PRIVATEQUERYW cacheInfo;   /**< Caching headers of the downloaded response */
+    BOOL hashContent;             /**< Hash the body while it is written */
+    BOOL contentHashValid;
+    BYTE contentHash[WW_SHA256_SIZE];
+    WW_INFLATE* decoder;          /**< Decodes a compressed body; NULL = raw */
+    DWORD statusCode;             /**< Status of the last HTTP response */
+    DWORD retryAfterMs;           /**< Retry-After of a 429 or 503 response */
+    WCHAR validator[256];         /**< Strong ETag or Last-Modified for If-Range */
+    BOOL segmented;               /**< The body was fetched as ranges; the journal drives resume */
+    HINTERNET hInet;              /**< WinInet handle of the current attempt, for mirror connections */
+    WW_PHASECLOCK* clock;         /**< Phases of the current hop; NULL = not timed */
+    WW_RATELIMIT* hostRate;       /**< Limit of the host the body comes from; NULL = none */
+    BOOL stalled;                 /**< The connection fell below the low-speed limit */
 } WW_PRIVATEPARAMSW;
 
+/**
+ * @brief Byte range of a segmented download.
+ */
+typedef struct {
+    ULONGLONG start;              /**< First byte of the range */
+    ULONGLONG end;                /**< One past the last byte */
+    ULONGLONG done;               /**< Bytes from start that are on disk */
+} WW_SEGMENT;
+
+/**
+ * @brief One of the two journal slots, written in turn. A torn write only
+ *        damages the slot being written; the valid slot with the higher
+ *        sequence is the journal.
+ */
+typedef struct {
+    DWORD magic;                  /**< WW_JOURNAL_MAGIC */
+    DWORD sequence;               /**< Incremented per write; its low bit selects the slot */
+    ULONGLONG totalSize;
+    WCHAR validator[256];         /**< Entity the ranges belong to */
+    DWORD segmentCount;
+    DWORD reserved;
+    WW_SEGMENT segments[WW_MAX_DOWNLOAD_SEGMENTS];
+    UINT crc;                     /**< CRC-32C of the fields above */
+} WW_JOURNALSLOT;
+
+/**
+ * @brief Reference-counted response body shared by coalesced and cached responses.
+ */
+typedef struct {
+    volatile LONG refCount;
+    SIZE_T size;
+    BYTE data[1];
+} WW_SHAREDBODY;
+
+/**
+ * @brief In-flight request that identical requests can wait on.
+ */
+typedef struct WW_FLIGHTW_S {
+    struct WW_FLIGHTW_S* next;
+    LPWSTR key;
+    HANDLE hDone;                 /**< Manual-reset event set when the result is ready */
+    volatile LONG refCount;       /**< Leader plus waiters */
+    INT result;
+    INT errorcode;
+    DWORD statusCode;
+    BOOL http2;
+    WW_SHAREDBODY* body;
+} WW_FLIGHTW;
+
+/**
+ * @brief Cached response, linked into a hash bucket and the session LRU list.
+ */
+typedef struct WW_CACHEENTRYW_S {
+    struct WW_CACHEENTRYW_S* hashNext;
+    struct WW_CACHEENTRYW_S* lruPrev;   /**< Towards the most recently used entry */
+    struct WW_CACHEENTRYW_S* lruNext;
+    ULONG hash;                   /**< Hash of the URL */
+    LPWSTR url;
+    LPWSTR varyNames;             /**< Vary header of the stored response, or NULL */
+    LPWSTR varyKey;               /**< Request header values selected by varyNames */
+    LPWSTR etag;                  /**< ETag validator, or NULL */
+    LPWSTR lastModified;          /**< Last-Modified validator, or NULL */
+    DWORD statusCode;
+    BOOL http2;
+    ULONGLONG storedAtMs;         /**< GetTickCount64 at store or last revalidation */
+    ULONGLONG freshMs;            /**< Freshness lifetime from storedAtMs */
+    SIZE_T cost;                  /**< Bytes charged against the cache budget */
+    WW_SHAREDBODY* body;
+} WW_CACHEENTRYW;
+
+#define WW_CACHE_BUCKETS 1024
+
+/**
+ * @brief Circuit breaker and concurrency limiter state of one origin.
+ */
+typedef struct WW_ORIGINW_S {
+    struct WW_ORIGINW_S* next;
+    INTERNET_SCHEME scheme;
+    INTERNET_PORT port;
+    WCHAR host[INTERNET_MAX_HOST_NAME_LENGTH];
+    INT state;                    /**< E_WW_BREAKER_STATE */
+    ULONGLONG windowStartMs;
+    UINT windowRequests;
+    UINT windowFailures;
+    ULONGLONG openedMs;
+    UINT probesInFlight;
+    UINT probeSuccesses;
+    UINT limit;
+    UINT credit;                  /**< Good requests since the limit last rose */
+    UINT inFlight;
+    ULONGLONG admitted;           /**< Requests let through so far */
+    ULONGLONG lastDrop;           /**< Value of admitted when the limit last fell */
+    WW_ORIGIN_STATS stats;
+} WW_ORIGINW;
+
+/**
+ * @brief A request let through by WWOriginAdmitW.
+ */
+typedef struct {
+    WW_ORIGINW* origin;           /**< NULL when no breaker or limiter applies */
+    BOOL probe;                   /**< Sent while the breaker was half-open */
+    ULONGLONG sequence;           /**< Value of origin->admitted at admission */
+    ULONGLONG startMs;
+} WW_ADMISSIONW;
+
+/**
+ * @brief Session state behind the opaque WW_SESSION handle.
+ */
+struct WW_SESSION_S {
+    HINTERNET hInet;
+    DWORD flags;
+    CRITICAL_SECTION lock;        /**< Guards the tables below */
+    WW_FLIGHTW* flights;          /**< Requests currently in flight (WW_SESSION_COALESCE) */
+    WW_CACHEENTRYW** cache;       /**< Hash buckets; NULL when caching is disabled */
+    WW_CACHEENTRYW* lruHead;      /**< Most recently used entry */
+    WW_CACHEENTRYW* lruTail;      /**< Next entry to evict */
+    SIZE_T cacheBudget;
+    WW_SESSION_STATS stats;
+    WW_BREAKER_OPTIONS breaker;
+    WW_LIMITER_OPTIONS limiter;
+    WW_ORIGINW* origins;          /**< Origins seen while a breaker or limiter is set */
+    CONDITION_VARIABLE slotFreed; /**< Signalled when a limited origin has room again */
+};
+
+/**
+ * @brief Shared state of the WWQueryBatchW worker threads.
+ */
+typedef struct {
+    WW_REQUESTW* requests;
+    WW_RESPONSEW* responses;
+    SIZE_T count;
+    WW_BATCH_RESULT* results;
+    WW_SESSION* session;
+    WW_CANCEL* cancel;
+    volatile LONG nextIndex;
+    volatile LONG failures;
+    ULONGLONG startUs;
+} WW_BATCHCTXW;
+
+/**
+ * @brief Manifest formats understood by WWDownloadManifestW.
+ */
+enum E_WW_MANIFEST_FORMAT {
+    WW_MANIFEST_METALINK,
+    WW_MANIFEST_JSON,
+    WW_MANIFEST_TSV
+};
+
+/**
+ * @brief Cursor over a memory-mapped manifest.
+ */
+typedef struct {
+    const CHAR* data;
+    SIZE_T size;
+    SIZE_T pos;
+    INT format;                   /**< E_WW_MANIFEST_FORMAT */
+    BOOL started;                 /**< The list of files has been entered */
+    BOOL finished;                /**< The end of the list was reached */
+    BOOL failed;                  /**< Malformed; no further files are read */
+} WW_MANIFESTREADER;
+
+/**
+ * @brief One file of a manifest.
+ */
+typedef struct {
+    WCHAR path[MAX_PATH];
+    WCHAR urls[WW_MAX_MANIFEST_URLS][INTERNET_MAX_URL_LENGTH];
+    DWORD priorities[WW_MAX_MANIFEST_URLS];
+    UINT urlCount;
+    ULONGLONG size;
+    BOOL hasSize;
+    BYTE sha256[WW_SHA256_SIZE];
+    BOOL hasHash;
+    BOOL invalid;                 /**< A value could not be used; the file fails */
+} WW_MANIFESTENTRYW;
+
+/**
+ * @brief Shared state of the WWDownloadManifestW worker threads.
+ */
+typedef struct {
+    WW_MANIFEST_OPTIONSW* options;
+    WCHAR dstPath[MAX_PATH];      /**< With a trailing separator */
+    CRITICAL_SECTION lock;        /**< Guards the reader, the counters and the callback */
+    WW_MANIFESTREADER reader;
+} WW_MANIFESTCTXW;
+
+/**
+ * @brief Shared state of the WWMultipartUploadW worker threads.
+ */
+typedef struct {
+    WW_MULTIPART_OPTIONSW* options;
+    WW_SESSION* session;
+    HANDLE hFile;                 /**< Read with explicit offsets by every worker */
+    ULONGLONG fileSize;
+    WW_MULTIPART_PART* parts;
+    UINT partCount;
+    UINT maxRetries;
+    volatile LONG nextIndex;
+    volatile LONG failed;         /**< Once set, workers stop taking new parts */
+    volatile LONG retries;
+    CRITICAL_SECTION lock;        /**< Guards the fields below and the progress callback */
+    ULONGLONG bytesDone;
+    INT errorcode;                /**< First failure */
+    DWORD statusCode;
+} WW_MULTIPARTCTXW;
+
+/**
+ * @brief Read position of one part, fed to the upload path as a callback.
+ */
+typedef struct {
+    HANDLE hFile;
+    ULONGLONG offset;
+    ULONGLONG left;
+} WW_PARTREADERW;
+
+#define WW_NO_SEGMENT ((UINT)-1)
+
+/**
+ * @brief One server a segmented download fetches ranges from.
+ */
+typedef struct {
+    HINTERNET hConn;
+    WCHAR urlPath[INTERNET_MAX_PATH_LENGTH];
+    DWORD requestFlags;
+    BOOL owned;                   /**< hConn was opened for the mirror and is closed with it */
+    BOOL dead;                    /**< Failed or served another entity; no longer used */
+    UINT active;                  /**< Ranges being fetched from it */
+    ULONGLONG bytes;              /**< Bytes received from it */
+    ULONGLONG busyMs;             /**< Connection time spent receiving them */
+    WW_RATELIMIT* hostRate;       /**< Limit of its host; NULL = none */
+} WW_MIRRORW;
+
+/**
+ * @brief Shared state of the segmented download worker threads.
+ */
+typedef struct {
+    WW_PARAMSW* userParams;
+    WW_MIRRORW* mirrors;          /**< The URL of the download first, then the mirrors */
+    UINT mirrorCount;
+    UINT liveMirrors;
+    BOOL split;                   /**< Idle workers take over the tail of a running range */
+    HINTERNET hFirst;             /**< Initial response, read by the segment at offset 0 */
+    HANDLE hTemp;                 /**< Written with explicit offsets by every worker */
+    HANDLE hJournal;              /**< INVALID_HANDLE_VALUE without a journal */
+    volatile LONG failed;         /**< Once set, workers stop */
+    CRITICAL_SECTION lock;        /**< Guards the fields below, the sources and the progress callback */
+    WW_JOURNALSLOT journal;       /**< Ranges as last checkpointed; ends only shrink */
+    BOOL claimed[WW_MAX_DOWNLOAD_SEGMENTS];     /**< A worker owns the range */
+    ULONGLONG liveDone[WW_MAX_DOWNLOAD_SEGMENTS]; /**< Bytes on disk, ahead of the journal */
+    ULONGLONG bytesDone;
+    ULONGLONG lastReportMs;
+    INT errorcode;                /**< First failure */
+    DWORD statusCode;
+} WW_SEGMENTCTXW;
+
+#define WW_HEDGE_LEGS 2
+
+typedef struct WW_HEDGECTXW_S WW_HEDGECTXW;
+
+/**
+ * @brief One copy of a hedged query. The first runs on the calling thread,
+ *        the hedge on a thread of its own.
+ */
+struct WW_HEDGELEGW_S {
+    WW_HEDGECTXW* ctx;
+    LONG index;
+    HINTERNET hInet;
+    WW_REQUESTW request;
+    WW_RESPONSEW response;
+    WW_PRIVATEQUERYW privateQuery;
+    UINT redirectsLeft;
+    WCHAR url[INTERNET_MAX_URL_LENGTH]; /**< Request URL with the alternate host */
+    HANDLE hThread;               /**< Hedge only; NULL until the hedge fires */
+    HINTERNET volatile hActive;   /**< Open request handle; whoever swaps it out closes it */
+    volatile LONG cancelled;
+    volatile LONG finished;
+    INT result;
+};
+
+/**
+ * @brief Shared state of the copies of a hedged query.
+ */
+struct WW_HEDGECTXW_S {
+    volatile LONG winner;         /**< First copy to get its final headers, or -1 */
+    WW_HEDGELEGW legs[WW_HEDGE_LEGS];
+};
+
+// Alternate host the next hedge goes to
+static volatile LONG g_wwHedgeNext = 0;
+
+// Tokens are kept in millionths of a byte so that refills of a few
+// microseconds are not rounded away
+#define WW_RATE_SCALE 1000000LL
+#define WW_RATE_MAX   (1ULL << 40)
+
+/**
+ * @brief Token bucket behind the opaque WW_RATELIMIT handle.
+ */
+struct WW_RATELIMIT_S {
+    SRWLOCK lock;                 /**< Guards the fields below */
+    ULONGLONG rate;               /**< Bytes per second; 0 = unlimited */
+    ULONGLONG burst;              /**< Bucket size in bytes */
+    LONGLONG credit;              /**< Tokens in WW_RATE_SCALE units; negative while in debt */
+    ULONGLONG lastUs;             /**< WWGetTimeUs of the last refill */
+};
+
+/**
+ * @brief Process-wide limit of one host (WWSetHostRateLimitW).
+ */
+typedef struct WW_HOSTRATEW_S {
+    struct WW_HOSTRATEW_S* next;
+    WCHAR host[INTERNET_MAX_HOST_NAME_LENGTH];
+    WW_RATELIMIT limit;
+} WW_HOSTRATEW;
+
+// Host limits are never freed, so running downloads may hold on to them
+static SRWLOCK g_wwHostRatesLock = SRWLOCK_INIT;
+static WW_HOSTRATEW* g_wwHostRates = NULL;
+static WW_RATELIMIT g_wwGlobalRate = { SRWLOCK_INIT };
+
+/**
+ * @brief Request handle attached to a cancellation token and a deadline.
+ *        Lives on the stack of the call that opened the handle.
+ */
+typedef struct WW_CANCELREG_S {
+    struct WW_CANCELREG_S* next;
+    struct WW_CANCELREG_S* prev;
+    BOOL linked;                  /**< In the list of the token */
+    HINTERNET volatile hOwned;    /**< Slot used unless the handle already has one */
+    HINTERNET volatile* slot;     /**< Open handle; whoever swaps it out closes it */
+    HANDLE hTimer;                /**< Timer-queue timer closing the handle at the deadline */
+} WW_CANCELREG;
+
+/**
+ * @brief Cancellation token behind the opaque WW_CANCEL handle.
+ */
+struct WW_CANCEL_S {
+    SRWLOCK lock;                 /**< Guards active */
+    volatile LONG cancelled;
+    HANDLE hEvent;                /**< Manual-reset; set by WWCancel to wake waits */
+    WW_CANCELREG* active;         /**< Handles to close on WWCancel */
+};
+
+#define WW_TRACE_BUFFER_SIZE 0x10000
+
+struct WW_TRACESINK_S {
+    SRWLOCK lock;                 /**< Guards the buffer and the file */
+    HANDLE hFile;
+    DWORD processId;
+    ULONGLONG events;             /**< Events written; all but the first start with a comma */
+    BOOL failed;                  /**< A write failed; later events are dropped */
+    SIZE_T used;
+    CHAR buffer[WW_TRACE_BUFFER_SIZE];
+};
+
+// Indexed by E_WW_TRACE_STAGE
+static const CHAR* const g_wwTraceStageNames[] = {
+    "query", "download", "crack_url", "connect", "send", "headers",
+    "redirect", "read", "write", "rename"
+};
+
+// Held shared while the callback runs, so replacing it waits for running calls
+static SRWLOCK g_wwTraceLock = SRWLOCK_INIT;
+static WW_TRACE_CALLBACK volatile g_wwTraceCallback = NULL;
+static LPVOID g_wwTraceUserData = NULL;
+
+// Only ever changed with interlocked operations. WW_METRICS holds nothing
+// but ULONGLONGs, so a snapshot reads it as an array; the histogram counts
+// are filled in by the snapshot.
+static WW_METRICS g_wwMetrics;
+
+// Upper bounds of all but the last WW_HISTOGRAM bucket
+static const ULONGLONG g_wwMetricsBoundsUs[WW_METRICS_BUCKETS - 1] = {
+    1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000, 300000000
+};
+
+static const CHAR* const g_wwMetricsBoundNames[WW_METRICS_BUCKETS] = {
+    "0.001", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5",
+    "1", "2.5", "5", "10", "30", "60", "300", "+Inf"
+};
+
+// Indexed by E_WW_STATUS_CLASS
+static const CHAR* const g_wwStatusClassNames[] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+/**
+ * @brief Output of WWMetricsFormatPrometheus; len keeps counting past size.
+ */
+typedef struct {
+    LPSTR buffer;
+    SIZE_T size;
+    SIZE_T len;
+} WW_METRICSTEXT;
+
 
 WW_PRIVATE
 INT
-WWDownloadProcessW(WW_PARAMSW* params, WW_PRIVATEPARAMSW* privateParams);
+WWQueryPerformW(HINTERNET hInet, WW_REQUESTW* request,
+                WW_RESPONSEW* response, UINT redirectsLeft,
+                WW_PRIVATEQUERYW* privateQuery);
 
 WW_PRIVATE
 INT
-WWProcessHttpW(URL_COMPONENTSW* ptrUrlC, HINTERNET hConn,
-               WW_PARAMSW* userParams, WW_PRIVATEPARAMSW* privateParams);
+WWQueryDispatchW(WW_REQUESTW* request, WW_RESPONSEW* response,
+                 UINT redirectsLeft, WW_PRIVATEQUERYW* privateQuery);
 
 WW_PRIVATE
 INT
-WWProcessFtpW(URL_COMPONENTSW* ptrUrlC, HINTERNET hConn,
-              WW_PARAMSW* userParams, WW_PRIVATEPARAMSW* privateParams);
+WWQuerySendW(HINTERNET hInet, WW_REQUESTW* request, WW_RESPONSEW* response,
+             UINT redirectsLeft, WW_PRIVATEQUERYW* privateQuery);
+
+WW_PRIVATE
+WW_ORIGINW*
+WWOriginFindW(WW_SESSION* session, LPCWSTR url, BOOL create);
+
+WW_PRIVATE
+UINT
+WWLimiterClampW(const WW_LIMITER_OPTIONS* limiter, UINT limit);
+
+WW_PRIVATE
+BOOL
+WWHedgePublishW(WW_HEDGELEGW* leg, HINTERNET hReq);
+
+WW_PRIVATE
+BOOL
+WWHedgeHeadersW(WW_HEDGELEGW* leg);
+
+WW_PRIVATE
+VOID
+WWQueryCloseW(WW_CANCEL* cancel, WW_CANCELREG* reg, HINTERNET hConn,
+              WW_PHASECLOCK* clock, WW_RESPONSEW* response);
+
+WW_PRIVATE
+DWORD WINAPI
+WWBatchWorkerW(LPVOID param);
+
+WW_PRIVATE
+BOOL
+WWIsCoalescableW(const WW_REQUESTW* request);
 
 WW_PRIVATE
 INT
-WWRetrieveDataW(HINTERNET hFile, LONGLONG size,
-                const FILETIME* pftLastModified,
-                WW_PARAMSW* userParams,
-                WW_PRIVATEPARAMSW* privateParams);
+WWQueryCoalescedW(WW_REQUESTW* request, WW_RESPONSEW* response,
+                  UINT redirectsLeft, WW_PRIVATEQUERYW* privateQuery);
+
+WW_PRIVATE
+BOOL
+WWIsCacheableRequestW(const WW_REQUESTW* request);
 
 WW_PRIVATE
 INT
-WWMakeDownloadPathW(LPCWSTR url, LPWSTR path, DWORD len);
+WWQueryCachedW(WW_REQUESTW* request, WW_RESPONSEW* response,
+               UINT redirectsLeft);
 
 WW_PRIVATE
-VOID 
-WWLogW(BOOL logEnabled, INT msgType, LPCWSTR displayStr);
+VOID
+WWCacheClearW(WW_SESSION* session);
+
+WW_PRIVATE
+INT
+WWQueryRouteW(WW_REQUESTW* request, WW_RESPONSEW* response,
+              UINT redirectsLeft, WW_PRIVATEQUERYW* privateQuery);
 
+WW_PRIVATE
+INT
+WWDiskCacheQueryW(WW_REQUESTW* request, WW_RESPONSEW* response,
+                  UINT redirectsLeft);
 
 WW_PRIVATE
 INT
-WWGetSizeUnitW(double sizeValue);
+WWDiskCacheDownloadW(WW_PARAMSW* userParams, WW_PRIVATEPARAMSW* privateParams);
 
 WW_PRIVATE
-BOOL
-WWIsRedirectStatus(DWORD statusCode);
+INT
+WWDiskCachePlaceDownloadW(WW_PARAMSW* userParams,
+                          WW_PRIVATEPARAMSW* privateParams,
+                          const WW_DISKSLOT* slot);
 
 WW_PRIVATE
-BOOL
-WWBuildRequestPathW(const URL_COMPONENTSW* ptrUrlC, LPWSTR outPath, DWORD outPathCch);
+VOID
+WWDiskCacheRefreshW(WW_DISKCACHE* cache, LPCWSTR url,
+                    const WW_DISKSLOT* validated,
+                    const WW_PRIVATEQUERYW* cacheInfo);
+
+WW_PRIVATE
+VOID
+WWDiskCacheStoreFileW(WW_DISKCACHE* cache, LPCWSTR url, LPCWSTR filePath,
+                      const BYTE* blob, ULONGLONG size,
+                      const WW_PRIVATEQUERYW* cacheInfo, LPCWSTR fileName);
 
 WW_PRIVATE
 BOOL
-WWBuildRequestPathA(const URL_COMPONENTSA* ptrUrlC, LPSTR outPath, DWORD outPathCch);
+WWDiskLockW(WW_DISKCACHE* cache);
+
+WW_PRIVATE
+VOID
+WWDiskUnlockW(WW_DISKCACHE* cache);
 
 WW_PRIVATE
 BOOL
-WWResolveRedirectW(LPCWSTR baseUrl, LPCWSTR location, LPWSTR outUrl, DWORD outUrlCch);
+WWHashBegin(WW_HASHCTX* ctx, INT algorithm);
+
+WW_PRIVATE
+VOID
+WWHashUpdate(WW_HASHCTX* ctx, LPCVOID data, SIZE_T size);
 
 WW_PRIVATE
 BOOL
-WWResolveRedirectA(LPCSTR baseUrl, LPCSTR location, LPSTR outUrl, DWORD outUrlCch);
-// generic
+WWHashEnd(WW_HASHCTX* ctx, PUCHAR digest, ULONG digestSize);
 
 WW_PRIVATE
 BOOL
-WWIsFileModified(HANDLE hFileN, LONGLONG fileSize,
-                 const FILETIME* pftLastWriteTime);
+WWSha256(LPCVOID data, SIZE_T size, PUCHAR digest);
 
-/******************************** PUBLIC API **********************************/
+WW_PRIVATE
+DWORD
+WWHashDigestSize(INT algorithm);
+
+WW_PRIVATE
+WW_CRC32C_FN
+WWGetCrc32c(void);
 
+WW_PRIVATE
 INT
-WWDownloadW(
-    LPCWSTR url,
+WWOpenDecoderW(HINTERNET hReq, WW_INFLATE** decoder);
+
+WW_PRIVATE
+BOOL
+WWReadBodyW(HINTERNET hReq, WW_INFLATE* decoder, LPVOID buf, DWORD size,
+            LPDWORD bytesRead);
+
+WW_PRIVATE
+BOOL
+WWGzipCompress(const BYTE* src, DWORD size, INT level,
+               LPBYTE* out, LPDWORD outSize);
+
+WW_PRIVATE
+WW_DEFLATE*
+WWGzipStreamOpen(const BYTE* src, DWORD size, INT level);
+
+WW_PRIVATE
+BOOL
+WWGzipStreamRead(WW_DEFLATE* def, LPBYTE buf, DWORD size, LPDWORD bytesRead);
+
+WW_PRIVATE
+VOID
+WWGzipStreamRewind(WW_DEFLATE* def);
+
+WW_PRIVATE
+VOID
+WWGzipStreamClose(WW_DEFLATE* def);
+
+WW_PRIVATE
+INT
+WWQueryCompressedW(WW_REQUESTW* request, WW_RESPONSEW* response,
+                   UINT redirectsLeft);
+
+WW_PRIVATE
+BOOL
+WWFindHeaderLineW(LPCWSTR headers, LPCWSTR name, SIZE_T nameLen,
+                  LPWSTR outValue, DWORD outValueCch);
+
+WW_PRIVATE
+LPWSTR
+WWBuildRequestHeadersW(const WW_REQUESTW* request,
+                       const WW_PRIVATEQUERYW* privateQuery,
+                       const WW_UPLOADSTATE* upload);
+
+WW_PRIVATE
+DWORD WINAPI
+WWMultipartWorkerW(LPVOID param);
+
+WW_PRIVATE
+BOOL
+WWPartReadW(LPVOID buffer, DWORD size, LPDWORD bytesRead, LPVOID pUserData);
+
+WW_PRIVATE
+BOOL
+WWMultipartHashW(WW_MULTIPARTCTXW* ctx, WW_MULTIPART_PART* part);
+
+WW_PRIVATE
+INT
+WWMultipartCallW(WW_MULTIPARTCTXW* ctx, INT phase, WW_MULTIPART_PART* part,
+                 LPDWORD statusCode);
+
+WW_PRIVATE
+VOID
+WWMultipartFailW(WW_MULTIPARTCTXW* ctx, INT errorcode, DWORD statusCode);
+
+WW_PRIVATE
+SOCKET
+WWSocketConnectW(LPCWSTR host, INTERNET_PORT port, DWORD timeoutMs,
+                 const WW_CANCEL* cancel);
+
+WW_PRIVATE
+BOOL
+WWSocketEventWaitW(WSAEVENT hReady, DWORD timeoutMs, const WW_CANCEL* cancel);
+
+WW_PRIVATE
+BOOL
+WWSocketWaitW(SOCKET sock, DWORD timeoutMs, const WW_CANCEL* cancel);
+
+WW_PRIVATE
+VOID
+WWExpectReadBodyW(SOCKET sock, const WW_HTTP_PARSER* parser, const CHAR* rest,
+                  SIZE_T restLen, DWORD timeoutMs, const WW_CANCEL* cancel,
+                  WW_RESPONSEW* response);
+
+WW_PRIVATE
+INT
+WWExpectContinueW(HINTERNET hInet, const WW_REQUESTW* request,
+                  const URL_COMPONENTSW* urlc, LPCWSTR verb, LPCWSTR headers,
+                  const WW_UPLOADSTATE* upload, WW_RESPONSEW* response);
+
+WW_PRIVATE
+DWORD
+WWRetryDelayW(const WW_RETRY_POLICY* policy, UINT attempt, DWORD retryAfterMs);
+
+WW_PRIVATE
+BOOL
+WWRetryWaitW(DWORD delayMs, const volatile BOOL* pCancelFlag,
+             const WW_CANCEL* cancel);
+
+WW_PRIVATE
+BOOL
+WWIsRetryableStatusW(DWORD statusCode, DWORD retryOn);
+
+WW_PRIVATE
+BOOL
+WWCancelAttach(WW_CANCEL* cancel, ULONGLONG deadlineMs, WW_CANCELREG* reg,
+               HINTERNET hReq, HINTERNET volatile* slot);
+
+WW_PRIVATE
+VOID CALLBACK
+WWDeadlineTimerW(PVOID param, BOOLEAN fired);
+
+WW_PRIVATE
+BOOL
+WWDeadlinePassed(ULONGLONG deadlineMs);
+
+WW_PRIVATE
+DWORD
+WWDeadlineClampW(ULONGLONG deadlineMs, DWORD timeoutMs);
+
+WW_PRIVATE
+VOID
+WWCancelRelease(WW_CANCEL* cancel, WW_CANCELREG* reg);
+
+WW_PRIVATE
+VOID
+WWTraceBeginW(INT stage, LPCWSTR url);
+
+WW_PRIVATE
+VOID
+WWTraceEndW(INT stage, ULONGLONG bytes, BOOL failed);
+
+WW_PRIVATE
+VOID
+WWTraceEmitW(const WW_TRACE_EVENT* event);
+
+WW_PRIVATE
+VOID
+WWTraceSinkAppend(WW_TRACESINK* sink, const CHAR* data, SIZE_T size);
+
+WW_PRIVATE
+VOID
+WWTraceSinkAppendUrlW(WW_TRACESINK* sink, LPCWSTR url);
+
+WW_PRIVATE
+VOID
+WWTraceSinkFlush(WW_TRACESINK* sink);
+
+WW_PRIVATE
+VOID
+WWMetricsAdd(ULONGLONG* counter, ULONGLONG value);
+
+WW_PRIVATE
+VOID
+WWMetricsObserve(WW_HISTOGRAM* histogram, ULONGLONG us);
+
+WW_PRIVATE
+VOID
+WWMetricsRequestW(const WW_PHASECLOCK* clock, DWORD statusCode);
+
+WW_PRIVATE
+VOID
+WWMetricsAppend(WW_METRICSTEXT* text, const CHAR* line, INT len);
+
+WW_PRIVATE
+VOID
+WWMetricsAppendCounter(WW_METRICSTEXT* text, const CHAR* name,
+                       const CHAR* help, ULONGLONG value);
+
+WW_PRIVATE
+VOID
+WWMetricsAppendHistogram(WW_METRICSTEXT* text, const CHAR* name,
+                         const CHAR* help, const WW_HISTOGRAM* histogram);
+
+WW_PRIVATE
+WW_PHASECLOCK*
+WWClockOpenW(ULONGLONG startUs, BOOL secure);
+
+WW_PRIVATE
+VOID
+WWClockAttachW(WW_PHASECLOCK* clock, HINTERNET hReq);
+
+WW_PRIVATE
+VOID
+WWClockMarkW(WW_PHASECLOCK* clock, INT phase);
+
+WW_PRIVATE
+VOID
+WWClockReadW(const WW_PHASECLOCK* clock, WW_TIMINGS* timings);
+
+WW_PRIVATE
+VOID
+WWClockRedirectW(WW_TIMINGS* timings, ULONGLONG startUs);
+
+WW_PRIVATE
+VOID
+WWClockCloseW(WW_PHASECLOCK* clock, WW_TIMINGS* timings);
+
+WW_PRIVATE
+VOID CALLBACK
+WWStatusCallbackW(HINTERNET hInternet, DWORD_PTR context, DWORD status,
+                  LPVOID info, DWORD infoLength);
+
+WW_PRIVATE
+VOID
+WWRateLimitConfigure(WW_RATELIMIT* limit, ULONGLONG bytesPerSecond,
+                     ULONGLONG burstBytes);
+
+WW_PRIVATE
+VOID
+WWRateLimitRefill(WW_RATELIMIT* limit, ULONGLONG nowUs);
+
+WW_PRIVATE
+WW_RATELIMIT*
+WWRateLimitHostW(LPCWSTR host);
+
+WW_PRIVATE
+DWORD
+WWRateLimitChunk(WW_RATELIMIT* const* limits, UINT count, DWORD size);
+
+WW_PRIVATE
+VOID
+WWRateLimitWait(WW_RATELIMIT* const* limits, UINT count, ULONGLONG bytes,
+                const volatile BOOL* pCancelFlag, const WW_CANCEL* cancel,
+                ULONGLONG deadlineMs);
+
+WW_PRIVATE
+DWORD
+WWLowSpeedTimeW(const WW_PARAMSW* userParams);
+
+WW_PRIVATE
+DWORD
+WWReceiveTimeoutW(const WW_PARAMSW* userParams);
+
+WW_PRIVATE
+VOID
+WWSpeedCheckStart(WW_SPEEDCHECK* check);
+
+WW_PRIVATE
+VOID
+WWSpeedCheckPause(WW_SPEEDCHECK* check, ULONGLONG pausedMs);
+
+WW_PRIVATE
+BOOL
+WWSpeedCheckStalledW(const WW_PARAMSW* userParams, WW_SPEEDCHECK* check,
+                     ULONGLONG bytes);
+
+WW_PRIVATE
+BOOL
+WWSpeedCheckSilentW(const WW_PARAMSW* userParams, const WW_SPEEDCHECK* check);
+
+WW_PRIVATE
+INT
+WWQueryRetryW(WW_REQUESTW* request, WW_RESPONSEW* response,
+              UINT redirectsLeft, WW_PRIVATEQUERYW* privateQuery);
+
+WW_PRIVATE
+BOOL
+WWIsDownloadStoppedW(const WW_PARAMSW* userParams);
+
+WW_PRIVATE
+BOOL
+WWIsRetryableDownloadW(const WW_PARAMSW* userParams,
+                       const WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+ULONGLONG
+WWResumeOffsetW(const WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+VOID
+WWCaptureValidatorW(HINTERNET hReq, LPWSTR validator, DWORD validatorCch);
+
+WW_PRIVATE
+VOID
+WWSegmentPlanW(WW_JOURNALSLOT* journal, ULONGLONG size, UINT segments,
+               LPCWSTR validator);
+
+WW_PRIVATE
+BOOL
+WWJournalReadW(LPCWSTR path, WW_JOURNALSLOT* journal);
+
+WW_PRIVATE
+BOOL
+WWJournalWriteW(HANDLE hJournal, WW_JOURNALSLOT* journal);
+
+WW_PRIVATE
+BOOL
+WWSegmentCheckpointW(WW_SEGMENTCTXW* ctx, UINT index, ULONGLONG done);
+
+WW_PRIVATE
+VOID
+WWSegmentFailW(WW_SEGMENTCTXW* ctx, INT errorcode, DWORD statusCode);
+
+WW_PRIVATE
+UINT
+WWMirrorPickW(WW_SEGMENTCTXW* ctx);
+
+WW_PRIVATE
+UINT
+WWSegmentClaimW(WW_SEGMENTCTXW* ctx);
+
+WW_PRIVATE
+VOID
+WWSegmentFetchW(WW_SEGMENTCTXW* ctx, UINT index, LPBYTE buf);
+
+WW_PRIVATE
+DWORD WINAPI
+WWSegmentWorkerW(LPVOID param);
+
+WW_PRIVATE
+VOID
+WWMirrorsOpenW(WW_SEGMENTCTXW* ctx, HINTERNET hInet, DWORD requestFlags);
+
+WW_PRIVATE
+VOID
+WWMirrorsCloseW(WW_SEGMENTCTXW* ctx);
+
+WW_PRIVATE
+VOID
+WWRaiseConnectionLimit(UINT count);
+
+WW_PRIVATE
+SIZE_T
+WWManifestFind(const CHAR* data, SIZE_T from, SIZE_T to, const CHAR* needle);
+
+WW_PRIVATE
+BOOL
+WWManifestIs(const CHAR* text, SIZE_T len, const CHAR* literal);
+
+WW_PRIVATE
+VOID
+WWManifestTrim(const CHAR** src, SIZE_T* len);
+
+WW_PRIVATE
+BOOL
+WWManifestTextW(const CHAR* src, SIZE_T len, INT format, LPWSTR out,
+                DWORD outCch);
+
+WW_PRIVATE
+BOOL
+WWManifestNumber(const CHAR* src, SIZE_T len, ULONGLONG* value);
+
+WW_PRIVATE
+BOOL
+WWManifestHash(const CHAR* src, SIZE_T len, BYTE* digest);
+
+WW_PRIVATE
+VOID
+WWManifestAddUrlW(WW_MANIFESTENTRYW* entry, const CHAR* src, SIZE_T len,
+                  INT format, DWORD priority);
+
+WW_PRIVATE
+BOOL
+WWManifestAttr(const CHAR* tag, SIZE_T len, const CHAR* name,
+               const CHAR** value, SIZE_T* valueLen);
+
+WW_PRIVATE
+BOOL
+WWManifestNextMetalinkW(WW_MANIFESTREADER* reader, WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+BOOL
+WWJsonString(WW_MANIFESTREADER* reader, const CHAR** value, SIZE_T* len);
+
+WW_PRIVATE
+VOID
+WWJsonSkipSpace(WW_MANIFESTREADER* reader);
+
+WW_PRIVATE
+BOOL
+WWJsonSkipValue(WW_MANIFESTREADER* reader);
+
+WW_PRIVATE
+BOOL
+WWManifestNextJsonW(WW_MANIFESTREADER* reader, WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+BOOL
+WWManifestNextTsvW(WW_MANIFESTREADER* reader, WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+BOOL
+WWManifestNextW(WW_MANIFESTREADER* reader, WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+BOOL
+WWManifestTargetW(const WW_MANIFESTCTXW* ctx, WW_MANIFESTENTRYW* entry,
+                  LPWSTR fullPath, LPWSTR dirPath);
+
+WW_PRIVATE
+BOOL
+WWManifestMatchesW(LPCWSTR path, const WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+VOID
+WWManifestFileW(WW_MANIFESTCTXW* ctx, WW_MANIFESTENTRYW* entry);
+
+WW_PRIVATE
+DWORD WINAPI
+WWManifestWorkerW(LPVOID param);
+
+WW_PRIVATE
+INT
+WWRetrieveSegmentsW(HINTERNET hConn, HINTERNET hReq, WW_CANCELREG* reqReg,
+                    LPCWSTR urlPath, DWORD requestFlags, ULONGLONG size,
+                    const FILETIME* pftLastModified, WW_PARAMSW* userParams,
+                    WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+BOOL
+WWUploadBeginW(const WW_UPLOAD_SOURCE* source, WW_UPLOADSTATE* state);
+
+WW_PRIVATE
+BOOL
+WWUploadRewindW(WW_UPLOADSTATE* state);
+
+WW_PRIVATE
+INT
+WWUploadSendW(HINTERNET hReq, LPCWSTR headers, DWORD headersLen,
+              WW_UPLOADSTATE* state);
+
+WW_PRIVATE
+BOOL
+WWHashFileW(HANDLE hFile, ULONGLONG size, WW_HASHCTX* ctx);
+
+WW_PRIVATE
+BOOL
+WWDigestMatchesW(const WW_PARAMSW* userParams);
+
+WW_PRIVATE
+DWORD
+WWDiskCacheDigestW(WW_DISKCACHE* cache, const WW_DISKSLOT* slot,
+                   INT algorithm, PUCHAR digest);
+
+WW_PRIVATE
+VOID
+WWHexEncodeW(const BYTE* data, SIZE_T size, LPWSTR out);
+
+WW_PRIVATE
+VOID
+WWSharedBodyRelease(WW_SHAREDBODY* body);
+
+WW_PRIVATE
+INT
+WWDownloadProcessW(WW_PARAMSW* params, WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+INT
+WWProcessHttpW(URL_COMPONENTSW* ptrUrlC, HINTERNET hConn,
+               WW_PARAMSW* userParams, WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+INT
+WWProcessFtpW(URL_COMPONENTSW* ptrUrlC, HINTERNET hConn,
+              WW_PARAMSW* userParams, WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+INT
+WWRetrieveDataW(HINTERNET hFile, LONGLONG size,
+                const FILETIME* pftLastModified,
+                WW_PARAMSW* userParams,
+                WW_PRIVATEPARAMSW* privateParams);
+
+WW_PRIVATE
+INT
+WWMakeDownloadPathW(LPCWSTR url, LPWSTR path, DWORD len);
+
+WW_PRIVATE
+VOID 
+WWLogW(BOOL logEnabled, INT msgType, LPCWSTR displayStr);
+
+
+WW_PRIVATE
+INT
+WWGetSizeUnitW(double sizeValue);
+
+WW_PRIVATE
+BOOL
+WWIsRedirectStatus(DWORD statusCode);
+
+WW_PRIVATE
+BOOL
+WWBuildRequestPathW(const URL_COMPONENTSW* ptrUrlC, LPWSTR outPath, DWORD outPathCch);
+
+WW_PRIVATE
+BOOL
+WWBuildRequestPathA(const URL_COMPONENTSA* ptrUrlC, LPSTR outPath, DWORD outPathCch);
+
+WW_PRIVATE
+BOOL
+WWResolveRedirectW(LPCWSTR baseUrl, LPCWSTR location, LPWSTR outUrl, DWORD outUrlCch);
+
+WW_PRIVATE
+BOOL
+WWResolveRedirectA(LPCSTR baseUrl, LPCSTR location, LPSTR outUrl, DWORD outUrlCch);
+// generic
+
+WW_PRIVATE
+BOOL
+WWIsFileModified(HANDLE hFileN, LONGLONG fileSize,
+                 const FILETIME* pftLastWriteTime);
+
+WW_PRIVATE
+ULONGLONG
+WWGetTimeUs(void);
+
+/******************************** PUBLIC API **********************************/
+
+INT
+WWDownloadW(
+    LPCWSTR url,
     LPCWSTR fullFilePath,
     DWORD flags
 )
 {
-    DWORD defaultPbFlags = WW_PB_PROGRESSBAR | WW_PB_PERCENTAGE | WW_PB_ETA |
-        WW_PB_SPEED | WW_PB_FILESIZE | WW_PB_FILENAME;
+    DWORD defaultPbFlags = WW_PB_PROGRESSBAR | WW_PB_PERCENTAGE | WW_PB_ETA |
+        WW_PB_SPEED | WW_PB_FILESIZE | WW_PB_FILENAME;
+
+
+    WW_PARAMSW userParams = {
+        .status = WW_STATUS_INIT,
+        .errorcode = WW_ERR_NOERROR,
+        .url = url,
+        .dstPath = NULL,
+        .outFileName = NULL,
+        .userAgent = WW_DEFAULT_USER_AGENTW,
+        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
+        .headerLength = WW_DEFAULT_HEADER_LENGTH,
+        .logEnabled = flags & WW_SHOW_LOG,
+        .progressBarEnabled = flags & WW_SHOW_PROGRESSBAR,
+        .forceDownload = flags & WW_FORCE_DOWNLOAD,
+        .progressBarFlags = defaultPbFlags,
+        .progressBarData = {
+            .ulTimeElapsedInSecs = 0,
+            .szDownloadedInBytes = 0,
+            .szTotalInBytes = 0,
+            .dETAInSecs = 0
+        }
+    };
+
+    // Extract filename and crop dstPath to needed states.
+    const WCHAR* extractedFileName = wcsrchr(fullFilePath, L'\\') + 1;
+    size_t dirPathLength = extractedFileName - fullFilePath;
+    WCHAR* newPath = (WCHAR*)malloc(dirPathLength + 1);
+    if (newPath == NULL)
+    {
+        return WW_FAILURE;
+    }
+    wcsncpy(newPath, fullFilePath, dirPathLength + 1);
+    newPath[dirPathLength] = '\0'; // Null-terminate the directory path
+    userParams.dstPath = newPath;
+    userParams.outFileName = extractedFileName;
+
+    return WWDownloadExW(&userParams);
+}
+
+INT
+WWDownloadAsW(
+    LPCWSTR url,
+    LPCWSTR dstPath,
+    LPCWSTR outFileName,
+    DWORD flags
+)
+{
+    DWORD defaultPbFlags = WW_PB_PROGRESSBAR | WW_PB_PERCENTAGE | WW_PB_ETA |
+                           WW_PB_SPEED | WW_PB_FILESIZE | WW_PB_FILENAME;
+
+    WW_PARAMSW userParams = {
+        .status = WW_STATUS_INIT,
+        .errorcode = WW_ERR_NOERROR,
+        .url = url,
+        .dstPath = dstPath,
+        .outFileName = outFileName,
+        .userAgent = WW_DEFAULT_USER_AGENTW,
+        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
+        .headerLength = WW_DEFAULT_HEADER_LENGTH,
+        .logEnabled = flags & WW_SHOW_LOG,
+        .progressBarEnabled = flags & WW_SHOW_PROGRESSBAR,
+        .forceDownload = flags & WW_FORCE_DOWNLOAD,
+        .progressBarFlags = defaultPbFlags,
+        .progressBarData = {
+            .ulTimeElapsedInSecs = 0,
+            .szDownloadedInBytes = 0,
+            .szTotalInBytes = 0,
+            .dETAInSecs = 0
+        }
+    };
+
+    return WWDownloadExW(&userParams);
+}
+
+INT
+WWQueryW(
+    LPCWSTR url,
+    LPCWSTR verb,
+    LPCVOID body,
+    DWORD bodySize,
+    LPCWSTR contentType,
+    WW_RESPONSEW* response
+)
+{
+    WW_REQUESTW request = {
+        .url = url,
+        .verb = verb,
+        .userAgent = WW_DEFAULT_USER_AGENTW,
+        .contentType = contentType,
+        .body = body,
+        .bodySize = bodySize,
+        .headers = NULL,
+        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
+        .logEnabled = FALSE
+    };
+    return WWQueryExW(&request, response);
+}
+
+INT
+WWQueryExW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response
+)
+{
+    if (NULL == request || NULL == response)
+    {
+        return WW_FAILURE;
+    }
+
+    ZeroMemory(response, sizeof(*response));
+
+    if (NULL == request->url)
+    {
+        response->errorcode = WW_ERR_NO_URL;
+        return WW_FAILURE;
+    }
+
+    if (WWIsCancelled(request->cancel))
+    {
+        response->errorcode = WW_ERR_CANCELLED;
+        return WW_FAILURE;
+    }
+    if (WWDeadlinePassed(request->deadlineMs))
+    {
+        response->errorcode = WW_ERR_TIMEOUT;
+        return WW_FAILURE;
+    }
+
+    UINT maxRedirs = request->maxRedirectLimit;
+    if (0 == maxRedirs)
+    {
+        maxRedirs = WW_DEFAULT_REDIRECT_LIMIT;
+    }
+
+    DWORD compressMinSize = request->compressMinSize;
+    if (0 == compressMinSize)
+    {
+        compressMinSize = WW_DEFAULT_COMPRESS_MIN_SIZE;
+    }
+
+    INT result = WW_FAILURE;
+    ULONGLONG startUs = WWGetTimeUs();
+    WWTraceBeginW(WW_TRACE_QUERY, request->url);
+    if (request->compressLevel > 0 && NULL == request->upload &&
+        NULL != request->body && request->bodySize >= compressMinSize)
+    {
+        result = WWQueryCompressedW(request, response, maxRedirs);
+    }
+    else if (NULL != request->diskCache && WWIsCacheableRequestW(request))
+    {
+        result = WWDiskCacheQueryW(request, response, maxRedirs);
+    }
+    else
+    {
+        result = WWQueryRetryW(request, response, maxRedirs, NULL);
+    }
+    WWTraceEndW(WW_TRACE_QUERY, response->dataSize, WW_SUCCESS != result);
+    WWMetricsObserve(&g_wwMetrics.queryDuration, WWGetTimeUs() - startUs);
+    return result;
+}
+
+WW_SESSION*
+WWSessionOpenW(
+    const WW_SESSION_OPTIONSW* options
+)
+{
+    WW_SESSION* session = (WW_SESSION*)calloc(1, sizeof(*session));
+    if (NULL == session)
+    {
+        return NULL;
+    }
+
+    LPCWSTR userAgent = WW_DEFAULT_USER_AGENTW;
+    if (NULL != options)
+    {
+        session->flags = options->flags;
+        session->cacheBudget = options->cacheBytes;
+        session->breaker = options->breaker;
+        session->limiter = options->limiter;
+        if (NULL != options->userAgent)
+        {
+            userAgent = options->userAgent;
+        }
+    }
+
+    if (session->cacheBudget > 0)
+    {
+        session->cache = (WW_CACHEENTRYW**)calloc(WW_CACHE_BUCKETS,
+                                                  sizeof(WW_CACHEENTRYW*));
+        if (NULL == session->cache)
+        {
+            free(session);
+            return NULL;
+        }
+    }
+
+    session->hInet = InternetOpenW(userAgent, INTERNET_OPEN_TYPE_PRECONFIG,
+                                   NULL, NULL, 0);
+    if (NULL == session->hInet)
+    {
+        free(session->cache);
+        free(session);
+        return NULL;
+    }
+
+    InitializeCriticalSection(&session->lock);
+    InitializeConditionVariable(&session->slotFreed);
+
+    if (session->flags & WW_SESSION_HTTP2)
+    {
+        // Requests opened on this handle negotiate h2 via ALPN and share one
+        // connection per origin. Older WinInet rejects the option, in which
+        // case the session silently stays on HTTP/1.1 keep-alive.
+        DWORD protocols = HTTP_PROTOCOL_FLAG_HTTP2;
+        InternetSetOptionW(session->hInet, INTERNET_OPTION_ENABLE_HTTP_PROTOCOL,
+                           &protocols, sizeof(protocols));
+    }
+
+    return session;
+}
+
+VOID
+WWSessionClose(
+    WW_SESSION* session
+)
+{
+    if (NULL != session)
+    {
+        InternetCloseHandle(session->hInet);
+        WWCacheClearW(session);
+        while (NULL != session->origins)
+        {
+            WW_ORIGINW* origin = session->origins;
+            session->origins = origin->next;
+            free(origin);
+        }
+        DeleteCriticalSection(&session->lock);
+        free(session->cache);
+        free(session);
+    }
+}
+
+INT
+WWSessionGetStats(
+    WW_SESSION* session,
+    WW_SESSION_STATS* stats
+)
+{
+    if (NULL == session || NULL == stats)
+    {
+        return WW_FAILURE;
+    }
+
+    EnterCriticalSection(&session->lock);
+    *stats = session->stats;
+    LeaveCriticalSection(&session->lock);
+
+    return WW_SUCCESS;
+}
+
+INT
+WWSessionGetOriginStatsW(
+    WW_SESSION* session,
+    LPCWSTR url,
+    WW_ORIGIN_STATS* stats
+)
+{
+    if (NULL == session || NULL == url || NULL == stats)
+    {
+        return WW_FAILURE;
+    }
+
+    ZeroMemory(stats, sizeof(*stats));
+
+    EnterCriticalSection(&session->lock);
+    WW_ORIGINW* origin = WWOriginFindW(session, url, FALSE);
+    if (NULL != origin)
+    {
+        *stats = origin->stats;
+        stats->breakerState = origin->state;
+        stats->inFlight = origin->inFlight;
+        stats->concurrencyLimit = origin->limit;
+    }
+    else
+    {
+        stats->breakerState = WW_BREAKER_CLOSED;
+        stats->concurrencyLimit = WWLimiterClampW(&session->limiter,
+                                                  session->limiter.initialLimit);
+    }
+    if (0 == session->limiter.initialLimit)
+    {
+        stats->concurrencyLimit = 0;
+    }
+    LeaveCriticalSection(&session->lock);
+
+    return WW_SUCCESS;
+}
+
+WW_DISKCACHE*
+WWDiskCacheOpenW(
+    LPCWSTR directory,
+    ULONGLONG maxBytes,
+    DWORD flags
+)
+{
+    if (NULL == directory)
+    {
+        return NULL;
+    }
+
+    WW_DISKCACHE* cache = (WW_DISKCACHE*)calloc(1, sizeof(*cache));
+    if (NULL == cache)
+    {
+        return NULL;
+    }
+    cache->maxBytes = maxBytes;
+    cache->flags = flags;
+
+    // Leave room for "blobs\<sha256>.<pid>-<tid>.tmp"
+    DWORD dirLen = GetFullPathNameW(directory, WW_COUNTOF(cache->directory),
+                                    cache->directory, NULL);
+    if (0 == dirLen || dirLen + 100 > WW_COUNTOF(cache->directory))
+    {
+        free(cache);
+        return NULL;
+    }
+    if (L'\\' != cache->directory[dirLen - 1])
+    {
+        wcsncat(cache->directory, L"\\", WW_STR_SYMSW(cache->directory));
+    }
+
+    WCHAR path[MAX_PATH] = L"";
+    wcsncpy(path, cache->directory, WW_COUNTOF(path));
+    wcsncat(path, L"blobs", WW_STR_SYMSW(path));
+    CreateDirectoryW(cache->directory, NULL);
+    CreateDirectoryW(path, NULL);
+    InitializeSRWLock(&cache->lock);
+
+    // The index file itself is the lock, so processes in other sessions
+    // (a service and a user application) exclude each other as well
+    wcsncpy(path, cache->directory, WW_COUNTOF(path));
+    wcsncat(path, L"index.bin", WW_STR_SYMSW(path));
+    cache->hIndexFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE,
+                                    FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == cache->hIndexFile)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    // Mapping a new (empty) file grows it to the index size, zero-filled
+    cache->hMapping = CreateFileMappingW(cache->hIndexFile, NULL, PAGE_READWRITE,
+                                         0, sizeof(WW_DISKINDEX), NULL);
+    if (NULL != cache->hMapping)
+    {
+        cache->index = (WW_DISKINDEX*)MapViewOfFile(cache->hMapping,
+                                                    FILE_MAP_ALL_ACCESS, 0, 0,
+                                                    sizeof(WW_DISKINDEX));
+    }
+    if (NULL == cache->index)
+    {
+        if (NULL != cache->hMapping)
+        {
+            CloseHandle(cache->hMapping);
+        }
+        CloseHandle(cache->hIndexFile);
+        free(cache);
+        return NULL;
+    }
+
+    // Validates (or initialises) the index header
+    if (WWDiskLockW(cache))
+    {
+        WWDiskUnlockW(cache);
+    }
+
+    return cache;
+}
+
+VOID
+WWDiskCacheClose(
+    WW_DISKCACHE* cache
+)
+{
+    if (NULL != cache)
+    {
+        FlushViewOfFile(cache->index, 0);
+        UnmapViewOfFile(cache->index);
+        CloseHandle(cache->hMapping);
+        CloseHandle(cache->hIndexFile);
+        free(cache);
+    }
+}
+
+WW_RATELIMIT*
+WWRateLimitOpen(
+    ULONGLONG bytesPerSecond,
+    ULONGLONG burstBytes
+)
+{
+    WW_RATELIMIT* limit = (WW_RATELIMIT*)calloc(1, sizeof(WW_RATELIMIT));
+    if (NULL == limit)
+    {
+        return NULL;
+    }
+    InitializeSRWLock(&limit->lock);
+    WWRateLimitConfigure(limit, bytesPerSecond, burstBytes);
+    return limit;
+}
+
+VOID
+WWRateLimitSet(
+    WW_RATELIMIT* limit,
+    ULONGLONG bytesPerSecond,
+    ULONGLONG burstBytes
+)
+{
+    if (NULL != limit)
+    {
+        WWRateLimitConfigure(limit, bytesPerSecond, burstBytes);
+    }
+}
+
+VOID
+WWRateLimitClose(
+    WW_RATELIMIT* limit
+)
+{
+    free(limit);
+}
+
+INT
+WWSetGlobalRateLimit(
+    ULONGLONG bytesPerSecond,
+    ULONGLONG burstBytes
+)
+{
+    WWRateLimitConfigure(&g_wwGlobalRate, bytesPerSecond, burstBytes);
+    return WW_SUCCESS;
+}
+
+INT
+WWSetHostRateLimitW(
+    LPCWSTR host,
+    ULONGLONG bytesPerSecond,
+    ULONGLONG burstBytes
+)
+{
+    if (NULL == host || L'\0' == host[0] ||
+        wcslen(host) >= INTERNET_MAX_HOST_NAME_LENGTH)
+    {
+        return WW_FAILURE;
+    }
+
+    AcquireSRWLockExclusive(&g_wwHostRatesLock);
+    WW_HOSTRATEW* entry = g_wwHostRates;
+    while (NULL != entry && 0 != _wcsicmp(entry->host, host))
+    {
+        entry = entry->next;
+    }
+    if (NULL == entry && 0 != bytesPerSecond)
+    {
+        entry = (WW_HOSTRATEW*)calloc(1, sizeof(WW_HOSTRATEW));
+        if (NULL == entry)
+        {
+            ReleaseSRWLockExclusive(&g_wwHostRatesLock);
+            return WW_FAILURE;
+        }
+        wcsncpy(entry->host, host, WW_STR_SYMSW(entry->host));
+        InitializeSRWLock(&entry->limit.lock);
+        entry->next = g_wwHostRates;
+        g_wwHostRates = entry;
+    }
+    if (NULL != entry)
+    {
+        WWRateLimitConfigure(&entry->limit, bytesPerSecond, burstBytes);
+    }
+    ReleaseSRWLockExclusive(&g_wwHostRatesLock);
+    return WW_SUCCESS;
+}
+
+WW_CANCEL*
+WWCancelOpen(
+    VOID
+)
+{
+    WW_CANCEL* cancel = (WW_CANCEL*)calloc(1, sizeof(WW_CANCEL));
+    if (NULL == cancel)
+    {
+        return NULL;
+    }
+    cancel->hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (NULL == cancel->hEvent)
+    {
+        free(cancel);
+        return NULL;
+    }
+    InitializeSRWLock(&cancel->lock);
+    return cancel;
+}
+
+VOID
+WWCancel(
+    WW_CANCEL* cancel
+)
+{
+    if (NULL == cancel)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&cancel->lock);
+    if (0 == InterlockedExchange(&cancel->cancelled, 1))
+    {
+        SetEvent(cancel->hEvent);
+        // Calls unlink their handle under the lock before returning, so
+        // every entry here is still alive
+        for (WW_CANCELREG* reg = cancel->active; NULL != reg; reg = reg->next)
+        {
+            HINTERNET hReq = (HINTERNET)InterlockedExchangePointer(
+                (PVOID volatile*)reg->slot, NULL);
+            if (NULL != hReq)
+            {
+                InternetCloseHandle(hReq);
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&cancel->lock);
+}
+
+BOOL
+WWIsCancelled(
+    const WW_CANCEL* cancel
+)
+{
+    return NULL != cancel && 0 != cancel->cancelled;
+}
+
+VOID
+WWCancelClose(
+    WW_CANCEL* cancel
+)
+{
+    if (NULL != cancel)
+    {
+        CloseHandle(cancel->hEvent);
+        free(cancel);
+    }
+}
+
+INT
+WWSetTraceCallback(
+    WW_TRACE_CALLBACK callback,
+    LPVOID userData
+)
+{
+    AcquireSRWLockExclusive(&g_wwTraceLock);
+    g_wwTraceCallback = callback;
+    g_wwTraceUserData = userData;
+    ReleaseSRWLockExclusive(&g_wwTraceLock);
+    return WW_SUCCESS;
+}
+
+WW_TRACESINK*
+WWTraceSinkOpenW(
+    LPCWSTR path
+)
+{
+    if (NULL == path)
+    {
+        return NULL;
+    }
+
+    WW_TRACESINK* sink = (WW_TRACESINK*)calloc(1, sizeof(WW_TRACESINK));
+    if (NULL == sink)
+    {
+        return NULL;
+    }
+    sink->hFile = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == sink->hFile)
+    {
+        free(sink);
+        return NULL;
+    }
+    InitializeSRWLock(&sink->lock);
+    sink->processId = GetCurrentProcessId();
+    WWTraceSinkAppend(sink, "[\n", 2);
+    return sink;
+}
+
+VOID
+WWTraceSinkEvent(
+    const WW_TRACE_EVENT* event,
+    LPVOID userData
+)
+{
+    WW_TRACESINK* sink = (WW_TRACESINK*)userData;
+    if (NULL == sink || NULL == event || event->stage < 0 ||
+        event->stage >= (INT)WW_COUNTOF(g_wwTraceStageNames))
+    {
+        return;
+    }
+
+    CHAR text[256];
+    AcquireSRWLockExclusive(&sink->lock);
+    INT len = _snprintf_s(text, sizeof(text), _TRUNCATE,
+                          "%s{\"name\":\"%s\",\"cat\":\"winweb\",\"ph\":\"%c\","
+                          "\"ts\":%llu,\"pid\":%lu,\"tid\":%lu",
+                          (0 != sink->events) ? ",\n" : "",
+                          g_wwTraceStageNames[event->stage],
+                          event->end ? 'E' : 'B', event->timeUs,
+                          sink->processId, event->threadId);
+    WWTraceSinkAppend(sink, text, (len > 0) ? (SIZE_T)len : 0);
+    if (event->end)
+    {
+        len = _snprintf_s(text, sizeof(text), _TRUNCATE,
+                          ",\"args\":{\"bytes\":%llu,\"failed\":%s}}",
+                          event->bytes, event->failed ? "true" : "false");
+        WWTraceSinkAppend(sink, text, (len > 0) ? (SIZE_T)len : 0);
+    }
+    else if (NULL != event->url)
+    {
+        WWTraceSinkAppend(sink, ",\"args\":{\"url\":\"", 16);
+        WWTraceSinkAppendUrlW(sink, event->url);
+        WWTraceSinkAppend(sink, "\"}}", 3);
+    }
+    else
+    {
+        WWTraceSinkAppend(sink, "}", 1);
+    }
+    sink->events++;
+    ReleaseSRWLockExclusive(&sink->lock);
+}
+
+INT
+WWTraceSinkClose(
+    WW_TRACESINK* sink
+)
+{
+    if (NULL == sink)
+    {
+        return WW_FAILURE;
+    }
+    WWTraceSinkAppend(sink, "\n]\n", 3);
+    WWTraceSinkFlush(sink);
+    CloseHandle(sink->hFile);
+    INT result = sink->failed ? WW_FAILURE : WW_SUCCESS;
+    free(sink);
+    return result;
+}
+
+INT
+WWMetricsSnapshot(
+    WW_METRICS* metrics
+)
+{
+    if (NULL == metrics)
+    {
+        return WW_FAILURE;
+    }
+
+    LONGLONG volatile* src = (LONGLONG volatile*)&g_wwMetrics;
+    ULONGLONG* dst = (ULONGLONG*)metrics;
+    for (SIZE_T i = 0; i < sizeof(WW_METRICS) / sizeof(ULONGLONG); ++i)
+    {
+        dst[i] = (ULONGLONG)InterlockedCompareExchange64(&src[i], 0, 0);
+    }
+
+    // Counted from the buckets, so the +Inf bucket always equals the count
+    WW_HISTOGRAM* histograms[] = { &metrics->queryDuration, &metrics->headersTime,
+                                   &metrics->downloadDuration };
+    for (SIZE_T i = 0; i < WW_COUNTOF(histograms); ++i)
+    {
+        histograms[i]->count = 0;
+        for (UINT b = 0; b < WW_METRICS_BUCKETS; ++b)
+        {
+            histograms[i]->count += histograms[i]->buckets[b];
+        }
+    }
+    return WW_SUCCESS;
+}
+
+SIZE_T
+WWMetricsFormatPrometheus(
+    const WW_METRICS* metrics,
+    LPSTR buffer,
+    SIZE_T bufferSize
+)
+{
+    WW_METRICS snapshot;
+    if (NULL == metrics)
+    {
+        WWMetricsSnapshot(&snapshot);
+        metrics = &snapshot;
+    }
+
+    WW_METRICSTEXT text = { buffer, (NULL != buffer) ? bufferSize : 0, 0 };
+    CHAR line[256];
+    INT len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                          "# HELP winweb_requests_total Requests sent, by response status class.\n"
+                          "# TYPE winweb_requests_total counter\n");
+    WWMetricsAppend(&text, line, len);
+    for (INT i = 0; i < WW_STATUS_CLASS_COUNT; ++i)
+    {
+        len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                          "winweb_requests_total{class=\"%s\"} %llu\n",
+                          g_wwStatusClassNames[i], metrics->requests[i]);
+        WWMetricsAppend(&text, line, len);
+    }
+
+    WWMetricsAppendCounter(&text, "winweb_downloaded_bytes_total",
+                           "Response body bytes received, after content decoding.",
+                           metrics->bytesDownloaded);
+    WWMetricsAppendCounter(&text, "winweb_uploaded_bytes_total",
+                           "Request body bytes sent.", metrics->bytesUploaded);
+    WWMetricsAppendCounter(&text, "winweb_connections_opened_total",
+                           "Connections made to servers.", metrics->connectionsOpened);
+    WWMetricsAppendCounter(&text, "winweb_connections_reused_total",
+                           "Requests sent on a connection kept from an earlier request.",
+                           metrics->connectionsReused);
+    WWMetricsAppendCounter(&text, "winweb_redirects_total",
+                           "Redirects followed.", metrics->redirects);
+    WWMetricsAppendCounter(&text, "winweb_retries_total",
+                           "Attempts repeated after a failure.", metrics->retries);
+
+    len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                      "# HELP winweb_cache_hits_total Requests answered from a fresh cache entry.\n"
+                      "# TYPE winweb_cache_hits_total counter\n"
+                      "winweb_cache_hits_total{cache=\"memory\"} %llu\n"
+                      "winweb_cache_hits_total{cache=\"disk\"} %llu\n",
+                      metrics->memoryCacheHits, metrics->diskCacheHits);
+    WWMetricsAppend(&text, line, len);
+
+    WWMetricsAppendHistogram(&text, "winweb_query_duration_seconds",
+                             "WWQueryExW call duration.", &metrics->queryDuration);
+    WWMetricsAppendHistogram(&text, "winweb_headers_time_seconds",
+                             "Time from the start of a request to its response headers.",
+                             &metrics->headersTime);
+    WWMetricsAppendHistogram(&text, "winweb_download_duration_seconds",
+                             "WWDownloadExW call duration.", &metrics->downloadDuration);
+
+    if (text.size > 0)
+    {
+        text.buffer[(text.len < text.size) ? text.len : text.size - 1] = '\0';
+    }
+    return text.len;
+}
+
+INT
+WWQueryBatchW(
+    WW_REQUESTW* requests,
+    WW_RESPONSEW* responses,
+    SIZE_T count,
+    const WW_BATCH_OPTIONS* options
+)
+{
+    if ((NULL == requests || NULL == responses) && count > 0)
+    {
+        return WW_FAILURE;
+    }
+
+    WW_BATCHCTXW ctx = {
+        .requests = requests,
+        .responses = responses,
+        .count = count,
+        .results = (NULL != options) ? options->results : NULL,
+        .session = (NULL != options) ? options->session : NULL,
+        .cancel = (NULL != options) ? options->cancel : NULL,
+        .nextIndex = 0,
+        .failures = 0,
+        .startUs = WWGetTimeUs()
+    };
+
+    // Without a caller session, a private one still lets the workers share
+    // connections (and HTTP/2 streams) per origin for the whole batch.
+    WW_SESSION* ownSession = NULL;
+    if (NULL == ctx.session)
+    {
+        WW_SESSION_OPTIONSW sessionOptions = {
+            .userAgent = NULL,
+            .flags = WW_SESSION_HTTP2
+        };
+        ownSession = WWSessionOpenW(&sessionOptions);
+        ctx.session = ownSession;
+    }
+
+    UINT workers = WW_DEFAULT_BATCH_CONCURRENCY;
+    if (NULL != options && options->maxConcurrency > 0)
+    {
+        workers = options->maxConcurrency;
+    }
+    if ((SIZE_T)workers > count)
+    {
+        workers = (UINT)count;
+    }
+    // Over HTTP/1.1 each worker needs a connection of its own
+    WWRaiseConnectionLimit(workers);
+
+    // The calling thread is one of the workers
+    HANDLE* threads = NULL;
+    UINT threadCount = 0;
+    if (workers > 1)
+    {
+        threads = (HANDLE*)calloc(workers - 1, sizeof(HANDLE));
+        if (NULL != threads)
+        {
+            for (UINT i = 0; i < workers - 1; ++i)
+            {
+                threads[threadCount] = CreateThread(NULL, 0, WWBatchWorkerW,
+                                                    &ctx, 0, NULL);
+                if (NULL != threads[threadCount])
+                {
+                    ++threadCount;
+                }
+            }
+        }
+    }
+
+    WWBatchWorkerW(&ctx);
+
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+
+    WWSessionClose(ownSession);
+
+    return (0 == ctx.failures) ? WW_SUCCESS : WW_FAILURE;
+}
+
+INT
+WWDownloadManifestW(
+    WW_MANIFEST_OPTIONSW* options
+)
+{
+    if (NULL == options)
+    {
+        return WW_FAILURE;
+    }
+
+    options->errorcode = WW_ERR_NOERROR;
+    options->filesDownloaded = 0;
+    options->filesSkipped = 0;
+    options->filesFailed = 0;
+
+    if (NULL == options->dstPath || L'\0' == options->dstPath[0])
+    {
+        options->errorcode = WW_ERR_NO_DOWNLOAD_PATH;
+        return WW_FAILURE;
+    }
+    if (NULL == options->manifestPath)
+    {
+        options->errorcode = WW_ERR_MANIFEST;
+        return WW_FAILURE;
+    }
+
+    WW_MANIFESTCTXW ctx = {
+        .options = options
+    };
+    wcsncpy(ctx.dstPath, options->dstPath, WW_STR_SYMSW(ctx.dstPath));
+    SIZE_T dstLen = wcslen(ctx.dstPath);
+    if (L'\\' != ctx.dstPath[dstLen - 1] && L'/' != ctx.dstPath[dstLen - 1])
+    {
+        wcsncat(ctx.dstPath, L"\\", WW_STR_SYMSW(ctx.dstPath));
+    }
+    CreateDirectoryW(ctx.dstPath, NULL);
+
+    // The manifest is paged in as the parser reaches it; sequential scan
+    // lets the cache manager read ahead
+    HANDLE hFile = CreateFileW(options->manifestPath, GENERIC_READ,
+                               FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    HANDLE hMapping = NULL;
+    LARGE_INTEGER liSize = WW_STRUCT_NULL;
+    if (INVALID_HANDLE_VALUE != hFile && GetFileSizeEx(hFile, &liSize) &&
+        liSize.QuadPart > 0 && (ULONGLONG)liSize.QuadPart <= (SIZE_T)-1)
+    {
+        hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (NULL != hMapping)
+    {
+        ctx.reader.data = (const CHAR*)MapViewOfFile(hMapping, FILE_MAP_READ,
+                                                     0, 0, 0);
+        ctx.reader.size = (SIZE_T)liSize.QuadPart;
+    }
+    if (NULL == ctx.reader.data)
+    {
+        if (NULL != hMapping)
+        {
+            CloseHandle(hMapping);
+        }
+        if (INVALID_HANDLE_VALUE != hFile)
+        {
+            CloseHandle(hFile);
+        }
+        options->errorcode = WW_ERR_MANIFEST;
+        return WW_FAILURE;
+    }
+
+    // The format follows from the first character after a UTF-8 BOM
+    if (ctx.reader.size >= 3 && 0 == memcmp(ctx.reader.data, "\xEF\xBB\xBF", 3))
+    {
+        ctx.reader.pos = 3;
+    }
+    SIZE_T first = ctx.reader.pos;
+    while (first < ctx.reader.size && ' ' >= (BYTE)ctx.reader.data[first])
+    {
+        ++first;
+    }
+    CHAR lead = (first < ctx.reader.size) ? ctx.reader.data[first] : '\0';
+    ctx.reader.format = ('<' == lead) ? WW_MANIFEST_METALINK :
+                        ('{' == lead || '[' == lead) ? WW_MANIFEST_JSON :
+                        WW_MANIFEST_TSV;
+
+    UINT workers = WW_DEFAULT_BATCH_CONCURRENCY;
+    if (options->maxConcurrency > 0)
+    {
+        workers = options->maxConcurrency;
+    }
+    WWRaiseConnectionLimit(workers);
+
+    InitializeCriticalSection(&ctx.lock);
+
+    // The calling thread is one of the workers
+    HANDLE* threads = NULL;
+    UINT threadCount = 0;
+    if (workers > 1)
+    {
+        threads = (HANDLE*)calloc(workers - 1, sizeof(HANDLE));
+        if (NULL != threads)
+        {
+            for (UINT i = 0; i < workers - 1; ++i)
+            {
+                threads[threadCount] = CreateThread(NULL, 0, WWManifestWorkerW,
+                                                    &ctx, 0, NULL);
+                if (NULL != threads[threadCount])
+                {
+                    ++threadCount;
+                }
+            }
+        }
+    }
+
+    WWManifestWorkerW(&ctx);
+
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+    DeleteCriticalSection(&ctx.lock);
+
+    UnmapViewOfFile(ctx.reader.data);
+    CloseHandle(hMapping);
+    CloseHandle(hFile);
+
+    if (ctx.reader.failed && WW_ERR_NOERROR == options->errorcode)
+    {
+        options->errorcode = WW_ERR_MANIFEST;
+    }
+
+    // A cancelled run leaves the rest of the manifest unread
+    return (ctx.reader.finished && WW_ERR_NOERROR == options->errorcode &&
+            0 == options->filesFailed) ? WW_SUCCESS : WW_FAILURE;
+}
+
+INT
+WWMultipartUploadW(
+    WW_MULTIPART_OPTIONSW* options
+)
+{
+    if (NULL == options)
+    {
+        return WW_FAILURE;
+    }
+
+    options->errorcode = WW_ERR_NOERROR;
+    options->statusCode = 0;
+    options->retries = 0;
+
+    if (NULL == options->filePath || NULL == options->adapter.prepare)
+    {
+        options->errorcode = WW_ERR_ADAPTER;
+        return WW_FAILURE;
+    }
+
+    HANDLE hFile = CreateFileW(options->filePath, GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        options->errorcode = WW_ERR_CREATE_FILE;
+        return WW_FAILURE;
+    }
+
+    LARGE_INTEGER fileSize = WW_STRUCT_NULL;
+    if (FALSE == GetFileSizeEx(hFile, &fileSize))
+    {
+        CloseHandle(hFile);
+        options->errorcode = WW_ERR_CREATE_FILE;
+        return WW_FAILURE;
+    }
+
+    ULONGLONG partSize = (options->partSize > 0) ? options->partSize : WW_DEFAULT_PART_SIZE;
+    ULONGLONG partCount = ((ULONGLONG)fileSize.QuadPart + partSize - 1) / partSize;
+    if (0 == partCount)
+    {
+        partCount = 1; // An empty file is still uploaded as one empty part
+    }
+
+    WW_MULTIPARTCTXW ctx = {
+        .options = options,
+        .session = options->session,
+        .hFile = hFile,
+        .fileSize = (ULONGLONG)fileSize.QuadPart,
+        .parts = NULL,
+        .partCount = (UINT)partCount,
+        .maxRetries = (options->maxRetries > 0) ? options->maxRetries : WW_DEFAULT_PART_RETRIES,
+        .nextIndex = 0,
+        .failed = 0,
+        .retries = 0,
+        .bytesDone = 0,
+        .errorcode = WW_ERR_NOERROR,
+        .statusCode = 0
+    };
+
+    if (partCount > (UINT)-1 ||
+        NULL == (ctx.parts = (WW_MULTIPART_PART*)calloc((SIZE_T)partCount,
+                                                         sizeof(WW_MULTIPART_PART))))
+    {
+        CloseHandle(hFile);
+        options->errorcode = WW_ERR_MALLOC;
+        return WW_FAILURE;
+    }
+
+    for (UINT i = 0; i < ctx.partCount; ++i)
+    {
+        ULONGLONG offset = (ULONGLONG)i * partSize;
+        ctx.parts[i].partNumber = i + 1;
+        ctx.parts[i].offset = offset;
+        ctx.parts[i].size = (ctx.fileSize - offset < partSize) ? ctx.fileSize - offset : partSize;
+    }
+
+    UINT workers = (options->maxConcurrency > 0) ? options->maxConcurrency
+                                                 : WW_DEFAULT_MULTIPART_CONCURRENCY;
+    if (workers > ctx.partCount)
+    {
+        workers = ctx.partCount;
+    }
+
+    // Parts are large, so each worker gets its own keep-alive connection
+    // instead of sharing one HTTP/2 connection
+    WW_SESSION* ownSession = NULL;
+    if (NULL == ctx.session)
+    {
+        WW_SESSION_OPTIONSW sessionOptions = {
+            .userAgent = NULL,
+            .flags = 0
+        };
+        ownSession = WWSessionOpenW(&sessionOptions);
+        ctx.session = ownSession;
+    }
+
+    WWRaiseConnectionLimit(workers);
+
+    InitializeCriticalSection(&ctx.lock);
+
+    DWORD statusCode = 0;
+    INT errorcode = WWMultipartCallW(&ctx, WW_MULTIPART_INITIATE, NULL, &statusCode);
+    if (WW_ERR_NOERROR != errorcode)
+    {
+        WWMultipartFailW(&ctx, errorcode, statusCode);
+    }
+    else
+    {
+        // The calling thread is one of the workers
+        HANDLE* threads = NULL;
+        UINT threadCount = 0;
+        if (workers > 1)
+        {
+            threads = (HANDLE*)calloc(workers - 1, sizeof(HANDLE));
+            if (NULL != threads)
+            {
+                for (UINT i = 0; i < workers - 1; ++i)
+                {
+                    threads[threadCount] = CreateThread(NULL, 0, WWMultipartWorkerW,
+                                                        &ctx, 0, NULL);
+                    if (NULL != threads[threadCount])
+                    {
+                        ++threadCount;
+                    }
+                }
+            }
+        }
+
+        WWMultipartWorkerW(&ctx);
+
+        for (UINT i = 0; i < threadCount; ++i)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        free(threads);
+
+        if (0 == ctx.failed)
+        {
+            errorcode = WWMultipartCallW(&ctx, WW_MULTIPART_COMPLETE, NULL, &statusCode);
+            if (WW_ERR_NOERROR != errorcode)
+            {
+                WWMultipartFailW(&ctx, errorcode, statusCode);
+            }
+        }
+
+        if (ctx.failed)
+        {
+            WWMultipartCallW(&ctx, WW_MULTIPART_ABORT, NULL, &statusCode);
+        }
+    }
+
+    DeleteCriticalSection(&ctx.lock);
+    WWSessionClose(ownSession);
+    CloseHandle(hFile);
+    free(ctx.parts);
+
+    if (ctx.failed && WWIsCancelled(options->cancel))
+    {
+        ctx.errorcode = WW_ERR_CANCELLED;
+    }
+    options->errorcode = ctx.errorcode;
+    options->statusCode = ctx.statusCode;
+    options->retries = (UINT)ctx.retries;
+    return ctx.failed ? WW_FAILURE : WW_SUCCESS;
+}
+
+INT
+WWGetRemoteFileSizeW(
+    LPCWSTR url,
+    ULONGLONG* outSize,
+    DWORD timeoutMs
+)
+{
+    if (NULL == url || NULL == outSize)
+    {
+        return WW_FAILURE;
+    }
+
+    *outSize = 0;
+
+    // timeoutMs is the budget of the whole call, not of each hop
+    ULONGLONG deadlineMs = (timeoutMs > 0) ? GetTickCount64() + timeoutMs : 0;
+
+    WCHAR currentUrl[INTERNET_MAX_URL_LENGTH] = L"";
+    if (wcslen(url) + 1 > WW_COUNTOF(currentUrl))
+    {
+        return WW_FAILURE;
+    }
+    wcsncpy(currentUrl, url, WW_COUNTOF(currentUrl));
+    currentUrl[WW_COUNTOF(currentUrl) - 1] = L'\0';
+
+    for (UINT redirects = 0; redirects <= WW_DEFAULT_REDIRECT_LIMIT; ++redirects)
+    {
+        WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
+        WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+        WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
+        WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
+        WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
+        WCHAR extraInfo[INTERNET_MAX_PATH_LENGTH] = L"";
+
+        URL_COMPONENTSW urlc = {
+            sizeof(urlc),
+            scheme, WW_COUNTOF(scheme),
+            INTERNET_SCHEME_DEFAULT,
+            hostname, WW_COUNTOF(hostname),
+            0,
+            username, WW_COUNTOF(username),
+            password, WW_COUNTOF(password),
+            urlpath, WW_COUNTOF(urlpath),
+            extraInfo, WW_COUNTOF(extraInfo)
+        };
+
+        if (FALSE == InternetCrackUrlW(currentUrl, 0, 0, &urlc))
+        {
+            return WW_FAILURE;
+        }
+
+        if (urlc.nScheme != INTERNET_SCHEME_HTTP &&
+            urlc.nScheme != INTERNET_SCHEME_HTTPS)
+        {
+            return WW_FAILURE;
+        }
+
+        HINTERNET hInet = InternetOpenW(WW_DEFAULT_USER_AGENTW,
+                                        INTERNET_OPEN_TYPE_PRECONFIG,
+                                        NULL, NULL, 0);
+        if (NULL == hInet)
+        {
+            return WW_FAILURE;
+        }
+
+        HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
+                                           urlc.lpszUserName, urlc.lpszPassword,
+                                           INTERNET_SERVICE_HTTP, 0, 0);
+        if (NULL == hConn)
+        {
+            InternetCloseHandle(hInet);
+            return WW_FAILURE;
+        }
+
+        DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
+                      INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI |
+                      INTERNET_FLAG_NO_AUTO_REDIRECT;
+        if (INTERNET_SCHEME_HTTPS == urlc.nScheme)
+        {
+            flags |= INTERNET_FLAG_SECURE;
+        }
+
+        WCHAR requestPath[INTERNET_MAX_URL_LENGTH] = L"";
+        if (FALSE == WWBuildRequestPathW(&urlc, requestPath, WW_COUNTOF(requestPath)))
+        {
+            InternetCloseHandle(hConn);
+            InternetCloseHandle(hInet);
+            return WW_FAILURE;
+        }
+
+        LPCWSTR acceptTypes[] = { L"*/*", NULL };
+        HINTERNET hReq = HttpOpenRequestW(hConn, L"HEAD", requestPath,
+                                          NULL, NULL, acceptTypes, flags, 0);
+        if (NULL == hReq)
+        {
+            InternetCloseHandle(hConn);
+            InternetCloseHandle(hInet);
+            return WW_FAILURE;
+        }
+
+        if (timeoutMs > 0)
+        {
+            DWORD leftMs = WWDeadlineClampW(deadlineMs, 0);
+            InternetSetOptionW(hReq, INTERNET_OPTION_CONNECT_TIMEOUT,
+                               &leftMs, sizeof(leftMs));
+            InternetSetOptionW(hReq, INTERNET_OPTION_SEND_TIMEOUT,
+                               &leftMs, sizeof(leftMs));
+            InternetSetOptionW(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT,
+                               &leftMs, sizeof(leftMs));
+        }
+
+        // The deadline timer closes hReq, also while the host name resolves
+        WW_CANCELREG deadlineReg;
+        BOOL sendOk = WWCancelAttach(NULL, deadlineMs, &deadlineReg, hReq, NULL) &&
+                      HttpSendRequestW(hReq, NULL, 0, NULL, 0);
+        DWORD statusCode = 0;
+        DWORD statusLen = sizeof(statusCode);
+        BOOL statusOk = sendOk && HttpQueryInfoW(
+            hReq,
+            HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+            &statusCode,
+            &statusLen,
+            NULL
+        );
+
+        if (statusOk && statusCode >= 200 && statusCode < 300)
+        {
+            WCHAR lengthBuf[64] = L"";
+            DWORD lengthLen = sizeof(lengthBuf);
+            BOOL ok = FALSE;
+
+            if (HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_LENGTH,
+                               lengthBuf, &lengthLen, NULL))
+            {
+                ULONGLONG parsed = _wcstoui64(lengthBuf, NULL, 10);
+                if (parsed > 0)
+                {
+                    *outSize = parsed;
+                    ok = TRUE;
+                }
+            }
+
+            WWCancelRelease(NULL, &deadlineReg);
+            InternetCloseHandle(hConn);
+            InternetCloseHandle(hInet);
+            return ok ? WW_SUCCESS : WW_FAILURE;
+        }
+
+        if (statusOk && WWIsRedirectStatus(statusCode))
+        {
+            WCHAR location[INTERNET_MAX_URL_LENGTH] = L"";
+            DWORD locationLen = sizeof(location);
+            BOOL haveLocation = HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION,
+                                               location, &locationLen, NULL);
+
+            WWCancelRelease(NULL, &deadlineReg);
+            InternetCloseHandle(hConn);
+            InternetCloseHandle(hInet);
+
+            if (FALSE == haveLocation)
+            {
+                return WW_FAILURE;
+            }
+
+            if (FALSE == WWResolveRedirectW(currentUrl, location,
+                                            currentUrl, WW_COUNTOF(currentUrl)))
+            {
+                return WW_FAILURE;
+            }
+            continue;
+        }
+
+        WWCancelRelease(NULL, &deadlineReg);
+        InternetCloseHandle(hConn);
+        InternetCloseHandle(hInet);
+        return WW_FAILURE;
+    }
+
+    return WW_FAILURE;
+}
+
+VOID
+WWFreeResponseW(
+    WW_RESPONSEW* response
+)
+{
+    if (NULL != response)
+    {
+        if (NULL != response->shared)
+        {
+            WWSharedBodyRelease((WW_SHAREDBODY*)response->shared);
+        }
+        else
+        {
+            free(response->data);
+        }
+        free(response->headers);
+        response->data = NULL;
+        response->dataSize = 0;
+        response->shared = NULL;
+        response->headers = NULL;
+    }
+}
+
+BOOL
+WWGetResponseHeaderW(
+    const WW_RESPONSEW* response,
+    LPCWSTR name,
+    LPWSTR value,
+    DWORD valueCch
+)
+{
+    if (NULL == response || NULL == name || NULL == value || 0 == valueCch)
+    {
+        return FALSE;
+    }
+    value[0] = L'\0';
+    if (NULL == response->headers)
+    {
+        return FALSE;
+    }
+    return WWFindHeaderLineW(response->headers, name, wcslen(name),
+                             value, valueCch);
+}
+
+INT
+WWDownloadExW(
+                WW_PARAMSW* userParams
+             )
+{
+    // Nothing would be computed to compare the digest with
+    if (NULL != userParams->expectedDigest &&
+        0 == WWHashDigestSize(userParams->hashAlgorithm))
+    {
+        userParams->status = WW_STATUS_ERROR;
+        userParams->errorcode = WW_ERR_INVALID_PARAMS;
+        return WW_FAILURE;
+    }
+
+    SIZE_T headerSizeTemp = userParams->headerLength * sizeof(LPWSTR);
+    WW_PRIVATEPARAMSW privateParams = {
+        .headerSize = headerSizeTemp,
+        .szHeader = (LPWSTR)malloc(headerSizeTemp),
+        .redirectCount = 0
+    };
+
+    // Check if memory allocation failed
+    if (NULL == privateParams.szHeader) 
+    {
+        userParams->errorcode = WW_ERR_MALLOC;
+        return WW_FAILURE;
+    }
+
+    ZeroMemory(privateParams.szHeader, userParams->headerLength);
+
+
+    if (NULL == userParams->url)
+    {
+        userParams->status = WW_STATUS_ERROR;
+        return WW_FAILURE;
+    }
+
+    if (NULL == userParams->userAgent)
+    {
+        userParams->userAgent = WW_DEFAULT_USER_AGENTW;
+    }
+
+    if (0 > userParams->maxRedirectLimit)
+    {
+        userParams->maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT;
+    }
+
+    if (0 >= userParams->headerLength)
+    {
+        userParams->headerLength = WW_DEFAULT_HEADER_LENGTH;
+    }
+
+    userParams->digestSize = 0;
+    userParams->stallRestarts = 0;
+    UINT maxStallRestarts = (0 != userParams->maxStallRestarts) ?
+        userParams->maxStallRestarts : WW_DEFAULT_STALL_RESTARTS;
+
+    if (WWIsCancelled(userParams->cancel) ||
+        WWDeadlinePassed(userParams->deadlineMs))
+    {
+        free(privateParams.szHeader);
+        userParams->status = WW_STATUS_ERROR;
+        userParams->errorcode = WWIsCancelled(userParams->cancel) ?
+                                WW_ERR_CANCELLED : WW_ERR_TIMEOUT;
+        return WW_FAILURE;
+    }
+
+    ULONGLONG startUs = WWGetTimeUs();
+    WWTraceBeginW(WW_TRACE_DOWNLOAD, userParams->url);
+
+    // A fresh disk cache entry is placed without any network I/O
+    privateParams.cacheUrl = userParams->url;
+    if (NULL != userParams->diskCache && 0 == userParams->resumeOffset &&
+        WW_SUCCESS == WWDiskCacheDownloadW(userParams, &privateParams))
+    {
+        free(privateParams.szHeader);
+        WWTraceEndW(WW_TRACE_DOWNLOAD, userParams->progressBarData.szDownloadedInBytes,
+                    FALSE);
+        WWMetricsObserve(&g_wwMetrics.downloadDuration, WWGetTimeUs() - startUs);
+        return WW_SUCCESS;
+    }
+
+    // Redirects point url into szHeader and retries move resumeOffset; every
+    // attempt starts from the original url and the caller gets both back
+    LPCWSTR url = userParams->url;
+    ULONGLONG resumeOffset = userParams->resumeOffset;
+    INT iStatus = WW_FAILURE;
+    for (userParams->attempts = 1; ; ++userParams->attempts)
+    {
+        // The timings describe the attempt that ends the download
+        ZeroMemory(&userParams->progressBarData.timings,
+                   sizeof(userParams->progressBarData.timings));
+        iStatus = WWDownloadProcessW(userParams, &privateParams);
+
+        // A stalled connection is reopened at once and uses up no attempt
+        if (WW_FAILURE == iStatus && privateParams.stalled &&
+            userParams->stallRestarts < maxStallRestarts &&
+            FALSE == WWIsDownloadStoppedW(userParams))
+        {
+            userParams->stallRestarts++;
+            userParams->attempts--;
+        }
+        else
+        {
+            if (WW_SUCCESS == iStatus ||
+                userParams->attempts >= userParams->retry.maxAttempts ||
+                FALSE == WWIsRetryableDownloadW(userParams, &privateParams))
+            {
+                break;
+            }
+
+            // A retry that could not start before the deadline is not made
+            DWORD delayMs = WWRetryDelayW(&userParams->retry, userParams->attempts,
+                                          privateParams.retryAfterMs);
+            if ((0 != userParams->deadlineMs &&
+                 GetTickCount64() + delayMs >= userParams->deadlineMs) ||
+                FALSE == WWRetryWaitW(delayMs, userParams->pCancelFlag,
+                                      userParams->cancel))
+            {
+                break;
+            }
+            WWMetricsAdd(&g_wwMetrics.retries, 1);
+        }
+
+        // Continue from the last byte written to the temporary file
+        userParams->url = url;
+        userParams->errorcode = WW_ERR_NOERROR;
+        userParams->resumeOffset = WWResumeOffsetW(&privateParams);
+        privateParams.redirectCount = 0;
+        privateParams.statusCode = 0;
+        privateParams.retryAfterMs = 0;
+        privateParams.stalled = FALSE;
+    }
+    userParams->url = url;
+    userParams->resumeOffset = resumeOffset;
+
+    // Whatever error a closed handle caused, the caller asked for it
+    if (WW_SUCCESS != iStatus && WWIsDownloadStoppedW(userParams))
+    {
+        userParams->errorcode =
+            ((userParams->pCancelFlag && *userParams->pCancelFlag) ||
+             WWIsCancelled(userParams->cancel)) ? WW_ERR_CANCELLED : WW_ERR_TIMEOUT;
+    }
+
+    free(privateParams.szHeader);
+    WWTraceEndW(WW_TRACE_DOWNLOAD, userParams->progressBarData.szDownloadedInBytes,
+                WW_SUCCESS != iStatus);
+    WWMetricsObserve(&g_wwMetrics.downloadDuration, WWGetTimeUs() - startUs);
+    return iStatus;
+}
+/******************************** PRIVATE API *********************************/
+/**
+ * @brief Unicode API implementation.
+ */
+
+WW_PRIVATE
+WW_SHAREDBODY*
+WWSharedBodyCreate(
+    LPCVOID data,
+    SIZE_T size
+)
+{
+    WW_SHAREDBODY* body =
+        (WW_SHAREDBODY*)malloc(offsetof(WW_SHAREDBODY, data) + size + 1);
+    if (NULL == body)
+    {
+        return NULL;
+    }
+    body->refCount = 1;
+    body->size = size;
+    if (size > 0)
+    {
+        CopyMemory(body->data, data, size);
+    }
+    return body;
+}
+
+WW_PRIVATE
+VOID
+WWSharedBodyRelease(
+    WW_SHAREDBODY* body
+)
+{
+    if (NULL != body && 0 == InterlockedDecrement(&body->refCount))
+    {
+        free(body);
+    }
+}
+
+/**
+ * @brief Point a response at a shared body, taking a new reference.
+ */
+WW_PRIVATE
+VOID
+WWSharedBodyAttachW(
+    WW_SHAREDBODY* body,
+    WW_RESPONSEW* response
+)
+{
+    if (NULL == body)
+    {
+        return;
+    }
+    InterlockedIncrement(&body->refCount);
+    response->shared = body;
+    response->data = body->data;
+    response->dataSize = body->size;
+}
+
+/**
+ * @brief Move a response body into a shared buffer (if it is not one yet).
+ *
+ * @return The response's shared body with one extra reference for the
+ *         caller, or NULL if the copy could not be allocated.
+ */
+WW_PRIVATE
+WW_SHAREDBODY*
+WWResponseShareW(
+    WW_RESPONSEW* response
+)
+{
+    WW_SHAREDBODY* body = (WW_SHAREDBODY*)response->shared;
+    if (NULL == body)
+    {
+        body = WWSharedBodyCreate(response->data, response->dataSize);
+        if (NULL == body)
+        {
+            return NULL;
+        }
+        free(response->data);
+        response->shared = body;
+        response->data = body->data;
+        response->dataSize = body->size;
+    }
+    InterlockedIncrement(&body->refCount);
+    return body;
+}
+
+WW_PRIVATE
+BOOL
+WWIsCoalescableW(
+    const WW_REQUESTW* request
+)
+{
+    // Followers must not fail with the token or deadline of the leader
+    if (request->bodySize > 0 || NULL != request->upload ||
+        request->captureHeaders || NULL != request->cancel ||
+        0 != request->deadlineMs)
+    {
+        return FALSE;
+    }
+    return NULL == request->verb ||
+           0 == _wcsicmp(request->verb, L"GET") ||
+           0 == _wcsicmp(request->verb, L"HEAD");
+}
+
+/**
+ * @brief Build the single-flight key: everything that can change the response.
+ */
+WW_PRIVATE
+LPWSTR
+WWMakeFlightKeyW(
+    const WW_REQUESTW* request,
+    LPCWSTR extraHeaders
+)
+{
+    LPCWSTR parts[] = {
+        (NULL != request->verb) ? request->verb : L"GET",
+        request->url,
+        (NULL != request->userAgent) ? request->userAgent : L"",
+        (NULL != request->headers) ? request->headers : L"",
+        (NULL != extraHeaders) ? extraHeaders : L""
+    };
+
+    SIZE_T length = 1;
+    for (SIZE_T i = 0; i < WW_COUNTOF(parts); ++i)
+    {
+        length += wcslen(parts[i]) + 1;
+    }
+
+    LPWSTR key = (LPWSTR)malloc(length * sizeof(WCHAR));
+    if (NULL == key)
+    {
+        return NULL;
+    }
+
+    key[0] = L'\0';
+    for (SIZE_T i = 0; i < WW_COUNTOF(parts); ++i)
+    {
+        wcsncat(key, parts[i], length - wcslen(key) - 1);
+        wcsncat(key, L"\n", length - wcslen(key) - 1);
+    }
+    return key;
+}
+
+WW_PRIVATE
+VOID
+WWFlightReleaseW(
+    WW_FLIGHTW* flight
+)
+{
+    if (0 == InterlockedDecrement(&flight->refCount))
+    {
+        WWSharedBodyRelease(flight->body);
+        CloseHandle(flight->hDone);
+        free(flight->key);
+        free(flight);
+    }
+}
+
+/**
+ * @brief Run a request through the session's single-flight table.
+ *
+ * The first caller for a key performs the request; callers arriving while
+ * it is in flight wait for it and receive a reference to the same body.
+ */
+WW_PRIVATE
+INT
+WWQueryCoalescedW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    WW_SESSION* session = request->session;
+    LPWSTR key = WWMakeFlightKeyW(request, (NULL != privateQuery) ?
+                                           privateQuery->extraHeaders : NULL);
+    if (NULL == key)
+    {
+        return WWQuerySendW(session->hInet, request, response,
+                            redirectsLeft, privateQuery);
+    }
+
+    EnterCriticalSection(&session->lock);
+
+    WW_FLIGHTW* flight = session->flights;
+    while (NULL != flight && 0 != wcscmp(flight->key, key))
+    {
+        flight = flight->next;
+    }
+
+    if (NULL != flight)
+    {
+        InterlockedIncrement(&flight->refCount);
+        LeaveCriticalSection(&session->lock);
+        free(key);
+
+        WaitForSingleObject(flight->hDone, INFINITE);
+
+        response->statusCode = flight->statusCode;
+        response->errorcode = flight->errorcode;
+        response->http2 = flight->http2;
+        WWSharedBodyAttachW(flight->body, response);
+        INT result = flight->result;
+
+        WWFlightReleaseW(flight);
+        return result;
+    }
+
+    flight = (WW_FLIGHTW*)calloc(1, sizeof(*flight));
+    HANDLE hDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (NULL == flight || NULL == hDone)
+    {
+        LeaveCriticalSection(&session->lock);
+        free(flight);
+        if (NULL != hDone)
+        {
+            CloseHandle(hDone);
+        }
+        free(key);
+        return WWQuerySendW(session->hInet, request, response,
+                            redirectsLeft, privateQuery);
+    }
+
+    flight->key = key;
+    flight->hDone = hDone;
+    flight->refCount = 1;
+    flight->next = session->flights;
+    session->flights = flight;
+
+    LeaveCriticalSection(&session->lock);
+
+    INT result = WWQuerySendW(session->hInet, request, response,
+                              redirectsLeft, privateQuery);
+
+    // Unlink first: from here on nobody can join, so the waiter count is final
+    EnterCriticalSection(&session->lock);
+    WW_FLIGHTW** link = &session->flights;
+    while (*link != flight)
+    {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    BOOL hasWaiters = (flight->refCount > 1);
+    LeaveCriticalSection(&session->lock);
+
+    INT waiterResult = result;
+    INT waiterError = response->errorcode;
+    if (hasWaiters && NULL != response->data)
+    {
+        // One reference for this response, one held by the flight
+        flight->body = WWResponseShareW(response);
+        if (NULL == flight->body)
+        {
+            waiterResult = WW_FAILURE;
+            waiterError = WW_ERR_MALLOC;
+        }
+    }
+
+    flight->result = waiterResult;
+    flight->errorcode = waiterError;
+    flight->statusCode = response->statusCode;
+    flight->http2 = response->http2;
+    SetEvent(flight->hDone);
+    WWFlightReleaseW(flight);
+
+    return result;
+}
+
+/**
+ * @brief Send a request through its session (and the session's memory cache)
+ *        or over a private WinInet handle.
+ */
+WW_PRIVATE
+INT
+WWQueryRouteW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    // A session already owns a WinInet handle with a warm connection pool
+    if (NULL != request->session)
+    {
+        if (NULL == privateQuery && NULL != request->session->cache &&
+            WWIsCacheableRequestW(request))
+        {
+            return WWQueryCachedW(request, response, redirectsLeft);
+        }
+        return WWQueryDispatchW(request, response, redirectsLeft, privateQuery);
+    }
+
+    LPCWSTR userAgent = request->userAgent;
+    if (NULL == userAgent)
+    {
+        userAgent = WW_DEFAULT_USER_AGENTW;
+    }
+
+    HINTERNET hInet = InternetOpenW(userAgent, INTERNET_OPEN_TYPE_PRECONFIG,
+                                     NULL, NULL, 0);
+    if (NULL == hInet)
+    {
+        response->errorcode = WW_ERR_WININET_INIT;
+        return WW_FAILURE;
+    }
+
+    INT iStatus = WWQuerySendW(hInet, request, response, redirectsLeft,
+                               privateQuery);
+
+    InternetCloseHandle(hInet);
+    return iStatus;
+}
+
+WW_PRIVATE
+INT
+WWQueryDispatchW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    WW_SESSION* session = request->session;
+    if ((session->flags & WW_SESSION_COALESCE) && WWIsCoalescableW(request))
+    {
+        return WWQueryCoalescedW(request, response, redirectsLeft,
+                                 privateQuery);
+    }
+    return WWQuerySendW(session->hInet, request, response, redirectsLeft,
+                        privateQuery);
+}
+
+/**
+ * @brief Keep a concurrency limit between the limiter's minimum and maximum.
+ */
+WW_PRIVATE
+UINT
+WWLimiterClampW(
+    const WW_LIMITER_OPTIONS* limiter,
+    UINT limit
+)
+{
+    UINT minLimit = (0 != limiter->minLimit) ? limiter->minLimit : 1;
+    UINT maxLimit = (0 != limiter->maxLimit) ? limiter->maxLimit :
+                                               WW_DEFAULT_LIMITER_MAX;
+    if (limit > maxLimit)
+    {
+        limit = maxLimit;
+    }
+    return (limit < minLimit) ? minLimit : limit;
+}
+
+/**
+ * @brief Look up the breaker and limiter state of the origin of url, adding
+ *        it when create is set. The session lock must be held.
+ */
+WW_PRIVATE
+WW_ORIGINW*
+WWOriginFindW(
+    WW_SESSION* session,
+    LPCWSTR url,
+    BOOL create
+)
+{
+    WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
+    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+
+    URL_COMPONENTSW urlc = WW_STRUCT_NULL;
+    urlc.dwStructSize = sizeof(urlc);
+    urlc.lpszScheme = scheme;
+    urlc.dwSchemeLength = WW_COUNTOF(scheme);
+    urlc.lpszHostName = hostname;
+    urlc.dwHostNameLength = WW_COUNTOF(hostname);
+
+    if (NULL == url || FALSE == InternetCrackUrlW(url, 0, 0, &urlc))
+    {
+        return NULL;
+    }
+
+    WW_ORIGINW* origin = session->origins;
+    while (NULL != origin &&
+           (origin->scheme != urlc.nScheme || origin->port != urlc.nPort ||
+            0 != _wcsicmp(origin->host, hostname)))
+    {
+        origin = origin->next;
+    }
+    if (NULL != origin || !create)
+    {
+        return origin;
+    }
+
+    origin = (WW_ORIGINW*)calloc(1, sizeof(*origin));
+    if (NULL == origin)
+    {
+        return NULL;
+    }
+
+    origin->scheme = urlc.nScheme;
+    origin->port = urlc.nPort;
+    wcsncpy(origin->host, hostname, WW_COUNTOF(origin->host) - 1);
+    origin->limit = WWLimiterClampW(&session->limiter,
+                                    session->limiter.initialLimit);
+    origin->next = session->origins;
+    session->origins = origin;
+    return origin;
+}
+
+/**
+ * @brief Open the breaker of an origin. The session lock must be held.
+ */
+WW_PRIVATE
+VOID
+WWBreakerTripW(
+    WW_ORIGINW* origin,
+    ULONGLONG nowMs
+)
+{
+    origin->state = WW_BREAKER_OPEN;
+    origin->openedMs = nowMs;
+    origin->stats.breakerOpens++;
+}
+
+/**
+ * @brief Let a request through to its origin, or fail it at once when the
+ *        origin's breaker is open or no concurrency slot frees up in time.
+ *
+ * @return FALSE with response->errorcode set if the request must not be sent.
+ */
+WW_PRIVATE
+BOOL
+WWOriginAdmitW(
+    WW_SESSION* session,
+    const WW_REQUESTW* request,
+    WW_ADMISSIONW* admission,
+    WW_RESPONSEW* response
+)
+{
+    ZeroMemory(admission, sizeof(*admission));
+
+    const WW_BREAKER_OPTIONS* breaker = &session->breaker;
+    const WW_LIMITER_OPTIONS* limiter = &session->limiter;
+    if (0 == breaker->minRequests && 0 == limiter->initialLimit)
+    {
+        return TRUE;
+    }
+
+    DWORD openMs = (0 != breaker->openMs) ? breaker->openMs :
+                                            WW_DEFAULT_BREAKER_OPEN;
+    UINT probes = (0 != breaker->halfOpenProbes) ? breaker->halfOpenProbes : 1;
+
+    EnterCriticalSection(&session->lock);
+
+    // A URL that does not parse fails later, in WWQueryPerformW
+    WW_ORIGINW* origin = WWOriginFindW(session, request->url, TRUE);
+    if (NULL == origin)
+    {
+        LeaveCriticalSection(&session->lock);
+        return TRUE;
+    }
+
+    DWORD queueTimeoutMs = (0 != limiter->queueTimeoutMs) ?
+        WWDeadlineClampW(request->deadlineMs, limiter->queueTimeoutMs) : 0;
+    ULONGLONG deadline = GetTickCount64() + queueTimeoutMs;
+    while (TRUE)
+    {
+        ULONGLONG now = GetTickCount64();
+        if (breaker->minRequests > 0)
+        {
+            if (WW_BREAKER_OPEN == origin->state && now - origin->openedMs >= openMs)
+            {
+                origin->state = WW_BREAKER_HALF_OPEN;
+                origin->probeSuccesses = 0;
+            }
+            if (WW_BREAKER_OPEN == origin->state ||
+                (WW_BREAKER_HALF_OPEN == origin->state &&
+                 origin->probesInFlight + origin->probeSuccesses >= probes))
+            {
+                origin->stats.breakerRejections++;
+                session->stats.breakerRejections++;
+                LeaveCriticalSection(&session->lock);
+                response->errorcode = WW_ERR_CIRCUIT_OPEN;
+                return FALSE;
+            }
+        }
+
+        if (0 == limiter->initialLimit || origin->inFlight < origin->limit)
+        {
+            break;
+        }
+
+        // Woken whenever a request to any limited origin completes
+        if (now >= deadline ||
+            FALSE == SleepConditionVariableCS(&session->slotFreed, &session->lock,
+                                              (DWORD)(deadline - now)))
+        {
+            origin->stats.limiterRejections++;
+            session->stats.limiterRejections++;
+            LeaveCriticalSection(&session->lock);
+            response->errorcode = WW_ERR_CONCURRENCY_LIMIT;
+            return FALSE;
+        }
+    }
+
+    admission->probe = (WW_BREAKER_HALF_OPEN == origin->state);
+    if (admission->probe)
+    {
+        origin->probesInFlight++;
+    }
+    origin->inFlight++;
+    origin->admitted++;
+    origin->stats.requests++;
+
+    admission->origin = origin;
+    admission->sequence = origin->admitted;
+    admission->startMs = GetTickCount64();
+
+    LeaveCriticalSection(&session->lock);
+    return TRUE;
+}
+
+/**
+ * @brief Feed the outcome of an admitted request into its origin's breaker
+ *        and concurrency limit.
+ */
+WW_PRIVATE
+VOID
+WWOriginCompleteW(
+    WW_SESSION* session,
+    const WW_ADMISSIONW* admission,
+    INT result,
+    const WW_RESPONSEW* response
+)
+{
+    WW_ORIGINW* origin = admission->origin;
+    if (NULL == origin)
+    {
+        return;
+    }
+
+    const WW_BREAKER_OPTIONS* breaker = &session->breaker;
+    const WW_LIMITER_OPTIONS* limiter = &session->limiter;
+
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG latency = now - admission->startMs;
+
+    // Errors such as a bad URL or a full heap say nothing about the origin
+    BOOL failed = (WW_SUCCESS == result) ?
+                  (response->statusCode >= 500 || 429 == response->statusCode) :
+                  (WW_ERR_INTERNET_CONN == response->errorcode ||
+                   WW_ERR_HTTP_REQUEST == response->errorcode ||
+                   WW_ERR_HTTP_QUERY_INFO == response->errorcode);
+    BOOL slow = (0 != breaker->slowCallMs && latency > breaker->slowCallMs);
+
+    EnterCriticalSection(&session->lock);
+
+    origin->inFlight--;
+    if (failed || slow)
+    {
+        origin->stats.failures++;
+    }
+
+    // Moving average with a weight of 1/8 for the newest sample
+    LONGLONG average = (LONGLONG)origin->stats.latencyMs;
+    average += ((LONGLONG)latency - average) / 8;
+    origin->stats.latencyMs = (1 == origin->stats.requests) ? (DWORD)latency :
+                                                              (DWORD)average;
+
+    if (breaker->minRequests > 0)
+    {
+        UINT probes = (0 != breaker->halfOpenProbes) ? breaker->halfOpenProbes : 1;
+        DWORD windowMs = (0 != breaker->windowMs) ? breaker->windowMs :
+                                                    WW_DEFAULT_BREAKER_WINDOW;
+        UINT failurePercent = (0 != breaker->failurePercent) ?
+                              breaker->failurePercent :
+                              WW_DEFAULT_BREAKER_FAILURE_PERCENT;
+
+        if (admission->probe)
+        {
+            origin->probesInFlight--;
+            if (WW_BREAKER_HALF_OPEN == origin->state)
+            {
+                if (failed || slow)
+                {
+                    WWBreakerTripW(origin, now);
+                }
+                else if (++origin->probeSuccesses >= probes)
+                {
+                    origin->state = WW_BREAKER_CLOSED;
+                    origin->windowStartMs = now;
+                    origin->windowRequests = 0;
+                    origin->windowFailures = 0;
+                }
+            }
+        }
+        else if (WW_BREAKER_CLOSED == origin->state)
+        {
+            if (now - origin->windowStartMs >= windowMs)
+            {
+                origin->windowStartMs = now;
+                origin->windowRequests = 0;
+                origin->windowFailures = 0;
+            }
+
+            origin->windowRequests++;
+            if (failed || slow)
+            {
+                origin->windowFailures++;
+            }
+
+            if (origin->windowRequests >= breaker->minRequests &&
+                (ULONGLONG)origin->windowFailures * 100 >=
+                (ULONGLONG)failurePercent * origin->windowRequests)
+            {
+                WWBreakerTripW(origin, now);
+            }
+        }
+    }
+
+    if (limiter->initialLimit > 0)
+    {
+        if (failed || (0 != limiter->latencyTargetMs &&
+                       latency > limiter->latencyTargetMs))
+        {
+            // Requests admitted before the last cut already ran under the
+            // old limit; letting them cut again would collapse it to the floor
+            if (admission->sequence > origin->lastDrop)
+            {
+                origin->limit = WWLimiterClampW(limiter, origin->limit / 2);
+                origin->credit = 0;
+                origin->lastDrop = origin->admitted;
+            }
+        }
+        else if (++origin->credit >= origin->limit)
+        {
+            origin->credit = 0;
+            origin->limit = WWLimiterClampW(limiter, origin->limit + 1);
+        }
+
+        WakeAllConditionVariable(&session->slotFreed);
+    }
+
+    LeaveCriticalSection(&session->lock);
+}
+
+/**
+ * @brief Whether a request may be sent twice to race a slow first copy.
+ */
+WW_PRIVATE
+BOOL
+WWIsHedgeableW(
+    const WW_REQUESTW* request
+)
+{
+    if (0 == request->hedgeDelayMs || NULL != request->upload ||
+        (NULL != request->body && 0 != request->bodySize))
+    {
+        return FALSE;
+    }
+    return NULL == request->verb || 0 == _wcsicmp(request->verb, L"GET") ||
+           0 == _wcsicmp(request->verb, L"HEAD");
+}
+
+/**
+ * @brief Copy url with its host (and port) replaced by host.
+ */
+WW_PRIVATE
+BOOL
+WWHedgeUrlW(
+    LPCWSTR url,
+    LPCWSTR host,
+    LPWSTR buffer,
+    SIZE_T bufferSize
+)
+{
+    LPCWSTR authority = wcsstr(url, L"://");
+    if (NULL == authority || NULL == host || L'\0' == host[0])
+    {
+        return FALSE;
+    }
+    authority += 3;
+
+    SIZE_T authorityLen = wcscspn(authority, L"/?#");
+    LPCWSTR hostStart = authority;
+    for (SIZE_T i = 0; i < authorityLen; i++)
+    {
+        if (L'@' == authority[i])
+        {
+            hostStart = authority + i + 1;
+        }
+    }
+
+    SIZE_T prefixLen = (SIZE_T)(hostStart - url);
+    LPCWSTR rest = authority + authorityLen;
+    if (prefixLen + wcslen(host) + wcslen(rest) >= bufferSize)
+    {
+        return FALSE;
+    }
+
+    wcsncpy(buffer, url, prefixLen);
+    buffer[prefixLen] = L'\0';
+    wcsncat(buffer, host, bufferSize - wcslen(buffer) - 1);
+    wcsncat(buffer, rest, bufferSize - wcslen(buffer) - 1);
+    return TRUE;
+}
+
+/**
+ * @brief Stop a copy of a hedged query: it fails at its next WinInet call.
+ */
+WW_PRIVATE
+VOID
+WWHedgeCancelW(
+    WW_HEDGELEGW* leg
+)
+{
+    InterlockedExchange(&leg->cancelled, TRUE);
+
+    // Closing the handle aborts a send or read blocked on it
+    HINTERNET hReq = (HINTERNET)InterlockedExchangePointer(
+        (PVOID volatile*)&leg->hActive, NULL);
+    if (NULL != hReq)
+    {
+        InternetCloseHandle(hReq);
+    }
+}
+
+/**
+ * @brief Make the request handle of a copy closable by the other copy.
+ *
+ * @return FALSE if the copy was cancelled already.
+ */
+WW_PRIVATE
+BOOL
+WWHedgePublishW(
+    WW_HEDGELEGW* leg,
+    HINTERNET hReq
+)
+{
+    InterlockedExchangePointer((PVOID volatile*)&leg->hActive, hReq);
+    return !leg->cancelled;
+}
+
+/**
+ * @brief Called once a copy has its final response headers. The first copy
+ *        to get here wins and cancels the others.
+ *
+ * @return FALSE if another copy won.
+ */
+WW_PRIVATE
+BOOL
+WWHedgeHeadersW(
+    WW_HEDGELEGW* leg
+)
+{
+    WW_HEDGECTXW* ctx = leg->ctx;
+    LONG winner = InterlockedCompareExchange(&ctx->winner, leg->index, -1);
+    if (-1 == winner)
+    {
+        winner = leg->index;
+        for (LONG i = 0; i < WW_HEDGE_LEGS; i++)
+        {
+            if (i != leg->index)
+            {
+                WWHedgeCancelW(&ctx->legs[i]);
+            }
+        }
+    }
+    return winner == leg->index;
+}
+
+/**
+ * @brief Close the handles of a query and record the phases it reached; the
+ *        request handle may have been closed already by the hedge copy that
+ *        won or by the token.
+ */
+WW_PRIVATE
+VOID
+WWQueryCloseW(
+    WW_CANCEL* cancel,
+    WW_CANCELREG* reg,
+    HINTERNET hConn,
+    WW_PHASECLOCK* clock,
+    WW_RESPONSEW* response
+)
+{
+    WWCancelRelease(cancel, reg);
+    InternetCloseHandle(hConn);
+    WWClockCloseW(clock, &response->timings);
+}
+
+WW_PRIVATE
+DWORD WINAPI
+WWHedgeLegW(
+    LPVOID param
+)
+{
+    WW_HEDGELEGW* leg = (WW_HEDGELEGW*)param;
+
+    leg->result = WWQueryPerformW(leg->hInet, &leg->request, &leg->response,
+                                  leg->redirectsLeft, &leg->privateQuery);
+
+    InterlockedExchange(&leg->finished, TRUE);
+    return 0;
+}
+
+/**
+ * @brief Start the hedge once hedgeDelayMs has passed, unless the first copy
+ *        has its headers or has finished. Runs on a timer-queue thread.
+ */
+WW_PRIVATE
+VOID CALLBACK
+WWHedgeTimerW(
+    PVOID param,
+    BOOLEAN fired
+)
+{
+    WW_HEDGECTXW* ctx = (WW_HEDGECTXW*)param;
+
+    // A first copy that failed outright is left to the retry policy. One
+    // that gets its headers from here on cancels the hedge itself.
+    if (ctx->winner < 0 && !ctx->legs[0].finished)
+    {
+        ctx->legs[1].hThread = CreateThread(NULL, 0, WWHedgeLegW,
+                                            &ctx->legs[1], 0, NULL);
+    }
+}
+
+/**
+ * @brief Send a request and, if it has no response headers after
+ *        hedgeDelayMs, a second copy of it; return whichever copy gets its
+ *        final headers first.
+ */
+WW_PRIVATE
+INT
+WWQueryHedgedW(
+    HINTERNET hInet,
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    WW_HEDGECTXW* ctx = (WW_HEDGECTXW*)calloc(1, sizeof(*ctx));
+    if (NULL == ctx)
+    {
+        return WWQueryPerformW(hInet, request, response, redirectsLeft,
+                               privateQuery);
+    }
+
+    ctx->winner = -1;
+    for (LONG i = 0; i < WW_HEDGE_LEGS; i++)
+    {
+        WW_HEDGELEGW* leg = &ctx->legs[i];
+        leg->ctx = ctx;
+        leg->index = i;
+        leg->hInet = hInet;
+        leg->request = *request;
+        leg->redirectsLeft = redirectsLeft;
+        if (NULL != privateQuery)
+        {
+            leg->privateQuery = *privateQuery;
+        }
+        leg->privateQuery.hedge = leg;
+    }
+
+    // Spread hedges over the alternate hosts
+    WW_HEDGELEGW* hedge = &ctx->legs[1];
+    if (NULL != request->hedgeHosts && request->hedgeHostCount > 0)
+    {
+        ULONG next = (ULONG)InterlockedIncrement(&g_wwHedgeNext) - 1;
+        if (WWHedgeUrlW(request->url,
+                        request->hedgeHosts[next % request->hedgeHostCount],
+                        hedge->url, WW_COUNTOF(hedge->url)))
+        {
+            hedge->request.url = hedge->url;
+        }
+    }
+
+    // Most queries answer within the delay, so the first copy runs here and
+    // a thread is only started for the hedge when the timer fires
+    HANDLE hTimer = NULL;
+    if (FALSE == CreateTimerQueueTimer(&hTimer, NULL, WWHedgeTimerW, ctx,
+                                       request->hedgeDelayMs, 0,
+                                       WT_EXECUTEONLYONCE))
+    {
+        free(ctx);
+        return WWQueryPerformW(hInet, request, response, redirectsLeft,
+                               privateQuery);
+    }
+
+    WW_HEDGELEGW* primary = &ctx->legs[0];
+    WWHedgeLegW(primary);
+
+    // Waits for a callback in progress, so hThread is final afterwards
+    DeleteTimerQueueTimer(NULL, hTimer, INVALID_HANDLE_VALUE);
+    BOOL hedged = (NULL != hedge->hThread);
+    if (hedged)
+    {
+        WaitForSingleObject(hedge->hThread, INFINITE);
+        CloseHandle(hedge->hThread);
+    }
+
+    LONG pick = (ctx->winner >= 0) ? ctx->winner : 0;
+    WW_HEDGELEGW* won = &ctx->legs[pick];
+    for (LONG i = 0; i < WW_HEDGE_LEGS; i++)
+    {
+        if (i != pick)
+        {
+            WWFreeResponseW(&ctx->legs[i].response);
+        }
+    }
+
+    INT result = won->result;
+    *response = won->response;
+    response->hedged = hedged;
+    response->hedgeWon = (hedged && 1 == pick);
+    if (NULL != privateQuery)
+    {
+        won->privateQuery.hedge = privateQuery->hedge;
+        *privateQuery = won->privateQuery;
+    }
+
+    if (hedged && NULL != request->session)
+    {
+        EnterCriticalSection(&request->session->lock);
+        request->session->stats.hedgesIssued++;
+        if (response->hedgeWon)
+        {
+            request->session->stats.hedgesWon++;
+        }
+        LeaveCriticalSection(&request->session->lock);
+    }
+
+    free(ctx);
+    return result;
+}
+
+/**
+ * @brief Perform a request over hInet, hedged when the request asks for it
+ *        and guarded by the session's breaker and limiter.
+ */
+WW_PRIVATE
+INT
+WWQuerySendW(
+    HINTERNET hInet,
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    WW_ADMISSIONW admission = WW_STRUCT_NULL;
+    if (NULL != request->session &&
+        FALSE == WWOriginAdmitW(request->session, request, &admission, response))
+    {
+        return WW_FAILURE;
+    }
+
+    INT result;
+    if (WWIsHedgeableW(request))
+    {
+        result = WWQueryHedgedW(hInet, request, response, redirectsLeft,
+                                privateQuery);
+    }
+    else
+    {
+        result = WWQueryPerformW(hInet, request, response, redirectsLeft,
+                                 privateQuery);
+    }
+
+    if (NULL != request->session)
+    {
+        WWOriginCompleteW(request->session, &admission, result, response);
+    }
+    return result;
+}
+
+/**
+ * @brief Delay before the retry that follows attempt number attempt: a random
+ *        point in the upper half of an exponentially growing, capped window.
+ */
+WW_PRIVATE
+DWORD
+WWRetryDelayW(
+    const WW_RETRY_POLICY* policy,
+    UINT attempt,
+    DWORD retryAfterMs
+)
+{
+    DWORD baseMs = policy->baseDelayMs;
+    if (0 == baseMs)
+    {
+        baseMs = WW_DEFAULT_RETRY_DELAY;
+    }
+    DWORD maxMs = policy->maxDelayMs;
+    if (0 == maxMs)
+    {
+        maxMs = WW_DEFAULT_RETRY_MAX_DELAY;
+    }
+
+    ULONGLONG windowMs = (ULONGLONG)baseMs << (attempt < 21 ? attempt - 1 : 20);
+    if (windowMs > maxMs)
+    {
+        windowMs = maxMs;
+    }
+
+    // Jitter keeps clients that failed together from retrying together
+    ULONG random = 0;
+    if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, (PUCHAR)&random, sizeof(random),
+                                        BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+    {
+        random = GetTickCount();
+    }
+    DWORD delayMs = (DWORD)(windowMs / 2 + random % (windowMs / 2 + 1));
+
+    if (retryAfterMs > delayMs)
+    {
+        delayMs = (retryAfterMs < maxMs) ? retryAfterMs : maxMs;
+    }
+    return delayMs;
+}
+
+/**
+ * @brief Sleep before a retry. Returns FALSE as soon as the cancel flag is set
+ *        or the token is signalled; the latter wakes the wait at once.
+ */
+WW_PRIVATE
+BOOL
+WWRetryWaitW(
+    DWORD delayMs,
+    const volatile BOOL* pCancelFlag,
+    const WW_CANCEL* cancel
+)
+{
+    // Nothing can cut the wait short
+    if (NULL == pCancelFlag && NULL == cancel)
+    {
+        Sleep(delayMs);
+        return TRUE;
+    }
+
+    while (delayMs > 0)
+    {
+        if ((NULL != pCancelFlag && *pCancelFlag) || WWIsCancelled(cancel))
+        {
+            return FALSE;
+        }
+        DWORD sliceMs = (delayMs < 100) ? delayMs : 100;
+        if (NULL != cancel)
+        {
+            WaitForSingleObject(cancel->hEvent, sliceMs);
+        }
+        else
+        {
+            Sleep(sliceMs);
+        }
+        delayMs -= sliceMs;
+    }
+    return (NULL == pCancelFlag || !*pCancelFlag) && !WWIsCancelled(cancel);
+}
+
+/**
+ * @brief Put a request handle where WWCancel and the deadline can close it.
+ *        The handle is kept in slot if it already has one (a hedge), in reg
+ *        otherwise.
+ *
+ * Returns FALSE if the token was signalled or the deadline has passed
+ * already; the request must then not be sent. Either way the handle is closed
+ * with WWCancelRelease.
+ */
+WW_PRIVATE
+BOOL
+WWCancelAttach(
+    WW_CANCEL* cancel,
+    ULONGLONG deadlineMs,
+    WW_CANCELREG* reg,
+    HINTERNET hReq,
+    HINTERNET volatile* slot
+)
+{
+    reg->next = NULL;
+    reg->prev = NULL;
+    reg->linked = FALSE;
+    reg->hOwned = (NULL == slot) ? hReq : NULL;
+    reg->slot = (NULL == slot) ? &reg->hOwned : slot;
+    reg->hTimer = NULL;
+
+    // Name resolution and TLS setup heed no WinInet timeout, so only closing
+    // the handle holds the deadline. Without a timer the clamped timeouts
+    // still apply.
+    if (0 != deadlineMs)
+    {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadlineMs)
+        {
+            return FALSE;
+        }
+        ULONGLONG dueMs = deadlineMs - now;
+        if (FALSE == CreateTimerQueueTimer(&reg->hTimer, NULL, WWDeadlineTimerW,
+                                           reg, (dueMs < MAXDWORD) ? (DWORD)dueMs : MAXDWORD - 1,
+                                           0, WT_EXECUTEONLYONCE))
+        {
+            reg->hTimer = NULL;
+        }
+    }
+    if (NULL == cancel)
+    {
+        return TRUE;
+    }
+
+    AcquireSRWLockExclusive(&cancel->lock);
+    BOOL attached = (0 == cancel->cancelled);
+    if (attached)
+    {
+        reg->next = cancel->active;
+        if (NULL != cancel->active)
+        {
+            cancel->active->prev = reg;
+        }
+        cancel->active = reg;
+        reg->linked = TRUE;
+    }
+    ReleaseSRWLockExclusive(&cancel->lock);
+    return attached;
+}
+
+/**
+ * @brief Detach a handle from its token and close it, unless WWCancel or a
+ *        hedge already did.
+ */
+WW_PRIVATE
+VOID
+WWCancelRelease(
+    WW_CANCEL* cancel,
+    WW_CANCELREG* reg
+)
+{
+    // Waits for a running callback, which may still be using reg
+    if (NULL != reg->hTimer)
+    {
+        DeleteTimerQueueTimer(NULL, reg->hTimer, INVALID_HANDLE_VALUE);
+        reg->hTimer = NULL;
+    }
+    if (reg->linked)
+    {
+        AcquireSRWLockExclusive(&cancel->lock);
+        if (NULL != reg->prev)
+        {
+            reg->prev->next = reg->next;
+        }
+        else
+        {
+            cancel->active = reg->next;
+        }
+        if (NULL != reg->next)
+        {
+            reg->next->prev = reg->prev;
+        }
+        reg->linked = FALSE;
+        ReleaseSRWLockExclusive(&cancel->lock);
+    }
+
+    HINTERNET hReq = (HINTERNET)InterlockedExchangePointer(
+        (PVOID volatile*)reg->slot, NULL);
+    if (NULL != hReq)
+    {
+        InternetCloseHandle(hReq);
+    }
+}
+
+/**
+ * @brief Close a request handle whose deadline passed. Runs on a timer-queue
+ *        thread.
+ */
+WW_PRIVATE
+VOID CALLBACK
+WWDeadlineTimerW(
+    PVOID param,
+    BOOLEAN fired
+)
+{
+    WW_CANCELREG* reg = (WW_CANCELREG*)param;
+    HINTERNET hReq = (HINTERNET)InterlockedExchangePointer(
+        (PVOID volatile*)reg->slot, NULL);
+    if (NULL != hReq)
+    {
+        InternetCloseHandle(hReq);
+    }
+}
+
+WW_PRIVATE
+BOOL
+WWDeadlinePassed(
+    ULONGLONG deadlineMs
+)
+{
+    return 0 != deadlineMs && GetTickCount64() >= deadlineMs;
+}
+
+/**
+ * @brief Cut a per-operation timeout to the time left before the deadline.
+ * @return timeoutMs without a deadline, otherwise at least 1; 0 still means
+ *         the WinInet default when there is no deadline.
+ */
+WW_PRIVATE
+DWORD
+WWDeadlineClampW(
+    ULONGLONG deadlineMs,
+    DWORD timeoutMs
+)
+{
+    if (0 == deadlineMs)
+    {
+        return timeoutMs;
+    }
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG leftMs = (deadlineMs > now) ? deadlineMs - now : 1;
+    if (0 != timeoutMs && timeoutMs < leftMs)
+    {
+        return timeoutMs;
+    }
+    return (leftMs < MAXDWORD) ? (DWORD)leftMs : MAXDWORD - 1;
+}
+
+/**
+ * @brief Start the phase clock of a request hop.
+ * @return NULL when out of memory; the request then goes untimed.
+ */
+WW_PRIVATE
+WW_PHASECLOCK*
+WWClockOpenW(
+    ULONGLONG startUs,
+    BOOL secure
+)
+{
+    WW_PHASECLOCK* clock = (WW_PHASECLOCK*)calloc(1, sizeof(WW_PHASECLOCK));
+    if (NULL != clock)
+    {
+        clock->refs = 1;
+        clock->startUs = startUs;
+        clock->secure = secure;
+    }
+    return clock;
+}
+
+/**
+ * @brief Route the status callbacks of a request handle opened with the
+ *        clock as its context to the clock.
+ */
+WW_PRIVATE
+VOID
+WWClockAttachW(
+    WW_PHASECLOCK* clock,
+    HINTERNET hReq
+)
+{
+    if (NULL == clock)
+    {
+        return;
+    }
+
+    // Taken first: the callback may drop it as soon as it is installed
+    InterlockedIncrement(&clock->refs);
+    if (INTERNET_INVALID_STATUS_CALLBACK ==
+        InternetSetStatusCallbackW(hReq, WWStatusCallbackW))
+    {
+        InterlockedDecrement(&clock->refs);
+    }
+}
+
+WW_PRIVATE
+VOID
+WWClockMarkW(
+    WW_PHASECLOCK* clock,
+    INT phase
+)
+{
+    if (NULL != clock)
+    {
+        ULONGLONG elapsedUs = WWGetTimeUs() - clock->startUs;
+        clock->marks[phase] = (0 != elapsedUs) ? elapsedUs : 1;
+    }
+}
+
+/**
+ * @brief Copy the phases reached so far into timings, keeping its redirect
+ *        fields. Phases skipped on the way to a later one end where the
+ *        phase before them ended.
+ */
+WW_PRIVATE
+VOID
+WWClockReadW(
+    const WW_PHASECLOCK* clock,
+    WW_TIMINGS* timings
+)
+{
+    ULONGLONG marks[WW_PHASE_COUNT] = { 0 };
+    if (NULL != clock)
+    {
+        INT last = WW_PHASE_COUNT - 1;
+        while (last >= 0 && 0 == clock->marks[last])
+        {
+            --last;
+        }
+        ULONGLONG prev = 0;
+        for (INT i = 0; i <= last; ++i)
+        {
+            marks[i] = (clock->marks[i] > prev) ? clock->marks[i] : prev;
+            prev = marks[i];
+        }
+    }
+
+    timings->resolveUs = marks[WW_PHASE_RESOLVE];
+    timings->connectUs = marks[WW_PHASE_CONNECT];
+    timings->tlsUs = marks[WW_PHASE_TLS];
+    timings->requestSentUs = marks[WW_PHASE_SENT];
+    timings->firstByteUs = marks[WW_PHASE_FIRST_BYTE];
+    timings->headersUs = marks[WW_PHASE_HEADERS];
+    timings->bodyUs = marks[WW_PHASE_BODY];
+    timings->connectionReused = (0 != marks[WW_PHASE_SENT] &&
+                                 NULL != clock && !clock->connected);
+}
+
+/**
+ * @brief Account for a redirect followed after the hop started at startUs,
+ *        also in the metrics; the phases are left to the next hop.
+ */
+WW_PRIVATE
+VOID
+WWClockRedirectW(
+    WW_TIMINGS* timings,
+    ULONGLONG startUs
+)
+{
+    WWMetricsAdd(&g_wwMetrics.redirects, 1);
+    timings->redirects++;
+    timings->redirectUs += WWGetTimeUs() - startUs;
+    WWClockReadW(NULL, timings);
+}
+
+/**
+ * @brief Read the clock into timings (if not NULL) and drop the reference
+ *        of the request.
+ */
+WW_PRIVATE
+VOID
+WWClockCloseW(
+    WW_PHASECLOCK* clock,
+    WW_TIMINGS* timings
+)
+{
+    if (NULL == clock)
+    {
+        return;
+    }
+    if (NULL != timings)
+    {
+        WWClockReadW(clock, timings);
+    }
+    if (0 == InterlockedDecrement(&clock->refs))
+    {
+        free(clock);
+    }
+}
+
+/**
+ * @brief WinInet status callback of a timed request handle. Runs on the
+ *        thread calling into WinInet, or on the one closing the handle.
+ */
+WW_PRIVATE
+VOID CALLBACK
+WWStatusCallbackW(
+    HINTERNET hInternet,
+    DWORD_PTR context,
+    DWORD status,
+    LPVOID info,
+    DWORD infoLength
+)
+{
+    WW_PHASECLOCK* clock = (WW_PHASECLOCK*)context;
+    switch (status)
+    {
+        case INTERNET_STATUS_NAME_RESOLVED:
+            WWClockMarkW(clock, WW_PHASE_RESOLVE);
+            break;
+        case INTERNET_STATUS_CONNECTING_TO_SERVER:
+            clock->connected = TRUE;
+            break;
+        case INTERNET_STATUS_CONNECTED_TO_SERVER:
+            WWClockMarkW(clock, WW_PHASE_CONNECT);
+            WWMetricsAdd(&g_wwMetrics.connectionsOpened, 1);
+            break;
+        case INTERNET_STATUS_SENDING_REQUEST:
+            // WinInet has no handshake status of its own but may report
+            // the handshake records as sends and receives. On a new https
+            // connection the handshake ends at the first send, moved on to
+            // each send that follows a receive, so the ClientHello and the
+            // ServerHello mark neither SENT nor FIRST_BYTE
+            if (clock->secure && clock->connected &&
+                0 == clock->marks[WW_PHASE_HEADERS] &&
+                (0 == clock->marks[WW_PHASE_TLS] ||
+                 0 != clock->marks[WW_PHASE_FIRST_BYTE]))
+            {
+                WWClockMarkW(clock, WW_PHASE_TLS);
+                clock->marks[WW_PHASE_SENT] = 0;
+                clock->marks[WW_PHASE_FIRST_BYTE] = 0;
+            }
+            break;
+        case INTERNET_STATUS_REQUEST_SENT:
+            // Reported per write; the last one ends the request body
+            WWClockMarkW(clock, WW_PHASE_SENT);
+            break;
+        case INTERNET_STATUS_RESPONSE_RECEIVED:
+            // Reported per read; the first after a send is the response
+            if (0 != clock->marks[WW_PHASE_SENT] &&
+                0 == clock->marks[WW_PHASE_FIRST_BYTE])
+            {
+                WWClockMarkW(clock, WW_PHASE_FIRST_BYTE);
+            }
+            break;
+        case INTERNET_STATUS_HANDLE_CLOSING:
+            // The last callback of the handle
+            WWClockCloseW(clock, NULL);
+            break;
+        default:
+            break;
+    }
+}
+
+WW_PRIVATE
+VOID
+WWTraceBeginW(
+    INT stage,
+    LPCWSTR url
+)
+{
+    if (NULL != g_wwTraceCallback)
+    {
+        WW_TRACE_EVENT event = { stage, FALSE, WWGetTimeUs(),
+                                 GetCurrentThreadId(), url, 0, FALSE };
+        WWTraceEmitW(&event);
+    }
+}
+
+WW_PRIVATE
+VOID
+WWTraceEndW(
+    INT stage,
+    ULONGLONG bytes,
+    BOOL failed
+)
+{
+    if (NULL != g_wwTraceCallback)
+    {
+        WW_TRACE_EVENT event = { stage, TRUE, WWGetTimeUs(),
+                                 GetCurrentThreadId(), NULL, bytes, failed };
+        WWTraceEmitW(&event);
+    }
+}
+
+WW_PRIVATE
+VOID
+WWTraceEmitW(
+    const WW_TRACE_EVENT* event
+)
+{
+    AcquireSRWLockShared(&g_wwTraceLock);
+    if (NULL != g_wwTraceCallback)
+    {
+        g_wwTraceCallback(event, g_wwTraceUserData);
+    }
+    ReleaseSRWLockShared(&g_wwTraceLock);
+}
+
+WW_PRIVATE
+VOID
+WWMetricsAdd(
+    ULONGLONG* counter,
+    ULONGLONG value
+)
+{
+    InterlockedExchangeAdd64((LONGLONG volatile*)counter, (LONGLONG)value);
+}
+
+WW_PRIVATE
+VOID
+WWMetricsObserve(
+    WW_HISTOGRAM* histogram,
+    ULONGLONG us
+)
+{
+    UINT bucket = 0;
+    while (bucket < WW_METRICS_BUCKETS - 1 && us > g_wwMetricsBoundsUs[bucket])
+    {
+        ++bucket;
+    }
+    InterlockedIncrement64((LONGLONG volatile*)&histogram->buckets[bucket]);
+    InterlockedExchangeAdd64((LONGLONG volatile*)&histogram->sumUs, (LONGLONG)us);
+}
+
+/**
+ * @brief Count a request that went out on the handle timed by clock (NULL
+ *        for none); statusCode is 0 when no response came back.
+ */
+WW_PRIVATE
+VOID
+WWMetricsRequestW(
+    const WW_PHASECLOCK* clock,
+    DWORD statusCode
+)
+{
+    INT statusClass = (statusCode >= 100 && statusCode < 600) ?
+                      (INT)(statusCode / 100) : WW_STATUS_CLASS_NONE;
+    InterlockedIncrement64((LONGLONG volatile*)&g_wwMetrics.requests[statusClass]);
+    if (NULL != clock && 0 != statusCode)
+    {
+        WWMetricsObserve(&g_wwMetrics.headersTime, WWGetTimeUs() - clock->startUs);
+        if (!clock->connected)
+        {
+            WWMetricsAdd(&g_wwMetrics.connectionsReused, 1);
+        }
+    }
+}
+
+/**
+ * @brief Append to the text being formatted, counting what does not fit.
+ */
+WW_PRIVATE
+VOID
+WWMetricsAppend(
+    WW_METRICSTEXT* text,
+    const CHAR* line,
+    INT len
+)
+{
+    if (len <= 0)
+    {
+        return;
+    }
+    if (text->len < text->size)
+    {
+        SIZE_T room = text->size - text->len;
+        memcpy(text->buffer + text->len, line, ((SIZE_T)len < room) ? (SIZE_T)len : room);
+    }
+    text->len += (SIZE_T)len;
+}
+
+WW_PRIVATE
+VOID
+WWMetricsAppendCounter(
+    WW_METRICSTEXT* text,
+    const CHAR* name,
+    const CHAR* help,
+    ULONGLONG value
+)
+{
+    CHAR line[256];
+    INT len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                          "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                          name, help, name, name, value);
+    WWMetricsAppend(text, line, len);
+}
+
+WW_PRIVATE
+VOID
+WWMetricsAppendHistogram(
+    WW_METRICSTEXT* text,
+    const CHAR* name,
+    const CHAR* help,
+    const WW_HISTOGRAM* histogram
+)
+{
+    CHAR line[256];
+    INT len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                          "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    WWMetricsAppend(text, line, len);
+
+    // Prometheus buckets are cumulative
+    ULONGLONG cumulative = 0;
+    for (UINT b = 0; b < WW_METRICS_BUCKETS; ++b)
+    {
+        cumulative += histogram->buckets[b];
+        len = _snprintf_s(line, sizeof(line), _TRUNCATE, "%s_bucket{le=\"%s\"} %llu\n",
+                          name, g_wwMetricsBoundNames[b], cumulative);
+        WWMetricsAppend(text, line, len);
+    }
+    len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+                      "%s_sum %llu.%06llu\n%s_count %llu\n", name,
+                      histogram->sumUs / 1000000, histogram->sumUs % 1000000,
+                      name, cumulative);
+    WWMetricsAppend(text, line, len);
+}
+
+/**
+ * @brief Append to the buffer of a sink, writing it out whenever it fills.
+ *        Called with the sink lock held.
+ */
+WW_PRIVATE
+VOID
+WWTraceSinkAppend(
+    WW_TRACESINK* sink,
+    const CHAR* data,
+    SIZE_T size
+)
+{
+    while (size > 0 && !sink->failed)
+    {
+        if (sink->used == sizeof(sink->buffer))
+        {
+            WWTraceSinkFlush(sink);
+        }
+        SIZE_T chunk = sizeof(sink->buffer) - sink->used;
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+        memcpy(sink->buffer + sink->used, data, chunk);
+        sink->used += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+/**
+ * @brief Append a URL as the contents of a JSON string, in UTF-8.
+ */
+WW_PRIVATE
+VOID
+WWTraceSinkAppendUrlW(
+    WW_TRACESINK* sink,
+    LPCWSTR url
+)
+{
+    CHAR utf8[INTERNET_MAX_URL_LENGTH * 3];
+    INT len = WideCharToMultiByte(CP_UTF8, 0, url, -1, utf8, sizeof(utf8),
+                                  NULL, NULL) - 1;
+    for (INT i = 0; i < len; i++)
+    {
+        CHAR c = utf8[i];
+        if ('"' == c || '\\' == c)
+        {
+            CHAR escaped[2] = { '\\', c };
+            WWTraceSinkAppend(sink, escaped, 2);
+        }
+        else if ((BYTE)c < 0x20)
+        {
+            CHAR escaped[8];
+            _snprintf_s(escaped, sizeof(escaped), _TRUNCATE, "\\u%04x", (BYTE)c);
+            WWTraceSinkAppend(sink, escaped, 6);
+        }
+        else
+        {
+            WWTraceSinkAppend(sink, &c, 1);
+        }
+    }
+}
+
+WW_PRIVATE
+VOID
+WWTraceSinkFlush(
+    WW_TRACESINK* sink
+)
+{
+    DWORD written = 0;
+    if (sink->used > 0 && !sink->failed &&
+        (FALSE == WriteFile(sink->hFile, sink->buffer, (DWORD)sink->used,
+                            &written, NULL) ||
+         written != sink->used))
+    {
+        sink->failed = TRUE;
+    }
+    sink->used = 0;
+}
+
+WW_PRIVATE
+BOOL
+WWIsRetryableStatusW(
+    DWORD statusCode,
+    DWORD retryOn
+)
+{
+    if (statusCode >= 500 && statusCode < 600)
+    {
+        // Not Implemented and Version Not Supported will not change on retry
+        return (retryOn & WW_RETRY_5XX) && 501 != statusCode &&
+               505 != statusCode;
+    }
+    if (429 == statusCode)
+    {
+        return 0 != (retryOn & WW_RETRY_429);
+    }
+    if (408 == statusCode)
+    {
+        return 0 != (retryOn & WW_RETRY_408);
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Set the rate and burst of a limiter, keeping the tokens it has
+ *        (or starting full when it was unlimited).
+ */
+WW_PRIVATE
+VOID
+WWRateLimitConfigure(
+    WW_RATELIMIT* limit,
+    ULONGLONG bytesPerSecond,
+    ULONGLONG burstBytes
+)
+{
+    ULONGLONG rate = (bytesPerSecond < WW_RATE_MAX) ? bytesPerSecond : WW_RATE_MAX;
+    ULONGLONG burst = (0 != burstBytes) ? burstBytes : rate;
+    burst = (burst < WW_RATE_MAX) ? burst : WW_RATE_MAX;
+    ULONGLONG nowUs = WWGetTimeUs();
+
+    AcquireSRWLockExclusive(&limit->lock);
+    if (0 == limit->rate)
+    {
+        limit->credit = (LONGLONG)burst * WW_RATE_SCALE;
+    }
+    else
+    {
+        WWRateLimitRefill(limit, nowUs);
+        if (limit->credit > (LONGLONG)burst * WW_RATE_SCALE)
+        {
+            limit->credit = (LONGLONG)burst * WW_RATE_SCALE;
+        }
+    }
+    limit->rate = rate;
+    limit->burst = burst;
+    limit->lastUs = nowUs;
+    ReleaseSRWLockExclusive(&limit->lock);
+}
+
+/**
+ * @brief Add the tokens earned since the last refill. The lock is held.
+ */
+WW_PRIVATE
+VOID
+WWRateLimitRefill(
+    WW_RATELIMIT* limit,
+    ULONGLONG nowUs
+)
+{
+    LONGLONG full = (LONGLONG)limit->burst * WW_RATE_SCALE;
+    ULONGLONG elapsedUs = (nowUs > limit->lastUs) ? nowUs - limit->lastUs : 0;
+    limit->lastUs = nowUs;
+    if (limit->credit >= full)
+    {
+        return;
+    }
+
+    // Compare durations first so that a long idle spell cannot overflow
+    ULONGLONG missing = (ULONGLONG)(full - limit->credit);
+    if (elapsedUs >= missing / limit->rate + 1)
+    {
+        limit->credit = full;
+    }
+    else
+    {
+        limit->credit += (LONGLONG)(elapsedUs * limit->rate);
+        if (limit->credit > full)
+        {
+            limit->credit = full;
+        }
+    }
+}
+
+/**
+ * @brief Look up the limit of a host set with WWSetHostRateLimitW.
+ */
+WW_PRIVATE
+WW_RATELIMIT*
+WWRateLimitHostW(
+    LPCWSTR host
+)
+{
+    WW_RATELIMIT* limit = NULL;
+    if (NULL == host)
+    {
+        return NULL;
+    }
+
+    AcquireSRWLockShared(&g_wwHostRatesLock);
+    for (WW_HOSTRATEW* entry = g_wwHostRates; NULL != entry; entry = entry->next)
+    {
+        if (0 == _wcsicmp(entry->host, host))
+        {
+            limit = &entry->limit;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&g_wwHostRatesLock);
+    return limit;
+}
+
+/**
+ * @brief Cut a read to the smallest burst of the limiters in force, so that
+ *        a single read cannot overshoot a low rate by much.
+ */
+WW_PRIVATE
+DWORD
+WWRateLimitChunk(
+    WW_RATELIMIT* const* limits,
+    UINT count,
+    DWORD size
+)
+{
+    for (UINT i = 0; i < count; ++i)
+    {
+        if (NULL == limits[i])
+        {
+            continue;
+        }
+        AcquireSRWLockShared(&limits[i]->lock);
+        if (0 != limits[i]->rate && limits[i]->burst < size)
+        {
+            size = (DWORD)limits[i]->burst;
+        }
+        ReleaseSRWLockShared(&limits[i]->lock);
+    }
+    return (0 != size) ? size : 1;
+}
+
+/**
+ * @brief Take tokens for bytes just read from every limiter in force, then
+ *        sleep until none of them is in debt.
+ *
+ * Readers sharing a limiter all wait for the shared debt, so together they
+ * stay at its rate. The debt is recomputed after every slice of at most
+ * 100 ms so that a changed rate, a cancellation or the deadline takes effect
+ * promptly.
+ */
+WW_PRIVATE
+VOID
+WWRateLimitWait(
+    WW_RATELIMIT* const* limits,
+    UINT count,
+    ULONGLONG bytes,
+    const volatile BOOL* pCancelFlag,
+    const WW_CANCEL* cancel,
+    ULONGLONG deadlineMs
+)
+{
+    BOOL limited = FALSE;
+    for (UINT i = 0; i < count; ++i)
+    {
+        if (NULL == limits[i])
+        {
+            continue;
+        }
+        AcquireSRWLockExclusive(&limits[i]->lock);
+        if (0 != limits[i]->rate)
+        {
+            limits[i]->credit -= (LONGLONG)bytes * WW_RATE_SCALE;
+            limited = TRUE;
+        }
+        ReleaseSRWLockExclusive(&limits[i]->lock);
+    }
+
+    while (limited)
+    {
+        ULONGLONG waitMs = 0;
+        ULONGLONG nowUs = WWGetTimeUs();
+        for (UINT i = 0; i < count; ++i)
+        {
+            if (NULL == limits[i])
+            {
+                continue;
+            }
+            AcquireSRWLockExclusive(&limits[i]->lock);
+            if (0 != limits[i]->rate)
+            {
+                WWRateLimitRefill(limits[i], nowUs);
+                if (limits[i]->credit < 0)
+                {
+                    ULONGLONG perMs = limits[i]->rate * 1000;
+                    ULONGLONG ms = ((ULONGLONG)-limits[i]->credit + perMs - 1) / perMs;
+                    waitMs = (ms > waitMs) ? ms : waitMs;
+                }
+            }
+            ReleaseSRWLockExclusive(&limits[i]->lock);
+        }
+
+        if (0 == waitMs || WWDeadlinePassed(deadlineMs) ||
+            FALSE == WWRetryWaitW((waitMs < 100) ? (DWORD)waitMs : 100, pCancelFlag,
+                                 cancel))
+        {
+            return;
+        }
+    }
+}
+
+WW_PRIVATE
+DWORD
+WWLowSpeedTimeW(
+    const WW_PARAMSW* userParams
+)
+{
+    return (0 != userParams->lowSpeedTimeMs) ? userParams->lowSpeedTimeMs :
+                                                WW_DEFAULT_LOW_SPEED_TIME;
+}
+
+/**
+ * @brief Receive timeout of a download request; 0 = WinInet default.
+ *
+ * With low-speed detection on, a read may block for at most one window, and
+ * never past the deadline.
+ */
+WW_PRIVATE
+DWORD
+WWReceiveTimeoutW(
+    const WW_PARAMSW* userParams
+)
+{
+    DWORD timeout = userParams->receiveTimeoutMs;
+    if (0 != userParams->lowSpeedLimit &&
+        (0 == timeout || WWLowSpeedTimeW(userParams) < timeout))
+    {
+        timeout = WWLowSpeedTimeW(userParams);
+    }
+    return WWDeadlineClampW(userParams->deadlineMs, timeout);
+}
+
+WW_PRIVATE
+VOID
+WWSpeedCheckStart(
+    WW_SPEEDCHECK* check
+)
+{
+    check->startMs = GetTickCount64();
+    check->lastMs = check->startMs;
+    check->bytes = 0;
+}
+
+/**
+ * @brief Leave time spent waiting on a rate limit out of the check.
+ */
+WW_PRIVATE
+VOID
+WWSpeedCheckPause(
+    WW_SPEEDCHECK* check,
+    ULONGLONG pausedMs
+)
+{
+    check->startMs += pausedMs;
+    check->lastMs += pausedMs;
+}
+
+/**
+ * @brief Count bytes received on a connection and tell whether it has been
+ *        below the low-speed limit for a whole window.
+ *
+ * A window that reaches the limit starts the next one.
+ */
+WW_PRIVATE
+BOOL
+WWSpeedCheckStalledW(
+    const WW_PARAMSW* userParams,
+    WW_SPEEDCHECK* check,
+    ULONGLONG bytes
+)
+{
+    if (0 == userParams->lowSpeedLimit)
+    {
+        return FALSE;
+    }
+
+    ULONGLONG nowMs = GetTickCount64();
+    ULONGLONG elapsedMs = nowMs - check->startMs;
+    check->bytes += bytes;
+    if (0 != bytes)
+    {
+        check->lastMs = nowMs;
+    }
+    if (elapsedMs < WWLowSpeedTimeW(userParams))
+    {
+        return FALSE;
+    }
+    if (check->bytes * 1000 < (ULONGLONG)userParams->lowSpeedLimit * elapsedMs)
+    {
+        return TRUE;
+    }
+    check->startMs = nowMs;
+    check->bytes = 0;
+    return FALSE;
+}
+
+/**
+ * @brief Tell whether a failed read came after a whole window without data,
+ *        which is how a receive timeout shortened by WWReceiveTimeoutW
+ *        shows.
+ */
+WW_PRIVATE
+BOOL
+WWSpeedCheckSilentW(
+    const WW_PARAMSW* userParams,
+    const WW_SPEEDCHECK* check
+)
+{
+    return 0 != userParams->lowSpeedLimit &&
+           GetTickCount64() - check->lastMs >= WWLowSpeedTimeW(userParams);
+}
+
+/**
+ * @brief Send a request under its retry policy. The response of the last
+ *        attempt is returned; earlier ones are freed.
+ */
+WW_PRIVATE
+INT
+WWQueryRetryW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    const WW_RETRY_POLICY* policy = &request->retry;
+    DWORD retryOn = policy->retryOn;
+    if (0 == retryOn)
+    {
+        retryOn = WW_RETRY_DEFAULT;
+    }
+
+    // Repeating a POST or PATCH may apply it twice
+    UINT maxAttempts = policy->maxAttempts;
+    if (NULL != request->verb && !(retryOn & WW_RETRY_NON_IDEMPOTENT) &&
+        (0 == _wcsicmp(request->verb, L"POST") ||
+         0 == _wcsicmp(request->verb, L"PATCH")))
+    {
+        maxAttempts = 1;
+    }
+
+    // Remember where a streamed body starts so it can be sent again
+    WW_UPLOADSTATE upload = WW_STRUCT_NULL;
+    if (NULL != request->upload && maxAttempts > 1 &&
+        FALSE == WWUploadBeginW(request->upload, &upload))
+    {
+        maxAttempts = 1;
+    }
+
+    INT iStatus = WW_FAILURE;
+    for (UINT attempt = 1; ; ++attempt)
+    {
+        iStatus = WWQueryRouteW(request, response, redirectsLeft, privateQuery);
+        response->attempts = attempt;
+
+        BOOL retry = (WW_SUCCESS == iStatus) ?
+            WWIsRetryableStatusW(response->statusCode, retryOn) :
+            (retryOn & WW_RETRY_NETWORK) &&
+            (WW_ERR_INTERNET_CONN == response->errorcode ||
+             WW_ERR_HTTP_REQUEST == response->errorcode);
+        if (!retry || attempt >= maxAttempts ||
+            (NULL != request->upload && FALSE == WWUploadRewindW(&upload)))
+        {
+            break;
+        }
+
+        // Retry-After is only visible when the headers were captured
+        DWORD retryAfterMs = 0;
+        WCHAR retryAfter[32];
+        if ((429 == response->statusCode ||
+             HTTP_STATUS_SERVICE_UNAVAIL == response->statusCode) &&
+            WWGetResponseHeaderW(response, L"Retry-After", retryAfter,
+                                 WW_COUNTOF(retryAfter)))
+        {
+            ULONG secs = wcstoul(retryAfter, NULL, 10);
+            retryAfterMs = (secs < 86400 ? secs : 86400) * 1000;
+        }
+
+        // A retry that could not start before the deadline is not made
+        DWORD delayMs = WWRetryDelayW(policy, attempt, retryAfterMs);
+        if (0 != request->deadlineMs &&
+            GetTickCount64() + delayMs >= request->deadlineMs)
+        {
+            break;
+        }
+
+        WWFreeResponseW(response);
+        ZeroMemory(response, sizeof(*response));
+        if (FALSE == WWRetryWaitW(delayMs, NULL, request->cancel))
+        {
+            iStatus = WW_FAILURE;
+            break;
+        }
+        WWMetricsAdd(&g_wwMetrics.retries, 1);
+    }
+
+    // Whatever error a closed handle caused, the caller asked for it
+    if (WW_SUCCESS != iStatus && WWIsCancelled(request->cancel))
+    {
+        response->errorcode = WW_ERR_CANCELLED;
+    }
+    else if (WW_SUCCESS != iStatus && WWDeadlinePassed(request->deadlineMs))
+    {
+        response->errorcode = WW_ERR_TIMEOUT;
+    }
+    return iStatus;
+}
+
+/**
+ * @brief Send the request with its body gzipped and Content-Encoding set.
+ *        A body that does not shrink, or that the caller already labelled
+ *        with a Content-Encoding, is sent as-is. Goes straight to the retry
+ *        loop so WWQueryExW traces and times the request only once.
+ */
+WW_PRIVATE
+INT
+WWQueryCompressedW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft
+)
+{
+    WW_REQUESTW packed = *request;
+    packed.compressLevel = 0;
+
+    WCHAR encoding[64];
+    if (WWFindHeaderLineW(request->headers, L"Content-Encoding", 16, encoding,
+                          WW_COUNTOF(encoding)))
+    {
+        return WWQueryRetryW(&packed, response, redirectsLeft, NULL);
+    }
+
+    // A body of up to one upload block is compressed up front. A larger one
+    // is compressed block by block as it is sent, with chunked framing, so
+    // it is never held twice.
+    LPBYTE gzBody = NULL;
+    DWORD gzSize = 0;
+    WW_DEFLATE* stream = NULL;
+    WW_UPLOAD_SOURCE source = WW_STRUCT_NULL;
+    if (request->bodySize <= WW_UPLOAD_BLOCK)
+    {
+        if (FALSE == WWGzipCompress((const BYTE*)request->body, request->bodySize,
+                                    request->compressLevel, &gzBody, &gzSize))
+        {
+            return WWQueryRetryW(&packed, response, redirectsLeft, NULL);
+        }
+        packed.body = gzBody;
+        packed.bodySize = gzSize;
+    }
+    else
+    {
+        stream = WWGzipStreamOpen((const BYTE*)request->body, request->bodySize,
+                                  request->compressLevel);
+        if (NULL == stream)
+        {
+            return WWQueryRetryW(&packed, response, redirectsLeft, NULL);
+        }
+        source.type = WW_UPLOAD_GZIP;
+        source.pCallbackData = stream;
+        packed.body = NULL;
+        packed.bodySize = 0;
+        packed.upload = &source;
+    }
+
+    SIZE_T headersLen = (NULL != request->headers) ? wcslen(request->headers) : 0;
+    LPWSTR headers = (LPWSTR)malloc(headersLen * sizeof(WCHAR) +
+                                    sizeof(WW_CONTENT_ENCODING_GZIPW));
+    if (NULL == headers)
+    {
+        free(gzBody);
+        WWGzipStreamClose(stream);
+        response->errorcode = WW_ERR_MALLOC;
+        return WW_FAILURE;
+    }
+    if (headersLen > 0)
+    {
+        memcpy(headers, request->headers, headersLen * sizeof(WCHAR));
+    }
+    memcpy(headers + headersLen, WW_CONTENT_ENCODING_GZIPW,
+           sizeof(WW_CONTENT_ENCODING_GZIPW));
+    packed.headers = headers;
+
+    INT iStatus = WWQueryRetryW(&packed, response, redirectsLeft, NULL);
+
+    free(headers);
+    free(gzBody);
+    WWGzipStreamClose(stream);
+    return iStatus;
+}
+
+/**
+ * @brief FNV-1a hash of a wide string.
+ */
+WW_PRIVATE
+ULONG
+WWHashStringW(
+    LPCWSTR str
+)
+{
+    ULONG hash = 2166136261u;
+    for (; L'\0' != *str; ++str)
+    {
+        hash = (hash ^ (ULONG)*str) * 16777619u;
+    }
+    return hash;
+}
+
+WW_PRIVATE
+BOOL
+WWIsCacheableRequestW(
+    const WW_REQUESTW* request
+)
+{
+    return 0 == request->bodySize && NULL == request->upload &&
+           !request->captureHeaders &&
+           (NULL == request->verb || 0 == _wcsicmp(request->verb, L"GET"));
+}
+
+/**
+ * @brief Find a header in a CRLF-separated block and copy its trimmed value.
+ */
+WW_PRIVATE
+BOOL
+WWFindHeaderLineW(
+    LPCWSTR headers,
+    LPCWSTR name,
+    SIZE_T nameLen,
+    LPWSTR outValue,
+    DWORD outValueCch
+)
+{
+    outValue[0] = L'\0';
+
+    LPCWSTR line = headers;
+    while (NULL != line && L'\0' != *line)
+    {
+        LPCWSTR lineEnd = wcschr(line, L'\n');
+        if (NULL == lineEnd)
+        {
+            lineEnd = line + wcslen(line);
+        }
+
+        LPCWSTR colon = line + nameLen;
+        if (colon < lineEnd && 0 == _wcsnicmp(line, name, nameLen))
+        {
+            while (colon < lineEnd && L' ' == *colon)
+            {
+                ++colon;
+            }
+            if (colon < lineEnd && L':' == *colon)
+            {
+                LPCWSTR value = colon + 1;
+                LPCWSTR valueEnd = lineEnd;
+                while (value < valueEnd && (L' ' == *value || L'\t' == *value))
+                {
+                    ++value;
+                }
+                while (valueEnd > value && (L'\r' == valueEnd[-1] ||
+                       L'\n' == valueEnd[-1] || L' ' == valueEnd[-1]))
+                {
+                    --valueEnd;
+                }
+
+                SIZE_T valueLen = (SIZE_T)(valueEnd - value);
+                if (valueLen >= outValueCch)
+                {
+                    valueLen = outValueCch - 1;
+                }
+                wcsncpy(outValue, value, valueLen);
+                outValue[valueLen] = L'\0';
+                return TRUE;
+            }
+        }
+
+        line = (L'\0' != *lineEnd) ? lineEnd + 1 : lineEnd;
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Look up the value a request sends for a header (empty if absent).
+ */
+WW_PRIVATE
+VOID
+WWFindRequestHeaderW(
+    const WW_REQUESTW* request,
+    LPCWSTR name,
+    SIZE_T nameLen,
+    LPWSTR outValue,
+    DWORD outValueCch
+)
+{
+    outValue[0] = L'\0';
+
+    if (10 == nameLen && 0 == _wcsnicmp(name, L"User-Agent", nameLen))
+    {
+        if (NULL != request->userAgent)
+        {
+            wcsncpy(outValue, request->userAgent, outValueCch - 1);
+            outValue[outValueCch - 1] = L'\0';
+        }
+        return;
+    }
+    if (12 == nameLen && 0 == _wcsnicmp(name, L"Content-Type", nameLen))
+    {
+        if (NULL != request->contentType)
+        {
+            wcsncpy(outValue, request->contentType, outValueCch - 1);
+            outValue[outValueCch - 1] = L'\0';
+        }
+        return;
+    }
+
+    WWFindHeaderLineW(request->headers, name, nameLen, outValue, outValueCch);
+}
+
+/**
+ * @brief Build the secondary cache key from the headers a response varies on.
+ *
+ * @return FALSE if the response varies on "*" or the key does not fit.
+ */
+WW_PRIVATE
+BOOL
+WWBuildVaryKeyW(
+    const WW_REQUESTW* request,
+    LPCWSTR varyNames,
+    LPWSTR outKey,
+    DWORD outKeyCch
+)
+{
+    outKey[0] = L'\0';
+    if (NULL == varyNames)
+    {
+        return TRUE;
+    }
+
+    LPCWSTR p = varyNames;
+    while (L'\0' != *p)
+    {
+        while (L' ' == *p || L',' == *p || L'\t' == *p)
+        {
+            ++p;
+        }
+        LPCWSTR name = p;
+        while (L'\0' != *p && L',' != *p && L' ' != *p && L'\t' != *p)
+        {
+            ++p;
+        }
+        SIZE_T nameLen = (SIZE_T)(p - name);
+        if (0 == nameLen)
+        {
+            continue;
+        }
+        if (1 == nameLen && L'*' == *name)
+        {
+            return FALSE;
+        }
+
+        WCHAR value[512] = L"";
+        WWFindRequestHeaderW(request, name, nameLen, value, WW_COUNTOF(value));
+
+        SIZE_T used = wcslen(outKey);
+        if (used + nameLen + wcslen(value) + 3 > outKeyCch)
+        {
+            return FALSE;
+        }
+        for (SIZE_T i = 0; i < nameLen; ++i)
+        {
+            outKey[used++] = (WCHAR)towlower(name[i]);
+        }
+        outKey[used++] = L':';
+        outKey[used] = L'\0';
+        wcsncat(outKey, value, outKeyCch - used - 1);
+        wcsncat(outKey, L"\n", outKeyCch - wcslen(outKey) - 1);
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Read a response header, joining repeated lines with ", ".
+ *
+ * @return FALSE if the header is present but could not be read. Otherwise
+ *         *value holds the header, or NULL if the response has none, and
+ *         must be freed with free().
+ */
+WW_PRIVATE
+BOOL
+WWQueryHeaderLinesW(
+    HINTERNET hReq,
+    DWORD query,
+    BOOL allLines,
+    LPWSTR* value
+)
+{
+    LPWSTR line = NULL;
+    DWORD lineSize = 0;
+    LPWSTR joined = NULL;
+    SIZE_T joinedLen = 0;
+    DWORD index = 0;
+    BOOL ok = TRUE;
+
+    while (TRUE)
+    {
+        DWORD next = index;
+        DWORD size = lineSize;
+        if (FALSE == HttpQueryInfoW(hReq, query, line, &size, &next))
+        {
+            DWORD error = GetLastError();
+            if (ERROR_INSUFFICIENT_BUFFER == error && size >= lineSize)
+            {
+                LPWSTR grown = (LPWSTR)realloc(line, size + sizeof(WCHAR));
+                if (NULL != grown)
+                {
+                    line = grown;
+                    lineSize = size + sizeof(WCHAR);
+                    continue;
+                }
+            }
+            ok = (ERROR_HTTP_HEADER_NOT_FOUND == error);
+            break;
+        }
+
+        SIZE_T lineLen = wcslen(line);
+        LPWSTR grown = (LPWSTR)realloc(joined,
+                                       (joinedLen + lineLen + 3) * sizeof(WCHAR));
+        if (NULL == grown)
+        {
+            ok = FALSE;
+            break;
+        }
+        joined = grown;
+        if (joinedLen > 0)
+        {
+            joined[joinedLen++] = L',';
+            joined[joinedLen++] = L' ';
+        }
+        memcpy(joined + joinedLen, line, lineLen * sizeof(WCHAR));
+        joinedLen += lineLen;
+        joined[joinedLen] = L'\0';
+
+        if (!allLines || next <= index)
+        {
+            break;
+        }
+        index = next;
+    }
+
+    free(line);
+    if (!ok)
+    {
+        free(joined);
+        joined = NULL;
+    }
+    *value = joined;
+    return ok;
+}
+
+/**
+ * @brief Pick out the Cache-Control directives the session cache uses.
+ *        Names must match whole; a max-age that is not all digits makes the
+ *        response stale, as RFC 9111 asks.
+ */
+WW_PRIVATE
+VOID
+WWParseCacheControlW(
+    LPCWSTR p,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    while (L'\0' != *p)
+    {
+        while (L' ' == *p || L',' == *p || L'\t' == *p)
+        {
+            ++p;
+        }
+        if (L'\0' == *p)
+        {
+            break;
+        }
+
+        LPCWSTR name = p;
+        while (L'\0' != *p && L',' != *p && L'=' != *p &&
+               L' ' != *p && L'\t' != *p)
+        {
+            ++p;
+        }
+        SIZE_T nameLen = (SIZE_T)(p - name);
+        while (L' ' == *p || L'\t' == *p)
+        {
+            ++p;
+        }
+
+        // The argument is a token or a quoted string, which may hold commas
+        LPCWSTR arg = NULL;
+        SIZE_T argLen = 0;
+        if (L'=' == *p)
+        {
+            ++p;
+            while (L' ' == *p || L'\t' == *p)
+            {
+                ++p;
+            }
+            if (L'"' == *p)
+            {
+                arg = ++p;
+                while (L'\0' != *p && L'"' != *p)
+                {
+                    if (L'\\' == *p && L'\0' != p[1])
+                    {
+                        ++p;
+                    }
+                    ++p;
+                }
+                argLen = (SIZE_T)(p - arg);
+                if (L'"' == *p)
+                {
+                    ++p;
+                }
+            }
+            else
+            {
+                arg = p;
+                while (L'\0' != *p && L',' != *p && L' ' != *p && L'\t' != *p)
+                {
+                    ++p;
+                }
+                argLen = (SIZE_T)(p - arg);
+            }
+            while (L' ' == *p || L'\t' == *p)
+            {
+                ++p;
+            }
+        }
+
+        // Anything else before the next comma makes the directive malformed
+        BOOL wellFormed = (L'\0' == *p || L',' == *p);
+        while (L'\0' != *p && L',' != *p)
+        {
+            ++p;
+        }
+
+        if (8 == nameLen && 0 == _wcsnicmp(name, L"no-store", nameLen))
+        {
+            privateQuery->noStore = TRUE;
+        }
+        else if (8 == nameLen && 0 == _wcsnicmp(name, L"no-cache", nameLen))
+        {
+            privateQuery->noCache = TRUE;
+        }
+        else if (7 == nameLen && 0 == _wcsnicmp(name, L"max-age", nameLen))
+        {
+            LONGLONG maxAge = (wellFormed && argLen > 0) ? 0 : -1;
+            for (SIZE_T i = 0; i < argLen && maxAge >= 0; ++i)
+            {
+                if (arg[i] < L'0' || arg[i] > L'9')
+                {
+                    maxAge = -1;
+                }
+                else if (maxAge < 0x80000000LL) // RFC 9111 caps overflow at 2^31
+                {
+                    maxAge = maxAge * 10 + (arg[i] - L'0');
+                }
+            }
+            privateQuery->maxAgeSecs = (maxAge < 0) ? 0 :
+                                       (maxAge > 0x80000000LL) ? 0x80000000LL : maxAge;
+        }
+    }
+}
+
+/**
+ * @brief Record the caching headers of the final response. A header that
+ *        cannot be read in full marks the response as not storable, since
+ *        the part that was lost may be a no-store or a Vary name.
+ */
+WW_PRIVATE
+VOID
+WWCaptureCacheInfoW(
+    HINTERNET hReq,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    privateQuery->hasCacheControl = FALSE;
+    privateQuery->noStore = FALSE;
+    privateQuery->noCache = FALSE;
+    privateQuery->maxAgeSecs = -1;
+
+    LPWSTR cacheControl = NULL;
+    if (FALSE == WWQueryHeaderLinesW(hReq, HTTP_QUERY_CACHE_CONTROL, TRUE,
+                                     &cacheControl))
+    {
+        privateQuery->hasCacheControl = TRUE;
+        privateQuery->noStore = TRUE;
+    }
+    else if (NULL != cacheControl)
+    {
+        privateQuery->hasCacheControl = TRUE;
+        WWParseCacheControlW(cacheControl, privateQuery);
+        free(cacheControl);
+    }
+
+    struct {
+        DWORD query;
+        BOOL allLines;
+        LPWSTR buf;
+        DWORD cch;
+    } fields[] = {
+        { HTTP_QUERY_ETAG, FALSE, privateQuery->etag,
+          WW_COUNTOF(privateQuery->etag) },
+        { HTTP_QUERY_LAST_MODIFIED, FALSE, privateQuery->lastModified,
+          WW_COUNTOF(privateQuery->lastModified) },
+        { HTTP_QUERY_VARY, TRUE, privateQuery->vary,
+          WW_COUNTOF(privateQuery->vary) }
+    };
+
+    for (SIZE_T i = 0; i < WW_COUNTOF(fields); ++i)
+    {
+        LPWSTR value = NULL;
+        fields[i].buf[0] = L'\0';
+        if (FALSE == WWQueryHeaderLinesW(hReq, fields[i].query,
+                                         fields[i].allLines, &value))
+        {
+            privateQuery->noStore = TRUE;
+        }
+        else if (NULL != value)
+        {
+            if (wcslen(value) < fields[i].cch)
+            {
+                wcscpy(fields[i].buf, value);
+            }
+            else
+            {
+                privateQuery->noStore = TRUE;
+            }
+            free(value);
+        }
+    }
+
+    DWORD age = 0;
+    DWORD ageLen = sizeof(age);
+    privateQuery->ageSecs = 0;
+    if (HttpQueryInfoW(hReq, HTTP_QUERY_AGE | HTTP_QUERY_FLAG_NUMBER,
+                       &age, &ageLen, NULL))
+    {
+        privateQuery->ageSecs = age;
+    }
+
+    // Expires is relative to the server clock, so measure it against Date
+    SYSTEMTIME expires = WW_STRUCT_NULL;
+    SYSTEMTIME date = WW_STRUCT_NULL;
+    DWORD stLen = sizeof(expires);
+    privateQuery->expiresSecs = -1;
+    if (HttpQueryInfoW(hReq, HTTP_QUERY_EXPIRES | HTTP_QUERY_FLAG_SYSTEMTIME,
+                       &expires, &stLen, NULL))
+    {
+        FILETIME ftExpires;
+        FILETIME ftDate;
+        stLen = sizeof(date);
+        if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_DATE | HTTP_QUERY_FLAG_SYSTEMTIME,
+                                    &date, &stLen, NULL) ||
+            FALSE == SystemTimeToFileTime(&date, &ftDate))
+        {
+            GetSystemTimeAsFileTime(&ftDate);
+        }
+
+        // An unparseable Expires means "already expired"
+        privateQuery->expiresSecs = 0;
+        if (SystemTimeToFileTime(&expires, &ftExpires))
+        {
+            ULARGE_INTEGER e = { .LowPart = ftExpires.dwLowDateTime,
+                                 .HighPart = ftExpires.dwHighDateTime };
+            ULARGE_INTEGER d = { .LowPart = ftDate.dwLowDateTime,
+                                 .HighPart = ftDate.dwHighDateTime };
+            if (e.QuadPart > d.QuadPart)
+            {
+                privateQuery->expiresSecs =
+                    (LONGLONG)((e.QuadPart - d.QuadPart) / 10000000ULL);
+            }
+        }
+    }
+
+    privateQuery->cacheInfoValid = TRUE;
+}
+
+/**
+ * @brief Compute how long a response stays fresh.
+ *
+ * @return FALSE if the response must not be stored.
+ */
+WW_PRIVATE
+BOOL
+WWCacheFreshnessW(
+    const WW_PRIVATEQUERYW* privateQuery,
+    ULONGLONG* freshMs
+)
+{
+    if (privateQuery->noStore)
+    {
+        return FALSE;
+    }
+
+    LONGLONG maxAge = privateQuery->maxAgeSecs;
+    if (maxAge < 0)
+    {
+        maxAge = privateQuery->expiresSecs;
+    }
+    if (privateQuery->noCache || maxAge < 0)
+    {
+        maxAge = 0;
+    }
+    if ((ULONGLONG)maxAge > privateQuery->ageSecs)
+    {
+        *freshMs = ((ULONGLONG)maxAge - privateQuery->ageSecs) * 1000;
+    }
+    else
+    {
+        *freshMs = 0;
+    }
+
+    // A response that is never fresh is only useful if it can be revalidated
+    return *freshMs > 0 ||
+           L'\0' != privateQuery->etag[0] ||
+           L'\0' != privateQuery->lastModified[0];
+}
+
+WW_PRIVATE
+VOID
+WWCacheFreeEntryW(
+    WW_CACHEENTRYW* entry
+)
+{
+    WWSharedBodyRelease(entry->body);
+    free(entry->url);
+    free(entry->varyNames);
+    free(entry->varyKey);
+    free(entry->etag);
+    free(entry->lastModified);
+    free(entry);
+}
+
+WW_PRIVATE
+VOID
+WWCacheLinkFrontW(
+    WW_SESSION* session,
+    WW_CACHEENTRYW* entry
+)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = session->lruHead;
+    if (NULL != session->lruHead)
+    {
+        session->lruHead->lruPrev = entry;
+    }
+    session->lruHead = entry;
+    if (NULL == session->lruTail)
+    {
+        session->lruTail = entry;
+    }
+}
+
+WW_PRIVATE
+VOID
+WWCacheUnlinkLruW(
+    WW_SESSION* session,
+    WW_CACHEENTRYW* entry
+)
+{
+    if (NULL != entry->lruPrev)
+    {
+        entry->lruPrev->lruNext = entry->lruNext;
+    }
+    else
+    {
+        session->lruHead = entry->lruNext;
+    }
+    if (NULL != entry->lruNext)
+    {
+        entry->lruNext->lruPrev = entry->lruPrev;
+    }
+    else
+    {
+        session->lruTail = entry->lruPrev;
+    }
+}
+
+/**
+ * @brief Drop an entry from the cache. The session lock must be held.
+ */
+WW_PRIVATE
+VOID
+WWCacheRemoveW(
+    WW_SESSION* session,
+    WW_CACHEENTRYW* entry
+)
+{
+    WW_CACHEENTRYW** link = &session->cache[entry->hash % WW_CACHE_BUCKETS];
+    while (*link != entry)
+    {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+
+    WWCacheUnlinkLruW(session, entry);
+    session->stats.cacheEntries--;
+    session->stats.cacheBytesUsed -= entry->cost;
+    WWCacheFreeEntryW(entry);
+}
+
+WW_PRIVATE
+VOID
+WWCacheClearW(
+    WW_SESSION* session
+)
+{
+    while (NULL != session->lruHead)
+    {
+        WWCacheRemoveW(session, session->lruHead);
+    }
+}
+
+/**
+ * @brief Find the entry matching a request's URL and Vary headers.
+ *        The session lock must be held.
+ */
+WW_PRIVATE
+WW_CACHEENTRYW*
+WWCacheFindW(
+    WW_SESSION* session,
+    const WW_REQUESTW* request,
+    ULONG hash
+)
+{
+    WW_CACHEENTRYW* entry = session->cache[hash % WW_CACHE_BUCKETS];
+    for (; NULL != entry; entry = entry->hashNext)
+    {
+        if (entry->hash != hash || 0 != wcscmp(entry->url, request->url))
+        {
+            continue;
+        }
+
+        WCHAR varyKey[1024];
+        if (WWBuildVaryKeyW(request, entry->varyNames, varyKey,
+                            WW_COUNTOF(varyKey)) &&
+            0 == wcscmp(entry->varyKey, varyKey))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+WW_PRIVATE
+LPWSTR
+WWCacheDupW(
+    LPCWSTR str
+)
+{
+    return (L'\0' != str[0]) ? _wcsdup(str) : NULL;
+}
+
+/**
+ * @brief Store a 200 response, replacing any previous variant for the same
+ *        request and evicting least recently used entries over the budget.
+ *        The session lock must be held.
+ */
+WW_PRIVATE
+VOID
+WWCacheStoreW(
+    WW_SESSION* session,
+    const WW_REQUESTW* request,
+    ULONG hash,
+    WW_RESPONSEW* response,
+    const WW_PRIVATEQUERYW* privateQuery
+)
+{
+    ULONGLONG freshMs = 0;
+    WCHAR varyKey[1024];
+    if (FALSE == WWCacheFreshnessW(privateQuery, &freshMs) ||
+        FALSE == WWBuildVaryKeyW(request,
+                                 (L'\0' != privateQuery->vary[0]) ?
+                                 privateQuery->vary : NULL,
+                                 varyKey, WW_COUNTOF(varyKey)))
+    {
+        return;
+    }
+
+    SIZE_T cost = sizeof(WW_CACHEENTRYW) + response->dataSize +
+                  (wcslen(request->url) + wcslen(varyKey) +
+                   wcslen(privateQuery->vary) + wcslen(privateQuery->etag) +
+                   wcslen(privateQuery->lastModified)) * sizeof(WCHAR);
+    if (cost > session->cacheBudget)
+    {
+        return;
+    }
+
+    WW_CACHEENTRYW* entry = (WW_CACHEENTRYW*)calloc(1, sizeof(*entry));
+    if (NULL == entry)
+    {
+        return;
+    }
+
+    entry->hash = hash;
+    entry->url = _wcsdup(request->url);
+    entry->varyKey = _wcsdup(varyKey);
+    entry->varyNames = WWCacheDupW(privateQuery->vary);
+    entry->etag = WWCacheDupW(privateQuery->etag);
+    entry->lastModified = WWCacheDupW(privateQuery->lastModified);
+    entry->body = WWResponseShareW(response);
+    if (NULL == entry->url || NULL == entry->varyKey || NULL == entry->body ||
+        (NULL == entry->varyNames && L'\0' != privateQuery->vary[0]) ||
+        (NULL == entry->etag && L'\0' != privateQuery->etag[0]) ||
+        (NULL == entry->lastModified && L'\0' != privateQuery->lastModified[0]))
+    {
+        WWCacheFreeEntryW(entry);
+        return;
+    }
+    entry->statusCode = response->statusCode;
+    entry->http2 = response->http2;
+    entry->storedAtMs = GetTickCount64();
+    entry->freshMs = freshMs;
+    entry->cost = cost;
+
+    WW_CACHEENTRYW* previous = WWCacheFindW(session, request, hash);
+    if (NULL != previous)
+    {
+        WWCacheRemoveW(session, previous);
+    }
+
+    WW_CACHEENTRYW** bucket = &session->cache[hash % WW_CACHE_BUCKETS];
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    WWCacheLinkFrontW(session, entry);
+    session->stats.cacheEntries++;
+    session->stats.cacheBytesUsed += cost;
+
+    while (session->stats.cacheBytesUsed > session->cacheBudget)
+    {
+        WWCacheRemoveW(session, session->lruTail);
+        session->stats.cacheEvictions++;
+    }
+}
+
+/**
+ * @brief Build If-None-Match/If-Modified-Since headers from stored validators.
+ */
+WW_PRIVATE
+VOID
+WWBuildConditionalW(
+    LPCWSTR etag,
+    LPCWSTR lastModified,
+    LPWSTR outHeaders,
+    DWORD outHeadersCch
+)
+{
+    outHeaders[0] = L'\0';
+    if (NULL != etag && L'\0' != etag[0])
+    {
+        _snwprintf_s(outHeaders, outHeadersCch, _TRUNCATE,
+                     L"If-None-Match: %s\r\n", etag);
+    }
+    if (NULL != lastModified && L'\0' != lastModified[0])
+    {
+        SIZE_T used = wcslen(outHeaders);
+        _snwprintf_s(outHeaders + used, outHeadersCch - used, _TRUNCATE,
+                     L"If-Modified-Since: %s\r\n", lastModified);
+    }
+}
+
+/**
+ * @brief Serve a GET through the session cache.
+ *
+ * Fresh entries are returned without touching the network. Stale entries
+ * with validators are revalidated; a 304 refreshes the entry and the stored
+ * body is returned as a 200.
+ */
+WW_PRIVATE
+INT
+WWQueryCachedW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft
+)
+{
+    WW_SESSION* session = request->session;
+    ULONG hash = WWHashStringW(request->url);
+
+    WW_PRIVATEQUERYW privateQuery = WW_STRUCT_NULL;
+    WCHAR conditional[512] = L"";
+    WW_SHAREDBODY* staleBody = NULL;
+    DWORD staleStatus = 0;
+    BOOL staleHttp2 = FALSE;
+
+    EnterCriticalSection(&session->lock);
+    WW_CACHEENTRYW* entry = WWCacheFindW(session, request, hash);
+    if (NULL != entry)
+    {
+        WWCacheUnlinkLruW(session, entry);
+        WWCacheLinkFrontW(session, entry);
+
+        if (GetTickCount64() - entry->storedAtMs < entry->freshMs)
+        {
+            session->stats.cacheHits++;
+            WWMetricsAdd(&g_wwMetrics.memoryCacheHits, 1);
+            response->statusCode = entry->statusCode;
+            response->http2 = entry->http2;
+            WWSharedBodyAttachW(entry->body, response);
+            LeaveCriticalSection(&session->lock);
+            return WW_SUCCESS;
+        }
+
+        WWBuildConditionalW(entry->etag, entry->lastModified, conditional,
+                            WW_COUNTOF(conditional));
+        if (L'\0' != conditional[0])
+        {
+            // Keep the body alive even if the entry is evicted meanwhile
+            staleBody = entry->body;
+            InterlockedIncrement(&staleBody->refCount);
+            staleStatus = entry->statusCode;
+            staleHttp2 = entry->http2;
+        }
+    }
+    LeaveCriticalSection(&session->lock);
+
+    privateQuery.extraHeaders = (L'\0' != conditional[0]) ? conditional : NULL;
+    INT result = WWQueryDispatchW(request, response, redirectsLeft,
+                                  &privateQuery);
+
+    EnterCriticalSection(&session->lock);
+    if (WW_SUCCESS == result && NULL != staleBody &&
+        HTTP_STATUS_NOT_MODIFIED == response->statusCode)
+    {
+        session->stats.cacheRevalidations++;
+
+        entry = WWCacheFindW(session, request, hash);
+        if (NULL != entry && entry->body == staleBody)
+        {
+            ULONGLONG freshMs = 0;
+            entry->storedAtMs = GetTickCount64();
+            if (privateQuery.cacheInfoValid &&
+                (privateQuery.hasCacheControl ||
+                 privateQuery.expiresSecs >= 0))
+            {
+                WWCacheFreshnessW(&privateQuery, &freshMs);
+                entry->freshMs = freshMs;
+            }
+        }
+        LeaveCriticalSection(&session->lock);
+
+        WWFreeResponseW(response);
+        response->statusCode = staleStatus;
+        response->http2 = staleHttp2;
+        WWSharedBodyAttachW(staleBody, response);
+    }
+    else
+    {
+        session->stats.cacheMisses++;
+        if (WW_SUCCESS == result && HTTP_STATUS_OK == response->statusCode &&
+            privateQuery.cacheInfoValid)
+        {
+            WWCacheStoreW(session, request, hash, response, &privateQuery);
+        }
+        LeaveCriticalSection(&session->lock);
+    }
+
+    WWSharedBodyRelease(staleBody);
+    return result;
+}
+
+WW_PRIVATE
+DWORD WINAPI
+WWBatchWorkerW(
+    LPVOID param
+)
+{
+    WW_BATCHCTXW* ctx = (WW_BATCHCTXW*)param;
+
+    while (TRUE)
+    {
+        SIZE_T index = (SIZE_T)InterlockedIncrement(&ctx->nextIndex) - 1;
+        if (index >= ctx->count)
+        {
+            break;
+        }
+
+        WW_REQUESTW request = ctx->requests[index];
+        if (NULL == request.session)
+        {
+            request.session = ctx->session;
+        }
+        if (NULL == request.cancel)
+        {
+            request.cancel = ctx->cancel;
+        }
+
+        ULONGLONG startUs = WWGetTimeUs();
+        INT result = WWQueryExW(&request, &ctx->responses[index]);
+        ULONGLONG endUs = WWGetTimeUs();
+
+        if (WW_SUCCESS != result)
+        {
+            InterlockedIncrement(&ctx->failures);
+        }
+
+        if (NULL != ctx->results)
+        {
+            WW_BATCH_RESULT* entry = &ctx->results[index];
+            entry->result = result;
+            entry->startUs = startUs - ctx->startUs;
+            entry->elapsedUs = endUs - startUs;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Upload read callback serving one part of the file. Reads use
+ *        explicit offsets so workers can share the handle.
+ */
+WW_PRIVATE
+BOOL
+WWPartReadW(
+    LPVOID buffer,
+    DWORD size,
+    LPDWORD bytesRead,
+    LPVOID pUserData
+)
+{
+    WW_PARTREADERW* reader = (WW_PARTREADERW*)pUserData;
+    *bytesRead = 0;
+    if (0 == reader->left)
+    {
+        return TRUE;
+    }
+
+    DWORD chunk = (reader->left < size) ? (DWORD)reader->left : size;
+    OVERLAPPED overlapped = WW_STRUCT_NULL;
+    overlapped.Offset = (DWORD)reader->offset;
+    overlapped.OffsetHigh = (DWORD)(reader->offset >> 32);
+    if (FALSE == ReadFile(reader->hFile, buffer, chunk, bytesRead, &overlapped) ||
+        0 == *bytesRead)
+    {
+        return FALSE;
+    }
+
+    reader->offset += *bytesRead;
+    reader->left -= *bytesRead;
+    return TRUE;
+}
+
+/**
+ * @brief Checksum one part with WW_MULTIPART_OPTIONSW.hashAlgorithm.
+ */
+WW_PRIVATE
+BOOL
+WWMultipartHashW(
+    WW_MULTIPARTCTXW* ctx,
+    WW_MULTIPART_PART* part
+)
+{
+    WW_HASHCTX hashCtx = WW_STRUCT_NULL;
+    if (FALSE == WWHashBegin(&hashCtx, ctx->options->hashAlgorithm))
+    {
+        return FALSE;
+    }
+
+    LPBYTE buf = (LPBYTE)malloc(WW_UPLOAD_BLOCK);
+    BOOL ok = (NULL != buf);
+    WW_PARTREADERW reader = { ctx->hFile, part->offset, part->size };
+    while (ok && reader.left > 0)
+    {
+        DWORD done = 0;
+        ok = WWPartReadW(buf, WW_UPLOAD_BLOCK, &done, &reader);
+        if (ok)
+        {
+            WWHashUpdate(&hashCtx, buf, done);
+        }
+    }
+    free(buf);
+
+    part->digestSize = WWHashDigestSize(ctx->options->hashAlgorithm);
+    if (FALSE == WWHashEnd(&hashCtx, part->digest, part->digestSize) || !ok)
+    {
+        part->digestSize = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Record the first failure of a multipart upload and stop the workers.
+ */
+WW_PRIVATE
+VOID
+WWMultipartFailW(
+    WW_MULTIPARTCTXW* ctx,
+    INT errorcode,
+    DWORD statusCode
+)
+{
+    EnterCriticalSection(&ctx->lock);
+    if (0 == ctx->failed)
+    {
+        ctx->errorcode = errorcode;
+        ctx->statusCode = statusCode;
+        InterlockedExchange(&ctx->failed, 1);
+    }
+    LeaveCriticalSection(&ctx->lock);
+}
+
+/**
+ * @brief Send one step of a multipart upload through the adapter, retrying
+ *        transport errors, 5xx, 408 and 429 with exponential backoff.
+ * @return WW_ERR_NOERROR or the error of the last attempt.
+ */
+WW_PRIVATE
+INT
+WWMultipartCallW(
+    WW_MULTIPARTCTXW* ctx,
+    INT phase,
+    WW_MULTIPART_PART* part,
+    LPDWORD statusCode
+)
+{
+    const WW_MULTIPART_ADAPTER* adapter = &ctx->options->adapter;
+    WW_MULTIPART_CALL* call = (WW_MULTIPART_CALL*)malloc(sizeof(WW_MULTIPART_CALL));
+    if (NULL == call)
+    {
+        return WW_ERR_MALLOC;
+    }
+
+    INT errorcode = WW_ERR_HTTP_STATUS;
+    *statusCode = 0;
+
+    // The abort step still runs after another step failed or the upload was
+    // cancelled, so it must not use the token
+    WW_CANCEL* cancel = (WW_MULTIPART_ABORT != phase) ? ctx->options->cancel : NULL;
+    for (UINT attempt = 0; attempt <= ctx->maxRetries; ++attempt)
+    {
+        if (attempt > 0)
+        {
+            if ((ctx->failed || WWIsCancelled(cancel)) && WW_MULTIPART_ABORT != phase)
+            {
+                break;
+            }
+            InterlockedIncrement(&ctx->retries);
+            WWMetricsAdd(&g_wwMetrics.retries, 1);
+            if (FALSE == WWRetryWaitW(
+                    WW_MULTIPART_BACKOFF_MS << ((attempt - 1 < 5) ? attempt - 1 : 5),
+                    NULL, cancel))
+            {
+                break;
+            }
+        }
+
+        memset(call, 0, sizeof(WW_MULTIPART_CALL));
+        call->phase = phase;
+        call->part = part;
+        call->parts = ctx->parts;
+        call->partCount = ctx->partCount;
+        call->request.verb = (WW_MULTIPART_UPLOAD_PART == phase) ? L"PUT" : L"POST";
+
+        if (FALSE == adapter->prepare(call, adapter->pUserData))
+        {
+            errorcode = WW_ERR_ADAPTER;
+            break;
+        }
+        if (NULL == call->request.url)
+        {
+            errorcode = (WW_MULTIPART_UPLOAD_PART == phase) ? WW_ERR_ADAPTER : WW_ERR_NOERROR;
+            break;
+        }
+
+        WW_PARTREADERW reader = WW_STRUCT_NULL;
+        WW_UPLOAD_SOURCE upload = WW_STRUCT_NULL;
+        if (WW_MULTIPART_UPLOAD_PART == phase)
+        {
+            reader.hFile = ctx->hFile;
+            reader.offset = part->offset;
+            reader.left = part->size;
+            upload.size = part->size;
+            if (part->size > 0)
+            {
+                upload.type = WW_UPLOAD_CALLBACK;
+                upload.readCallback = WWPartReadW;
+                upload.pCallbackData = &reader;
+            }
+            else
+            {
+                upload.type = WW_UPLOAD_BUFFERS;
+            }
+            call->request.upload = &upload;
+            ++part->attempts;
+        }
+        if (NULL == call->request.session)
+        {
+            call->request.session = ctx->session;
+        }
+        if (NULL == call->request.cancel)
+        {
+            call->request.cancel = cancel;
+        }
+        call->request.captureHeaders = TRUE;
+
+        WW_RESPONSEW response = WW_STRUCT_NULL;
+        INT result = WWQueryExW(&call->request, &response);
+        *statusCode = response.statusCode;
+
+        BOOL ok = (WW_SUCCESS == result &&
+                   response.statusCode >= 200 && response.statusCode < 300);
+        if (ok && NULL != adapter->response)
+        {
+            ok = adapter->response(call, &response, adapter->pUserData);
+            errorcode = WW_ERR_ADAPTER;
+        }
+        else
+        {
+            errorcode = (WW_SUCCESS != result) ? response.errorcode : WW_ERR_HTTP_STATUS;
+        }
+        WWFreeResponseW(&response);
+
+        if (ok)
+        {
+            errorcode = WW_ERR_NOERROR;
+            break;
+        }
+
+        // Client errors other than timeouts and throttling will not go away
+        if (WW_SUCCESS == result && *statusCode >= 400 && *statusCode < 500 &&
+            408 != *statusCode && 429 != *statusCode)
+        {
+            break;
+        }
+    }
+
+    free(call);
+    return errorcode;
+}
+
+WW_PRIVATE
+DWORD WINAPI
+WWMultipartWorkerW(
+    LPVOID param
+)
+{
+    WW_MULTIPARTCTXW* ctx = (WW_MULTIPARTCTXW*)param;
+
+    while (0 == ctx->failed)
+    {
+        UINT index = (UINT)InterlockedIncrement(&ctx->nextIndex) - 1;
+        if (index >= ctx->partCount)
+        {
+            break;
+        }
+
+        WW_MULTIPART_PART* part = &ctx->parts[index];
+        if (WW_HASH_NONE != ctx->options->hashAlgorithm &&
+            FALSE == WWMultipartHashW(ctx, part))
+        {
+            WWMultipartFailW(ctx, WW_ERR_UPLOAD, 0);
+            break;
+        }
+
+        DWORD statusCode = 0;
+        INT errorcode = WWMultipartCallW(ctx, WW_MULTIPART_UPLOAD_PART, part, &statusCode);
+        if (WW_ERR_NOERROR != errorcode)
+        {
+            WWMultipartFailW(ctx, errorcode, statusCode);
+            break;
+        }
+
+        EnterCriticalSection(&ctx->lock);
+        ctx->bytesDone += part->size;
+        if (NULL != ctx->options->progressCallback)
+        {
+            ctx->options->progressCallback(ctx->bytesDone, ctx->fileSize,
+                                           ctx->options->pCallbackData);
+        }
+        LeaveCriticalSection(&ctx->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Resolve the size of a streamed body and remember where it starts,
+ *        so the same body can be sent again after a redirect.
+ */
+WW_PRIVATE
+BOOL
+WWUploadBeginW(
+    const WW_UPLOAD_SOURCE* source,
+    WW_UPLOADSTATE* state
+)
+{
+    ZeroMemory(state, sizeof(*state));
+    state->source = source;
+    state->total = source->size;
+
+    switch (source->type)
+    {
+    case WW_UPLOAD_FILE:
+    {
+        LARGE_INTEGER zero = WW_STRUCT_NULL;
+        LARGE_INTEGER fileSize = WW_STRUCT_NULL;
+        if (FALSE == SetFilePointerEx(source->hFile, zero, &state->fileStart,
+                                      FILE_CURRENT))
+        {
+            return FALSE;
+        }
+        if (0 == state->total)
+        {
+            if (FALSE == GetFileSizeEx(source->hFile, &fileSize) ||
+                fileSize.QuadPart < state->fileStart.QuadPart)
+            {
+                return FALSE;
+            }
+            state->total = (ULONGLONG)(fileSize.QuadPart - state->fileStart.QuadPart);
+        }
+        return TRUE;
+    }
+    case WW_UPLOAD_CALLBACK:
+        state->chunked = (0 == state->total);
+        return NULL != source->readCallback;
+    case WW_UPLOAD_GZIP:
+        state->chunked = TRUE;
+        return NULL != source->pCallbackData;
+    case WW_UPLOAD_BUFFERS:
+        if (0 == state->total)
+        {
+            for (SIZE_T i = 0; i < source->bufferCount; i++)
+            {
+                state->total += source->buffers[i].size;
+            }
+        }
+        return NULL != source->buffers || 0 == source->bufferCount;
+    default:
+        return FALSE;
+    }
+}
+
+/**
+ * @brief Go back to the start of the body. A callback cannot be replayed.
+ */
+WW_PRIVATE
+BOOL
+WWUploadRewindW(
+    WW_UPLOADSTATE* state
+)
+{
+    state->sent = 0;
+    state->bufIndex = 0;
+    state->bufOffset = 0;
+    if (WW_UPLOAD_FILE == state->source->type)
+    {
+        return SetFilePointerEx(state->source->hFile, state->fileStart, NULL,
+                                FILE_BEGIN);
+    }
+    if (WW_UPLOAD_GZIP == state->source->type)
+    {
+        WWGzipStreamRewind((WW_DEFLATE*)state->source->pCallbackData);
+        return TRUE;
+    }
+    return WW_UPLOAD_BUFFERS == state->source->type;
+}
+
+/**
+ * @brief Fill buf with up to size bytes of the body. *bytesRead is 0 once
+ *        the source is exhausted.
+ */
+WW_PRIVATE
+BOOL
+WWUploadReadW(
+    WW_UPLOADSTATE* state,
+    LPBYTE buf,
+    DWORD size,
+    LPDWORD bytesRead
+)
+{
+    const WW_UPLOAD_SOURCE* source = state->source;
+    *bytesRead = 0;
+
+    if (WW_UPLOAD_CALLBACK == source->type)
+    {
+        if (FALSE == source->readCallback(buf, size, bytesRead,
+                                          source->pCallbackData))
+        {
+            return FALSE;
+        }
+        return *bytesRead <= size;
+    }
+    if (WW_UPLOAD_GZIP == source->type)
+    {
+        return WWGzipStreamRead((WW_DEFLATE*)source->pCallbackData, buf, size,
+                                bytesRead);
+    }
+
+    while (*bytesRead < size)
+    {
+        DWORD got = 0;
+        if (WW_UPLOAD_FILE == source->type)
+        {
+            if (FALSE == ReadFile(source->hFile, buf + *bytesRead,
+                                  size - *bytesRead, &got, NULL))
+            {
+                return FALSE;
+            }
+        }
+        else
+        {
+            while (state->bufIndex < source->bufferCount &&
+                   state->bufOffset == source->buffers[state->bufIndex].size)
+            {
+                state->bufIndex++;
+                state->bufOffset = 0;
+            }
+            if (state->bufIndex < source->bufferCount)
+            {
+                const WW_UPLOAD_BUFFER* piece = &source->buffers[state->bufIndex];
+                SIZE_T left = piece->size - state->bufOffset;
+                got = (left < size - *bytesRead) ? (DWORD)left : size - *bytesRead;
+                memcpy(buf + *bytesRead, (const BYTE*)piece->data + state->bufOffset, got);
+                state->bufOffset += got;
+            }
+        }
+
+        if (0 == got)
+        {
+            break;
+        }
+        *bytesRead += got;
+    }
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWWriteAllW(
+    HINTERNET hReq,
+    const BYTE* data,
+    DWORD size
+)
+{
+    WWTraceBeginW(WW_TRACE_WRITE, NULL);
+    DWORD total = size;
+    while (size > 0)
+    {
+        DWORD written = 0;
+        if (FALSE == InternetWriteFile(hReq, data, size, &written) || 0 == written)
+        {
+            WWTraceEndW(WW_TRACE_WRITE, total - size, TRUE);
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+    }
+    WWTraceEndW(WW_TRACE_WRITE, total, FALSE);
+    return TRUE;
+}
+
+/**
+ * @brief Send the request headers and stream the body through one fixed
+ *        block, framing each block as a chunk when the size is unknown.
+ *
+ * @return WW_ERR_NOERROR, WW_ERR_UPLOAD if the source failed or ended early,
+ *         or WW_ERR_HTTP_REQUEST on a network error.
+ */
+WW_PRIVATE
+INT
+WWUploadSendW(
+    HINTERNET hReq,
+    LPCWSTR headers,
+    DWORD headersLen,
+    WW_UPLOADSTATE* state
+)
+{
+    // Room for a "FFFFFFFF\r\n" chunk header before the data and "\r\n" after
+    const DWORD lead = 10;
+    LPBYTE block = (LPBYTE)malloc(lead + WW_UPLOAD_BLOCK + 2);
+    if (NULL == block)
+    {
+        return WW_ERR_MALLOC;
+    }
+
+    // The length goes in the headers, so bodies over 4 GB are not limited
+    // by the DWORD dwBufferTotal
+    INTERNET_BUFFERSW buffers = WW_STRUCT_NULL;
+    buffers.dwStructSize = sizeof(buffers);
+    buffers.lpcszHeader = headers;
+    buffers.dwHeadersLength = headersLen;
+    buffers.dwHeadersTotal = headersLen;
+
+    if (FALSE == HttpSendRequestExW(hReq, &buffers, NULL, 0, 0))
+    {
+        free(block);
+        return WW_ERR_HTTP_REQUEST;
+    }
+
+    const WW_UPLOAD_SOURCE* source = state->source;
+    INT error = WW_ERR_NOERROR;
+    while (WW_ERR_NOERROR == error)
+    {
+        DWORD want = WW_UPLOAD_BLOCK;
+        if (!state->chunked)
+        {
+            ULONGLONG left = state->total - state->sent;
+            if (0 == left)
+            {
+                break;
+            }
+            want = (left < want) ? (DWORD)left : want;
+        }
+
+        DWORD got = 0;
+        if (FALSE == WWUploadReadW(state, block + lead, want, &got))
+        {
+            error = WW_ERR_UPLOAD;
+            break;
+        }
+        if (0 == got)
+        {
+            // A declared Content-Length that the source cannot fill
+            error = state->chunked ? WW_ERR_NOERROR : WW_ERR_UPLOAD;
+            break;
+        }
+
+        LPBYTE frame = block + lead;
+        DWORD frameLen = got;
+        if (state->chunked)
+        {
+            static const CHAR hex[] = "0123456789ABCDEF";
+            *--frame = '\n';
+            *--frame = '\r';
+            for (DWORD v = got; v > 0; v >>= 4)
+            {
+                *--frame = hex[v & 0xF];
+            }
+            block[lead + got] = '\r';
+            block[lead + got + 1] = '\n';
+            frameLen = (DWORD)(block + lead + got + 2 - frame);
+        }
+
+        if (FALSE == WWWriteAllW(hReq, frame, frameLen))
+        {
+            error = WW_ERR_HTTP_REQUEST;
+            break;
+        }
+
+        state->sent += got;
+        WWMetricsAdd(&g_wwMetrics.bytesUploaded, got);
+        if (NULL != source->progressCallback)
+        {
+            source->progressCallback(state->sent,
+                                     state->chunked ? 0 : state->total,
+                                     source->pCallbackData);
+        }
+    }
+
+    if (WW_ERR_NOERROR == error && state->chunked &&
+        FALSE == WWWriteAllW(hReq, (const BYTE*)"0\r\n\r\n", 5))
+    {
+        error = WW_ERR_HTTP_REQUEST;
+    }
+    free(block);
+
+    if (WW_ERR_NOERROR == error &&
+        FALSE == HttpEndRequestW(hReq, NULL, 0, 0))
+    {
+        error = WW_ERR_HTTP_REQUEST;
+    }
+    return error;
+}
+
+/**
+ * @brief Connect a TCP socket to host:port, giving up after timeoutMs or when
+ *        the token is signalled. Name resolution itself cannot be interrupted;
+ *        the token is checked when it returns.
+ * @return A blocking socket, or INVALID_SOCKET.
+ */
+WW_PRIVATE
+SOCKET
+WWSocketConnectW(
+    LPCWSTR host,
+    INTERNET_PORT port,
+    DWORD timeoutMs,
+    const WW_CANCEL* cancel
+)
+{
+    WCHAR service[8] = L"";
+    _snwprintf_s(service, WW_COUNTOF(service), _TRUNCATE, L"%u", (UINT)port);
+
+    ADDRINFOW hints = WW_STRUCT_NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    PADDRINFOW addresses = NULL;
+    if (WWIsCancelled(cancel) ||
+        0 != GetAddrInfoW(host, service, &hints, &addresses))
+    {
+        return INVALID_SOCKET;
+    }
+
+    WSAEVENT hReady = WSACreateEvent();
+    SOCKET sock = INVALID_SOCKET;
+    for (PADDRINFOW ai = addresses;
+         NULL != ai && INVALID_SOCKET == sock && WSA_INVALID_EVENT != hReady &&
+         !WWIsCancelled(cancel);
+         ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (INVALID_SOCKET == sock)
+        {
+            continue;
+        }
+
+        // Selected before connecting so a quick failure is not missed; this
+        // also makes the socket non-blocking, bounding the attempt
+        BOOL connected = FALSE;
+        if (0 == WSAEventSelect(sock, hReady, FD_CONNECT))
+        {
+            connected = (0 == connect(sock, ai->ai_addr, (int)ai->ai_addrlen));
+            if (!connected && WSAEWOULDBLOCK == WSAGetLastError())
+            {
+                INT soError = 0;
+                int soErrorLen = sizeof(soError);
+                connected = (WWSocketEventWaitW(hReady, timeoutMs, cancel) &&
+                             0 == getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                                             (char*)&soError, &soErrorLen) &&
+                             0 == soError);
+            }
+            WSAEventSelect(sock, NULL, 0);
+        }
+        WSAResetEvent(hReady);
+
+        u_long nonBlocking = 0;
+        if (!connected || 0 != ioctlsocket(sock, FIONBIO, &nonBlocking))
+        {
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+        }
+    }
+
+    if (WSA_INVALID_EVENT != hReady)
+    {
+        WSACloseEvent(hReady);
+    }
+    FreeAddrInfoW(addresses);
+    return sock;
+}
+
+/**
+ * @brief Wait for a socket event object, giving up after timeoutMs or when
+ *        the token is signalled.
+ */
+WW_PRIVATE
+BOOL
+WWSocketEventWaitW(
+    WSAEVENT hReady,
+    DWORD timeoutMs,
+    const WW_CANCEL* cancel
+)
+{
+    HANDLE handles[2] = { hReady, (NULL != cancel) ? cancel->hEvent : NULL };
+    DWORD wait = WaitForMultipleObjects((NULL != cancel) ? 2 : 1, handles,
+                                        FALSE, timeoutMs);
+    return WAIT_OBJECT_0 == wait && !WWIsCancelled(cancel);
+}
+
+/**
+ * @brief Wait until sock is readable, timeoutMs elapses or the token is
+ *        signalled. The socket is left blocking.
+ */
+WW_PRIVATE
+BOOL
+WWSocketWaitW(
+    SOCKET sock,
+    DWORD timeoutMs,
+    const WW_CANCEL* cancel
+)
+{
+    WSAEVENT hReady = WSACreateEvent();
+    if (WSA_INVALID_EVENT == hReady)
+    {
+        return FALSE;
+    }
+
+    BOOL readable = FALSE;
+    if (0 == WSAEventSelect(sock, hReady, FD_READ | FD_CLOSE))
+    {
+        readable = WWSocketEventWaitW(hReady, timeoutMs, cancel);
+        WSAEventSelect(sock, NULL, 0);
+        u_long nonBlocking = 0;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+    }
+    WSACloseEvent(hReady);
+    return readable;
+}
+
+/**
+ * @brief Read the body of a final response the server sent instead of
+ *        100 Continue. It is normally a short error page; at most
+ *        WW_EXPECT_BODY_MAX bytes are kept.
+ */
+WW_PRIVATE
+VOID
+WWExpectReadBodyW(
+    SOCKET sock,
+    const WW_HTTP_PARSER* parser,
+    const CHAR* rest,
+    SIZE_T restLen,
+    DWORD timeoutMs,
+    const WW_CANCEL* cancel,
+    WW_RESPONSEW* response
+)
+{
+    LPBYTE body = (LPBYTE)malloc(WW_EXPECT_BODY_MAX);
+    if (NULL == body)
+    {
+        return;
+    }
+
+    WW_CHUNKED_DECODER chunked = WW_STRUCT_NULL;
+    ULONGLONG wanted = parser->hasContentLength ? parser->contentLength : WW_EXPECT_BODY_MAX;
+    if (wanted > WW_EXPECT_BODY_MAX)
+    {
+        wanted = WW_EXPECT_BODY_MAX;
+    }
+    if (204 == parser->statusCode || 304 == parser->statusCode)
+    {
+        wanted = 0;
+    }
+
+    SIZE_T used = 0;      // Payload bytes at the start of body
+    SIZE_T wire = 0;      // Bytes received after the head
+    BOOL done = (0 == wanted);
+    while (!done)
+    {
+        SIZE_T n = 0;
+        if (restLen > 0)
+        {
+            n = (restLen < WW_EXPECT_BODY_MAX - used) ? restLen : WW_EXPECT_BODY_MAX - used;
+            memcpy(body + used, rest, n);
+            rest += n;
+            restLen -= n;
+        }
+        else if (WWSocketWaitW(sock, timeoutMs, cancel))
+        {
+            int got = recv(sock, (char*)body + used, (int)(WW_EXPECT_BODY_MAX - used), 0);
+            n = (got > 0) ? (SIZE_T)got : 0;
+        }
+        if (0 == n)
+        {
+            break; // Closed, timed out or full: keep what arrived
+        }
+        wire += n;
+
+        if (parser->chunked)
+        {
+            INT result = WWHttpDecodeChunked(&chunked, (CHAR*)body + used, &n);
+            used += n;
+            done = (WW_PARSE_INCOMPLETE != result);
+        }
+        else
+        {
+            used += n;
+            done = (used >= wanted);
+        }
+        done = done || (used >= WW_EXPECT_BODY_MAX);
+    }
+
+    if (!parser->chunked && used > wanted)
+    {
+        used = (SIZE_T)wanted;
+    }
+    response->data = body;
+    response->dataSize = used;
+    response->wireSize = wire;
+    WWMetricsAdd(&g_wwMetrics.bytesDownloaded, used);
+}
+
+/**
+ * @brief Build the header block of a request: the session user agent, the
+ *        content type, the caller's headers, internal extras, Accept-Encoding
+ *        and the framing of a streamed body.
+ *
+ * @return The block (possibly empty), to be freed with free(), or NULL if
+ *         out of memory.
+ */
+WW_PRIVATE
+LPWSTR
+WWBuildRequestHeadersW(
+    const WW_REQUESTW* request,
+    const WW_PRIVATEQUERYW* privateQuery,
+    const WW_UPLOADSTATE* upload
+)
+{
+    WCHAR framing[64] = L"";
+    if (NULL != request->upload)
+    {
+        if (upload->chunked)
+        {
+            wcscpy(framing, L"Transfer-Encoding: chunked\r\n");
+        }
+        else
+        {
+            _snwprintf_s(framing, WW_COUNTOF(framing), _TRUNCATE,
+                         L"Content-Length: %llu\r\n", upload->total);
+        }
+    }
+
+    // The session user agent was fixed at InternetOpen time
+    LPCWSTR userAgent = (NULL != request->session) ? request->userAgent : NULL;
+    LPCWSTR extra = (NULL != privateQuery) ? privateQuery->extraHeaders : NULL;
+    LPCWSTR parts[] = {
+        (NULL != userAgent) ? L"User-Agent: " : NULL, userAgent,
+        (NULL != userAgent) ? L"\r\n" : NULL,
+        (NULL != request->contentType) ? L"Content-Type: " : NULL,
+        request->contentType,
+        (NULL != request->contentType) ? L"\r\n" : NULL,
+        request->headers,
+        extra,
+        request->acceptEncoding ? WW_ACCEPT_ENCODINGW : NULL,
+        framing
+    };
+
+    SIZE_T length = 0;
+    for (SIZE_T i = 0; i < WW_COUNTOF(parts); ++i)
+    {
+        if (NULL != parts[i])
+        {
+            length += wcslen(parts[i]);
+        }
+    }
+
+    LPWSTR block = (LPWSTR)malloc((length + 1) * sizeof(WCHAR));
+    if (NULL == block)
+    {
+        return NULL;
+    }
+    block[0] = L'\0';
+    for (SIZE_T i = 0; i < WW_COUNTOF(parts); ++i)
+    {
+        if (NULL != parts[i])
+        {
+            wcscat(block, parts[i]);
+        }
+    }
+    return block;
+}
+
+/**
+ * @brief Send the request head with Expect: 100-continue on a connection of
+ *        its own and wait for the server's verdict before any of the body is
+ *        sent. WinInet hides interim responses, so the handshake is made over
+ *        Winsock; it covers plain http reached without a proxy.
+ *
+ * The head carries the user agent, Accept and the cookies WinInet would send,
+ * but not the credentials it caches, so only a 413 is taken as the answer to
+ * the real request. Any other verdict is advisory: the request is sent as
+ * usual and the server decides again.
+ *
+ * @param headers     Headers as built for the WinInet request.
+ * @return E_WW_EXPECT_RESULT. On WW_EXPECT_SEND (100 Continue, another
+ *         status, timeout or no handshake possible) the request is sent as
+ *         usual.
+ */
+WW_PRIVATE
+INT
+WWExpectContinueW(
+    HINTERNET hInet,
+    const WW_REQUESTW* request,
+    const URL_COMPONENTSW* urlc,
+    LPCWSTR verb,
+    LPCWSTR headers,
+    const WW_UPLOADSTATE* upload,
+    WW_RESPONSEW* response
+)
+{
+    ULONGLONG bodySize = (NULL != request->upload) ? upload->total : request->bodySize;
+    BOOL chunked = (NULL != request->upload) && upload->chunked;
+    if (0 == request->expectContinueSize ||
+        (!chunked && (0 == bodySize || bodySize < request->expectContinueSize)) ||
+        INTERNET_SCHEME_HTTP != urlc->nScheme ||
+        L'\0' != urlc->lpszUserName[0])
+    {
+        return WW_EXPECT_SEND;
+    }
+
+    union {
+        INTERNET_PROXY_INFO info;
+        BYTE raw[1024];
+    } proxy;
+    DWORD proxyLen = sizeof(proxy);
+    if (FALSE == InternetQueryOptionW(hInet, INTERNET_OPTION_PROXY, &proxy, &proxyLen) ||
+        INTERNET_OPEN_TYPE_DIRECT != proxy.info.dwAccessType)
+    {
+        return WW_EXPECT_SEND;
+    }
+
+    // A preconfigured session reads as direct even when a PAC file or WPAD
+    // picks a proxy per URL, so the system settings must name no proxy at all
+    INTERNET_PER_CONN_OPTIONW perConn = WW_STRUCT_NULL;
+    perConn.dwOption = INTERNET_PER_CONN_FLAGS;
+    INTERNET_PER_CONN_OPTION_LISTW perConnList = WW_STRUCT_NULL;
+    perConnList.dwSize = sizeof(perConnList);
+    perConnList.dwOptionCount = 1;
+    perConnList.pOptions = &perConn;
+    DWORD perConnLen = sizeof(perConnList);
+    if (FALSE == InternetQueryOptionW(NULL, INTERNET_OPTION_PER_CONNECTION_OPTION,
+                                      &perConnList, &perConnLen) ||
+        0 != (perConn.Value.dwValue & (PROXY_TYPE_PROXY | PROXY_TYPE_AUTO_PROXY_URL |
+                                       PROXY_TYPE_AUTO_DETECT)))
+    {
+        return WW_EXPECT_SEND;
+    }
+
+    DWORD timeoutMs = WWDeadlineClampW(request->deadlineMs,
+        (request->expectContinueTimeoutMs > 0) ?
+        request->expectContinueTimeoutMs : WW_DEFAULT_EXPECT_CONTINUE_TIMEOUT);
+    DWORD connectTimeoutMs = WWDeadlineClampW(request->deadlineMs,
+        (request->connectTimeoutMs > 0) ? request->connectTimeoutMs : timeoutMs);
+
+    // Request head, in the same form WinInet would send it
+    LPWSTR wideHead = (LPWSTR)malloc(WW_EXPECT_HEAD_MAX * sizeof(WCHAR));
+    CHAR* head = (CHAR*)malloc(WW_EXPECT_HEAD_MAX);
+    if (NULL == wideHead || NULL == head)
+    {
+        free(wideHead);
+        free(head);
+        return WW_EXPECT_SEND;
+    }
+
+    WCHAR line[64] = L"";
+    wcsncpy(wideHead, verb, WW_EXPECT_HEAD_MAX);
+    wideHead[WW_EXPECT_HEAD_MAX - 1] = L'\0';
+    wcsncat(wideHead, L" ", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    wcsncat(wideHead, urlc->lpszUrlPath, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    wcsncat(wideHead, L" HTTP/1.1\r\nHost: ", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    wcsncat(wideHead, urlc->lpszHostName, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    if (INTERNET_DEFAULT_HTTP_PORT != urlc->nPort)
+    {
+        _snwprintf_s(line, WW_COUNTOF(line), _TRUNCATE, L":%u", (UINT)urlc->nPort);
+        wcsncat(wideHead, line, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    }
+    wcsncat(wideHead, L"\r\nAccept: */*\r\n", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    if (NULL != headers)
+    {
+        wcsncat(wideHead, headers, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    }
+
+    // What WinInet adds on its own: the session's user agent, unless the
+    // headers override it, and the cookies it holds for the URL
+    WCHAR extra[4096] = L"";
+    DWORD extraLen = sizeof(extra);
+    if ((NULL == headers ||
+         FALSE == WWFindHeaderLineW(headers, L"User-Agent", 10, extra,
+                                    WW_COUNTOF(extra))) &&
+        TRUE == InternetQueryOptionW(hInet, INTERNET_OPTION_USER_AGENT, extra, &extraLen) &&
+        L'\0' != extra[0])
+    {
+        wcsncat(wideHead, L"User-Agent: ", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+        wcsncat(wideHead, extra, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+        wcsncat(wideHead, L"\r\n", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    }
+    extraLen = WW_COUNTOF(extra);
+    if (TRUE == InternetGetCookieExW(request->url, NULL, extra, &extraLen,
+                                     INTERNET_COOKIE_HTTPONLY, NULL) &&
+        L'\0' != extra[0])
+    {
+        wcsncat(wideHead, L"Cookie: ", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+        wcsncat(wideHead, extra, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+        wcsncat(wideHead, L"\r\n", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    }
+
+    if (NULL == request->upload)
+    {
+        _snwprintf_s(line, WW_COUNTOF(line), _TRUNCATE,
+                     L"Content-Length: %llu\r\n", bodySize);
+        wcsncat(wideHead, line, WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+    }
+    wcsncat(wideHead, L"Expect: 100-continue\r\n\r\n", WW_EXPECT_HEAD_MAX - wcslen(wideHead) - 1);
+
+    int headLen = WideCharToMultiByte(CP_UTF8, 0, wideHead, -1, head,
+                                      WW_EXPECT_HEAD_MAX, NULL, NULL) - 1;
+    free(wideHead);
+
+    WSADATA wsaData;
+    if (headLen <= 0 || 0 != WSAStartup(MAKEWORD(2, 2), &wsaData))
+    {
+        free(head);
+        return WW_EXPECT_SEND;
+    }
+
+    INT result = WW_EXPECT_SEND;
+    SOCKET sock = WWSocketConnectW(urlc->lpszHostName, urlc->nPort, connectTimeoutMs,
+                                   request->cancel);
+    BOOL sent = (INVALID_SOCKET != sock);
+    if (sent)
+    {
+        WWMetricsAdd(&g_wwMetrics.connectionsOpened, 1);
+    }
+    for (int off = 0; sent && off < headLen; )
+    {
+        int n = send(sock, head + off, headLen - off, 0);
+        sent = (n > 0);
+        off += (n > 0) ? n : 0;
+    }
+
+    // The head buffer is reused for the response
+    WW_HTTP_HEADER parsed[64];
+    WW_HTTP_PARSER parser = WW_STRUCT_NULL;
+    parser.headers = parsed;
+    parser.maxHeaders = WW_COUNTOF(parsed);
+    SIZE_T len = 0;
+    ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+    while (sent)
+    {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline ||
+            FALSE == WWSocketWaitW(sock, (DWORD)(deadline - now), request->cancel))
+        {
+            break; // No answer in time: send the body anyway (RFC 9110 10.1.1)
+        }
+        int got = recv(sock, head + len, (int)(WW_EXPECT_HEAD_MAX - len), 0);
+        if (got <= 0)
+        {
+            break;
+        }
+        len += (SIZE_T)got;
+
+        INT parse = WWHttpParseResponse(&parser, head, len);
+        while (WW_PARSE_OK == parse && parser.statusCode > 100 && parser.statusCode < 200)
+        {
+            // Other interim responses (102, 103) are skipped
+            len -= parser.headerBytes;
+            MoveMemory(head, head + parser.headerBytes, len);
+            ZeroMemory(&parser, sizeof(parser));
+            parser.headers = parsed;
+            parser.maxHeaders = WW_COUNTOF(parsed);
+            parse = WWHttpParseResponse(&parser, head, len);
+        }
+
+        if (WW_PARSE_INCOMPLETE == parse && len < WW_EXPECT_HEAD_MAX)
+        {
+            continue;
+        }
+        if (WW_PARSE_OK != parse || 100 == parser.statusCode)
+        {
+            break;
+        }
+
+        // Only the body size is judged the same without what WinInet would
+        // have added; a 401, 403, 417, redirect or error may not be what the
+        // real request gets, so it is sent and the server decides again
+        if (413 != parser.statusCode)
+        {
+            break;
+        }
+
+        WWMetricsRequestW(NULL, parser.statusCode);
+        response->statusCode = parser.statusCode;
+        if (request->captureHeaders)
+        {
+            response->headers = (LPWSTR)calloc(parser.headerBytes + 1, sizeof(WCHAR));
+            if (NULL != response->headers)
+            {
+                MultiByteToWideChar(CP_UTF8, 0, head, (int)parser.headerBytes,
+                                    response->headers, (int)parser.headerBytes);
+            }
+        }
+        WWExpectReadBodyW(sock, &parser, head + parser.headerBytes,
+                          len - parser.headerBytes, timeoutMs, request->cancel,
+                          response);
+        result = WW_EXPECT_FINAL;
+        break;
+    }
+
+    // The body is never sent on this connection, so it cannot be reused
+    if (INVALID_SOCKET != sock)
+    {
+        closesocket(sock);
+    }
+    WSACleanup();
+    free(head);
+    return result;
+}
+
+WW_PRIVATE
+INT
+WWQueryPerformW(
+    HINTERNET hInet,
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft,
+    WW_PRIVATEQUERYW* privateQuery
+)
+{
+    ULONGLONG hopStartUs = WWGetTimeUs();
+    LPCWSTR verb = request->verb;
+    if (NULL == verb)
+    {
+        verb = L"GET";
+    }
+
+    WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
+    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+    WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
+    WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
+    WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
+
+    URL_COMPONENTSW urlc = {
+        sizeof(urlc),
+        scheme, WW_COUNTOF(scheme),
+        INTERNET_SCHEME_DEFAULT,
+        hostname, WW_COUNTOF(hostname),
+        0,
+        username, WW_COUNTOF(username),
+        password, WW_COUNTOF(password),
+        urlpath, WW_COUNTOF(urlpath),
+        NULL, 0
+    };
+
+    WWTraceBeginW(WW_TRACE_CRACK_URL, NULL);
+    BOOL cracked = InternetCrackUrlW(request->url, 0, 0, &urlc);
+    WWTraceEndW(WW_TRACE_CRACK_URL, 0, !cracked);
+    if (FALSE == cracked)
+    {
+        response->errorcode = WW_ERR_URL_PARSE;
+        return WW_FAILURE;
+    }
+
+    if (urlc.nScheme != INTERNET_SCHEME_HTTP &&
+        urlc.nScheme != INTERNET_SCHEME_HTTPS)
+    {
+        response->errorcode = WW_ERR_UNKNOWN_SCHEME;
+        return WW_FAILURE;
+    }
+
+    WW_UPLOADSTATE upload = WW_STRUCT_NULL;
+    if (NULL != request->upload &&
+        FALSE == WWUploadBeginW(request->upload, &upload))
+    {
+        response->errorcode = WW_ERR_UPLOAD;
+        return WW_FAILURE;
+    }
+
+    WWTraceBeginW(WW_TRACE_CONNECT, NULL);
+    HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
+                                        urlc.lpszUserName, urlc.lpszPassword,
+                                        INTERNET_SERVICE_HTTP, 0, 0);
+    if (NULL == hConn)
+    {
+        WWTraceEndW(WW_TRACE_CONNECT, 0, TRUE);
+        response->errorcode = WW_ERR_INTERNET_CONN;
+        return WW_FAILURE;
+    }
+
+    DWORD dwFlags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
+                    INTERNET_FLAG_NO_AUTO_REDIRECT | INTERNET_FLAG_NO_UI;
+
+    if (INTERNET_SCHEME_HTTPS == urlc.nScheme)
+    {
+        dwFlags |= INTERNET_FLAG_SECURE;
+    }
+
+    // Session handles stay open between calls, so ask WinInet to keep the
+    // socket (or HTTP/2 connection) around for the next request.
+    if (NULL != request->session)
+    {
+        dwFlags |= INTERNET_FLAG_KEEP_CONNECTION;
+    }
+
+    LPCWSTR rgpszAcceptTypes[] = { L"*/*", NULL };
+
+    // WinInet only reports the phases of a handle with a context
+    WW_PHASECLOCK* clock = WWClockOpenW(hopStartUs,
+                                        INTERNET_SCHEME_HTTPS == urlc.nScheme);
+    HINTERNET hReq = HttpOpenRequestW(hConn, verb, urlc.lpszUrlPath,
+                                       NULL, NULL, rgpszAcceptTypes,
+                                       dwFlags, (DWORD_PTR)clock);
+    WWTraceEndW(WW_TRACE_CONNECT, 0, NULL == hReq);
+    if (NULL == hReq)
+    {
+        response->errorcode = WW_ERR_HTTP_REQUEST;
+        InternetCloseHandle(hConn);
+        WWClockCloseW(clock, &response->timings);
+        return WW_FAILURE;
+    }
+    WWClockAttachW(clock, hReq);
+
+    // A hedge that already lost must not start sending. A hedge copy keeps
+    // its handle where the winner can close it; the token closes it there.
+    WW_HEDGELEGW* hedge = (NULL != privateQuery) ? privateQuery->hedge : NULL;
+    BOOL lost = (NULL != hedge && FALSE == WWHedgePublishW(hedge, hReq));
+    WW_CANCELREG cancelReg;
+    if (FALSE == WWCancelAttach(request->cancel, request->deadlineMs, &cancelReg,
+                                hReq, (NULL != hedge) ? &hedge->hActive : NULL))
+    {
+        response->errorcode = WWIsCancelled(request->cancel) ? WW_ERR_CANCELLED :
+                                                               WW_ERR_TIMEOUT;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+    if (lost)
+    {
+        response->errorcode = WW_ERR_HTTP_REQUEST;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    // Each hop gets only what is left of the deadline
+    DWORD connectTimeoutMs = WWDeadlineClampW(request->deadlineMs, request->connectTimeoutMs);
+    DWORD sendTimeoutMs = WWDeadlineClampW(request->deadlineMs, request->sendTimeoutMs);
+    DWORD receiveTimeoutMs = WWDeadlineClampW(request->deadlineMs, request->receiveTimeoutMs);
+    if (connectTimeoutMs > 0) {
+        InternetSetOptionW(hReq, INTERNET_OPTION_CONNECT_TIMEOUT,
+                           &connectTimeoutMs, sizeof(connectTimeoutMs));
+    }
+    if (sendTimeoutMs > 0) {
+        InternetSetOptionW(hReq, INTERNET_OPTION_SEND_TIMEOUT,
+                        &sendTimeoutMs, sizeof(sendTimeoutMs));
+    }
+    if (receiveTimeoutMs > 0) {
+        InternetSetOptionW(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT,
+                           &receiveTimeoutMs, sizeof(receiveTimeoutMs));
+    }
+    
+    // Build headers string
+    LPWSTR headerBuf = WWBuildRequestHeadersW(request, privateQuery, &upload);
+    if (NULL == headerBuf)
+    {
+        response->errorcode = WW_ERR_MALLOC;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+    LPCWSTR pHeaders = (L'\0' != headerBuf[0]) ? headerBuf : NULL;
+    DWORD headersLen = (DWORD)wcslen(headerBuf);
+
+    INT expect = WWExpectContinueW(hInet, request, &urlc, verb, pHeaders, &upload,
+                                   response);
+    if (WWIsCancelled(request->cancel))
+    {
+        // The token cut the handshake short; nothing more may go out
+        free(headerBuf);
+        response->errorcode = WW_ERR_CANCELLED;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+    if (WW_EXPECT_FINAL == expect)
+    {
+        free(headerBuf);
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_SUCCESS;
+    }
+
+    INT sendError = WW_ERR_NOERROR;
+    WWTraceBeginW(WW_TRACE_SEND, NULL);
+    if (NULL != request->upload)
+    {
+        sendError = WWUploadSendW(hReq, pHeaders, headersLen, &upload);
+    }
+    else if (FALSE == HttpSendRequestW(hReq, pHeaders, headersLen,
+                                        (LPVOID)request->body, request->bodySize))
+    {
+        sendError = WW_ERR_HTTP_REQUEST;
+    }
+    WWTraceEndW(WW_TRACE_SEND, (NULL != request->upload) ? upload.sent : request->bodySize,
+                WW_ERR_NOERROR != sendError);
+    free(headerBuf);
+
+    if (WW_ERR_NOERROR != sendError)
+    {
+        response->errorcode = sendError;
+        WWLogW(request->logEnabled, WW_LOG_WININET, NULL);
+        WWMetricsRequestW(clock, 0);
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    WWClockMarkW(clock, WW_PHASE_HEADERS);
+    response->sentSize = (NULL != request->upload) ? upload.sent : request->bodySize;
+    if (NULL == request->upload)
+    {
+        // Streamed bodies are counted per block as they go out
+        WWMetricsAdd(&g_wwMetrics.bytesUploaded, request->bodySize);
+    }
+
+    // Get status code
+    DWORD dwStatusCode = 0;
+    DWORD dwQueryLen = sizeof(dwStatusCode);
+    WWTraceBeginW(WW_TRACE_HEADERS, NULL);
+    if (FALSE == HttpQueryInfoW(hReq,
+                                 HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+                                 &dwStatusCode, &dwQueryLen, 0))
+    {
+        WWTraceEndW(WW_TRACE_HEADERS, 0, TRUE);
+        response->errorcode = WW_ERR_HTTP_QUERY_INFO;
+        WWMetricsRequestW(clock, 0);
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    response->statusCode = dwStatusCode;
+    WWMetricsRequestW(clock, dwStatusCode);
+
+    DWORD dwProtocol = 0;
+    DWORD dwProtocolLen = sizeof(dwProtocol);
+    if (InternetQueryOptionW(hReq, INTERNET_OPTION_HTTP_PROTOCOL_USED,
+                             &dwProtocol, &dwProtocolLen))
+    {
+        response->http2 = (dwProtocol & HTTP_PROTOCOL_FLAG_HTTP2) ? TRUE : FALSE;
+    }
+    WWTraceEndW(WW_TRACE_HEADERS, 0, FALSE);
+
+    // Handle redirects
+    if (WWIsRedirectStatus(dwStatusCode))
+    {
+        WCHAR location[INTERNET_MAX_URL_LENGTH] = L"";
+        WCHAR redirectUrl[INTERNET_MAX_URL_LENGTH] = L"";
+        DWORD locationLen = sizeof(location);
+        if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION,
+                                     location, &locationLen, 0) ||
+            FALSE == WWResolveRedirectW(request->url, location,
+                                        redirectUrl, WW_COUNTOF(redirectUrl)))
+        {
+            response->errorcode = WW_ERR_HTTP_QUERY_INFO;
+            WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+            return WW_FAILURE;
+        }
+
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+
+        if (0 == redirectsLeft)
+        {
+            response->errorcode = WW_ERR_REDIRS_EXCEEDED;
+            return WW_FAILURE;
+        }
+        WWClockRedirectW(&response->timings, hopStartUs);
+
+        // The body goes out again; a callback source cannot be replayed
+        if (NULL != request->upload && FALSE == WWUploadRewindW(&upload))
+        {
+            response->errorcode = WW_ERR_UPLOAD;
+            return WW_FAILURE;
+        }
+
+        WW_REQUESTW redirectReq = *request;
+        redirectReq.url = redirectUrl;
+        WWTraceBeginW(WW_TRACE_REDIRECT, redirectUrl);
+        INT result = WWQueryPerformW(hInet, &redirectReq, response,
+                                     redirectsLeft - 1, privateQuery);
+        WWTraceEndW(WW_TRACE_REDIRECT, response->dataSize, WW_SUCCESS != result);
+        return result;
+    }
+
+    if (NULL != privateQuery && NULL != privateQuery->hedge &&
+        FALSE == WWHedgeHeadersW(privateQuery->hedge))
+    {
+        response->errorcode = WW_ERR_HTTP_REQUEST;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    if (NULL != privateQuery)
+    {
+        WWCaptureCacheInfoW(hReq, privateQuery);
+    }
+
+    WW_INFLATE* decoder = NULL;
+    if (request->acceptEncoding && WW_FAILURE == WWOpenDecoderW(hReq, &decoder))
+    {
+        response->errorcode = WW_ERR_DECODE;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    // Read response body
+    SIZE_T bufCapacity = 0x10000; // 64 KiB initial
+    SIZE_T bufUsed = 0;
+    LPBYTE buf = (LPBYTE)malloc(bufCapacity);
+    if (NULL == buf)
+    {
+        free(decoder);
+        response->errorcode = WW_ERR_MALLOC;
+        WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+        return WW_FAILURE;
+    }
+
+    DWORD bytesRead = 0;
+    while (TRUE)
+    {
+        WWTraceBeginW(WW_TRACE_READ, NULL);
+        BOOL retRead = WWReadBodyW(hReq, decoder, buf + bufUsed,
+                                   (DWORD)(bufCapacity - bufUsed), &bytesRead);
+        WWTraceEndW(WW_TRACE_READ, retRead ? bytesRead : 0, !retRead);
+        if (FALSE == retRead)
+        {
+            free(buf);
+            response->errorcode = (NULL != decoder && !decoder->failed) ?
+                                  WW_ERR_DECODE : WW_ERR_HTTP_REQUEST;
+            free(decoder);
+            WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+            return WW_FAILURE;
+        }
+
+        if (0 == bytesRead)
+        {
+            break;
+        }
+
+        WWMetricsAdd(&g_wwMetrics.bytesDownloaded, bytesRead);
+        bufUsed += bytesRead;
+
+        if (bufUsed >= bufCapacity)
+        {
+            bufCapacity *= 2;
+            LPBYTE newBuf = (LPBYTE)realloc(buf, bufCapacity);
+            if (NULL == newBuf)
+            {
+                free(buf);
+                free(decoder);
+                response->errorcode = WW_ERR_MALLOC;
+                WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+                return WW_FAILURE;
+            }
+            buf = newBuf;
+        }
+    }
+
+    WWClockMarkW(clock, WW_PHASE_BODY);
+    response->data = buf;
+    response->dataSize = bufUsed;
+    response->wireSize = (NULL != decoder) ? decoder->wireBytes : bufUsed;
+    free(decoder);
+
+    if (request->captureHeaders)
+    {
+        DWORD headersSize = 0;
+        HttpQueryInfoW(hReq, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &headersSize, 0);
+        response->headers = (LPWSTR)calloc(1, headersSize + sizeof(WCHAR));
+        if (NULL != response->headers &&
+            FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_RAW_HEADERS_CRLF,
+                                    response->headers, &headersSize, 0))
+        {
+            response->headers[0] = L'\0';
+        }
+    }
+
+    WWQueryCloseW(request->cancel, &cancelReg, hConn, clock, response);
+
+    return WW_SUCCESS;
+}
+
+/**
+ * @brief Whether a download must stop: it was cancelled or its deadline
+ *        has passed.
+ */
+WW_PRIVATE
+BOOL
+WWIsDownloadStoppedW(
+    const WW_PARAMSW* userParams
+)
+{
+    return (userParams->pCancelFlag && *userParams->pCancelFlag) ||
+           WWIsCancelled(userParams->cancel) ||
+           WWDeadlinePassed(userParams->deadlineMs);
+}
+
+/**
+ * @brief Whether a failed download attempt may be retried.
+ */
+WW_PRIVATE
+BOOL
+WWIsRetryableDownloadW(
+    const WW_PARAMSW* userParams,
+    const WW_PRIVATEPARAMSW* privateParams
+)
+{
+    DWORD retryOn = userParams->retry.retryOn;
+    if (0 == retryOn)
+    {
+        retryOn = WW_RETRY_DEFAULT;
+    }
+
+    if (WWIsDownloadStoppedW(userParams))
+    {
+        return FALSE;
+    }
+    if (WW_ERR_HTTP_STATUS == userParams->errorcode)
+    {
+        return WWIsRetryableStatusW(privateParams->statusCode, retryOn);
+    }
+    return (retryOn & WW_RETRY_NETWORK) &&
+           (WW_ERR_INTERNET_CONN == userParams->errorcode ||
+            WW_ERR_HTTP_REQUEST == userParams->errorcode ||
+            WW_ERR_STALLED == userParams->errorcode);
+}
+
+/**
+ * @brief Bytes kept in the temporary file of an interrupted HTTP(S)
+ *        download, or 0 to start over.
+ */
+WW_PRIVATE
+ULONGLONG
+WWResumeOffsetW(
+    const WW_PRIVATEPARAMSW* privateParams
+)
+{
+    // Without a validator, If-Range cannot tell whether the entity changed.
+    // Segmented downloads resume from their journal instead.
+    if (privateParams->segmented || L'\0' == privateParams->validator[0] ||
+        L'\0' == privateParams->fullFilePath[0])
+    {
+        return 0;
+    }
+
+    WCHAR filePathTemp[MAX_PATH] = L"";
+    wcsncpy(filePathTemp, privateParams->fullFilePath,
+            WW_STR_SYMSW(filePathTemp));
+    wcsncat(filePathTemp, L"~", WW_STR_SYMSW(filePathTemp));
+
+    HANDLE hft = CreateFileW(filePathTemp, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == hft)
+    {
+        return 0;
+    }
+    LARGE_INTEGER liSize = WW_STRUCT_NULL;
+    if (FALSE == GetFileSizeEx(hft, &liSize))
+    {
+        liSize.QuadPart = 0;
+    }
+    CloseHandle(hft);
+    return (ULONGLONG)liSize.QuadPart;
+}
+
+/**
+ * @brief Record the validator If-Range will send: the ETag if it is strong,
+ *        the Last-Modified date otherwise.
+ */
+WW_PRIVATE
+VOID
+WWCaptureValidatorW(
+    HINTERNET hReq,
+    LPWSTR validator,
+    DWORD validatorCch
+)
+{
+    DWORD len = validatorCch * sizeof(WCHAR);
+    if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_ETAG, validator, &len, NULL) &&
+        0 != wcsncmp(validator, L"W/", 2))
+    {
+        return;
+    }
+    len = validatorCch * sizeof(WCHAR);
+    if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_LAST_MODIFIED, validator,
+                                &len, NULL))
+    {
+        validator[0] = L'\0';
+    }
+}
+
+WW_PRIVATE
+INT
+WWDownloadProcessW(
+                   WW_PARAMSW* userParams, 
+                   WW_PRIVATEPARAMSW* privateParams
+                  ) 
+{
+    if (privateParams->redirectCount > userParams->maxRedirectLimit) 
+    {
+        userParams->errorcode = WW_ERR_REDIRS_EXCEEDED;
+        WWLogW(userParams->logEnabled, WW_LOG_REDIRS_EXCEEDED, NULL);
+        return WW_FAILURE;
+    }
+
+    WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
+    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+    WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
+    WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
+    WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
+
+    URL_COMPONENTSW urlc = {
+        sizeof(urlc),
+        scheme, WW_COUNTOF(scheme),
+        INTERNET_SCHEME_DEFAULT,
+        hostname, WW_COUNTOF(hostname),
+        0,
+        username, WW_COUNTOF(username),
+        password, WW_COUNTOF(password),
+        urlpath, WW_COUNTOF(urlpath),
+        NULL, 0
+    };
+
+    // Crack the URL
+    WWTraceBeginW(WW_TRACE_CRACK_URL, NULL);
+    BOOL cracked = InternetCrackUrlW(userParams->url, 0, 0, &urlc);
+    WWTraceEndW(WW_TRACE_CRACK_URL, 0, !cracked);
+    if (FALSE == cracked)
+    {
+        userParams->status = WW_ERR_URL_PARSE;
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        return WW_FAILURE;
+    }
+
+    DWORD dwService = 0;
+    DWORD dwFlags = 0;
+
+    switch (urlc.nScheme)
+    {
+        case INTERNET_SCHEME_FTP:
+            dwService = INTERNET_SERVICE_FTP;
+            dwFlags = INTERNET_FLAG_PASSIVE;
+            break;
+        case INTERNET_SCHEME_HTTP:
+        case INTERNET_SCHEME_HTTPS:
+            dwService = INTERNET_SERVICE_HTTP;
+            break;
+        default:
+            userParams->errorcode = WW_ERR_UNKNOWN_SCHEME;
+            WWLogW(userParams->logEnabled, WW_LOG_UNKNOWN_SCHEME, 
+                   urlc.lpszScheme);
+            return WW_FAILURE;
+            break;
+    }
+
+    // Initialize WinINet
+    WWTraceBeginW(WW_TRACE_CONNECT, NULL);
+    HINTERNET hInet = InternetOpenW(userParams->userAgent,
+                                    INTERNET_OPEN_TYPE_PRECONFIG,
+                                    NULL, NULL, 0);
+    if (NULL == hInet)
+    {
+        WWTraceEndW(WW_TRACE_CONNECT, 0, TRUE);
+        userParams->errorcode = WW_ERR_WININET_INIT;
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        return WW_FAILURE;
+    }
+
+    // FTP logs in and looks the file up before there is a file handle to
+    // close, so the token and the deadline close the session instead, which
+    // aborts whatever call is blocked on it
+    BOOL ftp = (INTERNET_SCHEME_FTP == urlc.nScheme);
+    WW_CANCELREG cancelReg;
+    if (ftp && FALSE == WWCancelAttach(userParams->cancel, userParams->deadlineMs,
+                                       &cancelReg, hInet, NULL))
+    {
+        WWTraceEndW(WW_TRACE_CONNECT, 0, TRUE);
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return WW_FAILURE;
+    }
+
+    // Connect to the server
+    HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
+                                       urlc.lpszUserName, urlc.lpszPassword,
+                                       dwService, dwFlags, 0);
+    WWTraceEndW(WW_TRACE_CONNECT, 0, NULL == hConn);
+
+    if (NULL == hConn)
+    {
+        userParams->errorcode = WW_ERR_INTERNET_CONN;
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        if (ftp)
+        {
+            WWCancelRelease(userParams->cancel, &cancelReg);
+        }
+        else
+        {
+            InternetCloseHandle(hInet);
+        }
+        return WW_FAILURE;
+    }
+
+    INT iResult = WW_FAILURE;
+    privateParams->hInet = hInet;
+
+    // Process the download based on the URL scheme
+    switch (urlc.nScheme) 
+    {
+        case INTERNET_SCHEME_FTP:
+            iResult = WWProcessFtpW(&urlc, hConn, userParams, privateParams);
+            break;
+        case INTERNET_SCHEME_HTTP:
+        case INTERNET_SCHEME_HTTPS:
+            iResult = WWProcessHttpW(&urlc, hConn, userParams, privateParams);
+            // A redirect closed the clock of its own hop already
+            WWClockCloseW(privateParams->clock,
+                          &userParams->progressBarData.timings);
+            privateParams->clock = NULL;
+            break;
+        default:
+            break;
+    }
+
+    // Close the handles
+    InternetCloseHandle(hConn);
+    if (ftp)
+    {
+        WWCancelRelease(userParams->cancel, &cancelReg);
+    }
+    else
+    {
+        InternetCloseHandle(hInet);
+    }
+    return iResult;
+}
+
+WW_PRIVATE
+INT 
+WWProcessHttpW(
+               URL_COMPONENTSW* ptrUrlC, 
+               HINTERNET hConn,
+               WW_PARAMSW* userParams,
+               WW_PRIVATEPARAMSW* privateParams
+              )
+{
+    // Check if URL_COMPONENTSW pointer is NULL
+    if (NULL == ptrUrlC)
+    {
+        userParams->errorcode = WW_ERR_EMPTY_URLC;
+        return WW_FAILURE;
+    }
+
+    DWORD dwFlags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
+                    INTERNET_FLAG_NO_AUTO_REDIRECT | INTERNET_FLAG_NO_COOKIES |
+                    INTERNET_FLAG_NO_UI;
+
+    if (INTERNET_SCHEME_HTTPS == ptrUrlC->nScheme)
+    {
+        dwFlags = (dwFlags | INTERNET_FLAG_SECURE);
+    }
+
+    // Set the accept types for the HTTP request
+    LPCWSTR rgpszAcceptTypes[] = { L"*/*", NULL };
+
+    // Build optional Range header for resuming a partial download
+    WCHAR rangeHeader[640] = L"";
+    DWORD rangeHeaderLen  = 0;
+    if (userParams->resumeOffset > 0)
+    {
+        _snwprintf_s(rangeHeader, WW_COUNTOF(rangeHeader), _TRUNCATE,
+                     L"Range: bytes=%I64u-\r\n", userParams->resumeOffset);
+        // The server sends the whole entity instead if it has changed
+        if (L'\0' != privateParams->validator[0])
+        {
+            wcsncat(rangeHeader, L"If-Range: ", WW_STR_SYMSW(rangeHeader));
+            wcsncat(rangeHeader, privateParams->validator,
+                    WW_STR_SYMSW(rangeHeader));
+            wcsncat(rangeHeader, L"\r\n", WW_STR_SYMSW(rangeHeader));
+        }
+    }
+    else if (privateParams->hasCachedSlot)
+    {
+        // Revalidate the stale disk cache entry instead of downloading blindly
+        WWBuildConditionalW(privateParams->cachedSlot.etag,
+                            privateParams->cachedSlot.lastModified,
+                            rangeHeader, WW_COUNTOF(rangeHeader));
+    }
+    // A compressed body cannot be resumed at a decoded offset
+    if (userParams->acceptEncoding && 0 == userParams->resumeOffset)
+    {
+        wcsncat(rangeHeader, WW_ACCEPT_ENCODINGW, WW_STR_SYMSW(rangeHeader));
+    }
+    rangeHeaderLen = (DWORD)wcslen(rangeHeader);
+
+    // Open an HTTP request handle and send the request
+    ULONGLONG hopStartUs = WWGetTimeUs();
+    privateParams->clock = WWClockOpenW(hopStartUs,
+                                        INTERNET_SCHEME_HTTPS == ptrUrlC->nScheme);
+    HINTERNET hReq = HttpOpenRequestW(hConn, NULL,
+                                      ptrUrlC->lpszUrlPath, NULL, NULL,
+                                      rgpszAcceptTypes, dwFlags,
+                                      (DWORD_PTR)privateParams->clock);
+    if (NULL != hReq)
+    {
+        WWClockAttachW(privateParams->clock, hReq);
+    }
+
+    // Connecting may take no longer than the deadline leaves
+    if (NULL != hReq && 0 != userParams->deadlineMs)
+    {
+        DWORD leftMs = WWDeadlineClampW(userParams->deadlineMs, 0);
+        InternetSetOption(hReq, INTERNET_OPTION_CONNECT_TIMEOUT, &leftMs, sizeof(leftMs));
+        InternetSetOption(hReq, INTERNET_OPTION_SEND_TIMEOUT, &leftMs, sizeof(leftMs));
+    }
+
+    // From here on hReq is closed through the token or the deadline timer,
+    // which may close it first
+    WW_CANCELREG cancelReg;
+    BOOL sent = (NULL != hReq &&
+                 WWCancelAttach(userParams->cancel, userParams->deadlineMs,
+                                &cancelReg, hReq, NULL));
+    if (sent)
+    {
+        WWTraceBeginW(WW_TRACE_SEND, NULL);
+        sent = HttpSendRequestW(hReq,
+            rangeHeaderLen > 0 ? rangeHeader : NULL,
+            rangeHeaderLen, NULL, 0);
+        WWTraceEndW(WW_TRACE_SEND, 0, !sent);
+        if (!sent)
+        {
+            WWMetricsRequestW(privateParams->clock, 0);
+        }
+    }
+    if (FALSE == sent)
+    {
+        userParams->errorcode = WW_ERR_HTTP_REQUEST;
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        if (hReq != NULL)
+        {
+            WWCancelRelease(userParams->cancel, &cancelReg);
+        }
+        return WW_FAILURE;
+    }
+
+    // The progress callback sees the phases up to the headers from here on
+    WWClockMarkW(privateParams->clock, WW_PHASE_HEADERS);
+    WWClockReadW(privateParams->clock, &userParams->progressBarData.timings);
+
+    DWORD dwQueryLength = 0;
+    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
+    dwQueryLength = userParams->headerLength;
+    WWTraceBeginW(WW_TRACE_HEADERS, NULL);
+    if (HttpQueryInfoW(hReq,
+        HTTP_QUERY_RAW_HEADERS_CRLF |
+        HTTP_QUERY_FLAG_REQUEST_HEADERS,
+        privateParams->szHeader, &dwQueryLength, 0) == FALSE) {
+        WWTraceEndW(WW_TRACE_HEADERS, 0, TRUE);
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        WWMetricsRequestW(privateParams->clock, 0);
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return WW_FAILURE;
+    }
+
+    WWLogW(userParams->logEnabled, WW_LOG_HEADER, privateParams->szHeader);
+
+    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
+    dwQueryLength = userParams->headerLength;
+    if (HttpQueryInfoW(hReq, HTTP_QUERY_RAW_HEADERS_CRLF,
+        privateParams->szHeader, &dwQueryLength, 0) == FALSE) {
+        WWTraceEndW(WW_TRACE_HEADERS, 0, TRUE);
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        WWMetricsRequestW(privateParams->clock, 0);
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return WW_FAILURE;
+    }
+
+    WWLogW(userParams->logEnabled, WW_LOG_HEADER, privateParams->szHeader);
+
+    DWORD dwStatusCode = 0;
+    dwQueryLength = sizeof(dwStatusCode);
+
+    if (HttpQueryInfoW(hReq, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+        &dwStatusCode, &dwQueryLength, 0) == FALSE) {
+        WWTraceEndW(WW_TRACE_HEADERS, 0, TRUE);
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        WWMetricsRequestW(privateParams->clock, 0);
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return FALSE;
+    }
+    WWTraceEndW(WW_TRACE_HEADERS, 0, FALSE);
+    privateParams->statusCode = dwStatusCode;
+    WWMetricsRequestW(privateParams->clock, dwStatusCode);
+
+    // Handle different HTTP status codes
+    switch (dwStatusCode)
+    {
+        case HTTP_STATUS_OK:            // 200 - server may have ignored Range
+            userParams->resumeOffset = 0;
+            WWCaptureValidatorW(hReq, privateParams->validator,
+                                WW_COUNTOF(privateParams->validator));
+            break;
+        case 206:                       // HTTP_STATUS_PARTIAL_CONTENT - resume honoured
+            // The range must start exactly where the temporary file ends
+            ZeroMemory(privateParams->szHeader, privateParams->headerSize);
+            dwQueryLength = userParams->headerLength;
+            if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_RANGE,
+                                       privateParams->szHeader,
+                                       &dwQueryLength, 0) &&
+                userParams->resumeOffset != _wcstoui64(privateParams->szHeader +
+                    wcscspn(privateParams->szHeader, L"0123456789"), NULL, 10))
+            {
+                userParams->errorcode = WW_ERR_HTTP_STATUS;
+                WWCancelRelease(userParams->cancel, &cancelReg);
+                return WW_FAILURE;
+            }
+            if (L'\0' == privateParams->validator[0])
+            {
+                WWCaptureValidatorW(hReq, privateParams->validator,
+                                    WW_COUNTOF(privateParams->validator));
+            }
+            break;
+        case HTTP_STATUS_NOT_MODIFIED:  // stale disk cache entry is still valid
+            if (FALSE == privateParams->hasCachedSlot)
+            {
+                WWCancelRelease(userParams->cancel, &cancelReg);
+                return WW_FAILURE;
+            }
+            WWCaptureCacheInfoW(hReq, &privateParams->cacheInfo);
+            WWCancelRelease(userParams->cancel, &cancelReg);
+            WWDiskCacheRefreshW(userParams->diskCache, privateParams->cacheUrl,
+                                &privateParams->cachedSlot,
+                                &privateParams->cacheInfo);
+            return WWDiskCachePlaceDownloadW(userParams, privateParams,
+                                             &privateParams->cachedSlot);
+            break;
+        case HTTP_STATUS_MOVED:
+        case HTTP_STATUS_REDIRECT:
+        case HTTP_STATUS_REDIRECT_METHOD:
+        case HTTP_STATUS_REDIRECT_KEEP_VERB:
+            // Handle redirect scenarios
+            ZeroMemory(privateParams->szHeader, privateParams->headerSize);
+            dwQueryLength = userParams->headerLength;
+            if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION, 
+                                        privateParams->szHeader,
+                                        &dwQueryLength, 0))
+            {
+                userParams->errorcode = WW_ERR_HTTP_QUERY_INFO;
+                WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+                WWCancelRelease(userParams->cancel, &cancelReg);
+                return WW_FAILURE;
+            }
+            // hConn is closed by the caller once the redirect returns
+            WWCancelRelease(userParams->cancel, &cancelReg);
+            WWClockCloseW(privateParams->clock, NULL);
+            privateParams->clock = NULL;
+            WWClockRedirectW(&userParams->progressBarData.timings, hopStartUs);
+            userParams->url = privateParams->szHeader;
+            {
+                WWTraceBeginW(WW_TRACE_REDIRECT, userParams->url);
+                INT iStatus = WWDownloadProcessW(userParams, privateParams);
+                WWTraceEndW(WW_TRACE_REDIRECT,
+                            userParams->progressBarData.szDownloadedInBytes,
+                            WW_SUCCESS != iStatus);
+                return iStatus;
+            }
+            break;
+        default:
+            // Handle other HTTP status codes
+            userParams->errorcode = WW_ERR_HTTP_STATUS;
+            if (429 == dwStatusCode ||
+                HTTP_STATUS_SERVICE_UNAVAIL == dwStatusCode)
+            {
+                // Only the delay-seconds form; an HTTP-date is ignored
+                DWORD retryAfter = 0;
+                dwQueryLength = sizeof(retryAfter);
+                if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_RETRY_AFTER |
+                                           HTTP_QUERY_FLAG_NUMBER,
+                                           &retryAfter, &dwQueryLength, 0))
+                {
+                    privateParams->retryAfterMs =
+                        (retryAfter < 86400 ? retryAfter : 86400) * 1000;
+                }
+            }
+            WWCancelRelease(userParams->cancel, &cancelReg);
+            return WW_FAILURE;
+            break;
+    }
+
+
+    // Try to get filename and path from URL contents
+    if (WW_FAILURE == \
+            WWMakeDownloadPathW(ptrUrlC->lpszUrlPath, 
+                                privateParams->capturedFileName,
+                                WW_COUNTOF(privateParams->capturedFileName)))
+    {
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return WW_FAILURE;
+    }
+    // Try to get filename and path from content disposition header
+    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
+    dwQueryLength = userParams->headerLength;
+
+    if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_DISPOSITION,
+                               privateParams->szHeader, &dwQueryLength, 0))
+    {
+        LPWSTR pattachment = wcsstr(privateParams->szHeader, L"attachment;");
+        if (NULL != pattachment)
+        {
+            LPWSTR pfilename = wcsstr(pattachment, L"filename");
+            if (NULL != pfilename)
+            {
+                // Extract the filename from the content disposition
+                size_t ipath = wcsspn(pfilename + 8, L" =\"");
+                LPWSTR pcontent = pfilename + 8 + ipath;
+                LPWSTR pch = pcontent;
+                pch = wcspbrk(pch, L";\"");
+                if (NULL != pch)
+                {
+                    *pch = L'\0';
+                }
+                pch = pcontent;
+                while ((pch = wcspbrk(pch, L"\\/:*?\"<>|")) != NULL)
+                {
+                    *pch = L'_';
+                }
+                if (wcslen(pcontent) != 0)
+                {
+                    // Use the extracted filename as the local path
+                    wcsncpy(privateParams->capturedFileName, pcontent, 
+                            WW_COUNTOF(privateParams->capturedFileName));
+                }
+            }
+        }
+    }
+
+    // Content-Length is optional (absent with chunked transfer / CDN responses).
+    // If the header is missing, lDataLength stays 0 and the download still proceeds;
+    // the progress callback will receive total=0 in that case. It is read as a
+    // string because HTTP_QUERY_FLAG_NUMBER truncates lengths above 4 GiB.
+    LONGLONG lDataLength = 0;
+    {
+        WCHAR szCL[32] = L"";
+        DWORD dwCLSize = sizeof(szCL);
+        if (HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_LENGTH, szCL, &dwCLSize, NULL))
+            lDataLength = (LONGLONG)_wcstoui64(szCL, NULL, 10);
+    }
+    FILETIME ftLastModified = WW_STRUCT_NULL;
+    SYSTEMTIME stLastModified = WW_STRUCT_NULL;
+    dwQueryLength = sizeof(stLastModified);
+    if (TRUE == HttpQueryInfoW(hReq,
+                                HTTP_QUERY_LAST_MODIFIED | 
+                                HTTP_QUERY_FLAG_SYSTEMTIME,
+                                &stLastModified, &dwQueryLength, 0)) 
+    {
+        SystemTimeToFileTime(&stLastModified, &ftLastModified);
+    }
+
+    // Apply per-request receive timeout so InternetReadFile returns promptly
+    // when the connection is silently dropped (e.g. cable unplugged).
+    DWORD timeout = WWReceiveTimeoutW(userParams);
+    if (timeout > 0)
+    {
+        InternetSetOption(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT, &timeout, sizeof(timeout));
+    }
+
+    // Decode a compressed body on its way to disk
+    if (userParams->acceptEncoding && HTTP_STATUS_OK == dwStatusCode &&
+        WW_FAILURE == WWOpenDecoderW(hReq, &privateParams->decoder))
+    {
+        userParams->errorcode = WW_ERR_DECODE;
+        WWCancelRelease(userParams->cancel, &cancelReg);
+        return WW_FAILURE;
+    }
+
+    privateParams->hostRate = WWRateLimitHostW(ptrUrlC->lpszHostName);
+
+    // Fetch the body as ranges when asked to and the server allows it
+    if ((userParams->segments > 1 || userParams->journal ||
+         userParams->mirrorCount > 0) &&
+        HTTP_STATUS_OK == dwStatusCode && NULL == privateParams->decoder &&
+        lDataLength > 0 && L'\0' != privateParams->validator[0])
+    {
+        WCHAR acceptRanges[32] = L"";
+        dwQueryLength = sizeof(acceptRanges);
+        if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_ACCEPT_RANGES, acceptRanges,
+                                   &dwQueryLength, 0) &&
+            0 == _wcsicmp(acceptRanges, L"bytes"))
+        {
+            INT iStatus = WWRetrieveSegmentsW(hConn, hReq, &cancelReg,
+                                              ptrUrlC->lpszUrlPath, dwFlags,
+                                              (ULONGLONG)lDataLength,
+                                              &ftLastModified, userParams,
+                                              privateParams);
+            if (WW_SUCCESS == iStatus)
+            {
+                WWClockMarkW(privateParams->clock, WW_PHASE_BODY);
+            }
+            WWCancelRelease(userParams->cancel, &cancelReg);
+            return iStatus;
+        }
+    }
+
+    // Full responses are hashed on the way to disk so they can be cached
+    if (NULL != userParams->diskCache && HTTP_STATUS_OK == dwStatusCode)
+    {
+        WWCaptureCacheInfoW(hReq, &privateParams->cacheInfo);
+        privateParams->hashContent = TRUE;
+    }
+
+    // Expose hReq so an external watchdog can InternetCloseHandle it to abort a stalled read.
+    if (userParams->pActiveHandle)
+        *userParams->pActiveHandle = hReq;
+
+    // Retrieve the data and write it to disk
+    INT iStatus = WWRetrieveDataW(hReq, lDataLength, &ftLastModified,
+                                  userParams, privateParams);
+    if (WW_SUCCESS == iStatus)
+    {
+        WWClockMarkW(privateParams->clock, WW_PHASE_BODY);
+    }
+    free(privateParams->decoder);
+    privateParams->decoder = NULL;
+
+    // Clear the stored handle before closing (handle may already be closed by watchdog -- fails silently).
+    if (userParams->pActiveHandle)
+        *userParams->pActiveHandle = NULL;
+    WWCancelRelease(userParams->cancel, &cancelReg);
+
+    if (WW_SUCCESS == iStatus && privateParams->contentHashValid)
+    {
+        WWDiskCacheStoreFileW(userParams->diskCache, privateParams->cacheUrl,
+                              privateParams->fullFilePath,
+                              privateParams->contentHash,
+                              userParams->progressBarData.szDownloadedInBytes,
+                              &privateParams->cacheInfo,
+                              privateParams->capturedFileName);
+    }
+
+    return iStatus;
+}
+
+WW_PRIVATE
+INT
+WWProcessFtpW(
+              URL_COMPONENTSW* ptrUrlC, 
+              HINTERNET hConn,
+              WW_PARAMSW* userParams, 
+              WW_PRIVATEPARAMSW* privateParams
+             )
+{
+    // Check if URL_COMPONENTSW pointer is NULL
+    if (NULL == ptrUrlC)
+    {
+        userParams->errorcode = WW_ERR_EMPTY_URLC;
+        return WW_FAILURE;
+    }
+
+    WIN32_FIND_DATAW finddata;
+    HINTERNET hFind = FtpFindFirstFileW(hConn, ptrUrlC->lpszUrlPath,
+                                        &finddata, 0, 0);
+    if (NULL != hFind)
+    {
+        InternetCloseHandle(hFind);
+    }
+    else
+    {
+        return WW_FAILURE;
+    }
+
+    HINTERNET hFile = FtpOpenFileW(hConn, ptrUrlC->lpszUrlPath, GENERIC_READ,
+                                   FTP_TRANSFER_TYPE_BINARY, 0);
+    if (NULL == hFile)
+    {
+        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+        return WW_FAILURE;
+    }
+
+    LARGE_INTEGER liFileSize = { finddata.nFileSizeLow, 0 };
+
+    wcsncpy(privateParams->capturedFileName, finddata.cFileName,
+            WW_COUNTOF(privateParams->capturedFileName));
+
+    privateParams->hostRate = WWRateLimitHostW(ptrUrlC->lpszHostName);
+    INT iStatus = WWRetrieveDataW(hFile, liFileSize.QuadPart,
+                                  &finddata.ftLastWriteTime,
+                                  userParams, privateParams);
+
+    InternetCloseHandle(hFile);
+
+    return iStatus;
+}
+
+WW_PRIVATE
+INT
+WWPrepareFilePathW(
+    WW_PARAMSW* userParams,
+    WW_PRIVATEPARAMSW* privateParams
+)
+{
+    ZeroMemory(privateParams->fullFilePath, MAX_PATH);
+    if (NULL != userParams->dstPath)
+    {
+        wcsncpy(privateParams->fullFilePath, userParams->dstPath,
+            WW_STR_SYMSW(privateParams->fullFilePath));
+    }
+    if (NULL != userParams->outFileName)
+    {
+        if (NULL == privateParams->fullFilePath)
+        {
+            wcsncpy(privateParams->fullFilePath, userParams->outFileName,
+                WW_STR_SYMSW(privateParams->fullFilePath));
+        }
+        else
+        {
+            wcsncat(privateParams->fullFilePath, userParams->outFileName,
+                WW_STR_SYMSW(privateParams->fullFilePath));
+        }
+    }
+    else
+    {
+        if (NULL == privateParams->capturedFileName)
+        {
+            return WW_FAILURE;
+        }
+        else
+        {
+            wcsncat(privateParams->fullFilePath,
+                privateParams->capturedFileName,
+                WW_STR_SYMSW(privateParams->fullFilePath));
+        }
+    }
+    return WW_SUCCESS;
+}
+
+WW_PRIVATE
+INT
+WWRetrieveDataW(
+                HINTERNET hFile, 
+                LONGLONG fileSize, 
+                const FILETIME* pftLastModified,
+                WW_PARAMSW* userParams,
+                WW_PRIVATEPARAMSW* privateParams
+               )
+{
+    BYTE bufRead[0x10000];   //64KiB, per call so concurrent downloads stay apart
+    BOOL retRead;
+    DWORD bytesRead, byteWrite;
+    INT ratio = 0;
+    WW_INFLATE* decoder = privateParams->decoder;
+    WWPBARINFO* pbar = &userParams->progressBarData;
+    // fileSize counts wire bytes; a compressed body's decoded size is unknown
+    pbar->szWireTotalInBytes  = fileSize + (LONGLONG)userParams->resumeOffset;
+    pbar->szWireInBytes       = (LONGLONG)userParams->resumeOffset;
+    pbar->szTotalInBytes      = (NULL != decoder) ? 0 : pbar->szWireTotalInBytes;
+    pbar->szDownloadedInBytes = (LONGLONG)userParams->resumeOffset;
+    LONGLONG szDownloadedPrev = (LONGLONG)userParams->resumeOffset;
+    FILETIME st, st0, st1;
+    WCHAR speed[32] = { L'\0' };
+    WCHAR filePathTemp[MAX_PATH] = L"";
+
+    if (WW_FAILURE == WWPrepareFilePathW(userParams, privateParams))
+    { 
+        return WW_FAILURE;
+    }
+
+    if (!userParams->forceDownload)
+    {
+        HANDLE hFileN = CreateFileW(privateParams->fullFilePath, GENERIC_READ,
+                                    0, NULL, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, 0);
+        if (FALSE == WWIsFileModified(hFileN, (NULL != decoder) ? -1 : fileSize,
+                                      pftLastModified))
+        {
+            CloseHandle(hFileN);
+            return WW_SUCCESS;
+        }
+        CloseHandle(hFileN);
+    }
+
+    wcsncpy(filePathTemp, privateParams->fullFilePath,
+            WW_STR_SYMSW(filePathTemp));
+    wcsncat(filePathTemp, L"~", WW_STR_SYMSW(filePathTemp));
+
+    if (userParams->forceDownload)
+        SetFileAttributesW(privateParams->fullFilePath, FILE_ATTRIBUTE_NORMAL);
+
+    HANDLE hf = CreateFileW(privateParams->fullFilePath, GENERIC_WRITE, 0,
+                            NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == hf) 
+    {
+        userParams->errorcode = WW_ERR_CREATE_FILE;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        return WW_FAILURE;
+    }
+
+    // When resumeOffset > 0, try to open existing partial temp file and seek to offset.
+    // If the temp file is missing or has unexpected size, fall back to a fresh download.
+    HANDLE hft = INVALID_HANDLE_VALUE;
+    if (userParams->resumeOffset > 0)
+    {
+        hft = CreateFileW(filePathTemp, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE != hft)
+        {
+            LARGE_INTEGER liSize = { 0 };
+            LARGE_INTEGER liOffset = { 0 };
+            liOffset.QuadPart = (LONGLONG)userParams->resumeOffset;
+            if (!GetFileSizeEx(hft, &liSize) ||
+                liSize.QuadPart != liOffset.QuadPart ||
+                !SetFilePointerEx(hft, liOffset, NULL, FILE_BEGIN))
+            {
+                CloseHandle(hft);
+                hft = INVALID_HANDLE_VALUE;
+            }
+        }
+        // If temp file unavailable/mismatched, reset and start over
+        if (INVALID_HANDLE_VALUE == hft)
+        {
+            userParams->resumeOffset    = 0;
+            pbar->szTotalInBytes        = fileSize;
+            pbar->szDownloadedInBytes   = 0;
+            pbar->szWireTotalInBytes    = fileSize;
+            pbar->szWireInBytes         = 0;
+            szDownloadedPrev            = 0;
+        }
+    }
+    if (INVALID_HANDLE_VALUE == hft)
+    {
+        hft = CreateFileW(filePathTemp, GENERIC_WRITE, 0, NULL,
+                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    }
+    if (INVALID_HANDLE_VALUE == hft)
+    {
+        userParams->errorcode = WW_ERR_CREATE_FILE;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        CloseHandle(hf);
+        return WW_FAILURE;
+    }
+
+    GetSystemTimeAsFileTime(&st);
+    st0 = st;
+    st1 = st;
+
+    // The caller's digest covers the whole file: hash the resumed prefix first
+    WW_HASHCTX digestCtx = WW_STRUCT_NULL;
+    BOOL digesting = WWHashBegin(&digestCtx, userParams->hashAlgorithm);
+    if (digesting && userParams->resumeOffset > 0)
+    {
+        LARGE_INTEGER liStart = { 0 };
+        if (FALSE == SetFilePointerEx(hft, liStart, NULL, FILE_BEGIN) ||
+            FALSE == WWHashFileW(hft, userParams->resumeOffset, &digestCtx))
+        {
+            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+            WWHashEnd(&digestCtx, NULL, 0);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+    }
+
+    // Resumed downloads are never cached. A SHA-256 digest doubles as the
+    // content address, so the body is only hashed twice for other algorithms.
+    BOOL cacheHashing = privateParams->hashContent && 0 == userParams->resumeOffset;
+    WW_HASHCTX hashCtx = WW_STRUCT_NULL;
+    BOOL hashing = cacheHashing && WW_HASH_SHA256 != userParams->hashAlgorithm &&
+                   WWHashBegin(&hashCtx, WW_HASH_SHA256);
+
+    double averageSpeed = 0.0;
+    double remainingSize = (double)pbar->szTotalInBytes;
+    LPCWSTR fileNamePtr = NULL;
+    if (userParams->progressBarFlags & WW_PB_FILENAME)
+    {
+        fileNamePtr = userParams->outFileName;
+        if (NULL == fileNamePtr)
+        {
+            fileNamePtr = privateParams->capturedFileName;
+        }
+    }
+    WW_RATELIMIT* limits[] = { userParams->rateLimit, privateParams->hostRate,
+                               &g_wwGlobalRate };
+    WW_SPEEDCHECK speedCheck;
+    WWSpeedCheckStart(&speedCheck);
+    while (TRUE)
+    {
+        if (WWIsDownloadStoppedW(userParams))
+        {
+            WWHashEnd(&hashCtx, NULL, 0);
+            WWHashEnd(&digestCtx, NULL, 0);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+
+        ZeroMemory(bufRead, sizeof(bufRead));
+        DWORD readSize = WWRateLimitChunk(limits, WW_COUNTOF(limits),
+                                          sizeof(bufRead));
+        WWTraceBeginW(WW_TRACE_READ, NULL);
+        retRead = WWReadBodyW(hFile, decoder, bufRead, readSize, &bytesRead);
+        WWTraceEndW(WW_TRACE_READ, retRead ? bytesRead : 0, !retRead);
+        if (retRead)
+        {
+            if (bytesRead == 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            if (NULL != decoder && !decoder->failed)
+            {
+                userParams->errorcode = WW_ERR_DECODE;
+            }
+            else if (WWSpeedCheckSilentW(userParams, &speedCheck))
+            {
+                userParams->errorcode = WW_ERR_STALLED;
+                privateParams->stalled = TRUE;
+            }
+            else
+            {
+                userParams->errorcode = WW_ERR_HTTP_REQUEST;
+            }
+            WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
+            WWHashEnd(&hashCtx, NULL, 0);
+            WWHashEnd(&digestCtx, NULL, 0);
+            // A retry resumes after the bytes already written
+            FlushFileBuffers(hft);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+
+        WWTraceBeginW(WW_TRACE_WRITE, NULL);
+        BOOL retWrite = WriteFile(hft, bufRead, bytesRead, &byteWrite, NULL) &&
+                        bytesRead == byteWrite;
+        WWTraceEndW(WW_TRACE_WRITE, byteWrite, !retWrite);
+        if (FALSE == retWrite)
+        {
+            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+            WWHashEnd(&hashCtx, NULL, 0);
+            WWHashEnd(&digestCtx, NULL, 0);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+
+        if (hashing)
+        {
+            WWHashUpdate(&hashCtx, bufRead, bytesRead);
+        }
+        if (digesting)
+        {
+            WWHashUpdate(&digestCtx, bufRead, bytesRead);
+        }
+
+        // The limits apply to bytes on the wire, not to decoded ones
+        LONGLONG wirePrev = pbar->szWireInBytes;
+        pbar->szDownloadedInBytes += bytesRead;
+        WWMetricsAdd(&g_wwMetrics.bytesDownloaded, bytesRead);
+        pbar->szWireInBytes = (NULL != decoder) ? decoder->wireBytes :
+                                                  pbar->szDownloadedInBytes;
+        ULONGLONG pacingMs = GetTickCount64();
+        WWRateLimitWait(limits, WW_COUNTOF(limits),
+                        (ULONGLONG)(pbar->szWireInBytes - wirePrev),
+                        userParams->pCancelFlag, userParams->cancel,
+                        userParams->deadlineMs);
+        WWSpeedCheckPause(&speedCheck, GetTickCount64() - pacingMs);
+
+        // A slow connection is given up; the caller reopens it at this offset
+        if (WWSpeedCheckStalledW(userParams, &speedCheck,
+                                 (ULONGLONG)(pbar->szWireInBytes - wirePrev)))
+        {
+            userParams->errorcode = WW_ERR_STALLED;
+            privateParams->stalled = TRUE;
+            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+            WWHashEnd(&hashCtx, NULL, 0);
+            WWHashEnd(&digestCtx, NULL, 0);
+            FlushFileBuffers(hft);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+
+        if (0 != pbar->szTotalInBytes)
+        {
+            ratio = (INT)((pbar->szDownloadedInBytes * 10000) / pbar->szTotalInBytes);
+        }
+        else if (0 != pbar->szWireTotalInBytes)
+        {
+            ratio = (INT)((pbar->szWireInBytes * 10000) / pbar->szWireTotalInBytes);
+        }
+
+        WCHAR progressbar[64];
+        ZeroMemory(progressbar, sizeof(progressbar));
+        progressbar[0] = L'[';
+        for (INT i = 1; i < 24; i++)
+        {
+            if (ratio / 350 > i)
+            {
+                progressbar[i] = L'#';
+            }
+            else
+            {
+                progressbar[i] = L'-';
+            }
+        }
+        progressbar[24] = L']';
+        GetSystemTimeAsFileTime(&st1);
+        ULONGLONG difftime = ((PULARGE_INTEGER)&st1)->QuadPart - \
+            ((PULARGE_INTEGER)&st0)->QuadPart;
+        if ((difftime >= 10000000) || ((ratio != 0) && (ratio % 10000 == 0)))
+        {
+            double diffsize =
+                (double)(pbar->szDownloadedInBytes - szDownloadedPrev) /
+                ((double)difftime / (double)10000000);
+
+            pbar->ulTimeElapsedInSecs = ((PULARGE_INTEGER)&st1)->QuadPart - \
+                ((PULARGE_INTEGER)&st)->QuadPart;
+            ULONGLONG difftimeS = pbar->ulTimeElapsedInSecs;
+            INT diffsec = (INT)((difftimeS - (difftimeS % 10000000)) / 10000000);
+            INT speedUnitIndex = WWGetSizeUnitW(diffsize);
+
+            st0 = st1;
+
+
+            INT dwnSizeUnit = WWGetSizeUnitW((double)pbar->szDownloadedInBytes);
+            INT totlSizeUnit = WWGetSizeUnitW((double)pbar->szTotalInBytes);
+
+            // ETA calculation
+            double downloadSpeed = diffsize / (diffsec != 0 ? diffsec : 1);
+            ULONGLONG remainingSize = (pbar->szTotalInBytes > pbar->szDownloadedInBytes)
+                ? (pbar->szTotalInBytes - pbar->szDownloadedInBytes)
+                : 0;
+            pbar->dETAInSecs = (pbar->szTotalInBytes > 0 && downloadSpeed > 0.0)
+                ? (remainingSize / downloadSpeed)
+                : 0.0;
+            INT etaHours = (INT)(pbar->dETAInSecs / 3600);
+            INT etaMinutes = (INT)((pbar->dETAInSecs - (etaHours * 3600)) / 60);
+            INT etaSeconds = (INT)(pbar->dETAInSecs - (etaHours * 3600) - (etaMinutes * 60));
+
+            if (userParams->progressCallback != NULL)
+            {
+                userParams->progressCallback(pbar,
+                                             userParams->pCallbackData);
+            }
+
+            wprintf(L"\r");
+            if (userParams->progressBarFlags & WW_PB_FILENAME)
+            {
+                wprintf(L"%s ", fileNamePtr);
+            }
+            if (userParams->progressBarFlags & WW_PB_PROGRESSBAR)
+            {
+                wprintf(L"%s ", progressbar);
+            }
+            if (userParams->progressBarFlags & WW_PB_PERCENTAGE)
+            {
+                wprintf(L"%3d.%02d%%; ",
+                    (ratio - (ratio % 100)) / 100, (ratio % 100));
+            }
+            if (userParams->progressBarFlags & WW_PB_FILESIZE)
+            {
+                wprintf(L"%6.2f%s /%6.2f%s; ",
+                    pbar->szDownloadedInBytes / sizeUnitW[dwnSizeUnit].size,
+                    sizeUnitW[dwnSizeUnit].unit,
+                    pbar->szTotalInBytes / sizeUnitW[totlSizeUnit].size,
+                    sizeUnitW[totlSizeUnit].unit);
+            }
+            if (userParams->progressBarFlags & WW_PB_ELAPSEDTIME)
+            {
+                wprintf(L"%02d:%02d:%02d",
+                    (diffsec - (diffsec % 3600)) / 3600,
+                    ((diffsec % 3600) - (diffsec % 60)) / 60,
+                    diffsec % 60);
+            }
+            if (userParams->progressBarFlags & WW_PB_SPEED)
+            {
+                wprintf(L"%6.2f%s/s; ",
+                    diffsize / sizeUnitW[speedUnitIndex].size,
+                    sizeUnitW[speedUnitIndex].unit);
+            }
+            if (userParams->progressBarFlags & WW_PB_ETA)
+            {
+                wprintf(L"ETA: %02d:%02d:%02d ",
+                    etaHours, etaMinutes, etaSeconds);
+            }
+
+            szDownloadedPrev = pbar->szDownloadedInBytes;
+        }
+    }
+
+    wprintf(L"\n\n");
+
+    if (digesting)
+    {
+        DWORD digestSize = WWHashDigestSize(userParams->hashAlgorithm);
+        if (WWHashEnd(&digestCtx, userParams->digest, digestSize))
+        {
+            userParams->digestSize = digestSize;
+        }
+        if (cacheHashing && WW_HASH_SHA256 == userParams->hashAlgorithm &&
+            0 != userParams->digestSize)
+        {
+            CopyMemory(privateParams->contentHash, userParams->digest,
+                       WW_SHA256_SIZE);
+            privateParams->contentHashValid = TRUE;
+        }
+    }
+    if (hashing)
+    {
+        privateParams->contentHashValid =
+            WWHashEnd(&hashCtx, privateParams->contentHash, WW_SHA256_SIZE);
+    }
+
+    if (pftLastModified != NULL)
+    {
+        if (SetFileTime(hft, NULL, NULL, pftLastModified) == FALSE)
+        {
+            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+            CloseHandle(hft);
+            CloseHandle(hf);
+            return WW_FAILURE;
+        }
+    }
+
+    CloseHandle(hft);
+    CloseHandle(hf);
+
+    // A corrupt body must never replace the destination; drop it so a
+    // later resume does not build on it either
+    if (FALSE == WWDigestMatchesW(userParams))
+    {
+        userParams->errorcode = WW_ERR_DIGEST_MISMATCH;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        DeleteFileW(filePathTemp);
+        return WW_FAILURE;
+    }
+
+    if (userParams->forceDownload)
+    {
+        SetFileAttributesW(privateParams->fullFilePath, FILE_ATTRIBUTE_NORMAL);
+        DeleteFileW(privateParams->fullFilePath);
+    }
+
+    WWTraceBeginW(WW_TRACE_RENAME, NULL);
+    BOOL renamed = MoveFileExW(filePathTemp, privateParams->fullFilePath,
+                               MOVEFILE_REPLACE_EXISTING);
+    WWTraceEndW(WW_TRACE_RENAME, 0, !renamed);
+    if (FALSE == renamed)
+    {
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        return WW_FAILURE;
+    }
+
+    return WW_SUCCESS;
+}
+
+/**
+ * @brief Split size bytes into at most segments ranges of similar size.
+ */
+WW_PRIVATE
+VOID
+WWSegmentPlanW(
+    WW_JOURNALSLOT* journal,
+    ULONGLONG size,
+    UINT segments,
+    LPCWSTR validator
+)
+{
+    ZeroMemory(journal, sizeof(*journal));
+    journal->totalSize = size;
+    wcsncpy(journal->validator, validator, WW_COUNTOF(journal->validator) - 1);
+
+    ULONGLONG count = (segments > 1) ? segments : 1;
+    if (count > WW_MAX_DOWNLOAD_SEGMENTS)
+    {
+        count = WW_MAX_DOWNLOAD_SEGMENTS;
+    }
+    if (count > size / WW_MIN_SEGMENT_SIZE)
+    {
+        count = size / WW_MIN_SEGMENT_SIZE;
+    }
+    if (0 == count)
+    {
+        count = 1;
+    }
+
+    ULONGLONG step = size / count;
+    for (ULONGLONG i = 0; i < count; ++i)
+    {
+        journal->segments[i].start = i * step;
+        journal->segments[i].end = (i + 1 == count) ? size : (i + 1) * step;
+    }
+    journal->segmentCount = (DWORD)count;
+}
+
+/**
+ * @brief Load the newest intact slot of a download journal.
+ */
+WW_PRIVATE
+BOOL
+WWJournalReadW(
+    LPCWSTR path,
+    WW_JOURNALSLOT* journal
+)
+{
+    HANDLE hJournal = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == hJournal)
+    {
+        return FALSE;
+    }
+
+    BOOL found = FALSE;
+    WW_JOURNALSLOT slot;
+    for (DWORD i = 0; i < 2; ++i)
+    {
+        OVERLAPPED ov = WW_STRUCT_NULL;
+        ov.Offset = i * sizeof(slot);
+        DWORD bytesRead = 0;
+        if (FALSE == ReadFile(hJournal, &slot, sizeof(slot), &bytesRead, &ov) ||
+            sizeof(slot) != bytesRead || WW_JOURNAL_MAGIC != slot.magic ||
+            0 == slot.segmentCount ||
+            slot.segmentCount > WW_MAX_DOWNLOAD_SEGMENTS ||
+            slot.crc != ~WWGetCrc32c()(0xFFFFFFFF, (const BYTE*)&slot,
+                                       offsetof(WW_JOURNALSLOT, crc)))
+        {
+            continue;
+        }
+
+        BOOL sane = L'\0' == slot.validator[WW_COUNTOF(slot.validator) - 1];
+        for (DWORD j = 0; j < slot.segmentCount && sane; ++j)
+        {
+            const WW_SEGMENT* seg = &slot.segments[j];
+            sane = seg->start <= seg->end && seg->end <= slot.totalSize &&
+                   seg->done <= seg->end - seg->start;
+        }
+        if (sane && (!found || slot.sequence > journal->sequence))
+        {
+            *journal = slot;
+            found = TRUE;
+        }
+    }
+
+    CloseHandle(hJournal);
+    return found;
+}
+
+/**
+ * @brief Write the journal over its older slot and flush it.
+ */
+WW_PRIVATE
+BOOL
+WWJournalWriteW(
+    HANDLE hJournal,
+    WW_JOURNALSLOT* journal
+)
+{
+    journal->magic = WW_JOURNAL_MAGIC;
+    journal->sequence++;
+    journal->crc = ~WWGetCrc32c()(0xFFFFFFFF, (const BYTE*)journal,
+                                  offsetof(WW_JOURNALSLOT, crc));
+
+    OVERLAPPED ov = WW_STRUCT_NULL;
+    ov.Offset = (journal->sequence & 1) * sizeof(*journal);
+    DWORD written = 0;
+    return WriteFile(hJournal, journal, sizeof(*journal), &written, &ov) &&
+           sizeof(*journal) == written && FlushFileBuffers(hJournal);
+}
+
+/**
+ * @brief Record that a segment has done bytes on disk.
+ */
+WW_PRIVATE
+BOOL
+WWSegmentCheckpointW(
+    WW_SEGMENTCTXW* ctx,
+    UINT index,
+    ULONGLONG done
+)
+{
+    // The bytes must be durable before the journal claims them
+    if (INVALID_HANDLE_VALUE != ctx->hJournal &&
+        FALSE == FlushFileBuffers(ctx->hTemp))
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&ctx->lock);
+    ctx->journal.segments[index].done = done;
+    BOOL ok = INVALID_HANDLE_VALUE == ctx->hJournal ||
+              WWJournalWriteW(ctx->hJournal, &ctx->journal);
+    LeaveCriticalSection(&ctx->lock);
+    return ok;
+}
+
+/**
+ * @brief Stop the segmented download, keeping the first failure.
+ */
+WW_PRIVATE
+VOID
+WWSegmentFailW(
+    WW_SEGMENTCTXW* ctx,
+    INT errorcode,
+    DWORD statusCode
+)
+{
+    EnterCriticalSection(&ctx->lock);
+    if (0 == ctx->failed)
+    {
+        ctx->errorcode = errorcode;
+        ctx->statusCode = statusCode;
+        InterlockedExchange(&ctx->failed, 1);
+    }
+    LeaveCriticalSection(&ctx->lock);
+}
+
+/**
+ * @brief Pick the source that adds the most throughput with one more
+ *        connection. The context lock must be held.
+ *
+ * @return Index into ctx->mirrors, or WW_NO_SEGMENT if every source failed.
+ */
+WW_PRIVATE
+UINT
+WWMirrorPickW(
+    WW_SEGMENTCTXW* ctx
+)
+{
+    UINT best = WW_NO_SEGMENT;
+    ULONGLONG bestScore = 0;
+    for (UINT i = 0; i < ctx->mirrorCount; ++i)
+    {
+        const WW_MIRRORW* mirror = &ctx->mirrors[i];
+        if (mirror->dead)
+        {
+            continue;
+        }
+
+        // A source that has not delivered yet is tried first. Otherwise the
+        // bandwidth of its busy connections is assumed to be shared with
+        // one more.
+        ULONGLONG rate = (0 == mirror->bytes) ?
+                         (ULONGLONG)-1 / WW_MAX_DOWNLOAD_SEGMENTS :
+                         mirror->bytes * 1000 / (mirror->busyMs + 1);
+        ULONGLONG connections = (0 != mirror->active) ? mirror->active : 1;
+        ULONGLONG score = rate * connections / (mirror->active + 1);
+        if (WW_NO_SEGMENT == best || score > bestScore)
+        {
+            best = i;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Take an unfinished range nobody is fetching, or split the largest
+ *        range still in flight.
+ *
+ * @return Index of the range, or WW_NO_SEGMENT when nothing is left.
+ */
+WW_PRIVATE
+UINT
+WWSegmentClaimW(
+    WW_SEGMENTCTXW* ctx
+)
+{
+    UINT index = WW_NO_SEGMENT;
+
+    EnterCriticalSection(&ctx->lock);
+    WW_JOURNALSLOT* journal = &ctx->journal;
+    for (UINT i = 0; i < journal->segmentCount && WW_NO_SEGMENT == index; ++i)
+    {
+        const WW_SEGMENT* seg = &journal->segments[i];
+        if (!ctx->claimed[i] && ctx->liveDone[i] < seg->end - seg->start)
+        {
+            index = i;
+        }
+    }
+
+    if (WW_NO_SEGMENT == index && ctx->split &&
+        journal->segmentCount < WW_MAX_DOWNLOAD_SEGMENTS)
+    {
+        UINT largest = WW_NO_SEGMENT;
+        ULONGLONG largestLeft = 0;
+        for (UINT i = 0; i < journal->segmentCount; ++i)
+        {
+            const WW_SEGMENT* seg = &journal->segments[i];
+            ULONGLONG left = seg->end - seg->start - ctx->liveDone[i];
+            if (ctx->claimed[i] && left > largestLeft)
+            {
+                largest = i;
+                largestLeft = left;
+            }
+        }
+
+        // The owner stops at the new end; its read in flight (at most one
+        // buffer) lies well below it
+        if (WW_NO_SEGMENT != largest && largestLeft >= 2 * WW_MIN_SEGMENT_SIZE)
+        {
+            WW_SEGMENT* seg = &journal->segments[largest];
+            ULONGLONG middle = seg->start + ctx->liveDone[largest] + largestLeft / 2;
+
+            index = journal->segmentCount++;
+            journal->segments[index].start = middle;
+            journal->segments[index].end = seg->end;
+            journal->segments[index].done = 0;
+            ctx->liveDone[index] = 0;
+            seg->end = middle;
+
+            // Best effort: the next checkpoint writes the split again
+            if (INVALID_HANDLE_VALUE != ctx->hJournal)
+            {
+                WWJournalWriteW(ctx->hJournal, journal);
+            }
+        }
+    }
+
+    if (WW_NO_SEGMENT != index)
+    {
+        ctx->claimed[index] = TRUE;
+    }
+    LeaveCriticalSection(&ctx->lock);
+    return index;
+}
+
+/**
+ * @brief Fetch what is missing of one segment into the temporary file.
+ *
+ * A source that fails is dropped and the segment is left for another one.
+ */
+WW_PRIVATE
+VOID
+WWSegmentFetchW(
+    WW_SEGMENTCTXW* ctx,
+    UINT index,
+    LPBYTE buf
+)
+{
+    WW_PARAMSW* userParams = ctx->userParams;
+    WW_SEGMENT* seg = &ctx->journal.segments[index];
+
+    // Only this worker changes done; other workers may lower seg->end
+    EnterCriticalSection(&ctx->lock);
+    ULONGLONG start = seg->start;
+    ULONGLONG size = seg->end - seg->start;
+    ULONGLONG done = ctx->liveDone[index];
+
+    // The initial response already streams the first segment
+    HINTERNET hFirst = NULL;
+    UINT source = 0;
+    if (0 == start && 0 == done && NULL != ctx->hFirst && !ctx->mirrors[0].dead)
+    {
+        hFirst = ctx->hFirst;
+        ctx->hFirst = NULL;
+    }
+    else
+    {
+        source = WWMirrorPickW(ctx);
+        if (WW_NO_SEGMENT == source)
+        {
+            // The worker that dropped the last source has failed the download
+            ctx->claimed[index] = FALSE;
+            LeaveCriticalSection(&ctx->lock);
+            return;
+        }
+        ctx->mirrors[source].active++;
+    }
+    WW_MIRRORW* mirror = &ctx->mirrors[source];
+    LeaveCriticalSection(&ctx->lock);
+
+    INT errorcode = WW_ERR_NOERROR;
+    DWORD dwStatusCode = 0;
+    BOOL sourceFailed = FALSE;
+    HINTERNET hReq = hFirst;
+    WW_PHASECLOCK* clock = NULL;
+    WW_CANCELREG cancelReg;
+    if (NULL == hReq)
+    {
+        LPCWSTR rgpszAcceptTypes[] = { L"*/*", NULL };
+        WCHAR headers[640] = L"";
+        _snwprintf_s(headers, WW_COUNTOF(headers), _TRUNCATE,
+                     L"Range: bytes=%I64u-%I64u\r\n", start + done,
+                     start + size - 1);
+        wcsncat(headers, L"If-Range: ", WW_STR_SYMSW(headers));
+        wcsncat(headers, ctx->journal.validator, WW_STR_SYMSW(headers));
+        wcsncat(headers, L"\r\n", WW_STR_SYMSW(headers));
+
+        // Timed only so that the metrics see whether a connection was made
+        clock = WWClockOpenW(WWGetTimeUs(),
+                             0 != (mirror->requestFlags & INTERNET_FLAG_SECURE));
+        hReq = HttpOpenRequestW(mirror->hConn, NULL, mirror->urlPath, NULL, NULL,
+                                rgpszAcceptTypes, mirror->requestFlags,
+                                (DWORD_PTR)clock);
+        if (NULL != hReq)
+        {
+            WWClockAttachW(clock, hReq);
+        }
+        DWORD timeout = WWReceiveTimeoutW(userParams);
+        if (NULL != hReq && timeout > 0)
+        {
+            InternetSetOption(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT, &timeout,
+                              sizeof(timeout));
+        }
+
+        // A 200 means the entity changed (or the mirror has another one),
+        // a total other than the file size that the mirror has another file
+        WCHAR contentRange[128] = L"";
+        DWORD contentRangeLen = sizeof(contentRange);
+        DWORD dwQueryLength = sizeof(dwStatusCode);
+        BOOL attached = (NULL != hReq &&
+                         WWCancelAttach(userParams->cancel, userParams->deadlineMs,
+                                        &cancelReg, hReq, NULL));
+        if (FALSE == attached ||
+            FALSE == HttpSendRequestW(hReq, headers, (DWORD)wcslen(headers),
+                                      NULL, 0))
+        {
+            errorcode = WW_ERR_HTTP_REQUEST;
+        }
+        else if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_STATUS_CODE |
+                                         HTTP_QUERY_FLAG_NUMBER, &dwStatusCode,
+                                         &dwQueryLength, 0) ||
+                 206 != dwStatusCode ||
+                 FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_RANGE,
+                                         contentRange, &contentRangeLen, 0) ||
+                 start + done != _wcstoui64(contentRange +
+                     wcscspn(contentRange, L"0123456789"), NULL, 10) ||
+                 (NULL != wcschr(contentRange, L'/') &&
+                  L'*' != wcschr(contentRange, L'/')[1] &&
+                  ctx->journal.totalSize != _wcstoui64(
+                      wcschr(contentRange, L'/') + 1, NULL, 10)))
+        {
+            errorcode = WW_ERR_HTTP_STATUS;
+        }
+        if (attached)
+        {
+            // dwStatusCode is still 0 if no response came back
+            WWMetricsRequestW(clock, dwStatusCode);
+        }
+        sourceFailed = (WW_ERR_NOERROR != errorcode);
+    }
+
+    // Pacing counts as busy time, so a mirror on a limited host looks slower
+    WW_RATELIMIT* limits[] = { userParams->rateLimit, mirror->hostRate,
+                               &g_wwGlobalRate };
+    ULONGLONG checkpointed = done;
+    ULONGLONG lastTickMs = GetTickCount64();
+    WW_SPEEDCHECK speedCheck;
+    WWSpeedCheckStart(&speedCheck);
+    BOOL stalled = FALSE;
+    while (WW_ERR_NOERROR == errorcode && done < size)
+    {
+        if (ctx->failed || WWIsDownloadStoppedW(userParams))
+        {
+            break;
+        }
+
+        DWORD want = (size - done > 0x10000) ? 0x10000 : (DWORD)(size - done);
+        want = WWRateLimitChunk(limits, WW_COUNTOF(limits), want);
+        DWORD bytesRead = 0;
+        WWTraceBeginW(WW_TRACE_READ, NULL);
+        BOOL retRead = InternetReadFile(hReq, buf, want, &bytesRead);
+        WWTraceEndW(WW_TRACE_READ, retRead ? bytesRead : 0, !retRead || 0 == bytesRead);
+        if (FALSE == retRead || 0 == bytesRead)
+        {
+            stalled = WWSpeedCheckSilentW(userParams, &speedCheck);
+            if (!stalled)
+            {
+                errorcode = WW_ERR_HTTP_REQUEST;
+                sourceFailed = TRUE;
+            }
+            break;
+        }
+
+        OVERLAPPED ov = WW_STRUCT_NULL;
+        ULONGLONG offset = start + done;
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD written = 0;
+        WWTraceBeginW(WW_TRACE_WRITE, NULL);
+        BOOL retWrite = WriteFile(ctx->hTemp, buf, bytesRead, &written, &ov) &&
+                        written == bytesRead;
+        WWTraceEndW(WW_TRACE_WRITE, written, !retWrite);
+        if (FALSE == retWrite)
+        {
+            errorcode = WW_ERR_CREATE_FILE;
+            break;
+        }
+        done += bytesRead;
+        WWMetricsAdd(&g_wwMetrics.bytesDownloaded, bytesRead);
+
+        EnterCriticalSection(&ctx->lock);
+        ctx->liveDone[index] = done;
+        size = seg->end - seg->start;
+        ctx->bytesDone += bytesRead;
+        ULONGLONG nowMs = GetTickCount64();
+        mirror->bytes += bytesRead;
+        mirror->busyMs += nowMs - lastTickMs;
+        lastTickMs = nowMs;
+        if (NULL != userParams->progressCallback &&
+            (nowMs - ctx->lastReportMs >= 1000 || ctx->bytesDone == ctx->journal.totalSize))
+        {
+            ctx->lastReportMs = nowMs;
+            userParams->progressBarData.szDownloadedInBytes = ctx->bytesDone;
+            userParams->progressBarData.szWireInBytes = ctx->bytesDone;
+            userParams->progressCallback(&userParams->progressBarData,
+                                         userParams->pCallbackData);
+        }
+        LeaveCriticalSection(&ctx->lock);
+        ULONGLONG pacingMs = GetTickCount64();
+        WWRateLimitWait(limits, WW_COUNTOF(limits), bytesRead,
+                        userParams->pCancelFlag, userParams->cancel,
+                        userParams->deadlineMs);
+        WWSpeedCheckPause(&speedCheck, GetTickCount64() - pacingMs);
+
+        if (done - checkpointed >= WW_JOURNAL_INTERVAL)
+        {
+            if (FALSE == WWSegmentCheckpointW(ctx, index, done))
+            {
+                errorcode = WW_ERR_CREATE_FILE;
+                break;
+            }
+            checkpointed = done;
+        }
+
+        if (done < size &&
+            WWSpeedCheckStalledW(userParams, &speedCheck, bytesRead))
+        {
+            stalled = TRUE;
+            break;
+        }
+    }
+
+    if (NULL != hReq && hReq != hFirst)
+    {
+        WWCancelRelease(userParams->cancel, &cancelReg);
+    }
+    WWClockCloseW(clock, NULL);
+
+    // A read cut short by the token is no fault of the source
+    if (WWIsDownloadStoppedW(userParams))
+    {
+        errorcode = WW_ERR_NOERROR;
+        sourceFailed = FALSE;
+        stalled = FALSE;
+    }
+
+    // Keep what arrived before a failure for the next source or attempt
+    if (done != checkpointed && FALSE == WWSegmentCheckpointW(ctx, index, done) &&
+        WW_ERR_NOERROR == errorcode)
+    {
+        errorcode = WW_ERR_CREATE_FILE;
+        sourceFailed = FALSE;
+    }
+
+    // Another source takes over the rest of the segment. The failure of the
+    // last one is recorded before the lock is left so no worker claims the
+    // segment again in between.
+    EnterCriticalSection(&ctx->lock);
+    mirror->active--;
+    if (stalled && WW_ERR_NOERROR == errorcode)
+    {
+        // The range is requested again on a new connection, which may go to
+        // a faster source; past the restart budget the source is dropped
+        UINT maxStallRestarts = (0 != userParams->maxStallRestarts) ?
+            userParams->maxStallRestarts : WW_DEFAULT_STALL_RESTARTS;
+        if (userParams->stallRestarts < maxStallRestarts)
+        {
+            userParams->stallRestarts++;
+            ctx->claimed[index] = FALSE;
+            LeaveCriticalSection(&ctx->lock);
+            return;
+        }
+        errorcode = WW_ERR_STALLED;
+        sourceFailed = TRUE;
+    }
+    if (sourceFailed)
+    {
+        if (!mirror->dead)
+        {
+            mirror->dead = TRUE;
+            ctx->liveMirrors--;
+        }
+        ctx->claimed[index] = FALSE;
+        if (0 == ctx->liveMirrors && 0 == ctx->failed)
+        {
+            ctx->errorcode = errorcode;
+            ctx->statusCode = dwStatusCode;
+            InterlockedExchange(&ctx->failed, 1);
+        }
+    }
+    LeaveCriticalSection(&ctx->lock);
+
+    if (sourceFailed)
+    {
+        return;
+    }
+    if (WW_ERR_NOERROR != errorcode)
+    {
+        WWSegmentFailW(ctx, errorcode, dwStatusCode);
+    }
+    else if (done < size)
+    {
+        WWSegmentFailW(ctx, WW_ERR_NOERROR, 0);    // Cancelled
+    }
+}
+
+WW_PRIVATE
+DWORD WINAPI
+WWSegmentWorkerW(
+    LPVOID param
+)
+{
+    WW_SEGMENTCTXW* ctx = (WW_SEGMENTCTXW*)param;
+
+    LPBYTE buf = (LPBYTE)malloc(0x10000);
+    if (NULL == buf)
+    {
+        WWSegmentFailW(ctx, WW_ERR_MALLOC, 0);
+        return 0;
+    }
+
+    while (0 == ctx->failed)
+    {
+        UINT index = WWSegmentClaimW(ctx);
+        if (WW_NO_SEGMENT == index)
+        {
+            break;
+        }
+        WWSegmentFetchW(ctx, index, buf);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief Connect to the mirrors of a download. Mirrors that cannot be used
+ *        start out dropped.
+ */
+WW_PRIVATE
+VOID
+WWMirrorsOpenW(
+    WW_SEGMENTCTXW* ctx,
+    HINTERNET hInet,
+    DWORD requestFlags
+)
+{
+    WW_PARAMSW* userParams = ctx->userParams;
+    for (UINT i = 0; NULL != userParams->mirrors && i < userParams->mirrorCount; ++i)
+    {
+        WW_MIRRORW* mirror = &ctx->mirrors[1 + i];
+        mirror->dead = TRUE;
+        ctx->mirrorCount++;
+
+        WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
+        WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+        WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
+        WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
+        URL_COMPONENTSW urlc = {
+            sizeof(urlc),
+            scheme, WW_COUNTOF(scheme),
+            INTERNET_SCHEME_DEFAULT,
+            hostname, WW_COUNTOF(hostname),
+            0,
+            username, WW_COUNTOF(username),
+            password, WW_COUNTOF(password),
+            mirror->urlPath, WW_COUNTOF(mirror->urlPath),
+            NULL, 0
+        };
+
+        if (NULL == hInet || NULL == userParams->mirrors[i] ||
+            FALSE == InternetCrackUrlW(userParams->mirrors[i], 0, 0, &urlc) ||
+            (INTERNET_SCHEME_HTTP != urlc.nScheme &&
+             INTERNET_SCHEME_HTTPS != urlc.nScheme))
+        {
+            continue;
+        }
+
+        mirror->requestFlags = requestFlags & ~INTERNET_FLAG_SECURE;
+        if (INTERNET_SCHEME_HTTPS == urlc.nScheme)
+        {
+            mirror->requestFlags |= INTERNET_FLAG_SECURE;
+        }
+
+        mirror->hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
+                                         urlc.lpszUserName, urlc.lpszPassword,
+                                         INTERNET_SERVICE_HTTP, 0, 0);
+        if (NULL != mirror->hConn)
+        {
+            mirror->hostRate = WWRateLimitHostW(urlc.lpszHostName);
+            mirror->owned = TRUE;
+            mirror->dead = FALSE;
+            ctx->liveMirrors++;
+        }
+    }
+}
+
+/**
+ * @brief Close the connections opened for mirrors and free the sources.
+ */
+WW_PRIVATE
+VOID
+WWMirrorsCloseW(
+    WW_SEGMENTCTXW* ctx
+)
+{
+    for (UINT i = 0; i < ctx->mirrorCount; ++i)
+    {
+        if (ctx->mirrors[i].owned)
+        {
+            InternetCloseHandle(ctx->mirrors[i].hConn);
+        }
+    }
+    free(ctx->mirrors);
+    ctx->mirrors = NULL;
+}
+
+/**
+ * @brief Let WinInet open at least count connections per server. The limit is
+ *        process-wide and only ever raised.
+ */
+WW_PRIVATE
+VOID
+WWRaiseConnectionLimit(
+    UINT count
+)
+{
+    DWORD maxConns = 0;
+    DWORD maxConnsSize = sizeof(maxConns);
+    if (count > 1 &&
+        InternetQueryOptionW(NULL, INTERNET_OPTION_MAX_CONNS_PER_SERVER,
+                             &maxConns, &maxConnsSize) && maxConns < count)
+    {
+        maxConns = count;
+        InternetSetOptionW(NULL, INTERNET_OPTION_MAX_CONNS_PER_SERVER,
+                           &maxConns, sizeof(maxConns));
+    }
+}
+
+/**
+ * @brief Fetch the body as byte ranges written in place, resuming the ranges
+ *        a journal records as unfinished.
+ */
+WW_PRIVATE
+INT
+WWRetrieveSegmentsW(
+    HINTERNET hConn,
+    HINTERNET hReq,
+    WW_CANCELREG* reqReg,
+    LPCWSTR urlPath,
+    DWORD requestFlags,
+    ULONGLONG size,
+    const FILETIME* pftLastModified,
+    WW_PARAMSW* userParams,
+    WW_PRIVATEPARAMSW* privateParams
+)
+{
+    WCHAR filePathTemp[MAX_PATH] = L"";
+    WCHAR journalPath[MAX_PATH] = L"";
+
+    if (WW_FAILURE == WWPrepareFilePathW(userParams, privateParams))
+    {
+        return WW_FAILURE;
+    }
+
+    if (!userParams->forceDownload)
+    {
+        HANDLE hFileN = CreateFileW(privateParams->fullFilePath, GENERIC_READ,
+                                    0, NULL, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, 0);
+        if (FALSE == WWIsFileModified(hFileN, (LONGLONG)size, pftLastModified))
+        {
+            CloseHandle(hFileN);
+            return WW_SUCCESS;
+        }
+        CloseHandle(hFileN);
+    }
+
+    wcsncpy(filePathTemp, privateParams->fullFilePath,
+            WW_STR_SYMSW(filePathTemp));
+    wcsncat(filePathTemp, L"~", WW_STR_SYMSW(filePathTemp));
+    wcsncpy(journalPath, filePathTemp, WW_STR_SYMSW(journalPath));
+    wcsncat(journalPath, L"journal", WW_STR_SYMSW(journalPath));
+
+    privateParams->segmented = TRUE;
+
+    WW_SEGMENTCTXW ctx = {
+        .userParams = userParams,
+        .mirrors = NULL,
+        .mirrorCount = 0,
+        .liveMirrors = 0,
+        .split = FALSE,
+        .hFirst = NULL,
+        .hTemp = INVALID_HANDLE_VALUE,
+        .hJournal = INVALID_HANDLE_VALUE,
+        .failed = 0,
+        .bytesDone = 0,
+        .lastReportMs = 0,
+        .errorcode = WW_ERR_NOERROR,
+        .statusCode = 0
+    };
+
+    // A journal only applies to the same identifiable entity and a temporary
+    // file that still has its full size
+    BOOL resumed = userParams->journal &&
+                   L'\0' != privateParams->validator[0] &&
+                   WWJournalReadW(journalPath, &ctx.journal) &&
+                   size == ctx.journal.totalSize &&
+                   0 == wcscmp(ctx.journal.validator, privateParams->validator);
+    if (resumed)
+    {
+        LARGE_INTEGER liSize = WW_STRUCT_NULL;
+        ctx.hTemp = CreateFileW(filePathTemp, GENERIC_READ | GENERIC_WRITE, 0,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        resumed = INVALID_HANDLE_VALUE != ctx.hTemp &&
+                  GetFileSizeEx(ctx.hTemp, &liSize) &&
+                  size == (ULONGLONG)liSize.QuadPart;
+        if (FALSE == resumed && INVALID_HANDLE_VALUE != ctx.hTemp)
+        {
+            CloseHandle(ctx.hTemp);
+            ctx.hTemp = INVALID_HANDLE_VALUE;
+        }
+    }
+    if (resumed)
+    {
+        // The full response is never read; closing it frees its connection
+        // for the workers. The caller's release then finds the slot empty
+        WWCancelRelease(userParams->cancel, reqReg);
+    }
+
+    if (FALSE == resumed)
+    {
+        // Drop a stale journal before the file it describes is truncated
+        DeleteFileW(journalPath);
+        // Without a segment count every source gets a range of its own
+        UINT segments = (userParams->segments > 1) ? userParams->segments :
+                        1 + userParams->mirrorCount;
+        WWSegmentPlanW(&ctx.journal, size, segments, privateParams->validator);
+        ctx.hFirst = hReq;
+
+        LARGE_INTEGER liSize = WW_STRUCT_NULL;
+        liSize.QuadPart = (LONGLONG)size;
+        ctx.hTemp = CreateFileW(filePathTemp, GENERIC_READ | GENERIC_WRITE, 0,
+                                NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE != ctx.hTemp &&
+            (FALSE == SetFilePointerEx(ctx.hTemp, liSize, NULL, FILE_BEGIN) ||
+             FALSE == SetEndOfFile(ctx.hTemp)))
+        {
+            CloseHandle(ctx.hTemp);
+            ctx.hTemp = INVALID_HANDLE_VALUE;
+        }
+    }
+    if (INVALID_HANDLE_VALUE == ctx.hTemp)
+    {
+        userParams->errorcode = WW_ERR_CREATE_FILE;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        return WW_FAILURE;
+    }
+
+    if (userParams->journal)
+    {
+        ctx.hJournal = CreateFileW(journalPath, GENERIC_READ | GENERIC_WRITE,
+                                   0, NULL, resumed ? OPEN_EXISTING : CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == ctx.hJournal ||
+            (FALSE == resumed && FALSE == WWJournalWriteW(ctx.hJournal, &ctx.journal)))
+        {
+            if (INVALID_HANDLE_VALUE != ctx.hJournal)
+            {
+                CloseHandle(ctx.hJournal);
+            }
+            CloseHandle(ctx.hTemp);
+            userParams->errorcode = WW_ERR_CREATE_FILE;
+            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+            return WW_FAILURE;
+        }
+    }
+
+    ctx.mirrors = (WW_MIRRORW*)calloc(1 + userParams->mirrorCount,
+                                      sizeof(WW_MIRRORW));
+    if (NULL == ctx.mirrors)
+    {
+        if (INVALID_HANDLE_VALUE != ctx.hJournal)
+        {
+            CloseHandle(ctx.hJournal);
+        }
+        CloseHandle(ctx.hTemp);
+        userParams->errorcode = WW_ERR_MALLOC;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        return WW_FAILURE;
+    }
+
+    // The URL of the download is the first source. Its initial response
+    // counts as a connection until the first segment reads it.
+    ctx.mirrors[0].hConn = hConn;
+    wcsncpy(ctx.mirrors[0].urlPath, urlPath, WW_STR_SYMSW(ctx.mirrors[0].urlPath));
+    ctx.mirrors[0].requestFlags = requestFlags;
+    ctx.mirrors[0].hostRate = privateParams->hostRate;
+    ctx.mirrors[0].active = (NULL != ctx.hFirst) ? 1 : 0;
+    ctx.mirrorCount = 1;
+    ctx.liveMirrors = 1;
+    WWMirrorsOpenW(&ctx, privateParams->hInet, requestFlags);
+    ctx.split = (ctx.liveMirrors > 1);
+
+    UINT pending = 0;
+    for (DWORD i = 0; i < ctx.journal.segmentCount; ++i)
+    {
+        const WW_SEGMENT* seg = &ctx.journal.segments[i];
+        ctx.liveDone[i] = seg->done;
+        ctx.bytesDone += seg->done;
+        if (seg->done < seg->end - seg->start)
+        {
+            ++pending;
+        }
+    }
+
+    WWPBARINFO* pbar = &userParams->progressBarData;
+    pbar->szTotalInBytes      = size;
+    pbar->szWireTotalInBytes  = size;
+    pbar->szDownloadedInBytes = ctx.bytesDone;
+    pbar->szWireInBytes       = ctx.bytesDone;
+
+    // With mirrors, workers that run out of ranges split the running ones
+    UINT workers = (userParams->segments > 1) ? userParams->segments :
+                   ctx.liveMirrors;
+    if (workers > WW_MAX_DOWNLOAD_SEGMENTS)
+    {
+        workers = WW_MAX_DOWNLOAD_SEGMENTS;
+    }
+    if (FALSE == ctx.split && workers > pending)
+    {
+        workers = pending;
+    }
+
+    // Every worker needs a connection of its own
+    WWRaiseConnectionLimit(workers);
+
+    InitializeCriticalSection(&ctx.lock);
+
+    // The calling thread is one of the workers
+    HANDLE* threads = NULL;
+    UINT threadCount = 0;
+    if (workers > 1)
+    {
+        threads = (HANDLE*)calloc(workers - 1, sizeof(HANDLE));
+        if (NULL != threads)
+        {
+            for (UINT i = 0; i < workers - 1; ++i)
+            {
+                threads[threadCount] = CreateThread(NULL, 0, WWSegmentWorkerW,
+                                                    &ctx, 0, NULL);
+                if (NULL != threads[threadCount])
+                {
+                    ++threadCount;
+                }
+            }
+        }
+    }
+
+    WWSegmentWorkerW(&ctx);
+
+    for (UINT i = 0; i < threadCount; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+    DeleteCriticalSection(&ctx.lock);
+    WWMirrorsCloseW(&ctx);
+
+    pbar->szDownloadedInBytes = ctx.bytesDone;
+    pbar->szWireInBytes       = ctx.bytesDone;
+
+    if (INVALID_HANDLE_VALUE != ctx.hJournal)
+    {
+        CloseHandle(ctx.hJournal);
+    }
+
+    // The temporary file and the journal stay for the next attempt
+    if (ctx.failed)
+    {
+        CloseHandle(ctx.hTemp);
+        userParams->errorcode = ctx.errorcode;
+        privateParams->statusCode = ctx.statusCode;
+        return WW_FAILURE;
+    }
+
+    // Ranges arrive out of order, so the digest is computed from the file
+    WW_HASHCTX digestCtx = WW_STRUCT_NULL;
+    if (WWHashBegin(&digestCtx, userParams->hashAlgorithm))
+    {
+        LARGE_INTEGER liStart = WW_STRUCT_NULL;
+        DWORD digestSize = WWHashDigestSize(userParams->hashAlgorithm);
+        if (SetFilePointerEx(ctx.hTemp, liStart, NULL, FILE_BEGIN) &&
+            WWHashFileW(ctx.hTemp, size, &digestCtx) &&
+            WWHashEnd(&digestCtx, userParams->digest, digestSize))
+        {
+            userParams->digestSize = digestSize;
+        }
+        else
+        {
+            WWHashEnd(&digestCtx, NULL, 0);
+        }
+    }
+
+    if (NULL != pftLastModified)
+    {
+        SetFileTime(ctx.hTemp, NULL, NULL, pftLastModified);
+    }
+    CloseHandle(ctx.hTemp);
+
+    if (FALSE == WWDigestMatchesW(userParams))
+    {
+        userParams->errorcode = WW_ERR_DIGEST_MISMATCH;
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        DeleteFileW(journalPath);
+        DeleteFileW(filePathTemp);
+        return WW_FAILURE;
+    }
+
+    if (userParams->forceDownload)
+    {
+        SetFileAttributesW(privateParams->fullFilePath, FILE_ATTRIBUTE_NORMAL);
+        DeleteFileW(privateParams->fullFilePath);
+    }
+
+    WWTraceBeginW(WW_TRACE_RENAME, NULL);
+    BOOL renamed = MoveFileExW(filePathTemp, privateParams->fullFilePath,
+                               MOVEFILE_REPLACE_EXISTING);
+    WWTraceEndW(WW_TRACE_RENAME, 0, !renamed);
+    if (FALSE == renamed)
+    {
+        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
+        return WW_FAILURE;
+    }
+
+    // Without its temporary file the journal is ignored anyway
+    DeleteFileW(journalPath);
+    return WW_SUCCESS;
+}
+
+WW_PRIVATE
+INT 
+WWMakeDownloadPathW(
+                    LPCWSTR url, 
+                    LPWSTR path, 
+                    DWORD len
+                   ) 
+{
+    LPCWSTR fnurl = wcsrchr(url, L'/');
+    if (fnurl == NULL || wcslen(fnurl) == 1)
+    {
+        wprintf(L"ERROR : local path\n");
+        return WW_FAILURE;
+    }
+    wcsncpy(path, fnurl + 1, len);
+    path[len - 1] = L'\0';
+
+    LPWSTR ppath = wcschr(path, L'?');
+    if (ppath != NULL)
+    {
+        *ppath = L'\0';
+    }
+
+    // Preferred File Name
+    LPWSTR pfname = path;
+    while ((pfname = wcspbrk(pfname, L"\\/:*?\"<>|")) != NULL)
+    {
+        *pfname = L'_';
+    }
+
+    return WW_SUCCESS;
+}
+
+WW_PRIVATE
+INT
+WWGetSizeUnitW(
+                double sizeValue
+              )
+{
+    INT sizeUnit = 0;
+    for (INT i = 0; i < WW_COUNTOF(sizeUnitW); i++)
+    {
+        if (sizeValue >= sizeUnitW[i].size)
+        {
+            sizeUnit = i;
+            break;
+        }
+    }
+    return sizeUnit;
+}
+
+WW_PRIVATE
+BOOL
+WWIsRedirectStatus(
+    DWORD statusCode
+)
+{
+    return statusCode == HTTP_STATUS_MOVED ||
+           statusCode == HTTP_STATUS_REDIRECT ||
+           statusCode == HTTP_STATUS_REDIRECT_METHOD ||
+           statusCode == HTTP_STATUS_REDIRECT_KEEP_VERB ||
+           statusCode == 308;
+}
+
+WW_PRIVATE
+BOOL
+WWBuildRequestPathW(
+    const URL_COMPONENTSW* ptrUrlC,
+    LPWSTR outPath,
+    DWORD outPathCch
+)
+{
+    if (NULL == ptrUrlC || NULL == outPath || 0 == outPathCch)
+    {
+        return FALSE;
+    }
+
+    outPath[0] = L'\0';
+
+    if (NULL == ptrUrlC->lpszUrlPath || 0 == ptrUrlC->dwUrlPathLength)
+    {
+        if (outPathCch < 2)
+        {
+            return FALSE;
+        }
+        wcscpy(outPath, L"/");
+    }
+    else
+    {
+        if (ptrUrlC->dwUrlPathLength + 1 > outPathCch)
+        {
+            return FALSE;
+        }
+        wcsncpy(outPath, ptrUrlC->lpszUrlPath, ptrUrlC->dwUrlPathLength + 1);
+        outPath[ptrUrlC->dwUrlPathLength] = L'\0';
+    }
+
+    if (NULL != ptrUrlC->lpszExtraInfo && ptrUrlC->dwExtraInfoLength > 0)
+    {
+        size_t pathLen = wcslen(outPath);
+        if (pathLen + ptrUrlC->dwExtraInfoLength + 1 > outPathCch)
+        {
+            return FALSE;
+        }
+        wcsncpy(outPath + pathLen, ptrUrlC->lpszExtraInfo,
+                ptrUrlC->dwExtraInfoLength + 1);
+        outPath[pathLen + ptrUrlC->dwExtraInfoLength] = L'\0';
+    }
+
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWBuildRequestPathA(
+    const URL_COMPONENTSA* ptrUrlC,
+    LPSTR outPath,
+    DWORD outPathCch
+)
+{
+    if (NULL == ptrUrlC || NULL == outPath || 0 == outPathCch)
+    {
+        return FALSE;
+    }
+
+    outPath[0] = '\0';
+
+    if (NULL == ptrUrlC->lpszUrlPath || 0 == ptrUrlC->dwUrlPathLength)
+    {
+        if (outPathCch < 2)
+        {
+            return FALSE;
+        }
+        strcpy(outPath, "/");
+    }
+    else
+    {
+        if (ptrUrlC->dwUrlPathLength + 1 > outPathCch)
+        {
+            return FALSE;
+        }
+        strncpy(outPath, ptrUrlC->lpszUrlPath, ptrUrlC->dwUrlPathLength + 1);
+        outPath[ptrUrlC->dwUrlPathLength] = '\0';
+    }
+
+    if (NULL != ptrUrlC->lpszExtraInfo && ptrUrlC->dwExtraInfoLength > 0)
+    {
+        size_t pathLen = strlen(outPath);
+        if (pathLen + ptrUrlC->dwExtraInfoLength + 1 > outPathCch)
+        {
+            return FALSE;
+        }
+        strncpy(outPath + pathLen, ptrUrlC->lpszExtraInfo,
+                ptrUrlC->dwExtraInfoLength + 1);
+        outPath[pathLen + ptrUrlC->dwExtraInfoLength] = '\0';
+    }
+
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWResolveRedirectW(
+    LPCWSTR baseUrl,
+    LPCWSTR location,
+    LPWSTR outUrl,
+    DWORD outUrlCch
+)
+{
+    if (NULL == baseUrl || NULL == location || NULL == outUrl ||
+        0 == outUrlCch)
+    {
+        return FALSE;
+    }
+
+    LPWSTR resolvedUrl = (LPWSTR)malloc(outUrlCch * sizeof(WCHAR));
+    if (NULL == resolvedUrl)
+    {
+        return FALSE;
+    }
+
+    DWORD resolvedUrlCch = outUrlCch;
+    BOOL ok = InternetCombineUrlW(baseUrl, location, resolvedUrl,
+                                  &resolvedUrlCch, 0);
+    if (ok)
+    {
+        wcsncpy(outUrl, resolvedUrl, outUrlCch);
+        outUrl[outUrlCch - 1] = L'\0';
+    }
+
+    free(resolvedUrl);
+    return ok;
+}
+
+WW_PRIVATE
+BOOL
+WWResolveRedirectA(
+    LPCSTR baseUrl,
+    LPCSTR location,
+    LPSTR outUrl,
+    DWORD outUrlCch
+)
+{
+    if (NULL == baseUrl || NULL == location || NULL == outUrl ||
+        0 == outUrlCch)
+    {
+        return FALSE;
+    }
+
+    LPSTR resolvedUrl = (LPSTR)malloc(outUrlCch);
+    if (NULL == resolvedUrl)
+    {
+        return FALSE;
+    }
+
+    DWORD resolvedUrlCch = outUrlCch;
+    BOOL ok = InternetCombineUrlA(baseUrl, location, resolvedUrl,
+                                  &resolvedUrlCch, 0);
+    if (ok)
+    {
+        strncpy(outUrl, resolvedUrl, outUrlCch);
+        outUrl[outUrlCch - 1] = '\0';
+    }
+
+    free(resolvedUrl);
+    return ok;
+}
+
+
+WW_PRIVATE
+VOID 
+WWLogW(
+        BOOL logEnabled, 
+        INT msgType, 
+        LPCWSTR displayStr
+      ) 
+{
+    if (!logEnabled) return;
+    switch (msgType) 
+    {
+        case WW_LOG_MODULE: case WW_LOG_WININET:
+        {
+            DWORD error = GetLastError();
+            HMODULE hModule = NULL;
+
+            if (msgType == WW_LOG_WININET) 
+            {
+                hModule = GetModuleHandleW(L"wininet.dll");
+                WWLogW(logEnabled, WW_LOG_LASTRESPONSE, NULL);
+            }
+
+            LPWSTR message = NULL;
+
+            wprintf(L"ERROR : 0x%08X\n", error);
+
+            DWORD formatMsgFlag;
+
+            if (hModule != NULL) 
+            {
+                formatMsgFlag = FORMAT_MESSAGE_FROM_HMODULE;
+            }
+            else 
+            {
+                formatMsgFlag = FORMAT_MESSAGE_FROM_SYSTEM;
+            }
+
+            FormatMessageW(
+                FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                FORMAT_MESSAGE_IGNORE_INSERTS |
+                formatMsgFlag,
+                hModule, error, MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US),
+                (LPWSTR)&message, 0, NULL
+            );
+
+            if (message != NULL) 
+            {
+                wprintf(L"%s\n", message);
+                LocalFree(message);
+            }
+            break;
+        }
+        case WW_LOG_REDIRS_EXCEEDED:
+        {
+            wprintf(L"ERROR : Redirect limit exceeded\n");
+            break;
+        }
+        case WW_LOG_UNKNOWN_SCHEME:
+        {
+            wprintf(L"ERROR : Unknown scheme: %s\n", displayStr);
+            break;
+        }
+        case WW_LOG_HEADER:
+        {
+            wprintf(L"=== HEADER START === \n");
+            wprintf(L"%s\n", displayStr);
+            wprintf(L"=== HEADER END === \n");
+            break;
+        }
+        case WW_LOG_LASTRESPONSE:
+        {
+            DWORD dwError = 0;
+            PWSTR szBuffer = NULL;
+            DWORD dwBufferSize = 0;
+
+            if (InternetGetLastResponseInfoW(&dwError, szBuffer,
+                &dwBufferSize) == FALSE) {
+                DWORD error = GetLastError();
+                if (error == ERROR_INSUFFICIENT_BUFFER) {
+                    dwBufferSize += 1;
+                    szBuffer = (PWSTR)LocalAlloc(LPTR, dwBufferSize * sizeof(WCHAR));
+                    if (szBuffer != NULL) {
+                        if (InternetGetLastResponseInfoW(&dwError, szBuffer,
+                            &dwBufferSize) == TRUE) {
+                            wprintf(L"%s\n", szBuffer);
+                        }
+                        LocalFree(szBuffer);
+                    }
+                }
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Generic API
+ */
+
+WW_PRIVATE
+BOOL
+WWIsFileModified(
+    HANDLE hFileN,
+    LONGLONG fileSize,
+    const FILETIME* pftLastWriteTime
+)
+{
+    BOOL bStatus = (INVALID_HANDLE_VALUE == hFileN);
+    if (!bStatus)
+    {
+        FILETIME ft;
+        LARGE_INTEGER li;
+
+        GetFileTime(hFileN, NULL, NULL, &ft);
+        GetFileSizeEx(hFileN, &li);
+
+        bStatus = !(fileSize == li.QuadPart && \
+            CompareFileTime(pftLastWriteTime, &ft) <= 0);
+    }
+    return bStatus;
+}
+
+WW_PRIVATE
+ULONGLONG
+WWGetTimeUs(void)
+{
+    static LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER counter;
+
+    if (0 == frequency.QuadPart)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+
+    // Split to avoid overflowing counter * 1000000
+    ULONGLONG seconds = (ULONGLONG)(counter.QuadPart / frequency.QuadPart);
+    ULONGLONG remainder = (ULONGLONG)(counter.QuadPart % frequency.QuadPart);
+    return seconds * 1000000ULL +
+           remainder * 1000000ULL / (ULONGLONG)frequency.QuadPart;
+}
+
+/******************************* HTTP PARSER **********************************/
+
+/**
+ * @brief Delimiter scanner: returns the first control character, DEL or
+ *        (optionally) colon in [p, end), or end if there is none.
+ */
+typedef const CHAR* (*WW_SCAN_FN)(const CHAR* p, const CHAR* end,
+                                  BOOL stopAtColon);
+
+enum E_WW_CHUNK_STATE {
+    WW_CHUNK_SIZE = 0,
+    WW_CHUNK_SIZE_END,
+    WW_CHUNK_EXT,
+    WW_CHUNK_SIZE_LF,
+    WW_CHUNK_DATA,
+    WW_CHUNK_CRLF,
+    WW_CHUNK_TRAILER_HEAD,
+    WW_CHUNK_TRAILER_MIDDLE
+};
+
+static WW_SCAN_FN g_wwScanDelim = NULL;
+
+WW_PRIVATE
+const CHAR*
+WWScanDelimScalar(
+    const CHAR* p,
+    const CHAR* end,
+    BOOL stopAtColon
+)
+{
+    for (; p < end; ++p)
+    {
+        BYTE c = (BYTE)*p;
+        if (c < 0x20 || 0x7f == c || (stopAtColon && ':' == c))
+        {
+            break;
+        }
+    }
+    return p;
+}
+
+#ifdef WW_HAVE_X86_SIMD
+
+WW_PRIVATE
+UINT
+WWCountTrailingZeros(
+    UINT mask
+)
+{
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (UINT)index;
+#else
+    return (UINT)__builtin_ctz(mask);
+#endif
+}
+
+WW_TARGET("sse4.2")
+WW_PRIVATE
+const CHAR*
+WWScanDelimSse42(
+    const CHAR* p,
+    const CHAR* end,
+    BOOL stopAtColon
+)
+{
+    // Byte ranges: [0x00-0x1f], [0x7f-0x7f] and optionally [':'-':']
+    static const CHAR ranges[16] = "\x00\x1f\x7f\x7f::";
+    const __m128i vRanges = _mm_loadu_si128((const __m128i*)ranges);
+    const int rangeLen = stopAtColon ? 6 : 4;
+
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int index = _mm_cmpestri(vRanges, rangeLen, chunk, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                 _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16)
+        {
+            return p + index;
+        }
+        p += 16;
+    }
+    return WWScanDelimScalar(p, end, stopAtColon);
+}
+
+WW_TARGET("avx2")
+WW_PRIVATE
+const CHAR*
+WWScanDelimAvx2(
+    const CHAR* p,
+    const CHAR* end,
+    BOOL stopAtColon
+)
+{
+    const __m256i ctlMax = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i colon = _mm256_set1_epi8(stopAtColon ? ':' : 0x7f);
+
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        // Unsigned v <= 0x1f  <=>  min(v, 0x1f) == v
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctlMax), v);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, del));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, colon));
+        UINT mask = (UINT)_mm256_movemask_epi8(hit);
+        if (0 != mask)
+        {
+            return p + WWCountTrailingZeros(mask);
+        }
+        p += 32;
+    }
+    return WWScanDelimScalar(p, end, stopAtColon);
+}
+
+#endif // WW_HAVE_X86_SIMD
+
+WW_PRIVATE
+WW_SCAN_FN
+WWGetScanDelim(void)
+{
+    WW_SCAN_FN fn = g_wwScanDelim;
+    if (NULL == fn)
+    {
+        fn = WWScanDelimScalar;
+#ifdef WW_HAVE_X86_SIMD
+        if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE))
+        {
+            fn = WWScanDelimAvx2;
+        }
+        else if (IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE))
+        {
+            fn = WWScanDelimSse42;
+        }
+#endif
+        // Benign race: every thread computes the same pointer
+        g_wwScanDelim = fn;
+    }
+    return fn;
+}
+
+WW_PRIVATE
+CHAR
+WWAsciiLower(
+    CHAR c
+)
+{
+    return (c >= 'A' && c <= 'Z') ? (CHAR)(c - 'A' + 'a') : c;
+}
+
+WW_PRIVATE
+BOOL
+WWSliceEqualsI(
+    const CHAR* ptr,
+    SIZE_T len,
+    LPCSTR literal
+)
+{
+    SIZE_T i = 0;
+    for (; i < len; ++i)
+    {
+        if ('\0' == literal[i] ||
+            WWAsciiLower(ptr[i]) != WWAsciiLower(literal[i]))
+        {
+            return FALSE;
+        }
+    }
+    return '\0' == literal[i];
+}
+
+WW_PRIVATE
+VOID
+WWSliceTrim(
+    const CHAR** pptr,
+    SIZE_T* plen
+)
+{
+    const CHAR* p = *pptr;
+    SIZE_T len = *plen;
+    while (len > 0 && (' ' == *p || '\t' == *p))
+    {
+        ++p;
+        --len;
+    }
+    while (len > 0 && (' ' == p[len - 1] || '\t' == p[len - 1]))
+    {
+        --len;
+    }
+    *pptr = p;
+    *plen = len;
+}
+
+/**
+ * @brief Check whether a comma-separated header value contains a token.
+ *        With lastOnly set, only the final list element is compared.
+ */
+WW_PRIVATE
+BOOL
+WWSliceHasToken(
+    const CHAR* ptr,
+    SIZE_T len,
+    LPCSTR token,
+    BOOL lastOnly
+)
+{
+    const CHAR* end = ptr + len;
+    BOOL found = FALSE;
+    while (ptr <= end)
+    {
+        const CHAR* comma = (const CHAR*)memchr(ptr, ',', (SIZE_T)(end - ptr));
+        const CHAR* itemEnd = (NULL != comma) ? comma : end;
+        const CHAR* item = ptr;
+        SIZE_T itemLen = (SIZE_T)(itemEnd - ptr);
+        WWSliceTrim(&item, &itemLen);
+        found = WWSliceEqualsI(item, itemLen, token);
+        if (found && !lastOnly)
+        {
+            return TRUE;
+        }
+        if (NULL == comma)
+        {
+            break;
+        }
+        ptr = comma + 1;
+    }
+    return found;
+}
+
+/**
+ * @brief Consume a CRLF or bare LF line ending.
+ */
+WW_PRIVATE
+BOOL
+WWEatLineEnd(
+    const CHAR** pp,
+    const CHAR* end
+)
+{
+    const CHAR* p = *pp;
+    if (p < end && '\r' == *p)
+    {
+        ++p;
+    }
+    if (p >= end || '\n' != *p)
+    {
+        return FALSE;
+    }
+    *pp = p + 1;
+    return TRUE;
+}
+
+/**
+ * @brief Locate the blank line ending the response head.
+ *
+ * @return Length of the head including the blank line, or 0 if incomplete.
+ */
+WW_PRIVATE
+SIZE_T
+WWHttpFindHeadEnd(
+    const CHAR* buf,
+    SIZE_T len,
+    SIZE_T from
+)
+{
+    SIZE_T pos = from;
+    while (pos < len)
+    {
+        const CHAR* nl = (const CHAR*)memchr(buf + pos, '\n', len - pos);
+        if (NULL == nl)
+        {
+            break;
+        }
+        pos = (SIZE_T)(nl - buf) + 1;
+        if (pos < len && '\n' == buf[pos])
+        {
+            return pos + 1;
+        }
+        if (pos + 1 < len && '\r' == buf[pos] && '\n' == buf[pos + 1])
+        {
+            return pos + 2;
+        }
+    }
+    return 0;
+}
+
+WW_PRIVATE
+INT
+WWHttpParseHeaderLine(
+    WW_HTTP_PARSER* parser,
+    WW_SCAN_FN scan,
+    const CHAR** pp,
+    const CHAR* end
+)
+{
+    const CHAR* p = *pp;
+
+    // Obsolete line folding is rejected (RFC 7230, 3.2.4)
+    if (' ' == *p || '\t' == *p)
+    {
+        return WW_PARSE_ERROR;
+    }
+
+    const CHAR* name = p;
+    p = scan(p, end, TRUE);
+    if (p >= end || ':' != *p || p == name ||
+        NULL != memchr(name, ' ', (SIZE_T)(p - name)))
+    {
+        return WW_PARSE_ERROR;
+    }
+    SIZE_T nameLen = (SIZE_T)(p - name);
+    ++p;
+
+    const CHAR* value = p;
+    for (;;)
+    {
+        p = scan(p, end, FALSE);
+        if (p < end && '\t' == *p)
+        {
+            ++p;
+            continue;
+        }
+        break;
+    }
+    SIZE_T valueLen = (SIZE_T)(p - value);
+    if (FALSE == WWEatLineEnd(&p, end))
+    {
+        return WW_PARSE_ERROR;
+    }
+    WWSliceTrim(&value, &valueLen);
+
+    if (parser->headerCount >= parser->maxHeaders)
+    {
+        return WW_PARSE_TOO_MANY_HEADERS;
+    }
+
+    WW_HTTP_HEADER* header = &parser->headers[parser->headerCount++];
+    header->name.ptr = name;
+    header->name.len = nameLen;
+    header->value.ptr = value;
+    header->value.len = valueLen;
+
+    if (WWSliceEqualsI(name, nameLen, "content-length"))
+    {
+        ULONGLONG length = 0;
+        if (0 == valueLen)
+        {
+            return WW_PARSE_ERROR;
+        }
+        for (SIZE_T i = 0; i < valueLen; ++i)
+        {
+            if (value[i] < '0' || value[i] > '9' ||
+                length > (0xFFFFFFFFFFFFFFFFULL - 9) / 10)
+            {
+                return WW_PARSE_ERROR;
+            }
+            length = length * 10 + (ULONGLONG)(value[i] - '0');
+        }
+        // Conflicting duplicates are a request-smuggling vector
+        if (parser->hasContentLength && parser->contentLength != length)
+        {
+            return WW_PARSE_ERROR;
+        }
+        parser->contentLength = length;
+        parser->hasContentLength = TRUE;
+    }
+    else if (WWSliceEqualsI(name, nameLen, "transfer-encoding"))
+    {
+        parser->chunked = WWSliceHasToken(value, valueLen, "chunked", TRUE);
+    }
+    else if (WWSliceEqualsI(name, nameLen, "connection"))
+    {
+        if (WWSliceHasToken(value, valueLen, "close", FALSE))
+        {
+            parser->connectionClose = TRUE;
+        }
+    }
+
+    *pp = p;
+    return WW_PARSE_OK;
+}
+
+INT
+WWHttpParseResponse(
+    WW_HTTP_PARSER* parser,
+    const CHAR* buf,
+    SIZE_T len
+)
+{
+    if (NULL == parser || (NULL == buf && len > 0) ||
+        (NULL == parser->headers && parser->maxHeaders > 0))
+    {
+        return WW_PARSE_ERROR;
+    }
+
+    // Re-examine the last few bytes: the blank line may straddle two reads
+    SIZE_T from = (parser->scanned > 3) ? parser->scanned - 3 : 0;
+    SIZE_T headEnd = WWHttpFindHeadEnd(buf, len, from);
+    if (0 == headEnd)
+    {
+        parser->scanned = len;
+        return WW_PARSE_INCOMPLETE;
+    }
+
+    WW_SCAN_FN scan = WWGetScanDelim();
+    const CHAR* p = buf;
+    const CHAR* end = buf + headEnd;
+
+    parser->headerCount = 0;
+    parser->contentLength = 0;
+    parser->hasContentLength = FALSE;
+    parser->chunked = FALSE;
+    parser->connectionClose = FALSE;
+
+    // Status line: "HTTP/1.x SSS reason"
+    if (end - p < 13 || 0 != memcmp(p, "HTTP/1.", 7) ||
+        p[7] < '0' || p[7] > '9' || ' ' != p[8])
+    {
+        return WW_PARSE_ERROR;
+    }
+    parser->versionMinor = (UINT)(p[7] - '0');
+    p += 9;
+
+    DWORD status = 0;
+    for (INT i = 0; i < 3; ++i, ++p)
+    {
+        if (*p < '0' || *p > '9')
+        {
+            return WW_PARSE_ERROR;
+        }
+        status = status * 10 + (DWORD)(*p - '0');
+    }
+    parser->statusCode = status;
+
+    parser->reason.ptr = p;
+    parser->reason.len = 0;
+    if (' ' == *p)
+    {
+        const CHAR* reason = ++p;
+        for (;;)
+        {
+            p = scan(p, end, FALSE);
+            if (p < end && '\t' == *p)
+            {
+                ++p;
+                continue;
+            }
+            break;
+        }
+        parser->reason.ptr = reason;
+        parser->reason.len = (SIZE_T)(p - reason);
+    }
+    if (FALSE == WWEatLineEnd(&p, end))
+    {
+        return WW_PARSE_ERROR;
+    }
+
+    // Header lines up to the blank line
+    while (p < end && '\r' != *p && '\n' != *p)
+    {
+        INT result = WWHttpParseHeaderLine(parser, scan, &p, end);
+        if (WW_PARSE_OK != result)
+        {
+            return result;
+        }
+    }
+    if (FALSE == WWEatLineEnd(&p, end) || p != end)
+    {
+        return WW_PARSE_ERROR;
+    }
+
+    parser->scanned = headEnd;
+    parser->headerBytes = headEnd;
+    return WW_PARSE_OK;
+}
+
+const WW_HTTP_HEADER*
+WWHttpFindHeader(
+    const WW_HTTP_PARSER* parser,
+    LPCSTR name
+)
+{
+    if (NULL == parser || NULL == name)
+    {
+        return NULL;
+    }
+    for (SIZE_T i = 0; i < parser->headerCount; ++i)
+    {
+        const WW_HTTP_HEADER* header = &parser->headers[i];
+        if (WWSliceEqualsI(header->name.ptr, header->name.len, name))
+        {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+WW_PRIVATE
+INT
+WWHexDigitValue(
+    CHAR c
+)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+INT
+WWHttpDecodeChunked(
+    WW_CHUNKED_DECODER* decoder,
+    CHAR* buf,
+    SIZE_T* len
+)
+{
+    if (NULL == decoder || NULL == len || (NULL == buf && *len > 0))
+    {
+        return WW_PARSE_ERROR;
+    }
+
+    SIZE_T src = 0;
+    SIZE_T dst = 0;
+    SIZE_T bufSize = *len;
+    INT result = WW_PARSE_INCOMPLETE;
+    decoder->trailing = 0;
+
+    while (WW_PARSE_INCOMPLETE == result && src < bufSize)
+    {
+        CHAR ch = buf[src];
+        switch (decoder->state)
+        {
+            case WW_CHUNK_SIZE:
+            {
+                INT digit = WWHexDigitValue(ch);
+                if (digit >= 0)
+                {
+                    // 15 hex digits keep the size well inside 64 bits
+                    if (decoder->hexDigits >= 15)
+                    {
+                        result = WW_PARSE_ERROR;
+                        break;
+                    }
+                    decoder->chunkRemaining =
+                        (decoder->chunkRemaining << 4) | (ULONGLONG)digit;
+                    ++decoder->hexDigits;
+                    ++src;
+                }
+                else if (0 == decoder->hexDigits)
+                {
+                    result = WW_PARSE_ERROR;
+                }
+                else
+                {
+                    decoder->state = WW_CHUNK_SIZE_END;
+                }
+                break;
+            }
+            case WW_CHUNK_SIZE_END:
+                // Only whitespace may sit between the size and ';' or CRLF
+                ++src;
+                if (';' == ch)
+                {
+                    decoder->state = WW_CHUNK_EXT;
+                }
+                else if ('\r' == ch)
+                {
+                    decoder->state = WW_CHUNK_SIZE_LF;
+                }
+                else if (' ' != ch && '\t' != ch)
+                {
+                    result = WW_PARSE_ERROR;
+                }
+                break;
+            case WW_CHUNK_EXT:
+                // Chunk extensions are skipped up to the end of the line
+                ++src;
+                if ('\r' == ch)
+                {
+                    decoder->state = WW_CHUNK_SIZE_LF;
+                }
+                else if ('\n' == ch)
+                {
+                    result = WW_PARSE_ERROR;
+                }
+                break;
+            case WW_CHUNK_SIZE_LF:
+                ++src;
+                if ('\n' != ch)
+                {
+                    result = WW_PARSE_ERROR;
+                    break;
+                }
+                decoder->hexDigits = 0;
+                decoder->state = (0 != decoder->chunkRemaining)
+                    ? WW_CHUNK_DATA : WW_CHUNK_TRAILER_HEAD;
+                break;
+            case WW_CHUNK_DATA:
+            {
+                SIZE_T avail = bufSize - src;
+                SIZE_T take = ((ULONGLONG)avail < decoder->chunkRemaining)
+                    ? avail : (SIZE_T)decoder->chunkRemaining;
+                if (dst != src)
+                {
+                    MoveMemory(buf + dst, buf + src, take);
+                }
+                dst += take;
+                src += take;
+                decoder->chunkRemaining -= take;
+                if (0 == decoder->chunkRemaining)
+                {
+                    decoder->state = WW_CHUNK_CRLF;
+                }
+                break;
+            }
+            case WW_CHUNK_CRLF:
+                ++src;
+                if ('\n' == ch)
+                {
+                    decoder->state = WW_CHUNK_SIZE;
+                }
+                else if ('\r' != ch)
+                {
+                    result = WW_PARSE_ERROR;
+                }
+                break;
+            case WW_CHUNK_TRAILER_HEAD:
+                ++src;
+                if ('\n' == ch)
+                {
+                    result = WW_PARSE_OK;
+                }
+                else if ('\r' != ch)
+                {
+                    decoder->state = WW_CHUNK_TRAILER_MIDDLE;
+                }
+                break;
+            case WW_CHUNK_TRAILER_MIDDLE:
+                ++src;
+                if ('\n' == ch)
+                {
+                    decoder->state = WW_CHUNK_TRAILER_HEAD;
+                }
+                break;
+            default:
+                result = WW_PARSE_ERROR;
+                break;
+        }
+    }
+
+    if (WW_PARSE_OK == result)
+    {
+        // Keep bytes of the next message right after the decoded payload
+        decoder->trailing = bufSize - src;
+        MoveMemory(buf + dst, buf + src, decoder->trailing);
+    }
+
+    *len = dst;
+    return result;
+}
+
+/********************************* INFLATE ************************************/
+
+WW_PRIVATE
+UINT
+WWCrc32Update(
+    UINT crc,
+    const BYTE* p,
+    SIZE_T size
+)
+{
+    // Reflected polynomial 0xEDB88320 (gzip), one nibble per lookup
+    static const UINT table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    crc = ~crc;
+    while (size-- > 0)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+WW_PRIVATE
+UINT
+WWAdler32Update(
+    UINT adler,
+    const BYTE* p,
+    SIZE_T size
+)
+{
+    UINT a = adler & 0xFFFF;
+    UINT b = adler >> 16;
+    while (size > 0)
+    {
+        // 5552 is the largest run that cannot overflow 32 bits before the modulo
+        SIZE_T run = (size > 5552) ? 5552 : size;
+        size -= run;
+        while (run-- > 0)
+        {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * @brief Next compressed byte, refilling from the network when the input
+ *        buffer is empty. FALSE at the end of the body or on a read error.
+ */
+WW_PRIVATE
+BOOL
+WWInflateNextByte(
+    WW_INFLATE* inf,
+    BYTE* byte
+)
+{
+    if (inf->inPos == inf->inLen)
+    {
+        if (inf->inEof || inf->failed)
+        {
+            return FALSE;
+        }
+        DWORD got = 0;
+        if (FALSE == InternetReadFile(inf->hReq, inf->in, sizeof(inf->in), &got))
+        {
+            inf->failed = TRUE;
+            return FALSE;
+        }
+        if (0 == got)
+        {
+            inf->inEof = TRUE;
+            return FALSE;
+        }
+        inf->wireBytes += got;
+        inf->inPos = 0;
+        inf->inLen = got;
+    }
+    *byte = inf->in[inf->inPos++];
+    return TRUE;
+}
+
+/**
+ * @brief Make at least n bits available. Past the end of input the buffer is
+ *        padded with zeros; consuming padding is detected by WWInflateDrop.
+ */
+WW_PRIVATE
+BOOL
+WWInflateNeed(
+    WW_INFLATE* inf,
+    UINT n
+)
+{
+    while (inf->bitCnt < n)
+    {
+        BYTE byte = 0;
+        if (FALSE == WWInflateNextByte(inf, &byte))
+        {
+            if (inf->failed)
+            {
+                return FALSE;
+            }
+            inf->padBits += 8;
+        }
+        inf->bitBuf |= (ULONGLONG)byte << inf->bitCnt;
+        inf->bitCnt += 8;
+    }
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWInflateDrop(
+    WW_INFLATE* inf,
+    UINT n
+)
+{
+    inf->bitBuf >>= n;
+    inf->bitCnt -= n;
+    // Eating into the zero padding means the body was truncated
+    return inf->bitCnt >= inf->padBits;
+}
+
+WW_PRIVATE
+BOOL
+WWInflateBits(
+    WW_INFLATE* inf,
+    UINT n,
+    UINT* value
+)
+{
+    if (FALSE == WWInflateNeed(inf, n))
+    {
+        return FALSE;
+    }
+    *value = (UINT)(inf->bitBuf & ((1ULL << n) - 1));
+    return WWInflateDrop(inf, n);
+}
+
+/**
+ * @brief Build a decoding table from code lengths.
+ *
+ * @return FALSE if the lengths describe an over-subscribed code.
+ */
+WW_PRIVATE
+BOOL
+WWHuffmanBuild(
+    WW_HUFFMAN* h,
+    const BYTE* lengths,
+    UINT n
+)
+{
+    USHORT offs[16];
+    USHORT next[16];
+    ZeroMemory(h->count, sizeof(h->count));
+    ZeroMemory(h->fast, sizeof(h->fast));
+
+    for (UINT sym = 0; sym < n; sym++)
+    {
+        h->count[lengths[sym]]++;
+    }
+    h->count[0] = 0;
+
+    INT left = 1;
+    for (UINT len = 1; len < 16; len++)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+        {
+            return FALSE;
+        }
+    }
+
+    // Incomplete codes are allowed; unused codes fail in WWHuffmanDecode
+    offs[1] = 0;
+    next[1] = 0;
+    for (UINT len = 1; len < 15; len++)
+    {
+        offs[len + 1] = offs[len] + h->count[len];
+        next[len + 1] = (USHORT)((next[len] + h->count[len]) << 1);
+    }
+
+    for (UINT sym = 0; sym < n; sym++)
+    {
+        UINT len = lengths[sym];
+        if (0 == len)
+        {
+            continue;
+        }
+        h->symbol[offs[len]++] = (USHORT)sym;
+
+        UINT code = next[len]++;
+        if (len <= WW_HUFF_FAST_BITS)
+        {
+            // Deflate sends codes MSB first; the bit buffer is LSB first
+            UINT rev = 0;
+            for (UINT i = 0; i < len; i++)
+            {
+                rev = (rev << 1) | ((code >> i) & 1);
+            }
+            for (UINT i = rev; i < (1u << WW_HUFF_FAST_BITS); i += 1u << len)
+            {
+                h->fast[i] = (USHORT)((len << 9) | sym);
+            }
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Decode one symbol. Returns -1 on invalid or truncated input.
+ */
+WW_PRIVATE
+INT
+WWHuffmanDecode(
+    WW_INFLATE* inf,
+    const WW_HUFFMAN* h
+)
+{
+    if (FALSE == WWInflateNeed(inf, 15))
+    {
+        return -1;
+    }
+
+    USHORT entry = h->fast[inf->bitBuf & ((1u << WW_HUFF_FAST_BITS) - 1)];
+    if (0 != entry)
+    {
+        return WWInflateDrop(inf, entry >> 9) ? (INT)(entry & 0x1FF) : -1;
+    }
+
+    ULONGLONG bits = inf->bitBuf;
+    INT code = 0;
+    INT first = 0;
+    INT index = 0;
+    for (UINT len = 1; len < 16; len++)
+    {
+        code |= (INT)(bits & 1);
+        bits >>= 1;
+        INT count = h->count[len];
+        if (code - count < first)
+        {
+            return WWInflateDrop(inf, len) ? h->symbol[index + (code - first)] : -1;
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+WW_PRIVATE
+BOOL
+WWInflateFixed(
+    WW_INFLATE* inf
+)
+{
+    BYTE lengths[WW_HUFF_MAX_SYMBOLS];
+    UINT sym = 0;
+    for (; sym < 144; sym++) lengths[sym] = 8;
+    for (; sym < 256; sym++) lengths[sym] = 9;
+    for (; sym < 280; sym++) lengths[sym] = 7;
+    for (; sym < 288; sym++) lengths[sym] = 8;
+    if (FALSE == WWHuffmanBuild(&inf->lencode, lengths, 288))
+    {
+        return FALSE;
+    }
+
+    for (sym = 0; sym < 30; sym++) lengths[sym] = 5;
+    return WWHuffmanBuild(&inf->distcode, lengths, 30);
+}
+
+WW_PRIVATE
+BOOL
+WWInflateDynamic(
+    WW_INFLATE* inf
+)
+{
+    BYTE lengths[286 + 30];
+    UINT nlen, ndist, ncode;
+
+    if (FALSE == WWInflateBits(inf, 5, &nlen) ||
+        FALSE == WWInflateBits(inf, 5, &ndist) ||
+        FALSE == WWInflateBits(inf, 4, &ncode))
+    {
+        return FALSE;
+    }
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > 286 || ndist > 30)
+    {
+        return FALSE;
+    }
+
+    ZeroMemory(lengths, sizeof(lengths));
+    for (UINT i = 0; i < ncode; i++)
+    {
+        UINT len;
+        if (FALSE == WWInflateBits(inf, 3, &len))
+        {
+            return FALSE;
+        }
+        lengths[g_wwCodeLengthOrder[i]] = (BYTE)len;
+    }
+    // The code length code is decoded with the literal table as scratch
+    if (FALSE == WWHuffmanBuild(&inf->lencode, lengths, 19))
+    {
+        return FALSE;
+    }
+
+    UINT index = 0;
+    while (index < nlen + ndist)
+    {
+        INT sym = WWHuffmanDecode(inf, &inf->lencode);
+        if (sym < 0)
+        {
+            return FALSE;
+        }
+        if (sym < 16)
+        {
+            lengths[index++] = (BYTE)sym;
+            continue;
+        }
+
+        BYTE len = 0;
+        UINT repeat = 0;
+        if (16 == sym)
+        {
+            if (0 == index || FALSE == WWInflateBits(inf, 2, &repeat))
+            {
+                return FALSE;
+            }
+            len = lengths[index - 1];
+            repeat += 3;
+        }
+        else if (17 == sym)
+        {
+            if (FALSE == WWInflateBits(inf, 3, &repeat))
+            {
+                return FALSE;
+            }
+            repeat += 3;
+        }
+        else
+        {
+            if (FALSE == WWInflateBits(inf, 7, &repeat))
+            {
+                return FALSE;
+            }
+            repeat += 11;
+        }
+        if (index + repeat > nlen + ndist)
+        {
+            return FALSE;
+        }
+        while (repeat-- > 0)
+        {
+            lengths[index++] = len;
+        }
+    }
+
+    // A block without an end-of-block code could never finish
+    if (0 == lengths[256])
+    {
+        return FALSE;
+    }
+    return WWHuffmanBuild(&inf->lencode, lengths, nlen) &&
+           WWHuffmanBuild(&inf->distcode, lengths + nlen, ndist);
+}
+
+/**
+ * @brief TRUE if any compressed input is left after the current position.
+ */
+WW_PRIVATE
+BOOL
+WWInflateHasInput(
+    WW_INFLATE* inf
+)
+{
+    if (inf->bitCnt >= inf->padBits + 8)
+    {
+        return TRUE;
+    }
+    BYTE byte = 0;
+    if (0 != inf->padBits || FALSE == WWInflateNextByte(inf, &byte))
+    {
+        return FALSE;
+    }
+    inf->inPos--;
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWInflateHeader(
+    WW_INFLATE* inf
+)
+{
+    UINT b0, b1;
+    if (WW_INFLATE_DEFLATE == inf->format)
+    {
+        // zlib: CM = 8, window <= 32K, header check multiple of 31
+        if (FALSE == WWInflateNeed(inf, 16))
+        {
+            return FALSE;
+        }
+        b0 = (UINT)(inf->bitBuf & 0xFF);
+        b1 = (UINT)((inf->bitBuf >> 8) & 0xFF);
+        inf->zlib = (8 == (b0 & 0x0F) && (b0 >> 4) <= 7 &&
+                     0 == ((b0 << 8) | b1) % 31);
+        if (inf->zlib)
+        {
+            inf->check = 1;
+            // A preset dictionary is never used over HTTP
+            return 0 == (b1 & 0x20) && WWInflateDrop(inf, 16);
+        }
+        return TRUE;
+    }
+
+    UINT flags, skip;
+    if (FALSE == WWInflateBits(inf, 8, &b0) ||
+        FALSE == WWInflateBits(inf, 8, &b1) ||
+        0x1F != b0 || 0x8B != b1 ||
+        FALSE == WWInflateBits(inf, 8, &b0) || 8 != b0 ||
+        FALSE == WWInflateBits(inf, 8, &flags) || 0 != (flags & 0xE0))
+    {
+        return FALSE;
+    }
+    // MTIME, XFL, OS
+    for (UINT i = 0; i < 6; i++)
+    {
+        if (FALSE == WWInflateBits(inf, 8, &b0))
+        {
+            return FALSE;
+        }
+    }
+    if (flags & 0x04)   // FEXTRA
+    {
+        if (FALSE == WWInflateBits(inf, 16, &skip))
+        {
+            return FALSE;
+        }
+        while (skip-- > 0)
+        {
+            if (FALSE == WWInflateBits(inf, 8, &b0))
+            {
+                return FALSE;
+            }
+        }
+    }
+    for (UINT field = 0x08; field <= 0x10; field <<= 1)   // FNAME, FCOMMENT
+    {
+        if (flags & field)
+        {
+            do
+            {
+                if (FALSE == WWInflateBits(inf, 8, &b0))
+                {
+                    return FALSE;
+                }
+            } while (0 != b0);
+        }
+    }
+    if ((flags & 0x02) && FALSE == WWInflateBits(inf, 16, &skip))   // FHCRC
+    {
+        return FALSE;
+    }
+    inf->check = 0;
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWInflateTrailer(
+    WW_INFLATE* inf
+)
+{
+    UINT lo, hi;
+    WWInflateDrop(inf, inf->bitCnt & 7);
+
+    if (WW_INFLATE_GZIP == inf->format)
+    {
+        // CRC-32, then ISIZE (length mod 2^32), both little-endian
+        if (FALSE == WWInflateBits(inf, 16, &lo) ||
+            FALSE == WWInflateBits(inf, 16, &hi) ||
+            ((hi << 16) | lo) != inf->check)
+        {
+            return FALSE;
+        }
+        return WWInflateBits(inf, 16, &lo) && WWInflateBits(inf, 16, &hi) &&
+               ((hi << 16) | lo) == (UINT)inf->total;
+    }
+    if (inf->zlib)
+    {
+        // Adler-32, big-endian
+        UINT adler = 0;
+        for (UINT i = 0; i < 4; i++)
+        {
+            if (FALSE == WWInflateBits(inf, 8, &lo))
+            {
+                return FALSE;
+            }
+            adler = (adler << 8) | lo;
+        }
+        return adler == inf->check;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Decode up to size bytes. *produced is 0 once the stream has ended.
+ *
+ * @return FALSE on a network error or corrupt/truncated data.
+ */
+WW_PRIVATE
+BOOL
+WWInflateRead(
+    WW_INFLATE* inf,
+    LPBYTE out,
+    DWORD size,
+    LPDWORD produced
+)
+{
+    const UINT mask = WW_INFLATE_WINDOW - 1;
+    DWORD o = 0;
+    DWORD checked = 0;
+    BOOL ok = TRUE;
+
+    while (ok && o < size && WW_INFLATE_DONE != inf->state)
+    {
+        switch (inf->state)
+        {
+            case WW_INFLATE_HEADER:
+                // An empty body (HEAD, 204, 304) has nothing to decode
+                if (FALSE == WWInflateHasInput(inf))
+                {
+                    inf->state = WW_INFLATE_DONE;
+                    ok = !inf->failed;
+                    break;
+                }
+                ok = WWInflateHeader(inf);
+                inf->lastBlock = FALSE;
+                inf->state = WW_INFLATE_BLOCK;
+                break;
+
+            case WW_INFLATE_BLOCK:
+            {
+                UINT header;
+                if (inf->lastBlock)
+                {
+                    inf->state = WW_INFLATE_TRAILER;
+                    break;
+                }
+                if (FALSE == WWInflateBits(inf, 3, &header))
+                {
+                    ok = FALSE;
+                    break;
+                }
+                inf->lastBlock = header & 1;
+                switch (header >> 1)
+                {
+                    case 0:
+                    {
+                        UINT len, nlen;
+                        WWInflateDrop(inf, inf->bitCnt & 7);
+                        ok = WWInflateBits(inf, 16, &len) &&
+                             WWInflateBits(inf, 16, &nlen) &&
+                             len == (~nlen & 0xFFFF);
+                        inf->storedLeft = len;
+                        inf->state = WW_INFLATE_STORED;
+                        break;
+                    }
+                    case 1:
+                        ok = WWInflateFixed(inf);
+                        inf->state = WW_INFLATE_CODES;
+                        break;
+                    case 2:
+                        ok = WWInflateDynamic(inf);
+                        inf->state = WW_INFLATE_CODES;
+                        break;
+                    default:
+                        ok = FALSE;
+                        break;
+                }
+                break;
+            }
+
+            case WW_INFLATE_STORED:
+                while (inf->storedLeft > 0 && o < size)
+                {
+                    UINT byte;
+                    if (FALSE == WWInflateBits(inf, 8, &byte))
+                    {
+                        ok = FALSE;
+                        break;
+                    }
+                    inf->window[inf->total++ & mask] = (BYTE)byte;
+                    out[o++] = (BYTE)byte;
+                    inf->storedLeft--;
+                }
+                if (0 == inf->storedLeft)
+                {
+                    inf->state = WW_INFLATE_BLOCK;
+                }
+                break;
+
+            case WW_INFLATE_CODES:
+                while (o < size)
+                {
+                    if (inf->copyLen > 0)
+                    {
+                        while (inf->copyLen > 0 && o < size)
+                        {
+                            BYTE byte = inf->window[(inf->total - inf->copyDist) & mask];
+                            inf->window[inf->total++ & mask] = byte;
+                            out[o++] = byte;
+                            inf->copyLen--;
+                        }
+                        continue;
+                    }
+
+                    INT sym = WWHuffmanDecode(inf, &inf->lencode);
+                    if (sym < 256)
+                    {
+                        if (sym < 0)
+                        {
+                            ok = FALSE;
+                            break;
+                        }
+                        inf->window[inf->total++ & mask] = (BYTE)sym;
+                        out[o++] = (BYTE)sym;
+                        continue;
+                    }
+                    if (256 == sym)
+                    {
+                        inf->state = WW_INFLATE_BLOCK;
+                        break;
+                    }
+
+                    sym -= 257;
+                    UINT extra, dist;
+                    INT dsym;
+                    if (sym >= 29 ||
+                        FALSE == WWInflateBits(inf, g_wwLenExtra[sym], &extra) ||
+                        (dsym = WWHuffmanDecode(inf, &inf->distcode)) < 0 ||
+                        dsym >= 30 ||
+                        FALSE == WWInflateBits(inf, g_wwDistExtra[dsym], &dist))
+                    {
+                        ok = FALSE;
+                        break;
+                    }
+                    inf->copyLen = g_wwLenBase[sym] + extra;
+                    inf->copyDist = g_wwDistBase[dsym] + dist;
+                    if (inf->copyDist > inf->total)
+                    {
+                        ok = FALSE;
+                        break;
+                    }
+                }
+                break;
+
+            case WW_INFLATE_TRAILER:
+                // Bring the checksum up to date before comparing
+                if (WW_INFLATE_GZIP == inf->format)
+                {
+                    inf->check = WWCrc32Update(inf->check, out + checked, o - checked);
+                }
+                else if (inf->zlib)
+                {
+                    inf->check = WWAdler32Update(inf->check, out + checked, o - checked);
+                }
+                checked = o;
+                ok = WWInflateTrailer(inf);
+                // gzip allows several members back to back
+                inf->state = (WW_INFLATE_GZIP == inf->format &&
+                              WWInflateHasInput(inf)) ? WW_INFLATE_HEADER :
+                                                        WW_INFLATE_DONE;
+                if (WW_INFLATE_HEADER == inf->state)
+                {
+                    inf->total = 0;
+                }
+                break;
+
+            default:
+                ok = FALSE;
+                break;
+        }
+    }
+
+    if (WW_INFLATE_GZIP == inf->format)
+    {
+        inf->check = WWCrc32Update(inf->check, out + checked, o - checked);
+    }
+    else if (inf->zlib)
+    {
+        inf->check = WWAdler32Update(inf->check, out + checked, o - checked);
+    }
+
+    *produced = o;
+    return ok && !inf->failed;
+}
+
+/**
+ * @brief Set up decoding for the response's Content-Encoding.
+ *
+ * @return WW_SUCCESS with *decoder NULL for an identity body, or
+ *         WW_FAILURE for an encoding that cannot be decoded.
+ */
+WW_PRIVATE
+INT
+WWOpenDecoderW(
+    HINTERNET hReq,
+    WW_INFLATE** decoder
+)
+{
+    WCHAR encoding[64] = L"";
+    DWORD len = sizeof(encoding);
+    *decoder = NULL;
+
+    if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_ENCODING, encoding,
+                                &len, NULL) ||
+        L'\0' == encoding[0] || 0 == _wcsicmp(encoding, L"identity"))
+    {
+        return WW_SUCCESS;
+    }
+
+    INT format;
+    if (0 == _wcsicmp(encoding, L"gzip") || 0 == _wcsicmp(encoding, L"x-gzip"))
+    {
+        format = WW_INFLATE_GZIP;
+    }
+    else if (0 == _wcsicmp(encoding, L"deflate"))
+    {
+        format = WW_INFLATE_DEFLATE;
+    }
+    else
+    {
+        return WW_FAILURE;
+    }
+
+    WW_INFLATE* inf = (WW_INFLATE*)calloc(1, sizeof(WW_INFLATE));
+    if (NULL == inf)
+    {
+        return WW_FAILURE;
+    }
+    inf->hReq = hReq;
+    inf->format = format;
+    inf->state = WW_INFLATE_HEADER;
+    *decoder = inf;
+    return WW_SUCCESS;
+}
+
+/**
+ * @brief InternetReadFile, decoding the body first when it is compressed.
+ */
+WW_PRIVATE
+BOOL
+WWReadBodyW(
+    HINTERNET hReq,
+    WW_INFLATE* decoder,
+    LPVOID buf,
+    DWORD size,
+    LPDWORD bytesRead
+)
+{
+    if (NULL == decoder)
+    {
+        return InternetReadFile(hReq, buf, size, bytesRead);
+    }
+    return WWInflateRead(decoder, (LPBYTE)buf, size, bytesRead);
+}
+
+/********************************* DEFLATE ************************************/
+
+WW_PRIVATE
+VOID
+WWDeflatePutBits(
+    WW_DEFLATE* def,
+    UINT bits,
+    UINT count
+)
+{
+    def->bitBuf |= (ULONGLONG)bits << def->bitCnt;
+    def->bitCnt += count;
+    while (def->bitCnt >= 8)
+    {
+        if (def->outLen < def->outCap)
+        {
+            def->out[def->outLen++] = (BYTE)def->bitBuf;
+        }
+        else
+        {
+            def->full = TRUE;
+        }
+        def->bitBuf >>= 8;
+        def->bitCnt -= 8;
+    }
+}
+
+WW_PRIVATE
+VOID
+WWDeflateAlign(
+    WW_DEFLATE* def
+)
+{
+    if (0 != (def->bitCnt & 7))
+    {
+        WWDeflatePutBits(def, 0, 8 - (def->bitCnt & 7));
+    }
+}
+
+/**
+ * @brief Huffman code lengths for the given symbol frequencies, limited to
+ *        maxBits. Unused symbols get length 0; at least two symbols always
+ *        get a code so every tree is complete.
+ */
+WW_PRIVATE
+VOID
+WWDeflateBuildLengths(
+    const UINT* freq,
+    UINT n,
+    UINT maxBits,
+    BYTE* lengths
+)
+{
+    UINT order[WW_HUFF_MAX_SYMBOLS];
+    UINT weight[2 * WW_HUFF_MAX_SYMBOLS];
+    UINT parent[2 * WW_HUFF_MAX_SYMBOLS];
+    UINT used = 0;
+
+    ZeroMemory(lengths, n);
+
+    // Insertion sort by ascending frequency; n is at most 288
+    for (UINT sym = 0; sym < n; sym++)
+    {
+        if (0 == freq[sym])
+        {
+            continue;
+        }
+        UINT i = used++;
+        while (i > 0 && freq[order[i - 1]] > freq[sym])
+        {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = sym;
+    }
+
+    if (used < 2)
+    {
+        UINT other = (used > 0 && 0 == order[0]) ? 1 : 0;
+        lengths[other] = 1;
+        if (used > 0)
+        {
+            lengths[order[0]] = 1;
+        }
+        else
+        {
+            lengths[other + 1] = 1;
+        }
+        return;
+    }
+
+    // Two-queue Huffman construction: leaves in order, internal nodes after
+    for (UINT i = 0; i < used; i++)
+    {
+        weight[i] = freq[order[i]];
+    }
+    UINT leaf = 0;
+    UINT node = used;
+    UINT next = used;
+    for (UINT k = 0; k + 1 < used; k++)
+    {
+        UINT pick[2];
+        for (UINT j = 0; j < 2; j++)
+        {
+            if (leaf < used && (node >= next || weight[leaf] <= weight[node]))
+            {
+                pick[j] = leaf++;
+            }
+            else
+            {
+                pick[j] = node++;
+            }
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = next;
+        parent[pick[1]] = next;
+        next++;
+    }
+
+    // Depths, reusing weight[]: parents always come after their children
+    UINT count[16] = {0};
+    weight[next - 1] = 0;
+    for (UINT i = next - 1; i-- > 0;)
+    {
+        weight[i] = weight[parent[i]] + 1;
+        if (i < used)
+        {
+            count[(weight[i] > maxBits) ? maxBits : weight[i]]++;
+        }
+    }
+
+    // Clamping broke the Kraft sum; lengthen codes until it holds again
+    UINT total = 0;
+    for (UINT len = 1; len <= maxBits; len++)
+    {
+        total += count[len] << (maxBits - len);
+    }
+    while (total > (1u << maxBits))
+    {
+        count[maxBits]--;
+        for (UINT len = maxBits - 1; len > 0; len--)
+        {
+            if (0 != count[len])
+            {
+                count[len]--;
+                count[len + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The least frequent symbols take the longest codes
+    UINT i = 0;
+    for (UINT len = maxBits; len > 0; len--)
+    {
+        for (UINT c = count[len]; c > 0; c--)
+        {
+            lengths[order[i++]] = (BYTE)len;
+        }
+    }
+}
+
+/**
+ * @brief Canonical codes for the given lengths, bit-reversed for the
+ *        LSB-first bit writer.
+ */
+WW_PRIVATE
+VOID
+WWDeflateBuildCodes(
+    const BYTE* lengths,
+    UINT n,
+    USHORT* codes
+)
+{
+    USHORT count[16] = {0};
+    USHORT next[16] = {0};
+    for (UINT sym = 0; sym < n; sym++)
+    {
+        count[lengths[sym]]++;
+    }
+    count[0] = 0;
+
+    UINT code = 0;
+    for (UINT len = 1; len < 16; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next[len] = (USHORT)code;
+    }
+
+    for (UINT sym = 0; sym < n; sym++)
+    {
+        UINT len = lengths[sym];
+        UINT rev = 0;
+        if (0 != len)
+        {
+            code = next[len]++;
+            for (UINT i = 0; i < len; i++)
+            {
+                rev = (rev << 1) | ((code >> i) & 1);
+            }
+        }
+        codes[sym] = (USHORT)rev;
+    }
+}
+
+WW_PRIVATE
+UINT
+WWDeflateLog2(
+    UINT value
+)
+{
+    UINT bits = 0;
+    while (value >> (bits + 1))
+    {
+        bits++;
+    }
+    return bits;
+}
+
+/**
+ * @brief Index into g_wwLenBase for a match length of 3-258.
+ */
+WW_PRIVATE
+UINT
+WWDeflateLenCode(
+    UINT len
+)
+{
+    UINT v = len - 3;
+    if (v < 8)
+    {
+        return v;
+    }
+    if (WW_DEFLATE_MAX_MATCH == len)
+    {
+        return 28;
+    }
+    UINT bits = WWDeflateLog2(v);
+    return 4 * (bits - 1) + ((v >> (bits - 2)) & 3);
+}
+
+/**
+ * @brief Index into g_wwDistBase for a distance of 1-32768.
+ */
+WW_PRIVATE
+UINT
+WWDeflateDistCode(
+    UINT dist
+)
+{
+    UINT v = dist - 1;
+    if (v < 4)
+    {
+        return v;
+    }
+    UINT bits = WWDeflateLog2(v);
+    return 2 * bits + ((v >> (bits - 1)) & 1);
+}
+
+WW_PRIVATE
+VOID
+WWDeflateWriteSymbols(
+    WW_DEFLATE* def,
+    const USHORT* litCodes,
+    const BYTE* litLens,
+    const USHORT* distCodes,
+    const BYTE* distLens
+)
+{
+    for (UINT i = 0; i < def->symCount; i++)
+    {
+        const WW_LZSYMBOL* sym = &def->syms[i];
+        if (0 == sym->dist)
+        {
+            WWDeflatePutBits(def, litCodes[sym->value], litLens[sym->value]);
+            continue;
+        }
+
+        UINT lc = WWDeflateLenCode(sym->value);
+        WWDeflatePutBits(def, litCodes[257 + lc], litLens[257 + lc]);
+        WWDeflatePutBits(def, sym->value - g_wwLenBase[lc], g_wwLenExtra[lc]);
+
+        UINT dc = WWDeflateDistCode(sym->dist);
+        WWDeflatePutBits(def, distCodes[dc], distLens[dc]);
+        WWDeflatePutBits(def, sym->dist - g_wwDistBase[dc], g_wwDistExtra[dc]);
+    }
+    WWDeflatePutBits(def, litCodes[256], litLens[256]);
+}
+
+/**
+ * @brief Emit the buffered symbols as one block, picking whichever of the
+ *        stored, fixed and dynamic Huffman encodings is smallest.
+ */
+WW_PRIVATE
+VOID
+WWDeflateFlush(
+    WW_DEFLATE* def,
+    BOOL final
+)
+{
+    UINT litFreq[286] = {0};
+    UINT distFreq[30] = {0};
+    for (UINT i = 0; i < def->symCount; i++)
+    {
+        const WW_LZSYMBOL* sym = &def->syms[i];
+        if (0 == sym->dist)
+        {
+            litFreq[sym->value]++;
+        }
+        else
+        {
+            litFreq[257 + WWDeflateLenCode(sym->value)]++;
+            distFreq[WWDeflateDistCode(sym->dist)]++;
+        }
+    }
+    litFreq[256] = 1;
+
+    BYTE litLens[WW_HUFF_MAX_SYMBOLS];
+    BYTE distLens[30];
+    WWDeflateBuildLengths(litFreq, 286, 15, litLens);
+    WWDeflateBuildLengths(distFreq, 30, 15, distLens);
+
+    UINT nlit = 286;
+    while (nlit > 257 && 0 == litLens[nlit - 1])
+    {
+        nlit--;
+    }
+    UINT ndist = 30;
+    while (ndist > 1 && 0 == distLens[ndist - 1])
+    {
+        ndist--;
+    }
+
+    // Run-length encode both code length tables (RFC 1951, 3.2.7)
+    BYTE all[286 + 30];
+    BYTE rle[286 + 30];
+    BYTE rleExtra[286 + 30];
+    UINT nall = nlit + ndist;
+    UINT nrle = 0;
+    UINT clFreq[19] = {0};
+    memcpy(all, litLens, nlit);
+    memcpy(all + nlit, distLens, ndist);
+    for (UINT i = 0; i < nall;)
+    {
+        UINT run = 1;
+        while (i + run < nall && all[i + run] == all[i])
+        {
+            run++;
+        }
+
+        if (0 == all[i] && run >= 3)
+        {
+            run = (run > 138) ? 138 : run;
+            rle[nrle] = (run > 10) ? 18 : 17;
+            rleExtra[nrle] = (BYTE)(run - ((run > 10) ? 11 : 3));
+        }
+        else if (i > 0 && all[i] == all[i - 1] && run >= 3)
+        {
+            run = (run > 6) ? 6 : run;
+            rle[nrle] = 16;
+            rleExtra[nrle] = (BYTE)(run - 3);
+        }
+        else
+        {
+            run = 1;
+            rle[nrle] = all[i];
+            rleExtra[nrle] = 0;
+        }
+        clFreq[rle[nrle++]]++;
+        i += run;
+    }
+
+    BYTE clLens[19];
+    USHORT clCodes[19];
+    WWDeflateBuildLengths(clFreq, 19, 7, clLens);
+    WWDeflateBuildCodes(clLens, 19, clCodes);
+    UINT nclen = 19;
+    while (nclen > 4 && 0 == clLens[g_wwCodeLengthOrder[nclen - 1]])
+    {
+        nclen--;
+    }
+
+    // Block sizes in bits
+    ULONGLONG dynBits = 3 + 14 + 3 * nclen;
+    ULONGLONG fixedBits = 3;
+    for (UINT i = 0; i < nrle; i++)
+    {
+        static const BYTE rleExtraBits[3] = { 2, 3, 7 };
+        dynBits += clLens[rle[i]] + ((rle[i] >= 16) ? rleExtraBits[rle[i] - 16] : 0);
+    }
+    for (UINT sym = 0; sym < 286; sym++)
+    {
+        UINT extra = (sym > 256) ? g_wwLenExtra[sym - 257] : 0;
+        UINT fixedLen = (sym < 144) ? 8 : (sym < 256) ? 9 : (sym < 280) ? 7 : 8;
+        dynBits += (ULONGLONG)litFreq[sym] * (litLens[sym] + extra);
+        fixedBits += (ULONGLONG)litFreq[sym] * (fixedLen + extra);
+    }
+    for (UINT dc = 0; dc < 30; dc++)
+    {
+        dynBits += (ULONGLONG)distFreq[dc] * (distLens[dc] + g_wwDistExtra[dc]);
+        fixedBits += (ULONGLONG)distFreq[dc] * (5 + g_wwDistExtra[dc]);
+    }
+
+    DWORD raw = def->blockEnd - def->blockStart;
+    ULONGLONG storedChunks = (0 == raw) ? 1 : (raw + 0xFFFE) / 0xFFFF;
+    ULONGLONG storedBits = storedChunks * (3 + 7 + 32) + 8ull * raw;
+
+    if (storedBits <= fixedBits && storedBits <= dynBits)
+    {
+        const BYTE* p = def->src + def->blockStart;
+        do
+        {
+            DWORD chunk = (raw > 0xFFFF) ? 0xFFFF : raw;
+            raw -= chunk;
+            WWDeflatePutBits(def, (final && 0 == raw) ? 1 : 0, 3);
+            WWDeflateAlign(def);
+            WWDeflatePutBits(def, chunk, 16);
+            WWDeflatePutBits(def, ~chunk & 0xFFFF, 16);
+            if (def->outCap - def->outLen < chunk)
+            {
+                def->full = TRUE;
+                break;
+            }
+            memcpy(def->out + def->outLen, p, chunk);
+            def->outLen += chunk;
+            p += chunk;
+        } while (raw > 0);
+    }
+    else if (fixedBits <= dynBits)
+    {
+        BYTE fixedLit[288];
+        BYTE fixedDist[30];
+        USHORT litCodes[288];
+        USHORT distCodes[30];
+        UINT sym = 0;
+        for (; sym < 144; sym++) fixedLit[sym] = 8;
+        for (; sym < 256; sym++) fixedLit[sym] = 9;
+        for (; sym < 280; sym++) fixedLit[sym] = 7;
+        for (; sym < 288; sym++) fixedLit[sym] = 8;
+        memset(fixedDist, 5, sizeof(fixedDist));
+        WWDeflateBuildCodes(fixedLit, 288, litCodes);
+        WWDeflateBuildCodes(fixedDist, 30, distCodes);
+
+        WWDeflatePutBits(def, (final ? 1 : 0) | (1 << 1), 3);
+        WWDeflateWriteSymbols(def, litCodes, fixedLit, distCodes, fixedDist);
+    }
+    else
+    {
+        USHORT litCodes[286];
+        USHORT distCodes[30];
+        WWDeflateBuildCodes(litLens, 286, litCodes);
+        WWDeflateBuildCodes(distLens, 30, distCodes);
+
+        WWDeflatePutBits(def, (final ? 1 : 0) | (2 << 1), 3);
+        WWDeflatePutBits(def, nlit - 257, 5);
+        WWDeflatePutBits(def, ndist - 1, 5);
+        WWDeflatePutBits(def, nclen - 4, 4);
+        for (UINT i = 0; i < nclen; i++)
+        {
+            WWDeflatePutBits(def, clLens[g_wwCodeLengthOrder[i]], 3);
+        }
+        for (UINT i = 0; i < nrle; i++)
+        {
+            WWDeflatePutBits(def, clCodes[rle[i]], clLens[rle[i]]);
+            if (rle[i] >= 16)
+            {
+                static const BYTE rleExtraBits[3] = { 2, 3, 7 };
+                WWDeflatePutBits(def, rleExtra[i], rleExtraBits[rle[i] - 16]);
+            }
+        }
+        WWDeflateWriteSymbols(def, litCodes, litLens, distCodes, distLens);
+    }
+
+    def->symCount = 0;
+    def->blockStart = def->blockEnd;
+}
+
+WW_PRIVATE
+VOID
+WWDeflateEmit(
+    WW_DEFLATE* def,
+    UINT value,
+    UINT dist,
+    DWORD end
+)
+{
+    def->syms[def->symCount].dist = (USHORT)dist;
+    def->syms[def->symCount].value = (USHORT)value;
+    def->symCount++;
+    def->blockEnd = end;
+    if (WW_DEFLATE_BLOCK == def->symCount)
+    {
+        WWDeflateFlush(def, FALSE);
+    }
+}
 
+/**
+ * @brief Add the 3-byte string at pos to the hash chains.
+ * @return The previous position + 1 with the same hash, or 0.
+ */
+WW_PRIVATE
+DWORD
+WWDeflateInsert(
+    WW_DEFLATE* def,
+    DWORD pos
+)
+{
+    const BYTE* p = def->src + pos;
+    UINT v = (UINT)p[0] | ((UINT)p[1] << 8) | ((UINT)p[2] << 16);
+    UINT h = (v * 2654435761u) >> (32 - WW_DEFLATE_HASH_BITS);
+
+    DWORD candidate = def->head[h];
+    def->prev[pos & (WW_DEFLATE_MAX_DIST - 1)] = candidate;
+    def->head[h] = pos + 1;
+    return candidate;
+}
 
-    WW_PARAMSW userParams = {
-        .status = WW_STATUS_INIT,
-        .errorcode = WW_ERR_NOERROR,
-        .url = url,
-        .dstPath = NULL,
-        .outFileName = NULL,
-        .userAgent = WW_DEFAULT_USER_AGENTW,
-        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
-        .headerLength = WW_DEFAULT_HEADER_LENGTH,
-        .logEnabled = flags & WW_SHOW_LOG,
-        .progressBarEnabled = flags & WW_SHOW_PROGRESSBAR,
-        .forceDownload = flags & WW_FORCE_DOWNLOAD,
-        .progressBarFlags = defaultPbFlags,
-        .progressBarData = {
-            .ulTimeElapsedInSecs = 0,
-            .szDownloadedInBytes = 0,
-            .szTotalInBytes = 0,
-            .dETAInSecs = 0
+/**
+ * @brief Longest earlier match for the string at pos, walking at most
+ *        maxChain hash chain entries. Returns 0 if there is none of 3+ bytes.
+ */
+WW_PRIVATE
+UINT
+WWDeflateLongestMatch(
+    WW_DEFLATE* def,
+    DWORD pos,
+    DWORD candidate,
+    LPDWORD matchDist
+)
+{
+    const BYTE* src = def->src;
+    DWORD avail = def->srcSize - pos;
+    UINT maxLen = (avail < WW_DEFLATE_MAX_MATCH) ? avail : WW_DEFLATE_MAX_MATCH;
+    UINT best = 2;
+    UINT chain = def->maxChain;
+
+    while (0 != candidate && chain-- > 0)
+    {
+        DWORD c = candidate - 1;
+        if (pos - c > WW_DEFLATE_MAX_DIST)
+        {
+            break;
         }
-    };
 
-    // Extract filename and crop dstPath to needed states.
-    const WCHAR* extractedFileName = wcsrchr(fullFilePath, L'\\') + 1;
-    size_t dirPathLength = extractedFileName - fullFilePath;
-    WCHAR* newPath = (WCHAR*)malloc(dirPathLength + 1);
-    if (newPath == NULL)
+        // The byte that would extend the best match is the cheapest reject
+        if (src[c + best] == src[pos + best] && src[c] == src[pos])
+        {
+            UINT len = 1;
+            while (len < maxLen && src[c + len] == src[pos + len])
+            {
+                len++;
+            }
+            if (len > best)
+            {
+                best = len;
+                *matchDist = pos - c;
+                if (len >= def->niceLen || len >= maxLen)
+                {
+                    break;
+                }
+            }
+        }
+
+        DWORD next = def->prev[c & (WW_DEFLATE_MAX_DIST - 1)];
+        if (next >= candidate)
+        {
+            break;
+        }
+        candidate = next;
+    }
+
+    // A 3-byte match far away costs more than three literals
+    if (best < 3 || (3 == best && *matchDist > 4096))
     {
-        return WW_FAILURE;
+        return 0;
     }
-    wcsncpy(newPath, fullFilePath, dirPathLength + 1);
-    newPath[dirPathLength] = '\0'; // Null-terminate the directory path
-    userParams.dstPath = newPath;
-    userParams.outFileName = extractedFileName;
+    return best;
+}
 
-    return WWDownloadExW(&userParams);
+/**
+ * @brief Run the matcher, flushing full blocks as it goes, until the input
+ *        is used up or at least outWanted bytes of output are ready. Levels
+ *        with lazyLen set defer each match by one byte in case the next
+ *        position starts a longer one.
+ */
+WW_PRIVATE
+VOID
+WWDeflateRun(
+    WW_DEFLATE* def,
+    SIZE_T outWanted
+)
+{
+    const BYTE* src = def->src;
+    DWORD size = def->srcSize;
+    DWORD pos = def->pos;
+    UINT prevLen = def->prevLen;
+    DWORD prevDist = def->prevDist;
+    BOOL pending = def->pending;
+
+    while (pos < size && !def->full && def->outLen < outWanted)
+    {
+        UINT len = 0;
+        DWORD dist = 0;
+        if (pos + 3 <= size)
+        {
+            DWORD candidate = WWDeflateInsert(def, pos);
+            if (0 == def->lazyLen || prevLen < def->lazyLen)
+            {
+                len = WWDeflateLongestMatch(def, pos, candidate, &dist);
+            }
+        }
+
+        if (0 == def->lazyLen)
+        {
+            if (0 == len)
+            {
+                WWDeflateEmit(def, src[pos], 0, pos + 1);
+                pos++;
+                continue;
+            }
+            WWDeflateEmit(def, len, dist, pos + len);
+            for (DWORD p = pos + 1; p < pos + len && p + 3 <= size; p++)
+            {
+                WWDeflateInsert(def, p);
+            }
+            pos += len;
+            continue;
+        }
+
+        if (prevLen >= 3 && len <= prevLen)
+        {
+            DWORD end = pos - 1 + prevLen;
+            WWDeflateEmit(def, prevLen, prevDist, end);
+            for (DWORD p = pos + 1; p < end && p + 3 <= size; p++)
+            {
+                WWDeflateInsert(def, p);
+            }
+            pos = end;
+            prevLen = 0;
+            pending = FALSE;
+            continue;
+        }
+
+        if (pending)
+        {
+            WWDeflateEmit(def, src[pos - 1], 0, pos);
+        }
+        pending = TRUE;
+        prevLen = len;
+        prevDist = dist;
+        pos++;
+    }
+
+    if (pos >= size && pending)
+    {
+        WWDeflateEmit(def, src[pos - 1], 0, pos);
+        pending = FALSE;
+    }
+
+    def->pos = pos;
+    def->prevLen = prevLen;
+    def->prevDist = prevDist;
+    def->pending = pending;
 }
 
-INT
-WWDownloadAsW(
-    LPCWSTR url,
-    LPCWSTR dstPath,
-    LPCWSTR outFileName,
-    DWORD flags
+/**
+ * @brief Reset the encoder to the start of src and write the gzip header.
+ *        The output buffer is kept.
+ */
+WW_PRIVATE
+VOID
+WWGzipStart(
+    WW_DEFLATE* def,
+    const BYTE* src,
+    DWORD size,
+    INT level
 )
 {
-    DWORD defaultPbFlags = WW_PB_PROGRESSBAR | WW_PB_PERCENTAGE | WW_PB_ETA |
-                           WW_PB_SPEED | WW_PB_FILESIZE | WW_PB_FILENAME;
+    LPBYTE out = def->out;
+    SIZE_T outCap = def->outCap;
+    ZeroMemory(def, sizeof(*def));
+    def->out = out;
+    def->outCap = outCap;
+
+    level = (level < 1) ? 1 : (level > 9) ? 9 : level;
+    def->src = src;
+    def->srcSize = size;
+    def->level = level;
+    def->maxChain = g_wwDeflateLevels[level].chain;
+    def->niceLen = g_wwDeflateLevels[level].nice;
+    def->lazyLen = g_wwDeflateLevels[level].lazy;
+
+    // ID1 ID2 CM FLG MTIME(4) XFL OS(NTFS)
+    static const BYTE header[8] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0 };
+    for (UINT i = 0; i < sizeof(header); i++)
+    {
+        WWDeflatePutBits(def, header[i], 8);
+    }
+    WWDeflatePutBits(def, (9 == level) ? 2 : (1 == level) ? 4 : 0, 8);
+    WWDeflatePutBits(def, 11, 8);
+}
 
-    WW_PARAMSW userParams = {
-        .status = WW_STATUS_INIT,
-        .errorcode = WW_ERR_NOERROR,
-        .url = url,
-        .dstPath = dstPath,
-        .outFileName = outFileName,
-        .userAgent = WW_DEFAULT_USER_AGENTW,
-        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
-        .headerLength = WW_DEFAULT_HEADER_LENGTH,
-        .logEnabled = flags & WW_SHOW_LOG,
-        .progressBarEnabled = flags & WW_SHOW_PROGRESSBAR,
-        .forceDownload = flags & WW_FORCE_DOWNLOAD,
-        .progressBarFlags = defaultPbFlags,
-        .progressBarData = {
-            .ulTimeElapsedInSecs = 0,
-            .szDownloadedInBytes = 0,
-            .szTotalInBytes = 0,
-            .dETAInSecs = 0
+/**
+ * @brief Emit the final block and the gzip trailer once the matcher has
+ *        used up the input.
+ */
+WW_PRIVATE
+VOID
+WWGzipFinish(
+    WW_DEFLATE* def
+)
+{
+    if (!def->full)
+    {
+        WWDeflateFlush(def, TRUE);
+    }
+    WWDeflateAlign(def);
+
+    UINT crc = WWCrc32Update(0, def->src, def->srcSize);
+    WWDeflatePutBits(def, crc & 0xFFFF, 16);
+    WWDeflatePutBits(def, crc >> 16, 16);
+    WWDeflatePutBits(def, def->srcSize & 0xFFFF, 16);
+    WWDeflatePutBits(def, def->srcSize >> 16, 16);
+    def->ended = TRUE;
+}
+
+/**
+ * @brief Gzip a request body (RFC 1952) at level 1-9.
+ *
+ * @return FALSE if memory is short or the result would not be smaller than
+ *         the input; the caller then sends the body unchanged.
+ */
+WW_PRIVATE
+BOOL
+WWGzipCompress(
+    const BYTE* src,
+    DWORD size,
+    INT level,
+    LPBYTE* out,
+    LPDWORD outSize
+)
+{
+    *out = NULL;
+    *outSize = 0;
+    if (0 == size)
+    {
+        return FALSE;
+    }
+
+    WW_DEFLATE* def = (WW_DEFLATE*)calloc(1, sizeof(*def));
+    if (NULL == def)
+    {
+        return FALSE;
+    }
+    def->out = (LPBYTE)malloc(size);
+    if (NULL == def->out)
+    {
+        free(def);
+        return FALSE;
+    }
+    def->outCap = size - 1;
+
+    WWGzipStart(def, src, size, level);
+    WWDeflateRun(def, (SIZE_T)-1);
+    WWGzipFinish(def);
+
+    BOOL ok = !def->full;
+    if (ok)
+    {
+        *out = def->out;
+        *outSize = (DWORD)def->outLen;
+    }
+    else
+    {
+        free(def->out);
+    }
+    free(def);
+    return ok;
+}
+
+/**
+ * @brief Set up an encoder that gzips a body while it is sent, for bodies
+ *        too large to compress into a second buffer. The first upload
+ *        block's worth of output is encoded here: if it is not smaller than
+ *        the input it covers, the body is taken not to shrink.
+ *
+ * @return NULL if memory is short or the body does not shrink; the caller
+ *         then sends it unchanged.
+ */
+WW_PRIVATE
+WW_DEFLATE*
+WWGzipStreamOpen(
+    const BYTE* src,
+    DWORD size,
+    INT level
+)
+{
+    WW_DEFLATE* def = (WW_DEFLATE*)calloc(1, sizeof(*def));
+    if (NULL == def)
+    {
+        return NULL;
+    }
+
+    // One block is read at a time, and a flush adds at most a fixed-code
+    // block on top of what is still buffered
+    def->outCap = 2 * WW_UPLOAD_BLOCK;
+    def->out = (LPBYTE)malloc(def->outCap);
+    if (NULL == def->out)
+    {
+        free(def);
+        return NULL;
+    }
+
+    WWGzipStart(def, src, size, level);
+    WWDeflateRun(def, WW_UPLOAD_BLOCK);
+    if (def->pos >= def->srcSize)
+    {
+        WWGzipFinish(def);
+    }
+
+    DWORD covered = def->ended ? def->srcSize : def->blockStart;
+    if (def->full || def->outLen >= covered)
+    {
+        WWGzipStreamClose(def);
+        return NULL;
+    }
+    return def;
+}
+
+/**
+ * @brief Hand on up to size bytes of the gzipped body, encoding more as
+ *        needed. *bytesRead is 0 once the trailer has been handed on.
+ */
+WW_PRIVATE
+BOOL
+WWGzipStreamRead(
+    WW_DEFLATE* def,
+    LPBYTE buf,
+    DWORD size,
+    LPDWORD bytesRead
+)
+{
+    if (def->outRead > 0)
+    {
+        memmove(def->out, def->out + def->outRead, def->outLen - def->outRead);
+        def->outLen -= def->outRead;
+        def->outRead = 0;
+    }
+
+    if (!def->ended)
+    {
+        WWDeflateRun(def, size);
+        if (def->pos >= def->srcSize)
+        {
+            WWGzipFinish(def);
         }
-    };
+    }
+    if (def->full)
+    {
+        return FALSE;
+    }
 
-    return WWDownloadExW(&userParams);
+    *bytesRead = (def->outLen < size) ? (DWORD)def->outLen : size;
+    memcpy(buf, def->out, *bytesRead);
+    def->outRead = *bytesRead;
+    return TRUE;
+}
+
+/**
+ * @brief Start the gzipped body over, to send it again.
+ */
+WW_PRIVATE
+VOID
+WWGzipStreamRewind(
+    WW_DEFLATE* def
+)
+{
+    WWGzipStart(def, def->src, def->srcSize, def->level);
+}
+
+WW_PRIVATE
+VOID
+WWGzipStreamClose(
+    WW_DEFLATE* def
+)
+{
+    if (NULL != def)
+    {
+        free(def->out);
+        free(def);
+    }
 }
 
-INT
-WWQueryW(
-    LPCWSTR url,
-    LPCWSTR verb,
-    LPCVOID body,
-    DWORD bodySize,
-    LPCWSTR contentType,
-    WW_RESPONSEW* response
+/********************************* HASHING ************************************/
+
+WW_PRIVATE
+UINT
+WWCrc32cScalar(
+    UINT crc,
+    const BYTE* p,
+    SIZE_T size
 )
 {
-    WW_REQUESTW request = {
-        .url = url,
-        .verb = verb,
-        .userAgent = WW_DEFAULT_USER_AGENTW,
-        .contentType = contentType,
-        .body = body,
-        .bodySize = bodySize,
-        .headers = NULL,
-        .maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT,
-        .logEnabled = FALSE
+    // Reflected Castagnoli polynomial 0x82F63B78, one nibble per lookup
+    static const UINT table[16] = {
+        0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1,
+        0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+        0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+        0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
     };
-    return WWQueryExW(&request, response);
+
+    while (size-- > 0)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return crc;
 }
 
-INT
-WWQueryExW(
-    WW_REQUESTW* request,
-    WW_RESPONSEW* response
+#ifdef WW_HAVE_X86_SIMD
+
+WW_TARGET("sse4.2")
+WW_PRIVATE
+UINT
+WWCrc32cSse42(
+    UINT crc,
+    const BYTE* p,
+    SIZE_T size
 )
 {
-    if (NULL == request || NULL == response)
+#if defined(_M_X64) || defined(__x86_64__)
+    ULONGLONG crc64 = crc;
+    while (size >= 8)
     {
-        return WW_FAILURE;
+        ULONGLONG v;
+        CopyMemory(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        size -= 8;
+    }
+    crc = (UINT)crc64;
+#endif
+    while (size >= 4)
+    {
+        UINT v;
+        CopyMemory(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        size -= 4;
+    }
+    while (size-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
     }
+    return crc;
+}
 
-    ZeroMemory(response, sizeof(*response));
+#endif // WW_HAVE_X86_SIMD
 
-    if (NULL == request->url)
+WW_PRIVATE
+WW_CRC32C_FN
+WWGetCrc32c(void)
+{
+    WW_CRC32C_FN fn = g_wwCrc32c;
+    if (NULL == fn)
     {
-        response->errorcode = WW_ERR_NO_URL;
-        return WW_FAILURE;
+        fn = WWCrc32cScalar;
+#ifdef WW_HAVE_X86_SIMD
+        if (IsProcessorFeaturePresent(PF_SSE4_2_INSTRUCTIONS_AVAILABLE))
+        {
+            fn = WWCrc32cSse42;
+        }
+#endif
+        // Benign race: every thread computes the same pointer
+        g_wwCrc32c = fn;
     }
+    return fn;
+}
 
-    LPCWSTR userAgent = request->userAgent;
-    if (NULL == userAgent)
+WW_PRIVATE
+DWORD
+WWHashDigestSize(
+    INT algorithm
+)
+{
+    switch (algorithm)
     {
-        userAgent = WW_DEFAULT_USER_AGENTW;
+        case WW_HASH_SHA256:
+            return WW_SHA256_SIZE;
+        case WW_HASH_CRC32C:
+            return WW_CRC32C_SIZE;
+        default:
+            return 0;
     }
+}
 
-    LPCWSTR verb = request->verb;
-    if (NULL == verb)
+/**
+ * @brief Start a streaming hash. SHA-256 goes through CNG, which uses the
+ *        CPU's SHA extensions where available.
+ */
+WW_PRIVATE
+BOOL
+WWHashBegin(
+    WW_HASHCTX* ctx,
+    INT algorithm
+)
+{
+    ctx->algorithm = WW_HASH_NONE;
+    ctx->hAlg = NULL;
+    ctx->hHash = NULL;
+    ctx->crc = 0xFFFFFFFF;
+
+    if (WW_HASH_CRC32C == algorithm)
     {
-        verb = L"GET";
+        ctx->algorithm = algorithm;
+        return TRUE;
     }
-
-    UINT maxRedirs = request->maxRedirectLimit;
-    if (0 == maxRedirs)
+    if (WW_HASH_SHA256 != algorithm)
     {
-        maxRedirs = WW_DEFAULT_REDIRECT_LIMIT;
+        return FALSE;
     }
 
-    WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
-    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
-    WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
-    WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
-    WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&ctx->hAlg,
+                                                    BCRYPT_SHA256_ALGORITHM,
+                                                    NULL, 0)))
+    {
+        ctx->hAlg = NULL;
+        return FALSE;
+    }
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(ctx->hAlg, &ctx->hHash, NULL, 0,
+                                         NULL, 0, 0)))
+    {
+        BCryptCloseAlgorithmProvider(ctx->hAlg, 0);
+        ctx->hAlg = NULL;
+        ctx->hHash = NULL;
+        return FALSE;
+    }
+    ctx->algorithm = algorithm;
+    return TRUE;
+}
 
-    URL_COMPONENTSW urlc = {
-        sizeof(urlc),
-        scheme, WW_COUNTOF(scheme),
-        INTERNET_SCHEME_DEFAULT,
-        hostname, WW_COUNTOF(hostname),
-        0,
-        username, WW_COUNTOF(username),
-        password, WW_COUNTOF(password),
-        urlpath, WW_COUNTOF(urlpath),
-        NULL, 0
-    };
+WW_PRIVATE
+VOID
+WWHashUpdate(
+    WW_HASHCTX* ctx,
+    LPCVOID data,
+    SIZE_T size
+)
+{
+    const BYTE* p = (const BYTE*)data;
+    if (WW_HASH_CRC32C == ctx->algorithm)
+    {
+        ctx->crc = WWGetCrc32c()(ctx->crc, p, size);
+        return;
+    }
+    while (size > 0)
+    {
+        ULONG chunk = (size > 0x40000000) ? 0x40000000 : (ULONG)size;
+        BCryptHashData(ctx->hHash, (PUCHAR)p, chunk, 0);
+        p += chunk;
+        size -= chunk;
+    }
+}
 
-    if (FALSE == InternetCrackUrlW(request->url, 0, 0, &urlc))
+/**
+ * @brief Finish a hash and release its handles. Pass a NULL digest to abort.
+ */
+WW_PRIVATE
+BOOL
+WWHashEnd(
+    WW_HASHCTX* ctx,
+    PUCHAR digest,
+    ULONG digestSize
+)
+{
+    BOOL ok = FALSE;
+    if (WW_HASH_CRC32C == ctx->algorithm && NULL != digest &&
+        digestSize >= WW_CRC32C_SIZE)
     {
-        response->errorcode = WW_ERR_URL_PARSE;
-        return WW_FAILURE;
+        UINT crc = ~ctx->crc;
+        digest[0] = (BYTE)(crc >> 24);
+        digest[1] = (BYTE)(crc >> 16);
+        digest[2] = (BYTE)(crc >> 8);
+        digest[3] = (BYTE)crc;
+        ok = TRUE;
+    }
+    if (NULL != ctx->hHash)
+    {
+        if (NULL != digest)
+        {
+            ok = BCRYPT_SUCCESS(BCryptFinishHash(ctx->hHash, digest,
+                                                 digestSize, 0));
+        }
+        BCryptDestroyHash(ctx->hHash);
+    }
+    if (NULL != ctx->hAlg)
+    {
+        BCryptCloseAlgorithmProvider(ctx->hAlg, 0);
     }
+    ctx->algorithm = WW_HASH_NONE;
+    ctx->hAlg = NULL;
+    ctx->hHash = NULL;
+    return ok;
+}
 
-    if (urlc.nScheme != INTERNET_SCHEME_HTTP &&
-        urlc.nScheme != INTERNET_SCHEME_HTTPS)
+WW_PRIVATE
+BOOL
+WWSha256(
+    LPCVOID data,
+    SIZE_T size,
+    PUCHAR digest
+)
+{
+    WW_HASHCTX ctx;
+    if (FALSE == WWHashBegin(&ctx, WW_HASH_SHA256))
     {
-        response->errorcode = WW_ERR_UNKNOWN_SCHEME;
-        return WW_FAILURE;
+        return FALSE;
     }
+    WWHashUpdate(&ctx, data, size);
+    return WWHashEnd(&ctx, digest, WW_SHA256_SIZE);
+}
 
-    HINTERNET hInet = InternetOpenW(userAgent, INTERNET_OPEN_TYPE_PRECONFIG,
-                                     NULL, NULL, 0);
-    if (NULL == hInet)
+/**
+ * @brief Feed size bytes from the current file position into a hash.
+ */
+WW_PRIVATE
+BOOL
+WWHashFileW(
+    HANDLE hFile,
+    ULONGLONG size,
+    WW_HASHCTX* ctx
+)
+{
+    LPBYTE buf = (LPBYTE)malloc(0x10000);
+    if (NULL == buf)
     {
-        response->errorcode = WW_ERR_WININET_INIT;
-        return WW_FAILURE;
+        return FALSE;
     }
 
-    HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
-                                        urlc.lpszUserName, urlc.lpszPassword,
-                                        INTERNET_SERVICE_HTTP, 0, 0);
-    if (NULL == hConn)
+    while (size > 0)
     {
-        response->errorcode = WW_ERR_INTERNET_CONN;
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
+        DWORD chunk = (size > 0x10000) ? 0x10000 : (DWORD)size;
+        DWORD done = 0;
+        if (FALSE == ReadFile(hFile, buf, chunk, &done, NULL) || 0 == done)
+        {
+            break;
+        }
+        WWHashUpdate(ctx, buf, done);
+        size -= done;
     }
 
-    DWORD dwFlags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
-                    INTERNET_FLAG_NO_AUTO_REDIRECT | INTERNET_FLAG_NO_UI;
+    free(buf);
+    return 0 == size;
+}
 
-    if (INTERNET_SCHEME_HTTPS == urlc.nScheme)
+/**
+ * @brief Check the computed download digest against the caller's expectation.
+ */
+WW_PRIVATE
+BOOL
+WWDigestMatchesW(
+    const WW_PARAMSW* userParams
+)
+{
+    if (NULL == userParams->expectedDigest)
     {
-        dwFlags |= INTERNET_FLAG_SECURE;
+        return TRUE;
     }
+    return 0 != userParams->digestSize &&
+           0 == memcmp(userParams->expectedDigest, userParams->digest,
+                       userParams->digestSize);
+}
 
-    LPCWSTR rgpszAcceptTypes[] = { L"*/*", NULL };
+/******************************* DISK CACHE ***********************************/
 
-    HINTERNET hReq = HttpOpenRequestW(hConn, verb, urlc.lpszUrlPath,
-                                       NULL, NULL, rgpszAcceptTypes,
-                                       dwFlags, 0);
-    if (NULL == hReq)
+WW_PRIVATE
+VOID
+WWHexEncodeW(
+    const BYTE* data,
+    SIZE_T size,
+    LPWSTR out
+)
+{
+    static const WCHAR digits[] = L"0123456789abcdef";
+    for (SIZE_T i = 0; i < size; ++i)
     {
-        response->errorcode = WW_ERR_HTTP_REQUEST;
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0xF];
     }
+    out[size * 2] = L'\0';
+}
 
-    if (request->connectTimeoutMs > 0) {
-        InternetSetOptionW(hReq, INTERNET_OPTION_CONNECT_TIMEOUT,
-                           &request->connectTimeoutMs, sizeof(request->connectTimeoutMs));
-    }
-    if (request->sendTimeoutMs > 0) {
-        InternetSetOptionW(hReq, INTERNET_OPTION_SEND_TIMEOUT,
-                        &request->sendTimeoutMs, sizeof(request->sendTimeoutMs));
-    }
-    if (request->receiveTimeoutMs > 0) {
-        InternetSetOptionW(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT,
-                           &request->receiveTimeoutMs, sizeof(request->receiveTimeoutMs));
-    }
-    
-    // Build headers string
-    WCHAR headerBuf[2048] = L"";
-    if (request->contentType != NULL)
+WW_PRIVATE
+ULONGLONG
+WWFileTimeNow(void)
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+/**
+ * @brief Path of a blob file, optionally with a per-thread suffix for
+ *        temporary names ("blobs\<sha256>[.<pid>-<tid>.<suffix>]").
+ */
+WW_PRIVATE
+VOID
+WWDiskBlobPathW(
+    const WW_DISKCACHE* cache,
+    const BYTE* blob,
+    LPCWSTR suffix,
+    LPWSTR outPath,
+    DWORD outPathCch
+)
+{
+    WCHAR hex[WW_SHA256_SIZE * 2 + 1];
+    WWHexEncodeW(blob, WW_SHA256_SIZE, hex);
+    if (NULL != suffix)
     {
-        wcsncpy(headerBuf, L"Content-Type: ", WW_COUNTOF(headerBuf));
-        wcsncat(headerBuf, request->contentType, WW_STR_SYMSW(headerBuf));
-        wcsncat(headerBuf, L"\r\n", WW_STR_SYMSW(headerBuf));
+        _snwprintf_s(outPath, outPathCch, _TRUNCATE, L"%sblobs\\%s.%lu-%lu.%s",
+                     cache->directory, hex, GetCurrentProcessId(),
+                     GetCurrentThreadId(), suffix);
     }
-    if (request->headers != NULL)
+    else
     {
-        wcsncat(headerBuf, request->headers, WW_STR_SYMSW(headerBuf));
+        _snwprintf_s(outPath, outPathCch, _TRUNCATE, L"%sblobs\\%s",
+                     cache->directory, hex);
     }
+}
 
-    LPCWSTR pHeaders = (wcslen(headerBuf) > 0) ? headerBuf : NULL;
-    DWORD headersLen = (pHeaders != NULL) ? (DWORD)wcslen(pHeaders) : 0;
-
-    if (FALSE == HttpSendRequestW(hReq, pHeaders, headersLen,
-                                   (LPVOID)request->body, request->bodySize))
+/**
+ * @brief Take the cross-process index lock, an exclusive lock on the byte
+ *        just past the index in the index file.
+ *
+ * The system drops the file lock of a process that dies, so the index
+ * records whether it was left locked; if so, the counters are recomputed
+ * from the slots. An index that is not ours is reset.
+ */
+WW_PRIVATE
+BOOL
+WWDiskLockW(
+    WW_DISKCACHE* cache
+)
+{
+    AcquireSRWLockExclusive(&cache->lock);
+    OVERLAPPED ov = WW_STRUCT_NULL;
+    ov.Offset = (DWORD)sizeof(WW_DISKINDEX);
+    if (FALSE == LockFileEx(cache->hIndexFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov))
     {
-        response->errorcode = WW_ERR_HTTP_REQUEST;
-        WWLogW(request->logEnabled, WW_LOG_WININET, NULL);
-        InternetCloseHandle(hReq);
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
+        ReleaseSRWLockExclusive(&cache->lock);
+        return FALSE;
     }
 
-    // Get status code
-    DWORD dwStatusCode = 0;
-    DWORD dwQueryLen = sizeof(dwStatusCode);
-    if (FALSE == HttpQueryInfoW(hReq,
-                                 HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
-                                 &dwStatusCode, &dwQueryLen, 0))
+    WW_DISKINDEX* index = cache->index;
+    if (WW_DISKCACHE_MAGIC != index->magic ||
+        WW_DISKCACHE_VERSION != index->version ||
+        WW_DISKCACHE_SLOTS != index->slotCount)
     {
-        response->errorcode = WW_ERR_HTTP_QUERY_INFO;
-        InternetCloseHandle(hReq);
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
+        ZeroMemory(index, sizeof(*index));
+        index->magic = WW_DISKCACHE_MAGIC;
+        index->version = WW_DISKCACHE_VERSION;
+        index->slotCount = WW_DISKCACHE_SLOTS;
     }
-
-    response->statusCode = dwStatusCode;
-
-    // Handle redirects
-    if (dwStatusCode == HTTP_STATUS_MOVED ||
-        dwStatusCode == HTTP_STATUS_REDIRECT ||
-        dwStatusCode == HTTP_STATUS_REDIRECT_METHOD ||
-        dwStatusCode == HTTP_STATUS_REDIRECT_KEEP_VERB)
-    {
-        WCHAR redirectUrl[INTERNET_MAX_URL_LENGTH] = L"";
-        DWORD redirectLen = sizeof(redirectUrl);
-        if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION,
-                                     redirectUrl, &redirectLen, 0))
-        {
-            response->errorcode = WW_ERR_HTTP_QUERY_INFO;
-            InternetCloseHandle(hReq);
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
-            return WW_FAILURE;
+    else if (index->locked)
+    {
+        index->entryCount = 0;
+        index->totalBytes = 0;
+        for (DWORD i = 0; i < index->slotCount; ++i)
+        {
+            if (WW_DISKSLOT_USED == index->slots[i].state)
+            {
+                index->entryCount++;
+                index->totalBytes += index->slots[i].size;
+            }
         }
+    }
+    index->locked = TRUE;
+    return TRUE;
+}
 
-        InternetCloseHandle(hReq);
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
+WW_PRIVATE
+VOID
+WWDiskUnlockW(
+    WW_DISKCACHE* cache
+)
+{
+    cache->index->locked = FALSE;
+    OVERLAPPED ov = WW_STRUCT_NULL;
+    ov.Offset = (DWORD)sizeof(WW_DISKINDEX);
+    UnlockFileEx(cache->hIndexFile, 0, 1, 0, &ov);
+    ReleaseSRWLockExclusive(&cache->lock);
+}
 
-        if (maxRedirs == 0)
+/**
+ * @brief Find the used slot for a URL key. The index lock must be held.
+ */
+WW_PRIVATE
+WW_DISKSLOT*
+WWDiskFindSlotW(
+    WW_DISKINDEX* index,
+    const BYTE* urlKey
+)
+{
+    DWORD start = *(const DWORD*)urlKey % index->slotCount;
+    for (DWORD n = 0; n < index->slotCount; ++n)
+    {
+        WW_DISKSLOT* slot = &index->slots[(start + n) % index->slotCount];
+        if (WW_DISKSLOT_EMPTY == slot->state)
         {
-            response->errorcode = WW_ERR_REDIRS_EXCEEDED;
-            return WW_FAILURE;
+            break;
+        }
+        if (WW_DISKSLOT_USED == slot->state &&
+            0 == memcmp(slot->urlKey, urlKey, WW_SHA256_SIZE))
+        {
+            return slot;
         }
-
-        WW_REQUESTW redirectReq = *request;
-        redirectReq.url = redirectUrl;
-        redirectReq.maxRedirectLimit = maxRedirs - 1;
-        return WWQueryExW(&redirectReq, response);
     }
+    return NULL;
+}
 
-    // Read response body
-    SIZE_T bufCapacity = 0x10000; // 64 KiB initial
-    SIZE_T bufUsed = 0;
-    LPBYTE buf = (LPBYTE)malloc(bufCapacity);
-    if (NULL == buf)
+/**
+ * @brief Remove an entry, deleting its blob once no other entry uses it.
+ *        keepBlob (if not NULL) names a blob about to be used by a new
+ *        entry, which is never deleted. The index lock must be held.
+ */
+WW_PRIVATE
+VOID
+WWDiskFreeSlotW(
+    WW_DISKCACHE* cache,
+    WW_DISKSLOT* slot,
+    const BYTE* keepBlob
+)
+{
+    WW_DISKINDEX* index = cache->index;
+    slot->state = WW_DISKSLOT_DELETED;
+    index->entryCount--;
+    index->totalBytes -= slot->size;
+
+    if (NULL != keepBlob && 0 == memcmp(keepBlob, slot->blob, WW_SHA256_SIZE))
     {
-        response->errorcode = WW_ERR_MALLOC;
-        InternetCloseHandle(hReq);
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
+        return;
     }
 
-    DWORD bytesRead = 0;
-    while (TRUE)
+    for (DWORD i = 0; i < index->slotCount; ++i)
     {
-        if (FALSE == InternetReadFile(hReq, buf + bufUsed,
-                                       (DWORD)(bufCapacity - bufUsed),
-                                       &bytesRead))
-        {
-            free(buf);
-            response->errorcode = WW_ERR_HTTP_REQUEST;
-            InternetCloseHandle(hReq);
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
-            return WW_FAILURE;
-        }
-
-        if (0 == bytesRead)
+        if (WW_DISKSLOT_USED == index->slots[i].state &&
+            0 == memcmp(index->slots[i].blob, slot->blob, WW_SHA256_SIZE))
         {
-            break;
+            return;
         }
+    }
 
-        bufUsed += bytesRead;
+    // Files hardlinked from the blob keep their content
+    WCHAR blobPath[MAX_PATH];
+    WWDiskBlobPathW(cache, slot->blob, NULL, blobPath, WW_COUNTOF(blobPath));
+    DeleteFileW(blobPath);
+}
 
-        if (bufUsed >= bufCapacity)
+/**
+ * @brief Evict least recently used entries until an entry of incomingBytes
+ *        fits, keeping the blob of that entry. The index lock must be held.
+ */
+WW_PRIVATE
+VOID
+WWDiskEvictW(
+    WW_DISKCACHE* cache,
+    ULONGLONG incomingBytes,
+    const BYTE* incomingBlob
+)
+{
+    WW_DISKINDEX* index = cache->index;
+    while (index->entryCount > 0 &&
+           (index->totalBytes + incomingBytes > cache->maxBytes ||
+            index->entryCount >= index->slotCount / 4 * 3))
+    {
+        WW_DISKSLOT* oldest = NULL;
+        for (DWORD i = 0; i < index->slotCount; ++i)
         {
-            bufCapacity *= 2;
-            LPBYTE newBuf = (LPBYTE)realloc(buf, bufCapacity);
-            if (NULL == newBuf)
+            WW_DISKSLOT* slot = &index->slots[i];
+            if (WW_DISKSLOT_USED == slot->state &&
+                (NULL == oldest || slot->lastUsed < oldest->lastUsed))
             {
-                free(buf);
-                response->errorcode = WW_ERR_MALLOC;
-                InternetCloseHandle(hReq);
-                InternetCloseHandle(hConn);
-                InternetCloseHandle(hInet);
-                return WW_FAILURE;
+                oldest = slot;
             }
-            buf = newBuf;
         }
+        WWDiskFreeSlotW(cache, oldest, incomingBlob);
     }
+}
 
-    response->data = buf;
-    response->dataSize = bufUsed;
+/**
+ * @brief Look up the entry for a URL and mark it recently used.
+ *
+ * @return TRUE and a copy of the entry if one exists.
+ */
+WW_PRIVATE
+BOOL
+WWDiskCacheLookupW(
+    WW_DISKCACHE* cache,
+    LPCWSTR url,
+    WW_DISKSLOT* outSlot,
+    BOOL* outFresh
+)
+{
+    BYTE urlKey[WW_SHA256_SIZE];
+    if (FALSE == WWSha256(url, wcslen(url) * sizeof(WCHAR), urlKey) ||
+        FALSE == WWDiskLockW(cache))
+    {
+        return FALSE;
+    }
 
-    InternetCloseHandle(hReq);
-    InternetCloseHandle(hConn);
-    InternetCloseHandle(hInet);
+    WW_DISKSLOT* slot = WWDiskFindSlotW(cache->index, urlKey);
+    if (NULL != slot)
+    {
+        ULONGLONG now = WWFileTimeNow();
+        slot->lastUsed = now;
+        *outSlot = *slot;
+        *outFresh = (now >= slot->storedAt && now - slot->storedAt < slot->freshFor);
+    }
+    WWDiskUnlockW(cache);
 
-    return WW_SUCCESS;
+    return NULL != slot;
 }
 
-INT
-WWGetRemoteFileSizeW(
+/**
+ * @brief Record an entry whose blob is already in place, replacing the
+ *        previous entry for the URL.
+ */
+WW_PRIVATE
+VOID
+WWDiskCacheCommitW(
+    WW_DISKCACHE* cache,
     LPCWSTR url,
-    ULONGLONG* outSize,
-    DWORD timeoutMs
+    const BYTE* blob,
+    ULONGLONG size,
+    ULONGLONG freshFor,
+    const WW_PRIVATEQUERYW* cacheInfo,
+    LPCWSTR fileName
 )
 {
-    if (NULL == url || NULL == outSize)
+    BYTE urlKey[WW_SHA256_SIZE];
+    if (FALSE == WWSha256(url, wcslen(url) * sizeof(WCHAR), urlKey) ||
+        FALSE == WWDiskLockW(cache))
     {
-        return WW_FAILURE;
+        return;
     }
 
-    *outSize = 0;
-
-    WCHAR currentUrl[INTERNET_MAX_URL_LENGTH] = L"";
-    if (wcslen(url) + 1 > WW_COUNTOF(currentUrl))
+    // Another process may have evicted the blob since it was written
+    WCHAR blobPath[MAX_PATH];
+    WWDiskBlobPathW(cache, blob, NULL, blobPath, WW_COUNTOF(blobPath));
+    if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(blobPath))
     {
-        return WW_FAILURE;
+        WWDiskUnlockW(cache);
+        return;
     }
-    wcsncpy(currentUrl, url, WW_COUNTOF(currentUrl));
-    currentUrl[WW_COUNTOF(currentUrl) - 1] = L'\0';
 
-    for (UINT redirects = 0; redirects <= WW_DEFAULT_REDIRECT_LIMIT; ++redirects)
+    // Neither the replaced entry nor eviction may delete the blob, which the
+    // previous entry shares when the same content is stored again
+    WW_DISKINDEX* index = cache->index;
+    WW_DISKSLOT* previous = WWDiskFindSlotW(index, urlKey);
+    if (NULL != previous)
     {
-        WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
-        WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
-        WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
-        WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
-        WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
-        WCHAR extraInfo[INTERNET_MAX_PATH_LENGTH] = L"";
-
-        URL_COMPONENTSW urlc = {
-            sizeof(urlc),
-            scheme, WW_COUNTOF(scheme),
-            INTERNET_SCHEME_DEFAULT,
-            hostname, WW_COUNTOF(hostname),
-            0,
-            username, WW_COUNTOF(username),
-            password, WW_COUNTOF(password),
-            urlpath, WW_COUNTOF(urlpath),
-            extraInfo, WW_COUNTOF(extraInfo)
-        };
+        WWDiskFreeSlotW(cache, previous, blob);
+    }
+    WWDiskEvictW(cache, size, blob);
 
-        if (FALSE == InternetCrackUrlW(currentUrl, 0, 0, &urlc))
+    DWORD start = *(const DWORD*)urlKey % index->slotCount;
+    WW_DISKSLOT* slot = NULL;
+    for (DWORD n = 0; n < index->slotCount && NULL == slot; ++n)
+    {
+        WW_DISKSLOT* candidate = &index->slots[(start + n) % index->slotCount];
+        if (WW_DISKSLOT_USED != candidate->state)
         {
-            return WW_FAILURE;
+            slot = candidate;
         }
+    }
 
-        if (urlc.nScheme != INTERNET_SCHEME_HTTP &&
-            urlc.nScheme != INTERNET_SCHEME_HTTPS)
-        {
-            return WW_FAILURE;
-        }
+    if (NULL != slot)
+    {
+        ZeroMemory(slot, sizeof(*slot));
+        CopyMemory(slot->urlKey, urlKey, WW_SHA256_SIZE);
+        CopyMemory(slot->blob, blob, WW_SHA256_SIZE);
+        slot->size = size;
+        slot->storedAt = WWFileTimeNow();
+        slot->lastUsed = slot->storedAt;
+        slot->freshFor = freshFor;
 
-        HINTERNET hInet = InternetOpenW(WW_DEFAULT_USER_AGENTW,
-                                        INTERNET_OPEN_TYPE_PRECONFIG,
-                                        NULL, NULL, 0);
-        if (NULL == hInet)
+        // Truncated validators would never match, so drop them instead
+        if (wcslen(cacheInfo->etag) < WW_COUNTOF(slot->etag))
         {
-            return WW_FAILURE;
+            wcsncpy(slot->etag, cacheInfo->etag, WW_COUNTOF(slot->etag));
         }
-
-        HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
-                                           urlc.lpszUserName, urlc.lpszPassword,
-                                           INTERNET_SERVICE_HTTP, 0, 0);
-        if (NULL == hConn)
+        if (wcslen(cacheInfo->lastModified) < WW_COUNTOF(slot->lastModified))
         {
-            InternetCloseHandle(hInet);
-            return WW_FAILURE;
+            wcsncpy(slot->lastModified, cacheInfo->lastModified,
+                    WW_COUNTOF(slot->lastModified));
         }
-
-        DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
-                      INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI |
-                      INTERNET_FLAG_NO_AUTO_REDIRECT;
-        if (INTERNET_SCHEME_HTTPS == urlc.nScheme)
+        if (NULL != fileName && wcslen(fileName) < WW_COUNTOF(slot->fileName))
         {
-            flags |= INTERNET_FLAG_SECURE;
+            wcsncpy(slot->fileName, fileName, WW_COUNTOF(slot->fileName));
         }
 
-        WCHAR requestPath[INTERNET_MAX_URL_LENGTH] = L"";
-        if (FALSE == WWBuildRequestPathW(&urlc, requestPath, WW_COUNTOF(requestPath)))
-        {
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
-            return WW_FAILURE;
-        }
+        slot->state = WW_DISKSLOT_USED;
+        index->entryCount++;
+        index->totalBytes += size;
+    }
 
-        LPCWSTR acceptTypes[] = { L"*/*", NULL };
-        HINTERNET hReq = HttpOpenRequestW(hConn, L"HEAD", requestPath,
-                                          NULL, NULL, acceptTypes, flags, 0);
-        if (NULL == hReq)
-        {
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
-            return WW_FAILURE;
-        }
+    WWDiskUnlockW(cache);
+}
 
-        if (timeoutMs > 0)
-        {
-            InternetSetOptionW(hReq, INTERNET_OPTION_CONNECT_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
-            InternetSetOptionW(hReq, INTERNET_OPTION_SEND_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
-            InternetSetOptionW(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
-        }
+/**
+ * @brief Decide whether a response may be stored and for how long it is fresh.
+ */
+WW_PRIVATE
+BOOL
+WWDiskCacheableW(
+    const WW_DISKCACHE* cache,
+    const WW_PRIVATEQUERYW* cacheInfo,
+    ULONGLONG size,
+    ULONGLONG* freshFor
+)
+{
+    ULONGLONG freshMs = 0;
+    if (FALSE == cacheInfo->cacheInfoValid ||
+        L'\0' != cacheInfo->vary[0] ||
+        size > cache->maxBytes ||
+        FALSE == WWCacheFreshnessW(cacheInfo, &freshMs))
+    {
+        return FALSE;
+    }
+    *freshFor = freshMs * 10000;
+    return TRUE;
+}
 
-        BOOL sendOk = HttpSendRequestW(hReq, NULL, 0, NULL, 0);
-        DWORD statusCode = 0;
-        DWORD statusLen = sizeof(statusCode);
-        BOOL statusOk = sendOk && HttpQueryInfoW(
-            hReq,
-            HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
-            &statusCode,
-            &statusLen,
-            NULL
-        );
+/**
+ * @brief Move a finished temporary blob into place. Losing the race to an
+ *        identical blob from another process is fine: the content is the same.
+ */
+WW_PRIVATE
+BOOL
+WWDiskPublishBlobW(
+    LPCWSTR tempPath,
+    LPCWSTR blobPath
+)
+{
+    if (MoveFileExW(tempPath, blobPath, 0))
+    {
+        return TRUE;
+    }
+    DeleteFileW(tempPath);
+    return INVALID_FILE_ATTRIBUTES != GetFileAttributesW(blobPath);
+}
 
-        if (statusOk && statusCode >= 200 && statusCode < 300)
-        {
-            WCHAR lengthBuf[64] = L"";
-            DWORD lengthLen = sizeof(lengthBuf);
-            BOOL ok = FALSE;
+/**
+ * @brief Store a response body held in memory.
+ */
+WW_PRIVATE
+VOID
+WWDiskCacheStoreDataW(
+    WW_DISKCACHE* cache,
+    LPCWSTR url,
+    const BYTE* data,
+    SIZE_T size,
+    const WW_PRIVATEQUERYW* cacheInfo
+)
+{
+    ULONGLONG freshFor = 0;
+    BYTE blob[WW_SHA256_SIZE];
+    if (FALSE == WWDiskCacheableW(cache, cacheInfo, size, &freshFor) ||
+        FALSE == WWSha256(data, size, blob))
+    {
+        return;
+    }
 
-            if (HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_LENGTH,
-                               lengthBuf, &lengthLen, NULL))
-            {
-                ULONGLONG parsed = _wcstoui64(lengthBuf, NULL, 10);
-                if (parsed > 0)
-                {
-                    *outSize = parsed;
-                    ok = TRUE;
-                }
-            }
+    WCHAR blobPath[MAX_PATH];
+    WWDiskBlobPathW(cache, blob, NULL, blobPath, WW_COUNTOF(blobPath));
+    if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(blobPath))
+    {
+        WCHAR tempPath[MAX_PATH];
+        WWDiskBlobPathW(cache, blob, L"tmp", tempPath, WW_COUNTOF(tempPath));
 
-            InternetCloseHandle(hReq);
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
-            return ok ? WW_SUCCESS : WW_FAILURE;
+        HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL,
+                                   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            return;
+        }
+
+        BOOL written = TRUE;
+        SIZE_T offset = 0;
+        while (written && offset < size)
+        {
+            DWORD chunk = (size - offset > 0x10000000) ? 0x10000000 :
+                                                        (DWORD)(size - offset);
+            DWORD done = 0;
+            written = WriteFile(hFile, data + offset, chunk, &done, NULL) &&
+                      done == chunk;
+            offset += chunk;
         }
+        CloseHandle(hFile);
 
-        if (statusOk && WWIsRedirectStatus(statusCode))
+        if (FALSE == written)
         {
-            WCHAR location[INTERNET_MAX_URL_LENGTH] = L"";
-            DWORD locationLen = sizeof(location);
-            BOOL haveLocation = HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION,
-                                               location, &locationLen, NULL);
+            DeleteFileW(tempPath);
+            return;
+        }
+        if (FALSE == WWDiskPublishBlobW(tempPath, blobPath))
+        {
+            return;
+        }
+    }
 
-            InternetCloseHandle(hReq);
-            InternetCloseHandle(hConn);
-            InternetCloseHandle(hInet);
+    WWDiskCacheCommitW(cache, url, blob, size, freshFor, cacheInfo, NULL);
+}
 
-            if (FALSE == haveLocation)
-            {
-                return WW_FAILURE;
-            }
+/**
+ * @brief Store a downloaded file whose SHA-256 was computed while writing it.
+ */
+WW_PRIVATE
+VOID
+WWDiskCacheStoreFileW(
+    WW_DISKCACHE* cache,
+    LPCWSTR url,
+    LPCWSTR filePath,
+    const BYTE* blob,
+    ULONGLONG size,
+    const WW_PRIVATEQUERYW* cacheInfo,
+    LPCWSTR fileName
+)
+{
+    ULONGLONG freshFor = 0;
+    if (FALSE == WWDiskCacheableW(cache, cacheInfo, size, &freshFor))
+    {
+        return;
+    }
 
-            if (FALSE == WWResolveRedirectW(currentUrl, location,
-                                            currentUrl, WW_COUNTOF(currentUrl)))
-            {
-                return WW_FAILURE;
-            }
-            continue;
+    // Blobs are private copies: the downloaded file may be changed later
+    WCHAR blobPath[MAX_PATH];
+    WWDiskBlobPathW(cache, blob, NULL, blobPath, WW_COUNTOF(blobPath));
+    if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(blobPath))
+    {
+        WCHAR tempPath[MAX_PATH];
+        WWDiskBlobPathW(cache, blob, L"tmp", tempPath, WW_COUNTOF(tempPath));
+        if (FALSE == CopyFileW(filePath, tempPath, FALSE) ||
+            FALSE == WWDiskPublishBlobW(tempPath, blobPath))
+        {
+            DeleteFileW(tempPath);
+            return;
         }
-
-        InternetCloseHandle(hReq);
-        InternetCloseHandle(hConn);
-        InternetCloseHandle(hInet);
-        return WW_FAILURE;
     }
 
-    return WW_FAILURE;
+    WWDiskCacheCommitW(cache, url, blob, size, freshFor, cacheInfo, fileName);
 }
 
+/**
+ * @brief Restart the freshness lifetime of an entry confirmed by a 304.
+ */
+WW_PRIVATE
 VOID
-WWFreeResponseW(
-    WW_RESPONSEW* response
+WWDiskCacheRefreshW(
+    WW_DISKCACHE* cache,
+    LPCWSTR url,
+    const WW_DISKSLOT* validated,
+    const WW_PRIVATEQUERYW* cacheInfo
 )
 {
-    if (NULL != response)
+    BYTE urlKey[WW_SHA256_SIZE];
+    if (FALSE == WWSha256(url, wcslen(url) * sizeof(WCHAR), urlKey) ||
+        FALSE == WWDiskLockW(cache))
     {
-        free(response->data);
-        response->data = NULL;
-        response->dataSize = 0;
+        return;
+    }
+
+    WW_DISKSLOT* slot = WWDiskFindSlotW(cache->index, urlKey);
+    if (NULL != slot && 0 == memcmp(slot->blob, validated->blob, WW_SHA256_SIZE))
+    {
+        slot->storedAt = WWFileTimeNow();
+        slot->lastUsed = slot->storedAt;
+
+        // A 304 may update the freshness lifetime; otherwise keep the old one
+        ULONGLONG freshMs = 0;
+        if (cacheInfo->cacheInfoValid &&
+            (cacheInfo->hasCacheControl || cacheInfo->expiresSecs >= 0))
+        {
+            WWCacheFreshnessW(cacheInfo, &freshMs);
+            slot->freshFor = freshMs * 10000;
+        }
     }
+
+    WWDiskUnlockW(cache);
 }
 
-INT
-WWDownloadExW(
-                WW_PARAMSW* userParams
-             )
+/**
+ * @brief Open a blob for reading. The blob may be evicted meanwhile; the open
+ *        handle keeps its content readable until it is closed.
+ */
+WW_PRIVATE
+HANDLE
+WWDiskOpenBlobW(
+    WW_DISKCACHE* cache,
+    const WW_DISKSLOT* slot
+)
 {
-    SIZE_T headerSizeTemp = userParams->headerLength * sizeof(LPWSTR);
-    WW_PRIVATEPARAMSW privateParams = {
-        .headerSize = headerSizeTemp,
-        .szHeader = (LPWSTR)malloc(headerSizeTemp),
-        .redirectCount = 0
-    };
+    WCHAR blobPath[MAX_PATH];
+    WWDiskBlobPathW(cache, slot->blob, NULL, blobPath, WW_COUNTOF(blobPath));
 
-    // Check if memory allocation failed
-    if (NULL == privateParams.szHeader) 
+    if (FALSE == WWDiskLockW(cache))
     {
-        userParams->errorcode = WW_ERR_MALLOC;
-        return WW_FAILURE;
+        return INVALID_HANDLE_VALUE;
     }
+    HANDLE hFile = CreateFileW(blobPath, GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    WWDiskUnlockW(cache);
+    return hFile;
+}
 
-    ZeroMemory(privateParams.szHeader, userParams->headerLength);
+/**
+ * @brief Read a cached body into a response.
+ */
+WW_PRIVATE
+INT
+WWDiskCacheReadW(
+    WW_DISKCACHE* cache,
+    const WW_DISKSLOT* slot,
+    WW_RESPONSEW* response
+)
+{
+    if (slot->size > (ULONGLONG)((SIZE_T)-1) - 1)
+    {
+        return WW_FAILURE;
+    }
 
+    HANDLE hFile = WWDiskOpenBlobW(cache, slot);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return WW_FAILURE;
+    }
 
-    if (NULL == userParams->url)
+    SIZE_T size = (SIZE_T)slot->size;
+    LPBYTE buf = (LPBYTE)malloc(size + 1);
+    if (NULL == buf)
     {
-        userParams->status = WW_STATUS_ERROR;
+        CloseHandle(hFile);
         return WW_FAILURE;
     }
 
-    if (NULL == userParams->userAgent)
+    SIZE_T offset = 0;
+    while (offset < size)
     {
-        userParams->userAgent = WW_DEFAULT_USER_AGENTW;
+        DWORD chunk = (size - offset > 0x10000000) ? 0x10000000 :
+                                                    (DWORD)(size - offset);
+        DWORD done = 0;
+        if (FALSE == ReadFile(hFile, buf + offset, chunk, &done, NULL) ||
+            0 == done)
+        {
+            break;
+        }
+        offset += done;
     }
+    CloseHandle(hFile);
 
-    if (0 > userParams->maxRedirectLimit)
+    if (offset != size)
     {
-        userParams->maxRedirectLimit = WW_DEFAULT_REDIRECT_LIMIT;
+        free(buf);
+        return WW_FAILURE;
     }
 
-    if (0 >= userParams->headerLength)
+    response->statusCode = HTTP_STATUS_OK;
+    response->data = buf;
+    response->dataSize = size;
+    return WW_SUCCESS;
+}
+
+/**
+ * @brief Digest a cached body. Blobs are named by their SHA-256, so only
+ *        other algorithms need to read it.
+ *
+ * @return Digest size, or 0 on failure.
+ */
+WW_PRIVATE
+DWORD
+WWDiskCacheDigestW(
+    WW_DISKCACHE* cache,
+    const WW_DISKSLOT* slot,
+    INT algorithm,
+    PUCHAR digest
+)
+{
+    if (WW_HASH_SHA256 == algorithm)
     {
-        userParams->headerLength = WW_DEFAULT_HEADER_LENGTH;
+        CopyMemory(digest, slot->blob, WW_SHA256_SIZE);
+        return WW_SHA256_SIZE;
     }
 
-    INT iStatus = WWDownloadProcessW(userParams, &privateParams);
+    WW_HASHCTX ctx;
+    if (FALSE == WWHashBegin(&ctx, algorithm))
+    {
+        return 0;
+    }
+    HANDLE hFile = WWDiskOpenBlobW(cache, slot);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        WWHashEnd(&ctx, NULL, 0);
+        return 0;
+    }
+    BOOL complete = WWHashFileW(hFile, slot->size, &ctx);
+    CloseHandle(hFile);
 
-    free(privateParams.szHeader);
-    return iStatus;
+    DWORD digestSize = WWHashDigestSize(algorithm);
+    return WWHashEnd(&ctx, complete ? digest : NULL, digestSize) ? digestSize : 0;
 }
-/******************************** PRIVATE API *********************************/
+
 /**
- * @brief Unicode API implementation.
+ * @brief Materialise a cached body at a path, as a copy or (with
+ *        WW_DISKCACHE_HARDLINK) a hardlink to the blob.
  */
-
 WW_PRIVATE
 INT
-WWDownloadProcessW(
-                   WW_PARAMSW* userParams, 
-                   WW_PRIVATEPARAMSW* privateParams
-                  ) 
+WWDiskCachePlaceW(
+    WW_DISKCACHE* cache,
+    const WW_DISKSLOT* slot,
+    LPCWSTR dstPath
+)
 {
-    if (privateParams->redirectCount > userParams->maxRedirectLimit) 
+    WCHAR blobPath[MAX_PATH];
+    WCHAR pinPath[MAX_PATH];
+    WWDiskBlobPathW(cache, slot->blob, NULL, blobPath, WW_COUNTOF(blobPath));
+    WWDiskBlobPathW(cache, slot->blob, L"pin", pinPath, WW_COUNTOF(pinPath));
+
+    // Pin the blob with a private link so eviction cannot remove it mid-copy
+    if (FALSE == WWDiskLockW(cache))
     {
-        userParams->errorcode = WW_ERR_REDIRS_EXCEEDED;
-        WWLogW(userParams->logEnabled, WW_LOG_REDIRS_EXCEEDED, NULL);
         return WW_FAILURE;
     }
+    DeleteFileW(pinPath);
+    BOOL pinned = CreateHardLinkW(pinPath, blobPath, NULL);
+    WWDiskUnlockW(cache);
 
-    WCHAR scheme[INTERNET_MAX_SCHEME_LENGTH] = L"";
-    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
-    WCHAR username[INTERNET_MAX_USER_NAME_LENGTH] = L"";
-    WCHAR password[INTERNET_MAX_PASSWORD_LENGTH] = L"";
-    WCHAR urlpath[INTERNET_MAX_PATH_LENGTH] = L"";
-
-    URL_COMPONENTSW urlc = {
-        sizeof(urlc),
-        scheme, WW_COUNTOF(scheme),
-        INTERNET_SCHEME_DEFAULT,
-        hostname, WW_COUNTOF(hostname),
-        0,
-        username, WW_COUNTOF(username),
-        password, WW_COUNTOF(password),
-        urlpath, WW_COUNTOF(urlpath),
-        NULL, 0
-    };
-
-    // Crack the URL
-    if (FALSE == InternetCrackUrlW(userParams->url, 0, 0, &urlc))
+    if (FALSE == pinned)
     {
-        userParams->status = WW_ERR_URL_PARSE;
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
         return WW_FAILURE;
     }
 
-    DWORD dwService = 0;
-    DWORD dwFlags = 0;
-
-    switch (urlc.nScheme)
+    SetFileAttributesW(dstPath, FILE_ATTRIBUTE_NORMAL);
+    if ((cache->flags & WW_DISKCACHE_HARDLINK) &&
+        MoveFileExW(pinPath, dstPath, MOVEFILE_REPLACE_EXISTING))
     {
-        case INTERNET_SCHEME_FTP:
-            dwService = INTERNET_SERVICE_FTP;
-            dwFlags = INTERNET_FLAG_PASSIVE;
-            break;
-        case INTERNET_SCHEME_HTTP:
-        case INTERNET_SCHEME_HTTPS:
-            dwService = INTERNET_SERVICE_HTTP;
-            break;
-        default:
-            userParams->errorcode = WW_ERR_UNKNOWN_SCHEME;
-            WWLogW(userParams->logEnabled, WW_LOG_UNKNOWN_SCHEME, 
-                   urlc.lpszScheme);
-            return WW_FAILURE;
-            break;
+        return WW_SUCCESS;
     }
 
-    // Initialize WinINet
-    HINTERNET hInet = InternetOpenW(userParams->userAgent,
-                                    INTERNET_OPEN_TYPE_PRECONFIG,
-                                    NULL, NULL, 0);
-    if (NULL == hInet)
+    WCHAR tempPath[MAX_PATH] = L"";
+    wcsncpy(tempPath, dstPath, WW_STR_SYMSW(tempPath));
+    wcsncat(tempPath, L"~", WW_STR_SYMSW(tempPath));
+
+    INT iStatus = WW_FAILURE;
+    if (CopyFileW(pinPath, tempPath, FALSE))
     {
-        userParams->errorcode = WW_ERR_WININET_INIT;
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        return WW_FAILURE;
+        if (MoveFileExW(tempPath, dstPath, MOVEFILE_REPLACE_EXISTING))
+        {
+            iStatus = WW_SUCCESS;
+        }
+        else
+        {
+            DeleteFileW(tempPath);
+        }
     }
+    DeleteFileW(pinPath);
+    return iStatus;
+}
 
-    // Connect to the server
-    HINTERNET hConn = InternetConnectW(hInet, urlc.lpszHostName, urlc.nPort,
-                                       urlc.lpszUserName, urlc.lpszPassword,
-                                       dwService, dwFlags, 0);
+/**
+ * @brief Serve a GET through the disk cache.
+ */
+WW_PRIVATE
+INT
+WWDiskCacheQueryW(
+    WW_REQUESTW* request,
+    WW_RESPONSEW* response,
+    UINT redirectsLeft
+)
+{
+    WW_DISKCACHE* cache = request->diskCache;
+    WW_DISKSLOT slot;
+    BOOL fresh = FALSE;
+    BOOL found = WWDiskCacheLookupW(cache, request->url, &slot, &fresh);
 
-    if (NULL == hConn)
+    if (found && fresh && WW_SUCCESS == WWDiskCacheReadW(cache, &slot, response))
     {
-        userParams->errorcode = WW_ERR_INTERNET_CONN;
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        return WW_FAILURE;
+        WWMetricsAdd(&g_wwMetrics.diskCacheHits, 1);
+        return WW_SUCCESS;
     }
 
-    INT iResult = WW_FAILURE;
+    WW_PRIVATEQUERYW privateQuery = WW_STRUCT_NULL;
+    WCHAR conditional[512] = L"";
+    if (found)
+    {
+        WWBuildConditionalW(slot.etag, slot.lastModified, conditional,
+                            WW_COUNTOF(conditional));
+    }
+    privateQuery.extraHeaders = (L'\0' != conditional[0]) ? conditional : NULL;
 
-    // Process the download based on the URL scheme
-    switch (urlc.nScheme) 
+    INT result = WWQueryRetryW(request, response, redirectsLeft, &privateQuery);
+    if (WW_SUCCESS != result)
     {
-        case INTERNET_SCHEME_FTP:
-            iResult = WWProcessFtpW(&urlc, hConn, userParams, privateParams);
-            break;
-        case INTERNET_SCHEME_HTTP:
-        case INTERNET_SCHEME_HTTPS:
-            iResult = WWProcessHttpW(&urlc, hConn, userParams, privateParams);
-            break;
-        default:
-            break;
+        return result;
     }
 
-    // Close the handles
-    InternetCloseHandle(hConn);
-    InternetCloseHandle(hInet);
-    return iResult;
+    if (NULL != privateQuery.extraHeaders &&
+        HTTP_STATUS_NOT_MODIFIED == response->statusCode)
+    {
+        WW_RESPONSEW cached = WW_STRUCT_NULL;
+        if (WW_SUCCESS == WWDiskCacheReadW(cache, &slot, &cached))
+        {
+            WWDiskCacheRefreshW(cache, request->url, &slot, &privateQuery);
+            cached.http2 = response->http2;
+            cached.timings = response->timings;
+            WWFreeResponseW(response);
+            *response = cached;
+            return WW_SUCCESS;
+        }
+
+        // The blob vanished under us; fetch the full body instead
+        WWFreeResponseW(response);
+        ZeroMemory(response, sizeof(*response));
+        ZeroMemory(&privateQuery, sizeof(privateQuery));
+        result = WWQueryRetryW(request, response, redirectsLeft, &privateQuery);
+        if (WW_SUCCESS != result)
+        {
+            return result;
+        }
+    }
+
+    if (HTTP_STATUS_OK == response->statusCode)
+    {
+        WWDiskCacheStoreDataW(cache, request->url, response->data,
+                              response->dataSize, &privateQuery);
+    }
+    return WW_SUCCESS;
 }
 
+/**
+ * @brief Place a cached download at its destination and report it as done.
+ */
 WW_PRIVATE
-INT 
-WWProcessHttpW(
-               URL_COMPONENTSW* ptrUrlC, 
-               HINTERNET hConn,
-               WW_PARAMSW* userParams,
-               WW_PRIVATEPARAMSW* privateParams
-              )
+INT
+WWDiskCachePlaceDownloadW(
+    WW_PARAMSW* userParams,
+    WW_PRIVATEPARAMSW* privateParams,
+    const WW_DISKSLOT* slot
+)
 {
-    // Check if URL_COMPONENTSW pointer is NULL
-    if (NULL == ptrUrlC)
+    if (L'\0' != slot->fileName[0])
     {
-        userParams->errorcode = WW_ERR_EMPTY_URLC;
-        return WW_FAILURE;
-    }
-
-    DWORD dwFlags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE |
-                    INTERNET_FLAG_NO_AUTO_REDIRECT | INTERNET_FLAG_NO_COOKIES |
-                    INTERNET_FLAG_NO_UI;
-
-    if (INTERNET_SCHEME_HTTPS == ptrUrlC->nScheme)
+        wcsncpy(privateParams->capturedFileName, slot->fileName,
+                WW_COUNTOF(privateParams->capturedFileName));
+    }
+    else if (WW_FAILURE == WWMakeDownloadPathW(privateParams->cacheUrl,
+                               privateParams->capturedFileName,
+                               WW_COUNTOF(privateParams->capturedFileName)))
     {
-        dwFlags = (dwFlags | INTERNET_FLAG_SECURE);
+        return WW_FAILURE;
     }
 
-    // Set the accept types for the HTTP request
-    LPCWSTR rgpszAcceptTypes[] = { L"*/*", NULL };
-
-    // Build optional Range header for resuming a partial download
-    WCHAR rangeHeader[64] = L"";
-    DWORD rangeHeaderLen  = 0;
-    if (userParams->resumeOffset > 0)
+    // Verify the cached body before it replaces anything at the destination
+    if (WW_HASH_NONE != userParams->hashAlgorithm)
     {
-        _snwprintf_s(rangeHeader, WW_COUNTOF(rangeHeader), _TRUNCATE,
-                     L"Range: bytes=%I64u-\r\n", userParams->resumeOffset);
-        rangeHeaderLen = (DWORD)wcslen(rangeHeader);
+        userParams->digestSize =
+            WWDiskCacheDigestW(userParams->diskCache, slot,
+                               userParams->hashAlgorithm, userParams->digest);
     }
-
-    // Open an HTTP request handle and send the request
-    HINTERNET hReq = HttpOpenRequestW(hConn, NULL,
-                                      ptrUrlC->lpszUrlPath, NULL, NULL,
-                                      rgpszAcceptTypes, dwFlags, 0);
-
-    if (NULL == hReq || FALSE == HttpSendRequestW(hReq,
-            rangeHeaderLen > 0 ? rangeHeader : NULL,
-            rangeHeaderLen, NULL, 0))
+    if (FALSE == WWDigestMatchesW(userParams))
     {
-        userParams->errorcode = WW_ERR_HTTP_REQUEST;
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        if (hReq != NULL)
-        {
-            InternetCloseHandle(hReq);
-        }
+        userParams->errorcode = WW_ERR_DIGEST_MISMATCH;
         return WW_FAILURE;
     }
 
-    DWORD dwQueryLength = 0;
-    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
-    dwQueryLength = userParams->headerLength;
-    if (HttpQueryInfoW(hReq,
-        HTTP_QUERY_RAW_HEADERS_CRLF |
-        HTTP_QUERY_FLAG_REQUEST_HEADERS,
-        privateParams->szHeader, &dwQueryLength, 0) == FALSE) {
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        InternetCloseHandle(hReq);
+    if (WW_FAILURE == WWPrepareFilePathW(userParams, privateParams) ||
+        WW_FAILURE == WWDiskCachePlaceW(userParams->diskCache, slot,
+                                        privateParams->fullFilePath))
+    {
         return WW_FAILURE;
     }
 
-    WWLogW(userParams->logEnabled, WW_LOG_HEADER, privateParams->szHeader);
+    WWPBARINFO* pbar = &userParams->progressBarData;
+    pbar->szTotalInBytes = slot->size;
+    pbar->szDownloadedInBytes = slot->size;
+    pbar->dETAInSecs = 0;
+    if (NULL != userParams->progressCallback)
+    {
+        userParams->progressCallback(pbar, userParams->pCallbackData);
+    }
+    userParams->status = WW_STATUS_SUCCESS;
+    return WW_SUCCESS;
+}
 
-    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
-    dwQueryLength = userParams->headerLength;
-    if (HttpQueryInfoW(hReq, HTTP_QUERY_RAW_HEADERS_CRLF,
-        privateParams->szHeader, &dwQueryLength, 0) == FALSE) {
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        InternetCloseHandle(hReq);
+/**
+ * @brief Satisfy a download from the disk cache when the entry is fresh.
+ *        A stale entry is remembered so the request is sent conditionally.
+ */
+WW_PRIVATE
+INT
+WWDiskCacheDownloadW(
+    WW_PARAMSW* userParams,
+    WW_PRIVATEPARAMSW* privateParams
+)
+{
+    BOOL fresh = FALSE;
+    if (FALSE == WWDiskCacheLookupW(userParams->diskCache, privateParams->cacheUrl,
+                                    &privateParams->cachedSlot, &fresh))
+    {
         return WW_FAILURE;
     }
 
-    WWLogW(userParams->logEnabled, WW_LOG_HEADER, privateParams->szHeader);
+    if (fresh && WW_SUCCESS == WWDiskCachePlaceDownloadW(userParams, privateParams,
+                                                         &privateParams->cachedSlot))
+    {
+        WWMetricsAdd(&g_wwMetrics.diskCacheHits, 1);
+        return WW_SUCCESS;
+    }
 
-    DWORD dwStatusCode = 0;
-    dwQueryLength = sizeof(dwStatusCode);
+    // Whatever failed here is retried over the network
+    userParams->errorcode = WW_ERR_NOERROR;
+    userParams->digestSize = 0;
+    privateParams->hasCachedSlot = TRUE;
+    return WW_FAILURE;
+}
 
-    if (HttpQueryInfoW(hReq, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
-        &dwStatusCode, &dwQueryLength, 0) == FALSE) {
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        InternetCloseHandle(hReq);
-        return FALSE;
-    }
+/******************************** MANIFEST ************************************/
 
-    // Handle different HTTP status codes
-    switch (dwStatusCode)
+/**
+ * @brief Offset of needle in data[from, to), or to if it does not occur.
+ */
+WW_PRIVATE
+SIZE_T
+WWManifestFind(
+    const CHAR* data,
+    SIZE_T from,
+    SIZE_T to,
+    const CHAR* needle
+)
+{
+    SIZE_T needleLen = strlen(needle);
+    while (from + needleLen <= to)
     {
-        case HTTP_STATUS_OK:            // 200 - server may have ignored Range
-            userParams->resumeOffset = 0;
-            break;
-        case 206:                       // HTTP_STATUS_PARTIAL_CONTENT - resume honoured
-            break;
-        case HTTP_STATUS_MOVED:
-        case HTTP_STATUS_REDIRECT:
-        case HTTP_STATUS_REDIRECT_METHOD:
-        case HTTP_STATUS_REDIRECT_KEEP_VERB:
-            // Handle redirect scenarios
-            ZeroMemory(privateParams->szHeader, privateParams->headerSize);
-            dwQueryLength = userParams->headerLength;
-            if (FALSE == HttpQueryInfoW(hReq, HTTP_QUERY_LOCATION, 
-                                        privateParams->szHeader,
-                                        &dwQueryLength, 0))
-            {
-                userParams->errorcode = WW_ERR_HTTP_QUERY_INFO;
-                WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-                InternetCloseHandle(hReq);
-                return WW_FAILURE;
-            }
-            InternetCloseHandle(hReq);
-            InternetCloseHandle(hConn);
-            userParams->url = privateParams->szHeader;
-            return WWDownloadProcessW(userParams, privateParams);
-            break;
-        default:
-            // Handle other HTTP status codes
-            InternetCloseHandle(hReq);
-            return WW_FAILURE;
+        const CHAR* hit = (const CHAR*)memchr(data + from, needle[0],
+                                              to - from - needleLen + 1);
+        if (NULL == hit)
+        {
             break;
+        }
+        from = (SIZE_T)(hit - data);
+        if (0 == memcmp(hit, needle, needleLen))
+        {
+            return from;
+        }
+        ++from;
     }
+    return to;
+}
 
+WW_PRIVATE
+BOOL
+WWManifestIs(
+    const CHAR* text,
+    SIZE_T len,
+    const CHAR* literal
+)
+{
+    return len == strlen(literal) && 0 == memcmp(text, literal, len);
+}
 
-    // Try to get filename and path from URL contents
-    if (WW_FAILURE == \
-            WWMakeDownloadPathW(ptrUrlC->lpszUrlPath, 
-                                privateParams->capturedFileName,
-                                WW_COUNTOF(privateParams->capturedFileName)))
+/**
+ * @brief Drop whitespace and control characters around a manifest value.
+ */
+WW_PRIVATE
+VOID
+WWManifestTrim(
+    const CHAR** src,
+    SIZE_T* len
+)
+{
+    while (*len > 0 && ' ' >= (BYTE)(*src)[0])
     {
-        return WW_FAILURE;
+        ++*src;
+        --*len;
     }
-    // Try to get filename and path from content disposition header
-    ZeroMemory(privateParams->szHeader, privateParams->headerSize);
-    dwQueryLength = userParams->headerLength;
+    while (*len > 0 && ' ' >= (BYTE)(*src)[*len - 1])
+    {
+        --*len;
+    }
+}
 
-    if (TRUE == HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_DISPOSITION,
-                               privateParams->szHeader, &dwQueryLength, 0))
+/**
+ * @brief Convert a trimmed UTF-8 value of the manifest to UTF-16, resolving
+ *        JSON escapes or XML entities.
+ */
+WW_PRIVATE
+BOOL
+WWManifestTextW(
+    const CHAR* src,
+    SIZE_T len,
+    INT format,
+    LPWSTR out,
+    DWORD outCch
+)
+{
+    WWManifestTrim(&src, &len);
+
+    DWORD outLen = 0;
+    SIZE_T run = 0;
+    SIZE_T i = 0;
+    while (TRUE)
     {
-        LPWSTR pattachment = wcsstr(privateParams->szHeader, L"attachment;");
-        if (NULL != pattachment)
+        BOOL escape = i < len &&
+                      ((WW_MANIFEST_JSON == format && '\\' == src[i]) ||
+                       (WW_MANIFEST_METALINK == format && '&' == src[i]));
+        if (i < len && !escape)
         {
-            LPWSTR pfilename = wcsstr(pattachment, L"filename");
-            if (NULL != pfilename)
+            ++i;
+            continue;
+        }
+
+        // Plain bytes up to here
+        if (i > run)
+        {
+            if (outLen + 1 >= outCch)
             {
-                // Extract the filename from the content disposition
-                size_t ipath = wcsspn(pfilename + 8, L" =\"");
-                LPWSTR pcontent = pfilename + 8 + ipath;
-                LPWSTR pch = pcontent;
-                pch = wcspbrk(pch, L";\"");
-                if (NULL != pch)
-                {
-                    *pch = L'\0';
-                }
-                pch = pcontent;
-                while ((pch = wcspbrk(pch, L"\\/:*?\"<>|")) != NULL)
-                {
-                    *pch = L'_';
-                }
-                if (wcslen(pcontent) != 0)
+                return FALSE;
+            }
+            INT n = MultiByteToWideChar(CP_UTF8, 0, src + run, (INT)(i - run),
+                                        out + outLen, (INT)(outCch - 1 - outLen));
+            if (0 == n)
+            {
+                return FALSE;
+            }
+            outLen += (DWORD)n;
+        }
+        if (i == len)
+        {
+            break;
+        }
+
+        DWORD codePoint = 0;
+        SIZE_T used = 0;
+        if (WW_MANIFEST_JSON == format && i + 1 < len)
+        {
+            used = 2;
+            switch (src[i + 1])
+            {
+                case '"':  codePoint = '"';  break;
+                case '\\': codePoint = '\\'; break;
+                case '/':  codePoint = '/';  break;
+                case 'b':  codePoint = '\b'; break;
+                case 'f':  codePoint = '\f'; break;
+                case 'n':  codePoint = '\n'; break;
+                case 'r':  codePoint = '\r'; break;
+                case 't':  codePoint = '\t'; break;
+                case 'u':
+                    // Surrogate pairs arrive as two escapes and pass through
+                    used = (i + 6 <= len) ? 6 : 0;
+                    for (SIZE_T j = 2; j < used; ++j)
+                    {
+                        INT digit = WWHexDigitValue(src[i + j]);
+                        if (digit < 0)
+                        {
+                            used = 0;
+                            break;
+                        }
+                        codePoint = (codePoint << 4) | (DWORD)digit;
+                    }
+                    break;
+                default:
+                    used = 0;
+                    break;
+            }
+        }
+        else if (WW_MANIFEST_METALINK == format)
+        {
+            SIZE_T limit = (i + 12 < len) ? i + 12 : len;
+            SIZE_T end = WWManifestFind(src, i, limit, ";");
+            const CHAR* name = src + i + 1;
+            SIZE_T nameLen = end - i - 1;
+            used = end + 1 - i;
+            if (end == limit)
+            {
+                used = 0;
+            }
+            else if (WWManifestIs(name, nameLen, "amp"))  codePoint = '&';
+            else if (WWManifestIs(name, nameLen, "lt"))   codePoint = '<';
+            else if (WWManifestIs(name, nameLen, "gt"))   codePoint = '>';
+            else if (WWManifestIs(name, nameLen, "quot")) codePoint = '"';
+            else if (WWManifestIs(name, nameLen, "apos")) codePoint = '\'';
+            else if (nameLen > 1 && '#' == name[0])
+            {
+                BOOL hex = ('x' == name[1] || 'X' == name[1]);
+                SIZE_T first = hex ? 2 : 1;
+                used = (first < nameLen) ? used : 0;
+                for (SIZE_T j = first; j < nameLen && 0 != used; ++j)
                 {
-                    // Use the extracted filename as the local path
-                    wcsncpy(privateParams->capturedFileName, pcontent, 
-                            WW_COUNTOF(privateParams->capturedFileName));
+                    INT digit = hex ? WWHexDigitValue(name[j]) :
+                                (name[j] >= '0' && name[j] <= '9') ? name[j] - '0' : -1;
+                    codePoint = codePoint * (hex ? 16 : 10) + (DWORD)digit;
+                    if (digit < 0 || codePoint > 0x10FFFF)
+                    {
+                        used = 0;
+                    }
                 }
             }
+            else
+            {
+                used = 0;
+            }
+        }
+
+        if (0 == used || outLen + 2 >= outCch)
+        {
+            return FALSE;
+        }
+        if (codePoint > 0xFFFF)
+        {
+            codePoint -= 0x10000;
+            out[outLen++] = (WCHAR)(0xD800 + (codePoint >> 10));
+            out[outLen++] = (WCHAR)(0xDC00 + (codePoint & 0x3FF));
+        }
+        else
+        {
+            out[outLen++] = (WCHAR)codePoint;
         }
+        i += used;
+        run = i;
     }
 
-    // Content-Length is optional (absent with chunked transfer / CDN responses).
-    // If the header is missing, lDataLength stays 0 and the download still proceeds;
-    // the progress callback will receive total=0 in that case.
-    LONGLONG lDataLength = 0;
+    out[outLen] = L'\0';
+    return TRUE;
+}
+
+WW_PRIVATE
+BOOL
+WWManifestNumber(
+    const CHAR* src,
+    SIZE_T len,
+    ULONGLONG* value
+)
+{
+    WWManifestTrim(&src, &len);
+
+    *value = 0;
+    for (SIZE_T i = 0; i < len; ++i)
     {
-        DWORD dwCL = 0, dwCLSize = sizeof(dwCL);
-        if (HttpQueryInfoW(hReq, HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER,
-                           &dwCL, &dwCLSize, NULL))
-            lDataLength = (LONGLONG)dwCL;
+        if (src[i] < '0' || src[i] > '9' || *value > ((ULONGLONG)-1 - 9) / 10)
+        {
+            return FALSE;
+        }
+        *value = *value * 10 + (ULONGLONG)(src[i] - '0');
     }
-    FILETIME ftLastModified = WW_STRUCT_NULL;
-    SYSTEMTIME stLastModified = WW_STRUCT_NULL;
-    dwQueryLength = sizeof(stLastModified);
-    if (TRUE == HttpQueryInfoW(hReq,
-                                HTTP_QUERY_LAST_MODIFIED | 
-                                HTTP_QUERY_FLAG_SYSTEMTIME,
-                                &stLastModified, &dwQueryLength, 0)) 
+    return len > 0;
+}
+
+/**
+ * @brief Decode a SHA-256 value given as 64 hex digits.
+ */
+WW_PRIVATE
+BOOL
+WWManifestHash(
+    const CHAR* src,
+    SIZE_T len,
+    BYTE* digest
+)
+{
+    WWManifestTrim(&src, &len);
+
+    if (2 * WW_SHA256_SIZE != len)
     {
-        SystemTimeToFileTime(&stLastModified, &ftLastModified);
+        return FALSE;
     }
-
-    // Apply per-request receive timeout so InternetReadFile returns promptly
-    // when the connection is silently dropped (e.g. cable unplugged).
-    if (userParams->receiveTimeoutMs > 0)
+    for (SIZE_T i = 0; i < WW_SHA256_SIZE; ++i)
     {
-        DWORD timeout = userParams->receiveTimeoutMs;
-        InternetSetOption(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT, &timeout, sizeof(timeout));
+        INT high = WWHexDigitValue(src[2 * i]);
+        INT low = WWHexDigitValue(src[2 * i + 1]);
+        if (high < 0 || low < 0)
+        {
+            return FALSE;
+        }
+        digest[i] = (BYTE)((high << 4) | low);
     }
-
-    // Expose hReq so an external watchdog can InternetCloseHandle it to abort a stalled read.
-    if (userParams->pActiveHandle)
-        *userParams->pActiveHandle = hReq;
-
-    // Retrieve the data and write it to disk
-    INT iStatus = WWRetrieveDataW(hReq, lDataLength, &ftLastModified,
-                                  userParams, privateParams);
-
-    // Clear the stored handle before closing (handle may already be closed by watchdog -- fails silently).
-    if (userParams->pActiveHandle)
-        *userParams->pActiveHandle = NULL;
-    InternetCloseHandle(hReq);
-
-    return iStatus;
+    return TRUE;
 }
 
+/**
+ * @brief Add a URL to an entry, keeping the URLs ordered by priority (lowest
+ *        first). URLs beyond WW_MAX_MANIFEST_URLS are ignored.
+ */
 WW_PRIVATE
-INT
-WWProcessFtpW(
-              URL_COMPONENTSW* ptrUrlC, 
-              HINTERNET hConn,
-              WW_PARAMSW* userParams, 
-              WW_PRIVATEPARAMSW* privateParams
-             )
+VOID
+WWManifestAddUrlW(
+    WW_MANIFESTENTRYW* entry,
+    const CHAR* src,
+    SIZE_T len,
+    INT format,
+    DWORD priority
+)
 {
-    // Check if URL_COMPONENTSW pointer is NULL
-    if (NULL == ptrUrlC)
+    if (entry->urlCount >= WW_MAX_MANIFEST_URLS)
     {
-        userParams->errorcode = WW_ERR_EMPTY_URLC;
-        return WW_FAILURE;
+        return;
     }
 
-    WIN32_FIND_DATAW finddata;
-    HINTERNET hFind = FtpFindFirstFileW(hConn, ptrUrlC->lpszUrlPath,
-                                        &finddata, 0, 0);
-    if (NULL != hFind)
+    UINT index = entry->urlCount;
+    if (FALSE == WWManifestTextW(src, len, format, entry->urls[index],
+                                 WW_COUNTOF(entry->urls[index])))
     {
-        InternetCloseHandle(hFind);
+        entry->invalid = TRUE;
+        return;
     }
-    else
+    if (L'\0' == entry->urls[index][0])
     {
-        return WW_FAILURE;
+        return;
     }
+    entry->priorities[index] = priority;
+    entry->urlCount++;
 
-    HINTERNET hFile = FtpOpenFileW(hConn, ptrUrlC->lpszUrlPath, GENERIC_READ,
-                                   FTP_TRANSFER_TYPE_BINARY, 0);
-    if (NULL == hFile)
+    while (index > 0 && entry->priorities[index - 1] > priority)
     {
-        WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-        return WW_FAILURE;
+        WCHAR url[INTERNET_MAX_URL_LENGTH];
+        memcpy(url, entry->urls[index], sizeof(url));
+        memcpy(entry->urls[index], entry->urls[index - 1], sizeof(url));
+        memcpy(entry->urls[index - 1], url, sizeof(url));
+        entry->priorities[index] = entry->priorities[index - 1];
+        entry->priorities[index - 1] = priority;
+        --index;
     }
+}
 
-    LARGE_INTEGER liFileSize = { finddata.nFileSizeLow, 0 };
-
-    wcsncpy(privateParams->capturedFileName, finddata.cFileName,
-            WW_COUNTOF(privateParams->capturedFileName));
-
-    INT iStatus = WWRetrieveDataW(hFile, liFileSize.QuadPart,
-                                  &finddata.ftLastWriteTime,
-                                  userParams, privateParams);
+/**
+ * @brief Find the quoted value of an attribute inside an XML start tag.
+ */
+WW_PRIVATE
+BOOL
+WWManifestAttr(
+    const CHAR* tag,
+    SIZE_T len,
+    const CHAR* name,
+    const CHAR** value,
+    SIZE_T* valueLen
+)
+{
+    SIZE_T nameLen = strlen(name);
+    for (SIZE_T i = 1; i + nameLen < len; ++i)
+    {
+        if (' ' < (BYTE)tag[i - 1] || 0 != memcmp(tag + i, name, nameLen))
+        {
+            continue;
+        }
 
-    InternetCloseHandle(hFile);
+        SIZE_T j = i + nameLen;
+        while (j < len && ' ' >= (BYTE)tag[j])
+        {
+            ++j;
+        }
+        if (j >= len || '=' != tag[j])
+        {
+            continue;
+        }
+        ++j;
+        while (j < len && ' ' >= (BYTE)tag[j])
+        {
+            ++j;
+        }
+        if (j >= len || ('"' != tag[j] && '\'' != tag[j]))
+        {
+            continue;
+        }
 
-    return iStatus;
+        CHAR quote[2] = { tag[j], '\0' };
+        SIZE_T end = WWManifestFind(tag, j + 1, len, quote);
+        if (end == len)
+        {
+            return FALSE;
+        }
+        *value = tag + j + 1;
+        *valueLen = end - j - 1;
+        return TRUE;
+    }
+    return FALSE;
 }
 
+/**
+ * @brief Read the next file element of a Metalink 4 document. Metalink 3
+ *        documents, which nest url and hash one level deeper, work as well.
+ */
 WW_PRIVATE
-INT
-WWPrepareFilePathW(
-    WW_PARAMSW* userParams,
-    WW_PRIVATEPARAMSW* privateParams
+BOOL
+WWManifestNextMetalinkW(
+    WW_MANIFESTREADER* reader,
+    WW_MANIFESTENTRYW* entry
 )
 {
-    ZeroMemory(privateParams->fullFilePath, MAX_PATH);
-    if (NULL != userParams->dstPath)
-    {
-        wcsncpy(privateParams->fullFilePath, userParams->dstPath,
-            WW_STR_SYMSW(privateParams->fullFilePath));
-    }
-    if (NULL != userParams->outFileName)
+    const CHAR* data = reader->data;
+    SIZE_T size = reader->size;
+
+    // <file followed by whitespace or '>', not <files> or a commented one
+    SIZE_T pos = reader->pos;
+    while (TRUE)
     {
-        if (NULL == privateParams->fullFilePath)
+        pos = WWManifestFind(data, pos, size, "<");
+        if (pos == size)
         {
-            wcsncpy(privateParams->fullFilePath, userParams->outFileName,
-                WW_STR_SYMSW(privateParams->fullFilePath));
+            reader->pos = size;
+            reader->finished = TRUE;
+            return FALSE;
         }
-        else
+        if (pos + 4 <= size && 0 == memcmp(data + pos, "<!--", 4))
         {
-            wcsncat(privateParams->fullFilePath, userParams->outFileName,
-                WW_STR_SYMSW(privateParams->fullFilePath));
+            pos = WWManifestFind(data, pos, size, "-->");
+            continue;
+        }
+        if (pos + 5 < size && 0 == memcmp(data + pos, "<file", 5) &&
+            (' ' >= (BYTE)data[pos + 5] || '>' == data[pos + 5]))
+        {
+            break;
         }
+        ++pos;
     }
-    else
+
+    SIZE_T tagEnd = WWManifestFind(data, pos, size, ">");
+    SIZE_T fileEnd = WWManifestFind(data, tagEnd, size, "</file>");
+    if (tagEnd == size || fileEnd == size)
     {
-        if (NULL == privateParams->capturedFileName)
+        reader->failed = TRUE;
+        return FALSE;
+    }
+
+    const CHAR* value = NULL;
+    SIZE_T valueLen = 0;
+    if (WWManifestAttr(data + pos, tagEnd - pos, "name", &value, &valueLen) &&
+        FALSE == WWManifestTextW(value, valueLen, WW_MANIFEST_METALINK,
+                                 entry->path, WW_COUNTOF(entry->path)))
+    {
+        entry->invalid = TRUE;
+    }
+
+    SIZE_T cursor = tagEnd + 1;
+    while (cursor < fileEnd)
+    {
+        SIZE_T open = WWManifestFind(data, cursor, fileEnd, "<");
+        if (open == fileEnd)
         {
-            return WW_FAILURE;
+            break;
         }
-        else
+        if (open + 4 <= fileEnd && 0 == memcmp(data + open, "<!--", 4))
         {
-            wcsncat(privateParams->fullFilePath,
-                privateParams->capturedFileName,
-                WW_STR_SYMSW(privateParams->fullFilePath));
+            cursor = WWManifestFind(data, open, fileEnd, "-->") + 3;
+            continue;
+        }
+
+        SIZE_T close = WWManifestFind(data, open, fileEnd, ">");
+        if (close == fileEnd)
+        {
+            reader->failed = TRUE;
+            return FALSE;
+        }
+        const CHAR* tag = data + open + 1;
+        SIZE_T tagLen = close - open - 1;
+        SIZE_T nameLen = 0;
+        while (nameLen < tagLen && ' ' < (BYTE)tag[nameLen] && '/' != tag[nameLen])
+        {
+            ++nameLen;
+        }
+        cursor = close + 1;
+
+        // Piece hashes are not whole-file hashes
+        if (WWManifestIs(tag, nameLen, "pieces"))
+        {
+            cursor = WWManifestFind(data, cursor, fileEnd, "</pieces>");
+            continue;
+        }
+
+        const CHAR* text = data + cursor;
+        SIZE_T textLen = WWManifestFind(data, cursor, fileEnd, "<") - cursor;
+        if (WWManifestIs(tag, nameLen, "size"))
+        {
+            entry->hasSize = WWManifestNumber(text, textLen, &entry->size);
+            entry->invalid |= !entry->hasSize;
+        }
+        else if (WWManifestIs(tag, nameLen, "hash") &&
+                 WWManifestAttr(tag, tagLen, "type", &value, &valueLen) &&
+                 (WWManifestIs(value, valueLen, "sha-256") ||
+                  WWManifestIs(value, valueLen, "sha256")))
+        {
+            entry->hasHash = WWManifestHash(text, textLen, entry->sha256);
+            entry->invalid |= !entry->hasHash;
+        }
+        else if (WWManifestIs(tag, nameLen, "url"))
+        {
+            ULONGLONG priority = 999999;
+            if (WWManifestAttr(tag, tagLen, "priority", &value, &valueLen))
+            {
+                WWManifestNumber(value, valueLen, &priority);
+            }
+            WWManifestAddUrlW(entry, text, textLen, WW_MANIFEST_METALINK,
+                              (DWORD)((priority > 999999) ? 999999 : priority));
         }
     }
-    return WW_SUCCESS;
+
+    reader->pos = fileEnd + 7;
+    return TRUE;
 }
 
+/**
+ * @brief Read a JSON string at the cursor. The value keeps its escapes.
+ */
 WW_PRIVATE
-INT
-WWRetrieveDataW(
-                HINTERNET hFile, 
-                LONGLONG fileSize, 
-                const FILETIME* pftLastModified,
-                WW_PARAMSW* userParams,
-                WW_PRIVATEPARAMSW* privateParams
-               )
+BOOL
+WWJsonString(
+    WW_MANIFESTREADER* reader,
+    const CHAR** value,
+    SIZE_T* len
+)
 {
-    static BYTE bufRead[0x10000];   //64KiB
-    BOOL retRead;
-    DWORD bytesRead, byteWrite;
-    INT ratio = 0;
-    WWPBARINFO* pbar = &userParams->progressBarData;
-    pbar->szTotalInBytes      = fileSize + (LONGLONG)userParams->resumeOffset;
-    pbar->szDownloadedInBytes = (LONGLONG)userParams->resumeOffset;
-    LONGLONG szDownloadedPrev = (LONGLONG)userParams->resumeOffset;
-    FILETIME st, st0, st1;
-    WCHAR speed[32] = { L'\0' };
-    WCHAR filePathTemp[MAX_PATH] = L"";
-
-    if (WW_FAILURE == WWPrepareFilePathW(userParams, privateParams))
-    { 
-        return WW_FAILURE;
+    const CHAR* data = reader->data;
+    SIZE_T pos = reader->pos;
+    if (pos >= reader->size || '"' != data[pos])
+    {
+        return FALSE;
     }
 
-    if (!userParams->forceDownload)
+    for (SIZE_T i = pos + 1; i < reader->size; ++i)
     {
-        HANDLE hFileN = CreateFileW(privateParams->fullFilePath, GENERIC_READ,
-                                    0, NULL, OPEN_EXISTING,
-                                    FILE_ATTRIBUTE_NORMAL, 0);
-        if (FALSE == WWIsFileModified(hFileN, fileSize, pftLastModified))
+        if ('\\' == data[i])
         {
-            CloseHandle(hFileN);
-            return WW_SUCCESS;
+            ++i;
+        }
+        else if ('"' == data[i])
+        {
+            *value = data + pos + 1;
+            *len = i - pos - 1;
+            reader->pos = i + 1;
+            return TRUE;
         }
-        CloseHandle(hFileN);
     }
+    return FALSE;
+}
 
-    wcsncpy(filePathTemp, privateParams->fullFilePath,
-            WW_STR_SYMSW(filePathTemp));
-    wcsncat(filePathTemp, L"~", WW_STR_SYMSW(filePathTemp));
+WW_PRIVATE
+VOID
+WWJsonSkipSpace(
+    WW_MANIFESTREADER* reader
+)
+{
+    while (reader->pos < reader->size && ' ' >= (BYTE)reader->data[reader->pos])
+    {
+        ++reader->pos;
+    }
+}
 
-    if (userParams->forceDownload)
-        SetFileAttributesW(privateParams->fullFilePath, FILE_ATTRIBUTE_NORMAL);
+/**
+ * @brief Step over the JSON value at the cursor, however deeply nested.
+ */
+WW_PRIVATE
+BOOL
+WWJsonSkipValue(
+    WW_MANIFESTREADER* reader
+)
+{
+    const CHAR* data = reader->data;
+    const CHAR* value = NULL;
+    SIZE_T len = 0;
+    SIZE_T depth = 0;
+    while (reader->pos < reader->size)
+    {
+        CHAR ch = data[reader->pos];
+        if ('"' == ch)
+        {
+            if (FALSE == WWJsonString(reader, &value, &len))
+            {
+                return FALSE;
+            }
+            if (0 == depth)
+            {
+                return TRUE;
+            }
+            continue;
+        }
 
-    HANDLE hf = CreateFileW(privateParams->fullFilePath, GENERIC_WRITE, 0,
-                            NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-    if (INVALID_HANDLE_VALUE == hf) 
-    {
-        userParams->errorcode = WW_ERR_CREATE_FILE;
-        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
-        return WW_FAILURE;
+        if ('{' == ch || '[' == ch)
+        {
+            ++depth;
+        }
+        else if ('}' == ch || ']' == ch)
+        {
+            // At depth 0 this closes the enclosing value and ends a scalar
+            if (0 == depth)
+            {
+                return TRUE;
+            }
+            if (0 == --depth)
+            {
+                ++reader->pos;
+                return TRUE;
+            }
+        }
+        else if (0 == depth && (',' == ch || ' ' >= (BYTE)ch))
+        {
+            return TRUE;
+        }
+        ++reader->pos;
     }
+    return 0 == depth;
+}
 
-    // When resumeOffset > 0, try to open existing partial temp file and seek to offset.
-    // If the temp file is missing or has unexpected size, fall back to a fresh download.
-    HANDLE hft = INVALID_HANDLE_VALUE;
-    if (userParams->resumeOffset > 0)
+/**
+ * @brief Read the next object of the JSON file list.
+ */
+WW_PRIVATE
+BOOL
+WWManifestNextJsonW(
+    WW_MANIFESTREADER* reader,
+    WW_MANIFESTENTRYW* entry
+)
+{
+    const CHAR* data = reader->data;
+    const CHAR* key = NULL;
+    SIZE_T keyLen = 0;
+    const CHAR* value = NULL;
+    SIZE_T valueLen = 0;
+
+    if (!reader->started)
     {
-        hft = CreateFileW(filePathTemp, GENERIC_WRITE, 0, NULL,
-                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-        if (INVALID_HANDLE_VALUE != hft)
+        reader->started = TRUE;
+        WWJsonSkipSpace(reader);
+
+        // The list may be the "files" member of an outer object
+        if (reader->pos < reader->size && '{' == data[reader->pos])
         {
-            LARGE_INTEGER liSize = { 0 };
-            LARGE_INTEGER liOffset = { 0 };
-            liOffset.QuadPart = (LONGLONG)userParams->resumeOffset;
-            if (!GetFileSizeEx(hft, &liSize) ||
-                liSize.QuadPart != liOffset.QuadPart ||
-                !SetFilePointerEx(hft, liOffset, NULL, FILE_BEGIN))
+            ++reader->pos;
+            while (TRUE)
             {
-                CloseHandle(hft);
-                hft = INVALID_HANDLE_VALUE;
+                WWJsonSkipSpace(reader);
+                if (FALSE == WWJsonString(reader, &key, &keyLen))
+                {
+                    reader->failed = TRUE;
+                    return FALSE;
+                }
+                WWJsonSkipSpace(reader);
+                if (reader->pos >= reader->size || ':' != data[reader->pos])
+                {
+                    reader->failed = TRUE;
+                    return FALSE;
+                }
+                ++reader->pos;
+                WWJsonSkipSpace(reader);
+                if (WWManifestIs(key, keyLen, "files"))
+                {
+                    break;
+                }
+                if (FALSE == WWJsonSkipValue(reader))
+                {
+                    reader->failed = TRUE;
+                    return FALSE;
+                }
+                WWJsonSkipSpace(reader);
+                if (reader->pos < reader->size && ',' == data[reader->pos])
+                {
+                    ++reader->pos;
+                }
             }
         }
-        // If temp file unavailable/mismatched, reset and start over
-        if (INVALID_HANDLE_VALUE == hft)
+
+        if (reader->pos >= reader->size || '[' != data[reader->pos])
         {
-            userParams->resumeOffset    = 0;
-            pbar->szTotalInBytes        = fileSize;
-            pbar->szDownloadedInBytes   = 0;
-            szDownloadedPrev            = 0;
+            reader->failed = TRUE;
+            return FALSE;
         }
+        ++reader->pos;
     }
-    if (INVALID_HANDLE_VALUE == hft)
-    {
-        hft = CreateFileW(filePathTemp, GENERIC_WRITE, 0, NULL,
-                          CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+
+    WWJsonSkipSpace(reader);
+    if (reader->pos < reader->size && ',' == data[reader->pos])
+    {
+        ++reader->pos;
+        WWJsonSkipSpace(reader);
     }
-    if (INVALID_HANDLE_VALUE == hft)
+    if (reader->pos < reader->size && ']' == data[reader->pos])
     {
-        userParams->errorcode = WW_ERR_CREATE_FILE;
-        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
-        CloseHandle(hf);
-        return WW_FAILURE;
+        reader->pos = reader->size;
+        reader->finished = TRUE;
+        return FALSE;
     }
-
-    GetSystemTimeAsFileTime(&st);
-    st0 = st;
-    st1 = st;
-
-    double averageSpeed = 0.0;
-    double remainingSize = (double)pbar->szTotalInBytes;
-    LPCWSTR fileNamePtr = NULL;
-    if (userParams->progressBarFlags & WW_PB_FILENAME)
+    if (reader->pos >= reader->size || '{' != data[reader->pos])
     {
-        fileNamePtr = userParams->outFileName;
-        if (NULL == fileNamePtr)
-        {
-            fileNamePtr = privateParams->capturedFileName;
-        }
+        reader->failed = TRUE;
+        return FALSE;
     }
+    ++reader->pos;
+
     while (TRUE)
     {
-        if (userParams->pCancelFlag && *userParams->pCancelFlag)
+        WWJsonSkipSpace(reader);
+        if (reader->pos < reader->size && '}' == data[reader->pos])
         {
-            CloseHandle(hft);
-            CloseHandle(hf);
-            return WW_FAILURE;
+            ++reader->pos;
+            return TRUE;
         }
-
-        ZeroMemory(bufRead, sizeof(bufRead));
-        retRead = InternetReadFile(hFile, bufRead, sizeof(bufRead), &bytesRead);
-        if (retRead)
+        if (FALSE == WWJsonString(reader, &key, &keyLen))
         {
-            if (bytesRead == 0)
-            {
-                break;
-            }
+            break;
         }
-        else
+        WWJsonSkipSpace(reader);
+        if (reader->pos >= reader->size || ':' != data[reader->pos])
         {
-            WWLogW(userParams->logEnabled, WW_LOG_WININET, NULL);
-            CloseHandle(hft);
-            CloseHandle(hf);
-            return WW_FAILURE;
+            break;
         }
+        ++reader->pos;
+        WWJsonSkipSpace(reader);
 
-        if ((FALSE == WriteFile(hft, bufRead, bytesRead, &byteWrite, NULL)) ||
-            bytesRead != byteWrite)
+        SIZE_T start = reader->pos;
+        BOOL isString = WWJsonString(reader, &value, &valueLen);
+        if (FALSE == isString)
         {
-            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
-            CloseHandle(hft);
-            CloseHandle(hf);
-            return WW_FAILURE;
+            reader->pos = start;
         }
 
-        pbar->szDownloadedInBytes += bytesRead;
-
-        if (0 != pbar->szTotalInBytes)
+        if ((WWManifestIs(key, keyLen, "path") || WWManifestIs(key, keyLen, "name")) &&
+            isString)
         {
-            ratio = (INT)((pbar->szDownloadedInBytes * 10000) / pbar->szTotalInBytes);
+            entry->invalid |= !WWManifestTextW(value, valueLen, WW_MANIFEST_JSON,
+                                               entry->path, WW_COUNTOF(entry->path));
         }
-
-        WCHAR progressbar[64];
-        ZeroMemory(progressbar, sizeof(progressbar));
-        progressbar[0] = L'[';
-        for (INT i = 1; i < 24; i++)
+        else if (WWManifestIs(key, keyLen, "url") && isString)
         {
-            if (ratio / 350 > i)
+            WWManifestAddUrlW(entry, value, valueLen, WW_MANIFEST_JSON,
+                              entry->urlCount);
+        }
+        else if (WWManifestIs(key, keyLen, "urls") &&
+                 reader->pos < reader->size && '[' == data[reader->pos])
+        {
+            ++reader->pos;
+            while (TRUE)
             {
-                progressbar[i] = L'#';
+                WWJsonSkipSpace(reader);
+                if (reader->pos < reader->size && ']' == data[reader->pos])
+                {
+                    ++reader->pos;
+                    break;
+                }
+                if (FALSE == WWJsonString(reader, &value, &valueLen))
+                {
+                    reader->failed = TRUE;
+                    return FALSE;
+                }
+                WWManifestAddUrlW(entry, value, valueLen, WW_MANIFEST_JSON,
+                                  entry->urlCount);
+                WWJsonSkipSpace(reader);
+                if (reader->pos < reader->size && ',' == data[reader->pos])
+                {
+                    ++reader->pos;
+                }
             }
-            else
+        }
+        else if (WWManifestIs(key, keyLen, "size"))
+        {
+            // A number, or a string for sizes past 2^53
+            if (FALSE == isString)
             {
-                progressbar[i] = L'-';
+                value = data + reader->pos;
+                if (FALSE == WWJsonSkipValue(reader))
+                {
+                    break;
+                }
+                valueLen = (SIZE_T)(data + reader->pos - value);
             }
+            entry->hasSize = WWManifestNumber(value, valueLen, &entry->size);
+            entry->invalid |= !entry->hasSize;
         }
-        progressbar[24] = L']';
-        GetSystemTimeAsFileTime(&st1);
-        ULONGLONG difftime = ((PULARGE_INTEGER)&st1)->QuadPart - \
-            ((PULARGE_INTEGER)&st0)->QuadPart;
-        if ((difftime >= 10000000) || ((ratio != 0) && (ratio % 10000 == 0)))
+        else if (WWManifestIs(key, keyLen, "sha256") && isString)
         {
-            double diffsize =
-                (double)(pbar->szDownloadedInBytes - szDownloadedPrev) /
-                ((double)difftime / (double)10000000);
-
-            pbar->ulTimeElapsedInSecs = ((PULARGE_INTEGER)&st1)->QuadPart - \
-                ((PULARGE_INTEGER)&st)->QuadPart;
-            ULONGLONG difftimeS = pbar->ulTimeElapsedInSecs;
-            INT diffsec = (INT)((difftimeS - (difftimeS % 10000000)) / 10000000);
-            INT speedUnitIndex = WWGetSizeUnitW(diffsize);
+            entry->hasHash = WWManifestHash(value, valueLen, entry->sha256);
+            entry->invalid |= !entry->hasHash;
+        }
+        else if (FALSE == isString && FALSE == WWJsonSkipValue(reader))
+        {
+            break;
+        }
 
-            st0 = st1;
+        WWJsonSkipSpace(reader);
+        if (reader->pos < reader->size && ',' == data[reader->pos])
+        {
+            ++reader->pos;
+        }
+        else if (reader->pos >= reader->size || '}' != data[reader->pos])
+        {
+            break;
+        }
+    }
 
+    reader->failed = TRUE;
+    return FALSE;
+}
 
-            INT dwnSizeUnit = WWGetSizeUnitW((double)pbar->szDownloadedInBytes);
-            INT totlSizeUnit = WWGetSizeUnitW((double)pbar->szTotalInBytes);
+/**
+ * @brief Read the next line of a TSV manifest: path, size, sha256, URLs.
+ */
+WW_PRIVATE
+BOOL
+WWManifestNextTsvW(
+    WW_MANIFESTREADER* reader,
+    WW_MANIFESTENTRYW* entry
+)
+{
+    const CHAR* data = reader->data;
+    while (reader->pos < reader->size)
+    {
+        SIZE_T start = reader->pos;
+        SIZE_T end = WWManifestFind(data, start, reader->size, "\n");
+        reader->pos = (end < reader->size) ? end + 1 : end;
 
-            // ETA calculation
-            double downloadSpeed = diffsize / (diffsec != 0 ? diffsec : 1);
-            ULONGLONG remainingSize = (pbar->szTotalInBytes > pbar->szDownloadedInBytes)
-                ? (pbar->szTotalInBytes - pbar->szDownloadedInBytes)
-                : 0;
-            pbar->dETAInSecs = (pbar->szTotalInBytes > 0 && downloadSpeed > 0.0)
-                ? (remainingSize / downloadSpeed)
-                : 0.0;
-            INT etaHours = (INT)(pbar->dETAInSecs / 3600);
-            INT etaMinutes = (INT)((pbar->dETAInSecs - (etaHours * 3600)) / 60);
-            INT etaSeconds = (INT)(pbar->dETAInSecs - (etaHours * 3600) - (etaMinutes * 60));
+        SIZE_T first = start;
+        while (first < end && ' ' >= (BYTE)data[first] && '\t' != data[first])
+        {
+            ++first;
+        }
+        if (first == end || '#' == data[first])
+        {
+            continue;
+        }
 
-            if (userParams->progressCallback != NULL)
+        UINT column = 0;
+        SIZE_T field = start;
+        while (field <= end)
+        {
+            SIZE_T fieldEnd = WWManifestFind(data, field, end, "\t");
+            const CHAR* value = data + field;
+            SIZE_T len = fieldEnd - field;
+            while (len > 0 && ' ' >= (BYTE)value[len - 1])
             {
-                userParams->progressCallback(pbar,
-                                             userParams->pCallbackData);
+                --len;
             }
 
-            wprintf(L"\r");
-            if (userParams->progressBarFlags & WW_PB_FILENAME)
-            {
-                wprintf(L"%s ", fileNamePtr);
-            }
-            if (userParams->progressBarFlags & WW_PB_PROGRESSBAR)
-            {
-                wprintf(L"%s ", progressbar);
-            }
-            if (userParams->progressBarFlags & WW_PB_PERCENTAGE)
-            {
-                wprintf(L"%3d.%02d%%; ",
-                    (ratio - (ratio % 100)) / 100, (ratio % 100));
-            }
-            if (userParams->progressBarFlags & WW_PB_FILESIZE)
+            if (0 == column)
             {
-                wprintf(L"%6.2f%s /%6.2f%s; ",
-                    pbar->szDownloadedInBytes / sizeUnitW[dwnSizeUnit].size,
-                    sizeUnitW[dwnSizeUnit].unit,
-                    pbar->szTotalInBytes / sizeUnitW[totlSizeUnit].size,
-                    sizeUnitW[totlSizeUnit].unit);
+                entry->invalid |= !WWManifestTextW(value, len, WW_MANIFEST_TSV,
+                                                   entry->path,
+                                                   WW_COUNTOF(entry->path));
             }
-            if (userParams->progressBarFlags & WW_PB_ELAPSEDTIME)
+            else if (1 == column && len > 0)
             {
-                wprintf(L"%02d:%02d:%02d",
-                    (diffsec - (diffsec % 3600)) / 3600,
-                    ((diffsec % 3600) - (diffsec % 60)) / 60,
-                    diffsec % 60);
+                entry->hasSize = WWManifestNumber(value, len, &entry->size);
+                entry->invalid |= !entry->hasSize;
             }
-            if (userParams->progressBarFlags & WW_PB_SPEED)
+            else if (2 == column && len > 0)
             {
-                wprintf(L"%6.2f%s/s; ",
-                    diffsize / sizeUnitW[speedUnitIndex].size,
-                    sizeUnitW[speedUnitIndex].unit);
+                entry->hasHash = WWManifestHash(value, len, entry->sha256);
+                entry->invalid |= !entry->hasHash;
             }
-            if (userParams->progressBarFlags & WW_PB_ETA)
+            else if (column > 2)
             {
-                wprintf(L"ETA: %02d:%02d:%02d ",
-                    etaHours, etaMinutes, etaSeconds);
+                WWManifestAddUrlW(entry, value, len, WW_MANIFEST_TSV,
+                                  entry->urlCount);
             }
 
-            szDownloadedPrev = pbar->szDownloadedInBytes;
-        }
-    }
-
-    wprintf(L"\n\n");
-
-    if (pftLastModified != NULL)
-    {
-        if (SetFileTime(hft, NULL, NULL, pftLastModified) == FALSE)
-        {
-            WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
-            CloseHandle(hft);
-            CloseHandle(hf);
-            return WW_FAILURE;
-        }
-    }
-
-    CloseHandle(hft);
-    CloseHandle(hf);
-
-    if (userParams->forceDownload)
-    {
-        SetFileAttributesW(privateParams->fullFilePath, FILE_ATTRIBUTE_NORMAL);
-        DeleteFileW(privateParams->fullFilePath);
-    }
-
-    if (MoveFileExW(filePathTemp, privateParams->fullFilePath,
-        MOVEFILE_REPLACE_EXISTING) == FALSE)
-    {
-        WWLogW(userParams->logEnabled, WW_LOG_MODULE, NULL);
-        return WW_FAILURE;
-    }
-
-    return WW_SUCCESS;
-}
-
-WW_PRIVATE
-INT 
-WWMakeDownloadPathW(
-                    LPCWSTR url, 
-                    LPWSTR path, 
-                    DWORD len
-                   ) 
-{
-    LPCWSTR fnurl = wcsrchr(url, L'/');
-    if (fnurl == NULL || wcslen(fnurl) == 1)
-    {
-        wprintf(L"ERROR : local path\n");
-        return WW_FAILURE;
-    }
-    wcsncpy(path, fnurl + 1, len);
-    path[len - 1] = L'\0';
-
-    LPWSTR ppath = wcschr(path, L'?');
-    if (ppath != NULL)
-    {
-        *ppath = L'\0';
-    }
-
-    // Preferred File Name
-    LPWSTR pfname = path;
-    while ((pfname = wcspbrk(pfname, L"\\/:*?\"<>|")) != NULL)
-    {
-        *pfname = L'_';
-    }
-
-    return WW_SUCCESS;
-}
-
-WW_PRIVATE
-INT
-WWGetSizeUnitW(
-                double sizeValue
-              )
-{
-    INT sizeUnit = 0;
-    for (INT i = 0; i < WW_COUNTOF(sizeUnitW); i++)
-    {
-        if (sizeValue >= sizeUnitW[i].size)
-        {
-            sizeUnit = i;
-            break;
+            ++column;
+            field = fieldEnd + 1;
         }
+        return TRUE;
     }
-    return sizeUnit;
-}
 
-WW_PRIVATE
-BOOL
-WWIsRedirectStatus(
-    DWORD statusCode
-)
-{
-    return statusCode == HTTP_STATUS_MOVED ||
-           statusCode == HTTP_STATUS_REDIRECT ||
-           statusCode == HTTP_STATUS_REDIRECT_METHOD ||
-           statusCode == HTTP_STATUS_REDIRECT_KEEP_VERB ||
-           statusCode == 308;
+    reader->finished = TRUE;
+    return FALSE;
 }
 
+/**
+ * @brief Read the next file of the manifest.
+ *
+ * @return FALSE at the end of the list or once the manifest turned out to be
+ *         malformed (reader->failed).
+ */
 WW_PRIVATE
 BOOL
-WWBuildRequestPathW(
-    const URL_COMPONENTSW* ptrUrlC,
-    LPWSTR outPath,
-    DWORD outPathCch
+WWManifestNextW(
+    WW_MANIFESTREADER* reader,
+    WW_MANIFESTENTRYW* entry
 )
 {
-    if (NULL == ptrUrlC || NULL == outPath || 0 == outPathCch)
+    if (reader->failed || reader->finished)
     {
         return FALSE;
     }
 
-    outPath[0] = L'\0';
+    entry->path[0] = L'\0';
+    entry->urlCount = 0;
+    entry->hasSize = FALSE;
+    entry->hasHash = FALSE;
+    entry->invalid = FALSE;
+    entry->size = 0;
 
-    if (NULL == ptrUrlC->lpszUrlPath || 0 == ptrUrlC->dwUrlPathLength)
+    switch (reader->format)
     {
-        if (outPathCch < 2)
+        case WW_MANIFEST_METALINK:
+            return WWManifestNextMetalinkW(reader, entry);
+        case WW_MANIFEST_JSON:
+            return WWManifestNextJsonW(reader, entry);
+        default:
+            return WWManifestNextTsvW(reader, entry);
+    }
+}
+
+/**
+ * @brief Resolve the local path of an entry below the destination directory
+ *        and create the directories on the way.
+ *
+ * entry->path is normalized in place; a missing path is taken from the last
+ * segment of the first URL.
+ */
+WW_PRIVATE
+BOOL
+WWManifestTargetW(
+    const WW_MANIFESTCTXW* ctx,
+    WW_MANIFESTENTRYW* entry,
+    LPWSTR fullPath,
+    LPWSTR dirPath
+)
+{
+    LPWSTR path = entry->path;
+    if (L'\0' == path[0])
+    {
+        LPCWSTR url = entry->urls[0];
+        SIZE_T end = wcscspn(url, L"?#");
+        SIZE_T start = end;
+        while (start > 0 && L'/' != url[start - 1])
+        {
+            --start;
+        }
+        if (end - start >= WW_COUNTOF(entry->path))
         {
             return FALSE;
         }
-        wcscpy(outPath, L"/");
+        wcsncpy(path, url + start, end - start);
+        path[end - start] = L'\0';
     }
-    else
+
+    for (LPWSTR p = path; L'\0' != *p; ++p)
     {
-        if (ptrUrlC->dwUrlPathLength + 1 > outPathCch)
+        if (L'/' == *p)
         {
-            return FALSE;
+            *p = L'\\';
         }
-        wcsncpy(outPath, ptrUrlC->lpszUrlPath, ptrUrlC->dwUrlPathLength + 1);
-        outPath[ptrUrlC->dwUrlPathLength] = L'\0';
     }
 
-    if (NULL != ptrUrlC->lpszExtraInfo && ptrUrlC->dwExtraInfoLength > 0)
+    // Every file must stay below the destination directory
+    if (L'\0' == path[0] || L'\\' == path[0] || NULL != wcschr(path, L':'))
     {
-        size_t pathLen = wcslen(outPath);
-        if (pathLen + ptrUrlC->dwExtraInfoLength + 1 > outPathCch)
+        return FALSE;
+    }
+    for (LPCWSTR p = path; NULL != p; p = wcschr(p, L'\\'))
+    {
+        if (L'\\' == *p)
+        {
+            ++p;
+        }
+        if (0 == wcsncmp(p, L"..", 2) && (L'\0' == p[2] || L'\\' == p[2]))
         {
             return FALSE;
         }
-        wcsncpy(outPath + pathLen, ptrUrlC->lpszExtraInfo,
-                ptrUrlC->dwExtraInfoLength + 1);
-        outPath[pathLen + ptrUrlC->dwExtraInfoLength] = L'\0';
     }
 
-    return TRUE;
-}
-
-WW_PRIVATE
-BOOL
-WWBuildRequestPathA(
-    const URL_COMPONENTSA* ptrUrlC,
-    LPSTR outPath,
-    DWORD outPathCch
-)
-{
-    if (NULL == ptrUrlC || NULL == outPath || 0 == outPathCch)
+    if (wcslen(ctx->dstPath) + wcslen(path) >= MAX_PATH)
     {
         return FALSE;
     }
+    wcsncpy(fullPath, ctx->dstPath, MAX_PATH);
+    wcsncat(fullPath, path, MAX_PATH - wcslen(fullPath) - 1);
 
-    outPath[0] = '\0';
-
-    if (NULL == ptrUrlC->lpszUrlPath || 0 == ptrUrlC->dwUrlPathLength)
+    LPWSTR leaf = wcsrchr(fullPath, L'\\');
+    if (NULL == leaf || leaf < fullPath + wcslen(ctx->dstPath) - 1)
     {
-        if (outPathCch < 2)
-        {
-            return FALSE;
-        }
-        strcpy(outPath, "/");
+        leaf = fullPath + wcslen(ctx->dstPath) - 1;
     }
-    else
+    if (L'\0' == leaf[1])
     {
-        if (ptrUrlC->dwUrlPathLength + 1 > outPathCch)
-        {
-            return FALSE;
-        }
-        strncpy(outPath, ptrUrlC->lpszUrlPath, ptrUrlC->dwUrlPathLength + 1);
-        outPath[ptrUrlC->dwUrlPathLength] = '\0';
+        return FALSE;
     }
 
-    if (NULL != ptrUrlC->lpszExtraInfo && ptrUrlC->dwExtraInfoLength > 0)
+    // Missing directories are created one level at a time
+    SIZE_T dirLen = (SIZE_T)(leaf + 1 - fullPath);
+    wcsncpy(dirPath, fullPath, dirLen);
+    dirPath[dirLen] = L'\0';
+    for (SIZE_T i = wcslen(ctx->dstPath); i < dirLen; ++i)
     {
-        size_t pathLen = strlen(outPath);
-        if (pathLen + ptrUrlC->dwExtraInfoLength + 1 > outPathCch)
+        if (L'\\' == dirPath[i])
         {
-            return FALSE;
+            dirPath[i] = L'\0';
+            CreateDirectoryW(dirPath, NULL);
+            dirPath[i] = L'\\';
         }
-        strncpy(outPath + pathLen, ptrUrlC->lpszExtraInfo,
-                ptrUrlC->dwExtraInfoLength + 1);
-        outPath[pathLen + ptrUrlC->dwExtraInfoLength] = '\0';
     }
-
     return TRUE;
 }
 
+/**
+ * @brief Check whether the local copy has the size and SHA-256 the manifest
+ *        lists. A file without either is never considered a match.
+ */
 WW_PRIVATE
 BOOL
-WWResolveRedirectW(
-    LPCWSTR baseUrl,
-    LPCWSTR location,
-    LPWSTR outUrl,
-    DWORD outUrlCch
+WWManifestMatchesW(
+    LPCWSTR path,
+    const WW_MANIFESTENTRYW* entry
 )
 {
-    if (NULL == baseUrl || NULL == location || NULL == outUrl ||
-        0 == outUrlCch)
+    if (!entry->hasSize && !entry->hasHash)
     {
         return FALSE;
     }
 
-    LPWSTR resolvedUrl = (LPWSTR)malloc(outUrlCch * sizeof(WCHAR));
-    if (NULL == resolvedUrl)
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
     {
         return FALSE;
     }
 
-    DWORD resolvedUrlCch = outUrlCch;
-    BOOL ok = InternetCombineUrlW(baseUrl, location, resolvedUrl,
-                                  &resolvedUrlCch, 0);
-    if (ok)
+    LARGE_INTEGER liSize = WW_STRUCT_NULL;
+    BOOL matches = GetFileSizeEx(hFile, &liSize) &&
+                   (!entry->hasSize || entry->size == (ULONGLONG)liSize.QuadPart);
+    if (matches && entry->hasHash)
     {
-        wcsncpy(outUrl, resolvedUrl, outUrlCch);
-        outUrl[outUrlCch - 1] = L'\0';
+        WW_HASHCTX hashCtx = WW_STRUCT_NULL;
+        BYTE digest[WW_SHA256_SIZE];
+        matches = WWHashBegin(&hashCtx, WW_HASH_SHA256);
+        if (matches && FALSE == WWHashFileW(hFile, (ULONGLONG)liSize.QuadPart,
+                                            &hashCtx))
+        {
+            WWHashEnd(&hashCtx, NULL, 0);
+            matches = FALSE;
+        }
+        matches = matches &&
+                  WWHashEnd(&hashCtx, digest, sizeof(digest)) &&
+                  0 == memcmp(digest, entry->sha256, sizeof(digest));
     }
 
-    free(resolvedUrl);
-    return ok;
+    CloseHandle(hFile);
+    return matches;
 }
 
+/**
+ * @brief Bring one file of the manifest up to date and report the outcome.
+ */
 WW_PRIVATE
-BOOL
-WWResolveRedirectA(
-    LPCSTR baseUrl,
-    LPCSTR location,
-    LPSTR outUrl,
-    DWORD outUrlCch
+VOID
+WWManifestFileW(
+    WW_MANIFESTCTXW* ctx,
+    WW_MANIFESTENTRYW* entry
 )
 {
-    if (NULL == baseUrl || NULL == location || NULL == outUrl ||
-        0 == outUrlCch)
+    WW_MANIFEST_OPTIONSW* options = ctx->options;
+    WCHAR fullPath[MAX_PATH] = L"";
+    WCHAR dirPath[MAX_PATH] = L"";
+    WW_MANIFEST_RESULTW result = {
+        .path = entry->path,
+        .url = entry->urls[0],
+        .size = entry->size,
+        .result = WW_FAILURE,
+        .errorcode = WW_ERR_NOERROR,
+        .skipped = FALSE
+    };
+
+    if (entry->invalid || 0 == entry->urlCount)
     {
-        return FALSE;
+        result.errorcode = WW_ERR_MANIFEST;
     }
-
-    LPSTR resolvedUrl = (LPSTR)malloc(outUrlCch);
-    if (NULL == resolvedUrl)
+    else if (FALSE == WWManifestTargetW(ctx, entry, fullPath, dirPath))
     {
-        return FALSE;
+        result.errorcode = WW_ERR_NO_DOWNLOAD_PATH;
     }
-
-    DWORD resolvedUrlCch = outUrlCch;
-    BOOL ok = InternetCombineUrlA(baseUrl, location, resolvedUrl,
-                                  &resolvedUrlCch, 0);
-    if (ok)
+    else if (WWManifestMatchesW(fullPath, entry))
     {
-        strncpy(outUrl, resolvedUrl, outUrlCch);
-        outUrl[outUrlCch - 1] = '\0';
+        result.result = WW_SUCCESS;
+        result.skipped = TRUE;
     }
-
-    free(resolvedUrl);
-    return ok;
-}
-
-
-WW_PRIVATE
-VOID 
-WWLogW(
-        BOOL logEnabled, 
-        INT msgType, 
-        LPCWSTR displayStr
-      ) 
-{
-    if (!logEnabled) return;
-    switch (msgType) 
+    else
     {
-        case WW_LOG_MODULE: case WW_LOG_WININET:
+        // URLs after the one in use serve as its mirrors. When it fails
+        // outright, the next one takes over.
+        LPCWSTR mirrors[WW_MAX_MANIFEST_URLS];
+        for (UINT i = 0; i < entry->urlCount; ++i)
         {
-            DWORD error = GetLastError();
-            HMODULE hModule = NULL;
-
-            if (msgType == WW_LOG_WININET) 
-            {
-                hModule = GetModuleHandleW(L"wininet.dll");
-                WWLogW(logEnabled, WW_LOG_LASTRESPONSE, NULL);
-            }
-
-            LPWSTR message = NULL;
-
-            wprintf(L"ERROR : 0x%08X\n", error);
-
-            DWORD formatMsgFlag;
+            mirrors[i] = entry->urls[i];
+        }
 
-            if (hModule != NULL) 
-            {
-                formatMsgFlag = FORMAT_MESSAGE_FROM_HMODULE;
-            }
-            else 
+        for (UINT i = 0; i < entry->urlCount && WW_SUCCESS != result.result; ++i)
+        {
+            if ((NULL != options->pCancelFlag && *options->pCancelFlag) ||
+                WWIsCancelled(options->cancel))
             {
-                formatMsgFlag = FORMAT_MESSAGE_FROM_SYSTEM;
+                break;
             }
 
-            FormatMessageW(
-                FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                FORMAT_MESSAGE_IGNORE_INSERTS |
-                formatMsgFlag,
-                hModule, error, MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US),
-                (LPWSTR)&message, 0, NULL
-            );
-
-            if (message != NULL) 
+            WW_PARAMSW params = {
+                .url              = entry->urls[i],
+                .dstPath          = dirPath,
+                .outFileName      = fullPath + wcslen(dirPath),
+                .userAgent        = options->userAgent,
+                .headerLength     = WW_DEFAULT_HEADER_LENGTH,
+                .forceDownload    = entry->hasSize || entry->hasHash,
+                .pCancelFlag      = options->pCancelFlag,
+                .receiveTimeoutMs = options->receiveTimeoutMs,
+                .hashAlgorithm    = entry->hasHash ? WW_HASH_SHA256 : WW_HASH_NONE,
+                .expectedDigest   = entry->hasHash ? entry->sha256 : NULL,
+                .retry            = options->retry,
+                .mirrors          = mirrors + i + 1,
+                .mirrorCount      = entry->urlCount - i - 1,
+                .rateLimit        = options->rateLimit,
+                .cancel           = options->cancel
+            };
+            result.url = entry->urls[i];
+            result.result = WWDownloadExW(&params);
+            result.errorcode = params.errorcode;
+
+            // A SHA-256 already covers the size; without one the listed
+            // size is the only check the download gets
+            if (WW_SUCCESS == result.result && entry->hasSize &&
+                !entry->hasHash && FALSE == WWManifestMatchesW(fullPath, entry))
             {
-                wprintf(L"%s\n", message);
-                LocalFree(message);
+                DeleteFileW(fullPath);
+                result.result = WW_FAILURE;
+                result.errorcode = WW_ERR_MANIFEST;
             }
-            break;
-        }
-        case WW_LOG_REDIRS_EXCEEDED:
-        {
-            wprintf(L"ERROR : Redirect limit exceeded\n");
-            break;
-        }
-        case WW_LOG_UNKNOWN_SCHEME:
-        {
-            wprintf(L"ERROR : Unknown scheme: %s\n", displayStr);
-            break;
-        }
-        case WW_LOG_HEADER:
-        {
-            wprintf(L"=== HEADER START === \n");
-            wprintf(L"%s\n", displayStr);
-            wprintf(L"=== HEADER END === \n");
-            break;
         }
-        case WW_LOG_LASTRESPONSE:
-        {
-            DWORD dwError = 0;
-            PWSTR szBuffer = NULL;
-            DWORD dwBufferSize = 0;
+    }
 
-            if (InternetGetLastResponseInfoW(&dwError, szBuffer,
-                &dwBufferSize) == FALSE) {
-                DWORD error = GetLastError();
-                if (error == ERROR_INSUFFICIENT_BUFFER) {
-                    dwBufferSize += 1;
-                    szBuffer = (PWSTR)LocalAlloc(LPTR, dwBufferSize * sizeof(WCHAR));
-                    if (szBuffer != NULL) {
-                        if (InternetGetLastResponseInfoW(&dwError, szBuffer,
-                            &dwBufferSize) == TRUE) {
-                            wprintf(L"%s\n", szBuffer);
-                        }
-                        LocalFree(szBuffer);
-                    }
-                }
-            }
-            break;
-        }
+    EnterCriticalSection(&ctx->lock);
+    if (result.skipped)
+    {
+        options->filesSkipped++;
+    }
+    else if (WW_SUCCESS == result.result)
+    {
+        options->filesDownloaded++;
+    }
+    else
+    {
+        options->filesFailed++;
+    }
+    if (NULL != options->fileCallback)
+    {
+        options->fileCallback(&result, options->pCallbackData);
     }
+    LeaveCriticalSection(&ctx->lock);
 }
 
-/**
- * @brief Generic API
- */
-
 WW_PRIVATE
-BOOL
-WWIsFileModified(
-    HANDLE hFileN,
-    LONGLONG fileSize,
-    const FILETIME* pftLastWriteTime
+DWORD WINAPI
+WWManifestWorkerW(
+    LPVOID param
 )
 {
-    BOOL bStatus = (INVALID_HANDLE_VALUE == hFileN);
-    if (!bStatus)
-    {
-        FILETIME ft;
-        LARGE_INTEGER li;
+    WW_MANIFESTCTXW* ctx = (WW_MANIFESTCTXW*)param;
+    WW_MANIFEST_OPTIONSW* options = ctx->options;
 
-        GetFileTime(hFileN, NULL, NULL, &ft);
-        GetFileSizeEx(hFileN, &li);
+    // Too large for the stack of a worker thread
+    WW_MANIFESTENTRYW* entry = (WW_MANIFESTENTRYW*)malloc(sizeof(WW_MANIFESTENTRYW));
+    if (NULL == entry)
+    {
+        EnterCriticalSection(&ctx->lock);
+        options->errorcode = WW_ERR_MALLOC;
+        LeaveCriticalSection(&ctx->lock);
+        return 0;
+    }
 
-        bStatus = !(fileSize == li.QuadPart && \
-            CompareFileTime(pftLastWriteTime, &ft) <= 0);
+    while ((NULL == options->pCancelFlag || FALSE == *options->pCancelFlag) &&
+           FALSE == WWIsCancelled(options->cancel))
+    {
+        EnterCriticalSection(&ctx->lock);
+        BOOL more = WWManifestNextW(&ctx->reader, entry);
+        LeaveCriticalSection(&ctx->lock);
+        if (FALSE == more)
+        {
+            break;
+        }
+        WWManifestFileW(ctx, entry);
     }
-    return bStatus;
+
+    free(entry);
+    return 0;
 }
 
 /****************************** ANSI API **************************************/
@@ -2224,6 +15110,9 @@ WWGetRemoteFileSizeA(
 
     *outSize = 0;
 
+    // timeoutMs is the budget of the whole call, not of each hop
+    ULONGLONG deadlineMs = (timeoutMs > 0) ? GetTickCount64() + timeoutMs : 0;
+
     CHAR currentUrl[INTERNET_MAX_URL_LENGTH] = "";
     if (strlen(url) + 1 > WW_COUNTOF(currentUrl))
     {
@@ -2309,15 +15198,19 @@ WWGetRemoteFileSizeA(
 
         if (timeoutMs > 0)
         {
+            DWORD leftMs = WWDeadlineClampW(deadlineMs, 0);
             InternetSetOptionA(hReq, INTERNET_OPTION_CONNECT_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
+                               &leftMs, sizeof(leftMs));
             InternetSetOptionA(hReq, INTERNET_OPTION_SEND_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
+                               &leftMs, sizeof(leftMs));
             InternetSetOptionA(hReq, INTERNET_OPTION_RECEIVE_TIMEOUT,
-                               &timeoutMs, sizeof(timeoutMs));
+                               &leftMs, sizeof(leftMs));
         }
 
-        BOOL sendOk = HttpSendRequestA(hReq, NULL, 0, NULL, 0);
+        // The deadline timer closes hReq, also while the host name resolves
+        WW_CANCELREG deadlineReg;
+        BOOL sendOk = WWCancelAttach(NULL, deadlineMs, &deadlineReg, hReq, NULL) &&
+                      HttpSendRequestA(hReq, NULL, 0, NULL, 0);
         DWORD statusCode = 0;
         DWORD statusLen = sizeof(statusCode);
         BOOL statusOk = sendOk && HttpQueryInfoA(
@@ -2345,7 +15238,7 @@ WWGetRemoteFileSizeA(
                 }
             }
 
-            InternetCloseHandle(hReq);
+            WWCancelRelease(NULL, &deadlineReg);
             InternetCloseHandle(hConn);
             InternetCloseHandle(hInet);
             return ok ? WW_SUCCESS : WW_FAILURE;
@@ -2358,7 +15251,7 @@ WWGetRemoteFileSizeA(
             BOOL haveLocation = HttpQueryInfoA(hReq, HTTP_QUERY_LOCATION,
                                                location, &locationLen, NULL);
 
-            InternetCloseHandle(hReq);
+            WWCancelRelease(NULL, &deadlineReg);
             InternetCloseHandle(hConn);
             InternetCloseHandle(hInet);
 
@@ -2375,7 +15268,7 @@ WWGetRemoteFileSizeA(
             continue;
         }
 
-        InternetCloseHandle(hReq);
+        WWCancelRelease(NULL, &deadlineReg);
         InternetCloseHandle(hConn);
         InternetCloseHandle(hInet);
         return WW_FAILURE;
@@ -2769,6 +15662,11 @@ WWProcessHttpA(
         SystemTimeToFileTime(&stLastModified, &ftLastModified);
     }
 
+    WCHAR hostname[INTERNET_MAX_HOST_NAME_LENGTH] = L"";
+    MultiByteToWideChar(CP_ACP, 0, ptrUrlC->lpszHostName, -1, hostname,
+                        WW_COUNTOF(hostname));
+    privateParams->hostRate = WWRateLimitHostW(hostname);
+
     INT iStatus = WWRetrieveDataA(hReq, lDataLength, &ftLastModified,
                                    userParams, privateParams);
 
@@ -2829,7 +15727,7 @@ WWRetrieveDataA(
     WW_PRIVATEPARAMSA* privateParams
 )
 {
-    static BYTE bufRead[0x10000];   //64KiB
+    BYTE bufRead[0x10000];   //64KiB, per call so concurrent downloads stay apart
     BOOL retRead;
     DWORD bytesRead, byteWrite;
     INT ratio = 0;
@@ -2897,6 +15795,7 @@ WWRetrieveDataA(
             fileNamePtr = privateParams->capturedFileName;
         }
     }
+    WW_RATELIMIT* limits[] = { privateParams->hostRate, &g_wwGlobalRate };
     while (TRUE)
     {
         if (userParams->pCancelFlag && *userParams->pCancelFlag)
@@ -2907,7 +15806,9 @@ WWRetrieveDataA(
         }
 
         ZeroMemory(bufRead, sizeof(bufRead));
-        retRead = InternetReadFile(hFile, bufRead, sizeof(bufRead), &bytesRead);
+        DWORD readSize = WWRateLimitChunk(limits, WW_COUNTOF(limits),
+                                          sizeof(bufRead));
+        retRead = InternetReadFile(hFile, bufRead, readSize, &bytesRead);
         if (retRead)
         {
             if (bytesRead == 0)
@@ -2933,6 +15834,8 @@ WWRetrieveDataA(
         }
 
         pbar->szDownloadedInBytes += bytesRead;
+        WWRateLimitWait(limits, WW_COUNTOF(limits), bytesRead,
+                        userParams->pCancelFlag, NULL, 0);
 
         if (0 != pbar->szTotalInBytes)
         {
@@ -28,6 +28,7 @@
 #pragma comment(lib, "wininet.lib")
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "bcrypt.lib")
 #endif
 
 #ifdef __cplusplus
@@ -41,9 +42,46 @@ extern "C" {
 #define WW_DEFAULT_USER_AGENTW L"Winweb/0.5b"
 #define WW_DEFAULT_REDIRECT_LIMIT 4
 #define WW_DEFAULT_HEADER_LENGTH 16384
+#define WW_DEFAULT_BATCH_CONCURRENCY 16
+#define WW_DEFAULT_COMPRESS_MIN_SIZE 1024
+#define WW_DEFAULT_PART_SIZE (8 * 1024 * 1024)
+#define WW_DEFAULT_PART_RETRIES 3
+#define WW_DEFAULT_MULTIPART_CONCURRENCY 4
+#define WW_DEFAULT_EXPECT_CONTINUE_TIMEOUT 1000
+#define WW_DEFAULT_RETRY_DELAY 500
+#define WW_DEFAULT_RETRY_MAX_DELAY 30000
+#define WW_MAX_DOWNLOAD_SEGMENTS 16
+#define WW_MAX_MANIFEST_URLS 8
+#define WW_DEFAULT_LOW_SPEED_TIME 30000
+#define WW_DEFAULT_STALL_RESTARTS 5
+#define WW_DEFAULT_BREAKER_FAILURE_PERCENT 50
+#define WW_DEFAULT_BREAKER_WINDOW 10000
+#define WW_DEFAULT_BREAKER_OPEN 5000
+#define WW_DEFAULT_LIMITER_MAX 256
 #define WW_SUCCESS 0
 #define WW_FAILURE 1
 
+/**
+ * @brief Session flags (WW_SESSION_OPTIONSW.flags).
+ */
+#define WW_SESSION_HTTP2    0x00000001 // Negotiate HTTP/2 over TLS (Windows 10+)
+#define WW_SESSION_COALESCE 0x00000002 // Share one request between identical in-flight GETs
+
+/**
+ * @brief Retryable failure classes (WW_RETRY_POLICY.retryOn).
+ */
+#define WW_RETRY_NETWORK        0x00000001 // Connection failures and interrupted transfers
+#define WW_RETRY_5XX            0x00000002 // 5xx statuses except 501 and 505
+#define WW_RETRY_429            0x00000004 // 429 Too Many Requests
+#define WW_RETRY_408            0x00000008 // 408 Request Timeout
+#define WW_RETRY_NON_IDEMPOTENT 0x00000100 // Also retry POST and PATCH queries
+#define WW_RETRY_DEFAULT        0x0000000F // Every class except non-idempotent queries
+
+/**
+ * @brief Disk cache flags (WWDiskCacheOpenW).
+ */
+#define WW_DISKCACHE_HARDLINK 0x00000001 // Serve download hits as hardlinks to the cached blob
+
 /**
  * @brief Constants for different flags.
  */
@@ -78,6 +116,18 @@ enum E_WW_ERRORCODES {
     WW_ERR_HTTP_QUERY_INFO,
     WW_ERR_NO_DOWNLOAD_PATH,
     WW_ERR_CREATE_FILE,
+    WW_ERR_DIGEST_MISMATCH,
+    WW_ERR_DECODE,
+    WW_ERR_UPLOAD,
+    WW_ERR_ADAPTER,
+    WW_ERR_HTTP_STATUS,
+    WW_ERR_CIRCUIT_OPEN,
+    WW_ERR_CONCURRENCY_LIMIT,
+    WW_ERR_MANIFEST,
+    WW_ERR_STALLED,
+    WW_ERR_CANCELLED,
+    WW_ERR_TIMEOUT,
+    WW_ERR_INVALID_PARAMS,
 };
 
 /**
@@ -90,6 +140,55 @@ enum E_WW_WORKSTATUS {
     WW_STATUS_SUCCESS      /**< Work status: Successful */
 };
 
+/**
+ * @brief Digest algorithms computed while a download is written (WW_PARAMSW).
+ */
+enum E_WW_HASH_ALGORITHM {
+    WW_HASH_NONE,          /**< No digest */
+    WW_HASH_SHA256,        /**< SHA-256, 32 bytes */
+    WW_HASH_CRC32C         /**< CRC-32C (Castagnoli), 4 bytes, big-endian */
+};
+
+/**
+ * @brief States of a per-origin circuit breaker (WW_ORIGIN_STATS).
+ */
+enum E_WW_BREAKER_STATE {
+    WW_BREAKER_CLOSED,     /**< Requests are sent */
+    WW_BREAKER_OPEN,       /**< Requests fail at once with WW_ERR_CIRCUIT_OPEN */
+    WW_BREAKER_HALF_OPEN   /**< A few probe requests decide whether to close again */
+};
+
+#define WW_DIGEST_MAX_SIZE 32
+
+/**
+ * @brief Phase timings of one HTTP request, in microseconds.
+ *
+ * Each phase field is the time from the start of the request to the end of
+ * that phase, so the phases add up: resolveUs <= connectUs <= tlsUs <=
+ * requestSentUs <= firstByteUs <= headersUs <= bodyUs. Subtracting one from
+ * the next gives the duration of a phase. A phase that did not take place, such as
+ * name resolution and connect on a reused connection or the TLS handshake over
+ * plain http, takes no time; a phase that was never reached because the
+ * request failed stays 0.
+ *
+ * After redirects the phases describe the last hop, and redirectUs holds the
+ * time spent on the hops before it. After retries they describe the last
+ * attempt. FTP transfers and responses served from a cache or a coalesced
+ * request carry no timings.
+ */
+typedef struct {
+    ULONGLONG resolveUs;            /**< Host name resolved */
+    ULONGLONG connectUs;            /**< TCP connection established */
+    ULONGLONG tlsUs;                /**< TLS handshake complete */
+    ULONGLONG requestSentUs;        /**< Request line, headers and body sent */
+    ULONGLONG firstByteUs;          /**< First byte of the response received */
+    ULONGLONG headersUs;            /**< Response headers complete */
+    ULONGLONG bodyUs;               /**< Response body complete */
+    ULONGLONG redirectUs;           /**< Time spent on the hops before the last one */
+    UINT redirects;                 /**< Redirects followed */
+    BOOL connectionReused;          /**< The request went out on an open connection */
+} WW_TIMINGS;
+
 /**
  * @brief Structure representing information for the progress bar.
  */
@@ -98,8 +197,26 @@ typedef struct {
     ULONGLONG szDownloadedInBytes;  /**< Size of downloaded data in bytes */
     ULONGLONG szTotalInBytes;       /**< Total size of the data in bytes */
     double dETAInSecs;
+    ULONGLONG szWireInBytes;        /**< Bytes received on the wire; less than szDownloadedInBytes for a compressed body */
+    ULONGLONG szWireTotalInBytes;   /**< Content-Length on the wire; with a compressed body szTotalInBytes is unknown (0) */
+    WW_TIMINGS timings;             /**< Phases of the current HTTP request; bodyUs is set once the body is complete */
 } WWPBARINFO;
 
+/**
+ * @brief Automatic retry policy for downloads and queries. A zeroed policy
+ *        makes a single attempt.
+ *
+ * The delay before attempt n + 1 is drawn at random between half and all of
+ * min(maxDelayMs, baseDelayMs * 2^(n - 1)). A Retry-After sent with a 429 or
+ * 503 lengthens the delay, still capped at maxDelayMs.
+ */
+typedef struct {
+    UINT maxAttempts;                 /**< Attempts including the first; 0 or 1 = no retries */
+    DWORD baseDelayMs;                /**< Delay before the first retry; 0 = WW_DEFAULT_RETRY_DELAY */
+    DWORD maxDelayMs;                 /**< Upper bound of any delay; 0 = WW_DEFAULT_RETRY_MAX_DELAY */
+    DWORD retryOn;                    /**< WW_RETRY_* classes; 0 = WW_RETRY_DEFAULT */
+} WW_RETRY_POLICY;
+
 /**
  * @brief Callback function type for download progress reporting.
  *
@@ -131,6 +248,113 @@ typedef struct {
     const volatile BOOL* pCancelFlag; /**< Optional pointer to a cancellation flag; set to TRUE to abort download */
 } WW_PARAMSA;
 
+/**
+ * @brief Opaque on-disk HTTP cache. One cache directory may be opened by
+ *        several processes at once.
+ */
+typedef struct WW_DISKCACHE_S WW_DISKCACHE;
+
+/**
+ * @brief Opaque token-bucket bandwidth limiter. One limiter may pace several
+ *        downloads at once; they then share its rate.
+ */
+typedef struct WW_RATELIMIT_S WW_RATELIMIT;
+
+/**
+ * @brief Opaque cancellation token. Signalling it closes the network handles
+ *        of every call it was passed to, so blocked reads return at once.
+ */
+typedef struct WW_CANCEL_S WW_CANCEL;
+
+/**
+ * @brief Opaque trace sink writing Chrome trace-event JSON (WWTraceSinkOpenW).
+ */
+typedef struct WW_TRACESINK_S WW_TRACESINK;
+
+/**
+ * @brief Stages of a query or download reported to the trace callback. Each
+ *        stage is reported as a begin and an end event on the same thread;
+ *        stages nest, so a redirect contains the stages of the next hop.
+ */
+enum E_WW_TRACE_STAGE {
+    WW_TRACE_QUERY,        /**< WWQueryExW from start to end */
+    WW_TRACE_DOWNLOAD,     /**< WWDownloadExW from start to end */
+    WW_TRACE_CRACK_URL,    /**< Splitting the URL into its components */
+    WW_TRACE_CONNECT,      /**< Opening the connection and request handles */
+    WW_TRACE_SEND,         /**< Sending the request up to the response headers */
+    WW_TRACE_HEADERS,      /**< Querying the response headers */
+    WW_TRACE_REDIRECT,     /**< Following a redirect, including the next hop */
+    WW_TRACE_READ,         /**< One chunk of the response body read */
+    WW_TRACE_WRITE,        /**< One chunk written to the file, or of a request body sent */
+    WW_TRACE_RENAME        /**< Moving the finished temporary file into place */
+};
+
+/**
+ * @brief One trace event.
+ */
+typedef struct {
+    INT stage;             /**< One of E_WW_TRACE_STAGE */
+    BOOL end;              /**< FALSE = the stage begins, TRUE = it ends */
+    ULONGLONG timeUs;      /**< QueryPerformanceCounter time in microseconds */
+    DWORD threadId;        /**< Thread the stage runs on */
+    LPCWSTR url;           /**< URL of a query, download or redirect target; NULL for other stages. Valid during the callback only */
+    ULONGLONG bytes;       /**< End events: bytes read, written or received; 0 otherwise */
+    BOOL failed;           /**< End events: the stage failed */
+} WW_TRACE_EVENT;
+
+/**
+ * @brief Trace callback, see WWSetTraceCallback.
+ *
+ * @param event    The event.
+ * @param userData User-provided context pointer.
+ */
+typedef VOID (*WW_TRACE_CALLBACK)(const WW_TRACE_EVENT* event, LPVOID userData);
+
+/**
+ * @brief Response status classes counted in WW_METRICS.requests.
+ */
+enum E_WW_STATUS_CLASS {
+    WW_STATUS_CLASS_NONE,  /**< No response, or a status outside 100-599 */
+    WW_STATUS_CLASS_1XX,
+    WW_STATUS_CLASS_2XX,
+    WW_STATUS_CLASS_3XX,
+    WW_STATUS_CLASS_4XX,
+    WW_STATUS_CLASS_5XX,
+    WW_STATUS_CLASS_COUNT
+};
+
+#define WW_METRICS_BUCKETS 16
+
+/**
+ * @brief Latency histogram in WW_METRICS. The buckets end at 1, 5, 10, 25,
+ *        50, 100, 250 and 500 ms and at 1, 2.5, 5, 10, 30, 60 and 300 s; the
+ *        last bucket holds everything longer.
+ */
+typedef struct {
+    ULONGLONG buckets[WW_METRICS_BUCKETS]; /**< Observations per bucket, not cumulative */
+    ULONGLONG count;                       /**< Observations; the sum of buckets */
+    ULONGLONG sumUs;                       /**< Sum of the observations in microseconds */
+} WW_HISTOGRAM;
+
+/**
+ * @brief Process-wide counters returned by WWMetricsSnapshot. All counters
+ *        only grow.
+ */
+typedef struct {
+    ULONGLONG requests[WW_STATUS_CLASS_COUNT]; /**< Requests sent, by E_WW_STATUS_CLASS of the response */
+    ULONGLONG bytesDownloaded;        /**< Response body bytes received, after content decoding */
+    ULONGLONG bytesUploaded;          /**< Request body bytes sent */
+    ULONGLONG connectionsOpened;      /**< Connections made to servers */
+    ULONGLONG connectionsReused;      /**< Requests sent on a connection kept from an earlier request */
+    ULONGLONG redirects;              /**< Redirects followed */
+    ULONGLONG retries;                /**< Attempts repeated by a retry policy or a multipart upload */
+    ULONGLONG memoryCacheHits;        /**< Queries answered from a fresh session cache entry */
+    ULONGLONG diskCacheHits;          /**< Queries and downloads answered from a fresh disk cache entry */
+    WW_HISTOGRAM queryDuration;       /**< WWQueryExW calls, retries and redirects included */
+    WW_HISTOGRAM headersTime;         /**< From the start of each request sent to its response headers */
+    WW_HISTOGRAM downloadDuration;    /**< WWDownloadExW calls, retries and redirects included */
+} WW_METRICS;
+
 /**
  * @brief Structure representing parameters for the WinWeb library functions (Unicode version).
  */
@@ -154,8 +378,109 @@ typedef struct {
     ULONGLONG resumeOffset;           /**< Byte offset to resume from (sends Range: bytes=N-); 0 = start from beginning */
     DWORD     receiveTimeoutMs;       /**< InternetReadFile timeout in ms; 0 = WinInet default (~30 s) */
     volatile HINTERNET* pActiveHandle; /**< If non-NULL, WinWeb stores the active request handle here so external code can InternetCloseHandle it to abort a stalled read */
+    WW_DISKCACHE* diskCache;          /**< Optional disk cache consulted before downloading over HTTP(S) */
+    INT hashAlgorithm;                /**< WW_HASH_* digest to compute while writing the file; WW_HASH_NONE = off */
+    const BYTE* expectedDigest;       /**< Optional digest the file must match; a mismatch fails with WW_ERR_DIGEST_MISMATCH; requires hashAlgorithm */
+    BYTE digest[WW_DIGEST_MAX_SIZE];  /**< Out: digest of the whole downloaded file */
+    DWORD digestSize;                 /**< Out: valid bytes in digest; 0 if no digest was computed */
+    BOOL acceptEncoding;              /**< Send Accept-Encoding: gzip, deflate and decode the body while writing it */
+    WW_RETRY_POLICY retry;            /**< Retries; an interrupted HTTP(S) transfer resumes with Range and If-Range */
+    UINT attempts;                    /**< Out: attempts made */
+    UINT segments;                    /**< Fetch the body as up to this many parallel ranges (at most WW_MAX_DOWNLOAD_SEGMENTS); 0 or 1 = one stream */
+    BOOL journal;                     /**< Record finished ranges in a "<file>~journal" sidecar so a later call resumes them after a crash */
+    const LPCWSTR* mirrors;           /**< Optional further http(s) URLs of the same file; ranges are fetched from all of them */
+    UINT mirrorCount;                 /**< Number of entries in mirrors */
+    WW_RATELIMIT* rateLimit;          /**< Optional limiter the body is read through, besides the host and process limits */
+    DWORD lowSpeedLimit;              /**< Restart a connection that stays below this many bytes per second for lowSpeedTimeMs; 0 = off */
+    DWORD lowSpeedTimeMs;             /**< Window of the low-speed check; 0 = WW_DEFAULT_LOW_SPEED_TIME */
+    UINT maxStallRestarts;            /**< Restarts before the download fails with WW_ERR_STALLED; 0 = WW_DEFAULT_STALL_RESTARTS */
+    UINT stallRestarts;               /**< Out: connections restarted because the transfer stalled */
+    WW_CANCEL* cancel;                /**< Optional token; signalling it aborts the download with WW_ERR_CANCELLED */
+    ULONGLONG deadlineMs;             /**< GetTickCount64() time by which the whole download must be done, retries included; 0 = none */
 } WW_PARAMSW;
 
+/**
+ * @brief Opaque session sharing one WinInet handle (and its connection pool)
+ *        between requests. Safe to use from several threads at once.
+ */
+typedef struct WW_SESSION_S WW_SESSION;
+
+/**
+ * @brief Per-origin circuit breaker of a session. A zeroed structure turns
+ *        the breaker off.
+ *
+ * A request counts as failed on a connection error, a 5xx or 429 status, or
+ * when it takes longer than slowCallMs.
+ */
+typedef struct {
+    UINT minRequests;                 /**< Completed requests in the window before the breaker may open; 0 = off */
+    UINT failurePercent;              /**< Failure rate in the window that opens the breaker; 0 = WW_DEFAULT_BREAKER_FAILURE_PERCENT */
+    DWORD slowCallMs;                 /**< Requests slower than this count as failed; 0 = latency is not considered */
+    DWORD windowMs;                   /**< Length of the counting window; 0 = WW_DEFAULT_BREAKER_WINDOW */
+    DWORD openMs;                     /**< How long the breaker stays open before probing; 0 = WW_DEFAULT_BREAKER_OPEN */
+    UINT halfOpenProbes;              /**< Probes that must succeed to close the breaker; 0 = 1 */
+} WW_BREAKER_OPTIONS;
+
+/**
+ * @brief Per-origin adaptive concurrency limit of a session (additive
+ *        increase, multiplicative decrease). A zeroed structure turns the
+ *        limiter off.
+ *
+ * Every limit's worth of requests that succeed within latencyTargetMs
+ * raise the limit by one. A failed or slower request halves it, at most once
+ * per round of requests in flight.
+ */
+typedef struct {
+    UINT initialLimit;                /**< Requests in flight per origin to start with; 0 = off */
+    UINT minLimit;                    /**< Lowest limit; 0 = 1 */
+    UINT maxLimit;                    /**< Highest limit; 0 = WW_DEFAULT_LIMITER_MAX */
+    DWORD latencyTargetMs;            /**< Slower requests lower the limit; 0 = only failures do */
+    DWORD queueTimeoutMs;             /**< How long a request waits for a free slot before failing with WW_ERR_CONCURRENCY_LIMIT; 0 = fail at once */
+} WW_LIMITER_OPTIONS;
+
+/**
+ * @brief Options for WWSessionOpenW.
+ */
+typedef struct {
+    LPCWSTR userAgent;                /**< User agent string; NULL = WW_DEFAULT_USER_AGENTW */
+    DWORD flags;                      /**< WW_SESSION_* flags */
+    SIZE_T cacheBytes;                /**< In-memory response cache budget in bytes; 0 = no cache */
+    WW_BREAKER_OPTIONS breaker;       /**< Per-origin circuit breaker; zeroed = off */
+    WW_LIMITER_OPTIONS limiter;       /**< Per-origin concurrency limit; zeroed = off */
+} WW_SESSION_OPTIONSW;
+
+/**
+ * @brief Session counters returned by WWSessionGetStats.
+ */
+typedef struct {
+    ULONGLONG cacheHits;              /**< Requests answered from a fresh cache entry */
+    ULONGLONG cacheMisses;            /**< Cacheable requests that went to the network */
+    ULONGLONG cacheRevalidations;     /**< Stale entries confirmed by a 304 Not Modified */
+    ULONGLONG cacheEvictions;         /**< Entries dropped to stay within cacheBytes */
+    SIZE_T cacheEntries;              /**< Entries currently cached */
+    SIZE_T cacheBytesUsed;            /**< Bytes currently charged against cacheBytes */
+    ULONGLONG hedgesIssued;           /**< Hedge requests sent because the first request was slow */
+    ULONGLONG hedgesWon;              /**< Hedge requests whose response was used */
+    ULONGLONG breakerRejections;      /**< Requests failed with WW_ERR_CIRCUIT_OPEN */
+    ULONGLONG limiterRejections;      /**< Requests failed with WW_ERR_CONCURRENCY_LIMIT */
+} WW_SESSION_STATS;
+
+/**
+ * @brief Breaker and limiter state of one origin, returned by
+ *        WWSessionGetOriginStatsW.
+ */
+typedef struct {
+    INT breakerState;                 /**< E_WW_BREAKER_STATE */
+    UINT concurrencyLimit;            /**< Current limit; 0 when the limiter is off */
+    UINT inFlight;                    /**< Requests currently sent to the origin */
+    DWORD latencyMs;                  /**< Moving average of request latency */
+    ULONGLONG requests;               /**< Requests sent */
+    ULONGLONG failures;               /**< Sent requests that counted as failed */
+    ULONGLONG breakerRejections;      /**< Requests failed with WW_ERR_CIRCUIT_OPEN */
+    ULONGLONG limiterRejections;      /**< Requests failed with WW_ERR_CONCURRENCY_LIMIT */
+    ULONGLONG breakerOpens;           /**< Times the breaker opened */
+} WW_ORIGIN_STATS;
+
 /**
  * @brief Structure representing an HTTP response (ANSI version).
  */
@@ -174,6 +499,15 @@ typedef struct {
     LPBYTE data;                      /**< Response body (library-allocated) */
     SIZE_T dataSize;                  /**< Size of response body in bytes */
     INT errorcode;                    /**< Error code on failure */
+    BOOL http2;                       /**< Response was received over HTTP/2 */
+    ULONGLONG wireSize;               /**< Body bytes received on the wire (compressed size when decoded); 0 if served from a cache or a coalesced request */
+    ULONGLONG sentSize;               /**< Request body bytes sent (gzipped size when compressed); 0 if served from a cache or a coalesced request */
+    LPWSTR headers;                   /**< Raw response headers, CRLF separated (library-allocated); NULL unless WW_REQUESTW.captureHeaders */
+    UINT attempts;                    /**< Attempts made, including retries */
+    BOOL hedged;                      /**< A hedge request was sent for the last attempt */
+    BOOL hedgeWon;                    /**< The response came from the hedge rather than the first request */
+    WW_TIMINGS timings;               /**< Phase timings of the request */
+    LPVOID shared;                    /**< Internal: reference to a body shared with other responses */
 } WW_RESPONSEW;
 
 /**
@@ -194,6 +528,63 @@ typedef struct {
     DWORD receiveTimeoutMs;           /**< Receive timeout in ms; 0 = WinINet default */
 } WW_REQUESTA;
 
+/**
+ * @brief Kinds of streamed request body (WW_UPLOAD_SOURCE.type).
+ */
+enum E_WW_UPLOAD_TYPE {
+    WW_UPLOAD_FILE,        /**< Read from hFile, starting at its current position */
+    WW_UPLOAD_CALLBACK,    /**< Pulled from readCallback */
+    WW_UPLOAD_BUFFERS      /**< Gathered from the buffers array, in order */
+};
+
+/**
+ * @brief Callback supplying the next piece of a streamed request body.
+ *
+ * @param buffer    Destination for up to size bytes.
+ * @param size      Capacity of buffer.
+ * @param bytesRead Out: bytes stored; 0 ends the body.
+ * @param pUserData WW_UPLOAD_SOURCE.pCallbackData.
+ * @return FALSE to abort the request with WW_ERR_UPLOAD.
+ */
+typedef BOOL (*WW_UPLOAD_READ_CALLBACK)(LPVOID buffer, DWORD size,
+                                        LPDWORD bytesRead, LPVOID pUserData);
+
+/**
+ * @brief Callback reporting upload progress after each block is sent.
+ *
+ * @param sentBytes  Body bytes sent so far.
+ * @param totalBytes Body size, or 0 when it is sent chunked.
+ * @param pUserData  WW_UPLOAD_SOURCE.pCallbackData.
+ */
+typedef VOID (*WW_UPLOAD_PROGRESS_CALLBACK)(ULONGLONG sentBytes,
+                                            ULONGLONG totalBytes,
+                                            LPVOID pUserData);
+
+/**
+ * @brief One piece of a scatter-gather request body.
+ */
+typedef struct {
+    LPCVOID data;                     /**< First byte of the piece */
+    SIZE_T size;                      /**< Size of the piece in bytes */
+} WW_UPLOAD_BUFFER;
+
+/**
+ * @brief Request body streamed in fixed-size blocks instead of passed as one
+ *        buffer. Bodies of known size are sent with Content-Length (which may
+ *        exceed 4 GB); a callback source of unknown size is sent with
+ *        Transfer-Encoding: chunked.
+ */
+typedef struct {
+    INT type;                         /**< E_WW_UPLOAD_TYPE */
+    ULONGLONG size;                   /**< Body size; 0 = rest of the file, sum of the buffers, or unknown for a callback */
+    HANDLE hFile;                     /**< WW_UPLOAD_FILE: readable file handle */
+    WW_UPLOAD_READ_CALLBACK readCallback; /**< WW_UPLOAD_CALLBACK: body producer */
+    const WW_UPLOAD_BUFFER* buffers;  /**< WW_UPLOAD_BUFFERS: pieces to send */
+    SIZE_T bufferCount;               /**< WW_UPLOAD_BUFFERS: number of pieces */
+    WW_UPLOAD_PROGRESS_CALLBACK progressCallback; /**< Optional upload progress callback */
+    LPVOID pCallbackData;             /**< User context for both callbacks */
+} WW_UPLOAD_SOURCE;
+
 /**
  * @brief Structure representing an HTTP request (Unicode version).
  */
@@ -210,8 +601,221 @@ typedef struct {
     DWORD connectTimeoutMs;           /**< Connect timeout in ms; 0 = WinINet default */
     DWORD sendTimeoutMs;              /**< Send timeout in ms; 0 = WinINet default */
     DWORD receiveTimeoutMs;           /**< Receive timeout in ms; 0 = WinINet default */
+    WW_SESSION* session;              /**< Optional session to reuse connections through; NULL = private connection */
+    WW_DISKCACHE* diskCache;          /**< Optional disk cache for GET responses */
+    BOOL acceptEncoding;              /**< Send Accept-Encoding: gzip, deflate and return the decoded body */
+    INT compressLevel;                /**< Gzip the body at level 1-9 and send Content-Encoding: gzip (chunked above 256 KiB); 0 = send as-is */
+    DWORD compressMinSize;            /**< Bodies smaller than this are sent as-is; 0 = WW_DEFAULT_COMPRESS_MIN_SIZE */
+    const WW_UPLOAD_SOURCE* upload;   /**< Optional streamed body; replaces body/bodySize and is never compressed */
+    BOOL captureHeaders;              /**< Return the raw response headers in WW_RESPONSEW.headers; bypasses caching and coalescing */
+    ULONGLONG expectContinueSize;     /**< Send Expect: 100-continue and wait for the server before bodies of at least this size (plain http without a proxy); only a 413 stops the body; 0 = off */
+    DWORD expectContinueTimeoutMs;    /**< How long to wait for 100 Continue before sending the body anyway; 0 = WW_DEFAULT_EXPECT_CONTINUE_TIMEOUT */
+    WW_RETRY_POLICY retry;            /**< Retries; POST and PATCH only with WW_RETRY_NON_IDEMPOTENT, callback uploads never */
+    DWORD hedgeDelayMs;               /**< GET/HEAD without a body: send a second copy if no response headers arrive within this many ms; 0 = off */
+    const LPCWSTR* hedgeHosts;        /**< Optional alternate "host" or "host:port" names the second copy is sent to, used in turn */
+    UINT hedgeHostCount;              /**< Number of entries in hedgeHosts; 0 = hedge to the same URL */
+    WW_CANCEL* cancel;                /**< Optional token; signalling it aborts the request with WW_ERR_CANCELLED; bypasses coalescing */
+    ULONGLONG deadlineMs;             /**< GetTickCount64() time by which the whole call must be done, redirects and retries included; 0 = none; bypasses coalescing */
 } WW_REQUESTW;
 
+/**
+ * @brief Per-request outcome reported by WWQueryBatchW.
+ */
+typedef struct {
+    INT result;                       /**< WW_SUCCESS or WW_FAILURE returned for the request */
+    ULONGLONG startUs;                /**< Start of the request relative to the batch start, in microseconds */
+    ULONGLONG elapsedUs;              /**< Time the request took, in microseconds */
+} WW_BATCH_RESULT;
+
+/**
+ * @brief Options for WWQueryBatchW.
+ */
+typedef struct {
+    UINT maxConcurrency;              /**< Requests in flight at once; 0 = WW_DEFAULT_BATCH_CONCURRENCY */
+    WW_SESSION* session;              /**< Session for requests that have none; NULL = temporary HTTP/2 session */
+    WW_BATCH_RESULT* results;         /**< Optional array receiving one entry per request */
+    WW_CANCEL* cancel;                /**< Optional token for requests that have none; once signalled, requests not yet started fail at once */
+} WW_BATCH_OPTIONS;
+
+/**
+ * @brief Outcome of one file of a manifest, passed to WW_MANIFEST_CALLBACK.
+ */
+typedef struct {
+    LPCWSTR path;                     /**< Path of the file below WW_MANIFEST_OPTIONSW.dstPath */
+    LPCWSTR url;                      /**< URL the file came from, or the last one tried */
+    ULONGLONG size;                   /**< Size from the manifest; 0 if it has none */
+    INT result;                       /**< WW_SUCCESS or WW_FAILURE */
+    INT errorcode;                    /**< WW_ERR_* of a failed file */
+    BOOL skipped;                     /**< The local copy already matched and was kept */
+} WW_MANIFEST_RESULTW;
+
+/**
+ * @brief Callback invoked once per file of a manifest. Calls come from the
+ *        worker threads, one at a time.
+ */
+typedef VOID (*WW_MANIFEST_CALLBACK)(const WW_MANIFEST_RESULTW* result, LPVOID userData);
+
+/**
+ * @brief Options for WWDownloadManifestW.
+ */
+typedef struct {
+    LPCWSTR manifestPath;             /**< Metalink 4, JSON or TSV manifest; the format is detected from the content */
+    LPCWSTR dstPath;                  /**< Directory the paths in the manifest are relative to */
+    UINT maxConcurrency;              /**< Files downloaded at once; 0 = WW_DEFAULT_BATCH_CONCURRENCY */
+    LPCWSTR userAgent;                /**< User agent string; NULL = default */
+    DWORD receiveTimeoutMs;           /**< InternetReadFile timeout in ms; 0 = WinInet default */
+    WW_RETRY_POLICY retry;            /**< Retries of each file */
+    const volatile BOOL* pCancelFlag; /**< Optional cancellation flag; set to TRUE to stop after the files in flight */
+    WW_MANIFEST_CALLBACK fileCallback; /**< Optional callback receiving the outcome of every file */
+    LPVOID pCallbackData;             /**< User context for fileCallback */
+    WW_RATELIMIT* rateLimit;          /**< Optional limiter shared by all files of the manifest */
+    WW_CANCEL* cancel;                /**< Optional token; signalling it aborts the files in flight and stops the manifest */
+    INT errorcode;                    /**< Out: WW_ERR_MANIFEST if the manifest could not be read to the end */
+    ULONGLONG filesDownloaded;        /**< Out: files fetched and verified */
+    ULONGLONG filesSkipped;           /**< Out: files whose local copy already matched */
+    ULONGLONG filesFailed;            /**< Out: files that could not be fetched or did not match */
+} WW_MANIFEST_OPTIONSW;
+
+/**
+ * @brief Steps of a multipart upload (WW_MULTIPART_CALL.phase).
+ */
+enum E_WW_MULTIPART_PHASE {
+    WW_MULTIPART_INITIATE,        /**< Start the upload, e.g. obtain an upload ID */
+    WW_MULTIPART_UPLOAD_PART,     /**< Send one part; the engine supplies the body */
+    WW_MULTIPART_COMPLETE,        /**< Assemble the uploaded parts */
+    WW_MULTIPART_ABORT            /**< Discard the uploaded parts after a failure */
+};
+
+/**
+ * @brief One part of a multipart upload.
+ */
+typedef struct {
+    UINT partNumber;                  /**< 1-based part number */
+    ULONGLONG offset;                 /**< Offset of the part in the source file */
+    ULONGLONG size;                   /**< Size of the part in bytes */
+    BYTE digest[WW_DIGEST_MAX_SIZE];  /**< Checksum of the part data (WW_MULTIPART_OPTIONSW.hashAlgorithm) */
+    DWORD digestSize;                 /**< Valid bytes in digest; 0 if no checksum was computed */
+    UINT attempts;                    /**< Attempts made, including the successful one */
+    WCHAR tag[128];                   /**< Set by the adapter from the part response (e.g. its ETag) for the completion request */
+} WW_MULTIPART_PART;
+
+/**
+ * @brief One request of a multipart upload, filled in by the protocol adapter.
+ */
+typedef struct {
+    INT phase;                        /**< E_WW_MULTIPART_PHASE */
+    WW_REQUESTW request;              /**< Request to send; verb defaults to PUT for parts and POST otherwise. A NULL url skips the initiate, complete and abort steps */
+    WW_MULTIPART_PART* part;          /**< WW_MULTIPART_UPLOAD_PART: the part being sent */
+    const WW_MULTIPART_PART* parts;   /**< WW_MULTIPART_COMPLETE: every part, in order */
+    UINT partCount;                   /**< WW_MULTIPART_COMPLETE: number of parts */
+    WCHAR url[INTERNET_MAX_URL_LENGTH]; /**< Storage request.url may point at */
+    WCHAR headers[1024];              /**< Storage request.headers may point at */
+} WW_MULTIPART_CALL;
+
+/**
+ * @brief Adapter callback building the request for one step.
+ * @return FALSE to abort the whole upload.
+ */
+typedef BOOL (*WW_MULTIPART_PREPARE_CALLBACK)(WW_MULTIPART_CALL* call,
+                                              LPVOID pUserData);
+
+/**
+ * @brief Adapter callback inspecting a 2xx response, e.g. to store the upload
+ *        ID or call->part->tag. Response headers are always captured.
+ * @return FALSE to treat the attempt as failed.
+ */
+typedef BOOL (*WW_MULTIPART_RESPONSE_CALLBACK)(WW_MULTIPART_CALL* call,
+                                               const WW_RESPONSEW* response,
+                                               LPVOID pUserData);
+
+/**
+ * @brief Protocol adapter mapping an initiate/part/complete style API (such
+ *        as S3 multipart uploads) onto requests. Callbacks for parts run on
+ *        worker threads concurrently.
+ */
+typedef struct {
+    WW_MULTIPART_PREPARE_CALLBACK prepare;   /**< Required */
+    WW_MULTIPART_RESPONSE_CALLBACK response; /**< Optional; NULL = any 2xx status succeeds */
+    LPVOID pUserData;                        /**< Passed to both callbacks */
+} WW_MULTIPART_ADAPTER;
+
+/**
+ * @brief Options for WWMultipartUploadW.
+ */
+typedef struct {
+    LPCWSTR filePath;                 /**< File to upload */
+    ULONGLONG partSize;               /**< Bytes per part (the last may be shorter); 0 = WW_DEFAULT_PART_SIZE */
+    UINT maxConcurrency;              /**< Parts in flight at once; 0 = WW_DEFAULT_MULTIPART_CONCURRENCY */
+    UINT maxRetries;                  /**< Extra attempts per request; 0 = WW_DEFAULT_PART_RETRIES */
+    INT hashAlgorithm;                /**< WW_HASH_* checksum computed for each part before it is sent */
+    WW_SESSION* session;              /**< Session to send through; NULL = private keep-alive session */
+    WW_MULTIPART_ADAPTER adapter;     /**< Protocol adapter */
+    WW_UPLOAD_PROGRESS_CALLBACK progressCallback; /**< Optional; reports bytes of finished parts from worker threads */
+    LPVOID pCallbackData;             /**< User context for progressCallback */
+    INT errorcode;                    /**< Out: error code on failure */
+    DWORD statusCode;                 /**< Out: status of the last failed request, if any */
+    UINT retries;                     /**< Out: attempts that had to be repeated */
+    WW_CANCEL* cancel;                /**< Optional token; signalling it aborts the parts in flight and the upload with WW_ERR_CANCELLED */
+} WW_MULTIPART_OPTIONSW;
+
+/**
+ * @brief Result codes returned by the HTTP/1.1 parser functions.
+ */
+enum E_WW_PARSE_RESULT {
+    WW_PARSE_OK = 0,              /**< Message (or chunked body) fully parsed */
+    WW_PARSE_INCOMPLETE,          /**< More input is required */
+    WW_PARSE_ERROR,               /**< Malformed input */
+    WW_PARSE_TOO_MANY_HEADERS     /**< Header array supplied by caller is too small */
+};
+
+/**
+ * @brief Non-owning view into a caller-supplied buffer (not NUL-terminated).
+ */
+typedef struct {
+    const CHAR* ptr;                  /**< First byte of the slice */
+    SIZE_T len;                       /**< Length of the slice in bytes */
+} WW_SLICE;
+
+/**
+ * @brief Response header as returned by WWHttpParseResponse.
+ */
+typedef struct {
+    WW_SLICE name;                    /**< Header name, without the colon */
+    WW_SLICE value;                   /**< Header value, with surrounding whitespace trimmed */
+} WW_HTTP_HEADER;
+
+/**
+ * @brief Incremental HTTP/1.1 response head parser state.
+ *
+ * Zero-initialise, set headers/maxHeaders, then call WWHttpParseResponse each
+ * time more bytes are appended to the receive buffer. All slices point into
+ * that buffer; the parser never allocates.
+ */
+typedef struct {
+    WW_HTTP_HEADER* headers;          /**< Caller-owned header array */
+    SIZE_T maxHeaders;                /**< Capacity of the header array */
+    UINT versionMinor;                /**< Minor version from "HTTP/1.x" */
+    DWORD statusCode;                 /**< HTTP status code */
+    WW_SLICE reason;                  /**< Reason phrase */
+    SIZE_T headerCount;               /**< Number of headers stored */
+    SIZE_T headerBytes;               /**< Length of the response head including the blank line */
+    ULONGLONG contentLength;          /**< Content-Length value, if hasContentLength */
+    BOOL hasContentLength;            /**< Content-Length header was present */
+    BOOL chunked;                     /**< Transfer-Encoding ends with "chunked" */
+    BOOL connectionClose;             /**< Connection: close was sent */
+    SIZE_T scanned;                   /**< Internal: bytes already searched for the end of the head */
+} WW_HTTP_PARSER;
+
+/**
+ * @brief In-place chunked transfer-encoding decoder state. Zero-initialise before use.
+ */
+typedef struct {
+    ULONGLONG chunkRemaining;         /**< Bytes left in the current chunk */
+    INT state;                        /**< Internal decoder state */
+    UINT hexDigits;                   /**< Internal: digits seen in the chunk-size line */
+    SIZE_T trailing;                  /**< Bytes following the terminating chunk once WW_PARSE_OK is returned */
+} WW_CHUNKED_DECODER;
+
 /**
  * @brief Function to download a file (ANSI version).
  *
@@ -265,11 +869,102 @@ INT WWDownloadExA(WW_PARAMSA* params);
  *
  * This function downloads a file with extended parameters provided in the WW_PARAMSW structure.
  *
+ * With hashAlgorithm set, the digest is computed from the bytes as they are
+ * written (a resumed download hashes the existing part first) and checked
+ * against expectedDigest before the temporary file is renamed into place. An
+ * expectedDigest without a hashAlgorithm fails at once with
+ * WW_ERR_INVALID_PARAMS.
+ *
+ * With a retry policy, a failed attempt is retried after a backoff delay. When
+ * an HTTP(S) transfer breaks off, the next attempt keeps the bytes already in
+ * the temporary file and asks for the rest with Range, guarded by If-Range
+ * with the entity's strong ETag or Last-Modified date. If the entity changed,
+ * the server sends it whole and the download starts over.
+ *
+ * With segments or journal set and a server that accepts byte ranges, the
+ * temporary file is allocated at its full size and the body is fetched as
+ * ranges written in place, segments of them at a time. With journal set, the
+ * progress of every range is recorded in "<file>~journal" next to the
+ * temporary file once its bytes are flushed to disk. A later call for the
+ * same file and entity (same validator and size) fetches only what the
+ * journal does not cover, even after a crash or reboot. Progress is then
+ * reported from the worker threads.
+ *
+ * With mirrors set, url still supplies the size and validator, and the ranges
+ * are spread over url and every mirror. Each range goes to the source with the
+ * best measured throughput for one more connection, so fast mirrors serve
+ * more of the file. A worker left without a range takes over the second half
+ * of the largest range still in flight. A mirror that fails or serves another
+ * size or entity (If-Range carries the validator of url) is dropped and its
+ * unfinished range goes to the others. The download fails only when every
+ * source is dropped. segments sets the number of connections in total; 0 or
+ * 1 = one per source.
+ *
+ * The body is read through rateLimit, the limit of the host it comes from
+ * (WWSetHostRateLimitW) and the process limit (WWSetGlobalRateLimit), each
+ * where set. Every range of a segmented download counts against the limit of
+ * the host serving it.
+ *
+ * With lowSpeedLimit set, a connection that receives fewer than
+ * lowSpeedLimit bytes per second over lowSpeedTimeMs (time spent waiting on a
+ * rate limit aside) is closed, and the download continues at once from the
+ * current offset on a new connection, with Range and If-Range as for a
+ * retry. The receive timeout is lowered to lowSpeedTimeMs so that total
+ * silence is noticed too. A stalled range of a segmented download is
+ * requested again, possibly from another source. Restarts do not count as
+ * attempts. After maxStallRestarts of them the next stall fails the download
+ * with WW_ERR_STALLED, which the retry policy treats as a network error.
+ *
+ * A download stopped through pCancelFlag or cancel fails with
+ * WW_ERR_CANCELLED and is not retried. pCancelFlag is only checked between
+ * reads; signalling cancel (WWCancel) also closes the connection, so a read
+ * blocked on a silent server returns at once.
+ *
+ * deadlineMs bounds the whole download as it does a query (see WWQueryExW):
+ * the receive timeout is cut to the time left, the connection is closed when
+ * the deadline passes and no retry or stall restart is started after it. The
+ * download then fails with WW_ERR_TIMEOUT.
+ *
+ * progressBarData.timings holds the phase timings of the HTTP request that
+ * carries the body (for a segmented download, the first one). The progress
+ * callback sees them from the moment the response headers are in; bodyUs is
+ * set when the body is complete.
+ *
  * @param params The WW_PARAMSW structure containing the download parameters.
  * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) on failure.
  */
 INT WWDownloadExW(WW_PARAMSW* params);
 
+/**
+ * @brief Download every file listed in a manifest into a directory tree.
+ *
+ * The manifest is memory-mapped and parsed as the workers ask for the next
+ * file, so its size does not matter. The format is detected from the first
+ * character. A Metalink 4 (RFC 5854) manifest supplies the name, size,
+ * sha-256 hash and url elements of each file element, with urls ordered by
+ * priority. A JSON manifest is an array of objects, or an object whose
+ * "files" member is one, with "path", "url" or "urls", "size" and "sha256"
+ * members. A TSV manifest has one file per line: path, size, sha256 and one
+ * or more URLs separated by tabs, with empty lines and lines starting with
+ * '#' skipped.
+ *
+ * Size and hash are optional. A path may name subdirectories, which are
+ * created; absolute paths and ".." are rejected. A file without a path is
+ * named after its URL. Further URLs of a file are used as its mirrors and, if
+ * the first one fails, in its place.
+ *
+ * A file whose local copy has the listed size and SHA-256 is skipped. Other
+ * files are downloaded on up to maxConcurrency threads, with the SHA-256
+ * computed while the file is written; a mismatch fails the file. A file
+ * listed with a size but no SHA-256 fails with WW_ERR_MANIFEST, and is
+ * deleted, when the download has another size.
+ *
+ * @param options Manifest options; errorcode and the file counters are set.
+ * @return WW_SUCCESS if the manifest was read to the end and every file
+ *         succeeded, otherwise WW_FAILURE.
+ */
+INT WWDownloadManifestW(WW_MANIFEST_OPTIONSW* options);
+
 /**
  * @brief Perform an HTTP request (ANSI version).
  *
@@ -293,16 +988,77 @@ INT WWQueryExA(WW_REQUESTA* request, WW_RESPONSEA* response);
 
 /**
  * @brief Perform an HTTP request with extended parameters (Unicode version).
+ *
+ * With compressLevel set, a body of at least compressMinSize bytes is gzipped
+ * before sending. A body that does not shrink, or whose headers already name a
+ * Content-Encoding, is sent unchanged and gets no Content-Encoding added.
+ * Bodies over 256 KiB are gzipped while they are sent, with
+ * Transfer-Encoding: chunked, so no compressed copy of the whole body is
+ * held; whether such a body shrinks is judged from its first 256 KiB of
+ * output. The server must accept chunked request bodies.
+ *
+ * With expectContinueSize set, a large body is only sent once the server has
+ * answered the request head with 100 Continue (or not answered within
+ * expectContinueTimeoutMs). A 413 is returned without sending the body. The
+ * handshake runs over a connection of its own, whose head lacks the
+ * credentials WinInet caches, so any other answer (401, 417, a redirect) is
+ * only advice and the request is sent as usual. When the server accepts,
+ * the handshake costs an extra connection and round trip; turn it on only
+ * for bodies that are expensive to send and likely to be refused. It applies
+ * to http:// URLs reached without a proxy, configured or found through a PAC
+ * file or WPAD; other requests are sent as usual.
+ *
+ * With a retry policy, connection failures and the retryable statuses are
+ * retried after a backoff delay; the response of the last attempt is
+ * returned. A file or buffer upload is sent again from its start.
+ *
+ * With hedgeDelayMs set, a GET or HEAD without a body that has no response
+ * headers after hedgeDelayMs is sent a second time, to the next of hedgeHosts
+ * if any. The first copy to receive its final response headers is read to the
+ * end and the other is closed. Each hedge adds one request, so pick a delay
+ * near the usual p95 latency; the session counts hedges issued and won.
+ *
+ * With deadlineMs set, the connect, send and receive timeouts of every step
+ * (each redirect hop and retry, the 100 Continue handshake and the wait for
+ * a concurrency slot) are cut to the time left, and the request handle is
+ * closed when the deadline passes, which also ends name resolution and TLS
+ * setup. A retry that could not start before the deadline is not made. A
+ * call that fails at or after the deadline fails with WW_ERR_TIMEOUT.
+ *
+ * response->timings breaks the request down into name resolution, connect,
+ * TLS handshake, sending, time to first byte, headers and body, as reported
+ * by WinInet. It is filled in on failure too, up to the last phase reached.
  */
 INT WWQueryExW(WW_REQUESTW* request, WW_RESPONSEW* response);
 
+/**
+ * @brief Perform many HTTP requests concurrently (Unicode version).
+ *
+ * Requests run on up to maxConcurrency worker threads and share one session,
+ * so connections to the same origin are reused. responses[i] is filled for
+ * requests[i] exactly as WWQueryExW would fill it and must be freed with
+ * WWFreeResponseW.
+ *
+ * @param requests  Array of count requests.
+ * @param responses Array of count responses.
+ * @param count     Number of requests.
+ * @param options   Batch options, or NULL for defaults.
+ * @return WW_SUCCESS if every request succeeded, otherwise WW_FAILURE.
+ */
+INT WWQueryBatchW(WW_REQUESTW* requests, WW_RESPONSEW* responses,
+                  SIZE_T count, const WW_BATCH_OPTIONS* options);
+
 /**
  * @brief Return remote Content-Length via HEAD, following redirects (ANSI version).
+ *
+ * timeoutMs bounds the whole call, redirects included; 0 = WinInet defaults.
  */
 INT WWGetRemoteFileSizeA(LPCSTR url, ULONGLONG* outSize, DWORD timeoutMs);
 
 /**
  * @brief Return remote Content-Length via HEAD, following redirects (Unicode version).
+ *
+ * timeoutMs bounds the whole call, redirects included; 0 = WinInet defaults.
  */
 INT WWGetRemoteFileSizeW(LPCWSTR url, ULONGLONG* outSize, DWORD timeoutMs);
 
@@ -313,9 +1069,318 @@ VOID WWFreeResponseA(WW_RESPONSEA* response);
 
 /**
  * @brief Free response data allocated by query functions (Unicode version).
+ *
+ * Bodies shared between coalesced responses are reference counted; each
+ * response must still be freed once.
  */
 VOID WWFreeResponseW(WW_RESPONSEW* response);
 
+/**
+ * @brief Look up a header captured with WW_REQUESTW.captureHeaders.
+ *
+ * @param response  Response of the request.
+ * @param name      Header name, case-insensitive.
+ * @param value     Receives the value with surrounding whitespace trimmed.
+ * @param valueCch  Capacity of value in characters.
+ * @return TRUE if the header is present.
+ */
+BOOL WWGetResponseHeaderW(const WW_RESPONSEW* response, LPCWSTR name,
+                          LPWSTR value, DWORD valueCch);
+
+/**
+ * @brief Upload a file in parts over concurrent connections.
+ *
+ * The file is split into partSize pieces that are sent by up to
+ * maxConcurrency worker threads. Each part is read from disk as it is sent
+ * (after a checksum pass when hashAlgorithm is set), so memory use does not
+ * grow with the part size. A failed part is retried with exponential
+ * backoff; 4xx statuses other than 408 and 429 are not retried. After all
+ * parts succeed the completion request is sent; if the upload fails after
+ * it was initiated, the abort request is sent. The requests themselves come
+ * from the protocol adapter.
+ *
+ * @param options Upload options; errorcode, statusCode and retries are set.
+ * @return WW_SUCCESS or WW_FAILURE.
+ */
+INT WWMultipartUploadW(WW_MULTIPART_OPTIONSW* options);
+
+/**
+ * @brief Open a session whose connections are shared by every request that
+ *        references it through WW_REQUESTW.session.
+ *
+ * With WW_SESSION_HTTP2, HTTPS requests to the same origin are multiplexed
+ * as HTTP/2 streams over one connection when the server supports it.
+ * With WW_SESSION_COALESCE, a GET or HEAD without a body that matches one
+ * already in flight (same URL, user agent and headers) waits for that
+ * request instead of sending its own, and receives the same body buffer.
+ * With a non-zero cacheBytes, 200 responses to GET requests are kept in
+ * memory (keyed by URL and the request headers named in Vary) and served
+ * while fresh per Cache-Control/Expires; stale entries are revalidated with
+ * If-None-Match/If-Modified-Since. Least recently used entries are evicted.
+ *
+ * The breaker and limiter options guard each origin separately. An open
+ * breaker fails requests at once with WW_ERR_CIRCUIT_OPEN instead of letting
+ * them wait for a timeout; after openMs a few probes are let through. The
+ * limiter caps the requests in flight to an origin and lowers the cap as soon
+ * as the origin slows down or fails; requests over the cap wait up to
+ * queueTimeoutMs and then fail with WW_ERR_CONCURRENCY_LIMIT. Neither error
+ * is retried by a retry policy.
+ *
+ * @param options Session options, or NULL for defaults.
+ * @return Session handle, or NULL on failure.
+ */
+WW_SESSION* WWSessionOpenW(const WW_SESSION_OPTIONSW* options);
+
+/**
+ * @brief Close a session. No request may be using it.
+ */
+VOID WWSessionClose(WW_SESSION* session);
+
+/**
+ * @brief Read the cache, hedging and rejection counters of a session.
+ *
+ * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) on invalid arguments.
+ */
+INT WWSessionGetStats(WW_SESSION* session, WW_SESSION_STATS* stats);
+
+/**
+ * @brief Read the circuit breaker and concurrency limiter state of the
+ *        origin (scheme, host and port) of a URL.
+ *
+ * An origin the session has not sent to yet reports a closed breaker and
+ * the initial limit.
+ *
+ * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) on invalid arguments.
+ */
+INT WWSessionGetOriginStatsW(WW_SESSION* session, LPCWSTR url,
+                             WW_ORIGIN_STATS* stats);
+
+/**
+ * @brief Open (or create) a persistent HTTP cache in a directory.
+ *
+ * Response bodies are stored once per content (named by their SHA-256) and
+ * indexed by URL in a memory-mapped file; a lock on the index file
+ * serialises index updates between processes, also across sessions.
+ * Entries are served without network I/O while fresh per
+ * Cache-Control/Expires and revalidated with their ETag or Last-Modified
+ * afterwards. Responses carrying Vary or no-store are not stored. Least
+ * recently used entries are evicted to stay within maxBytes.
+ *
+ * Download hits are copied to the destination, or hardlinked with
+ * WW_DISKCACHE_HARDLINK (the caller must then treat the file as read-only).
+ *
+ * @param directory Cache directory; created if missing.
+ * @param maxBytes  Size budget for cached bodies.
+ * @param flags     WW_DISKCACHE_* flags.
+ * @return Cache handle, or NULL on failure.
+ */
+WW_DISKCACHE* WWDiskCacheOpenW(LPCWSTR directory, ULONGLONG maxBytes, DWORD flags);
+
+/**
+ * @brief Close a disk cache handle. Cached data stays on disk.
+ */
+VOID WWDiskCacheClose(WW_DISKCACHE* cache);
+
+/**
+ * @brief Create a token-bucket bandwidth limiter.
+ *
+ * The bucket fills at bytesPerSecond up to burstBytes and every byte of a
+ * response body read through the limiter takes one token. A read that
+ * overdraws the bucket is let through and the next read waits (sleeping, in
+ * slices of at most 100 ms) until the debt is paid off, so downloads sharing
+ * the limiter add up to its rate however many there are. Reads are also cut
+ * to at most burstBytes, which keeps short bursts close to the configured
+ * rate.
+ *
+ * @param bytesPerSecond Sustained rate; 0 = unlimited.
+ * @param burstBytes     Bucket size; 0 = one second's worth at bytesPerSecond.
+ * @return Limiter handle, or NULL on failure.
+ */
+WW_RATELIMIT* WWRateLimitOpen(ULONGLONG bytesPerSecond, ULONGLONG burstBytes);
+
+/**
+ * @brief Change the rate and burst of a limiter while downloads use it.
+ *
+ * Downloads waiting on the limiter pick up the new rate within 100 ms.
+ * Arguments are as for WWRateLimitOpen.
+ */
+VOID WWRateLimitSet(WW_RATELIMIT* limit, ULONGLONG bytesPerSecond,
+                    ULONGLONG burstBytes);
+
+/**
+ * @brief Free a limiter. No download may be using it.
+ */
+VOID WWRateLimitClose(WW_RATELIMIT* limit);
+
+/**
+ * @brief Limit the bandwidth of all downloads of the process together.
+ *
+ * Applies on top of the host limits and the limiter of each download, and
+ * may be changed at any time. Arguments are as for WWRateLimitOpen; a
+ * bytesPerSecond of 0 removes the limit.
+ *
+ * @return 0 (WW_SUCCESS).
+ */
+INT WWSetGlobalRateLimit(ULONGLONG bytesPerSecond, ULONGLONG burstBytes);
+
+/**
+ * @brief Limit the bandwidth of all downloads from one host together.
+ *
+ * The host is compared case-insensitively with the host name of the URL
+ * (after redirects) or of a mirror. Downloads already running pick up a
+ * changed limit; a new limit applies to downloads started afterwards. A
+ * bytesPerSecond of 0 removes the limit.
+ *
+ * @param host Host name, without scheme or port.
+ * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) on invalid arguments
+ *         or when out of memory.
+ */
+INT WWSetHostRateLimitW(LPCWSTR host, ULONGLONG bytesPerSecond,
+                        ULONGLONG burstBytes);
+
+/**
+ * @brief Create a cancellation token.
+ *
+ * Pass the token in the cancel field of downloads, requests, batches,
+ * manifests or multipart uploads, as many at a time as needed. WWCancel
+ * closes the network handle of every call using the token, which makes a
+ * blocked connect, send or read return within milliseconds instead of at the
+ * end of its timeout, and wakes calls waiting for a retry, a rate limit or
+ * a 100 Continue. A name lookup for the 100 Continue handshake runs to its
+ * end first. The calls then fail with WW_ERR_CANCELLED, as does every later
+ * call given the token. Each handle is closed exactly once, by WWCancel or by
+ * the call that opened it, whichever comes first. An FTP download is stopped
+ * by closing its session, which also ends the login and the file lookup.
+ *
+ * @return Token handle, or NULL on failure.
+ */
+WW_CANCEL* WWCancelOpen(void);
+
+/**
+ * @brief Signal a cancellation token. Safe to call from any thread, more than
+ *        once, and while calls are using the token.
+ */
+VOID WWCancel(WW_CANCEL* cancel);
+
+/**
+ * @brief Check whether a token was signalled.
+ *
+ * @return TRUE after WWCancel; FALSE otherwise and for NULL.
+ */
+BOOL WWIsCancelled(const WW_CANCEL* cancel);
+
+/**
+ * @brief Free a cancellation token. No call may be using it.
+ */
+VOID WWCancelClose(WW_CANCEL* cancel);
+
+/**
+ * @brief Report the stages of every query and download of the process to a
+ *        callback.
+ *
+ * The callback runs on the thread of the stage, for all threads at once, so
+ * it must be thread-safe and quick: reads and writes are reported for every
+ * chunk. It must not call WinWeb functions. Without a callback, tracing
+ * costs one pointer test per stage.
+ *
+ * Replacing or removing the callback waits for calls of the old one still
+ * running, after which its userData may be freed.
+ *
+ * @param callback Callback; NULL stops tracing.
+ * @param userData Passed to the callback, for example a WW_TRACESINK.
+ * @return 0 (WW_SUCCESS).
+ */
+INT WWSetTraceCallback(WW_TRACE_CALLBACK callback, LPVOID userData);
+
+/**
+ * @brief Create a trace sink writing Chrome trace-event JSON to a file.
+ *
+ * Install it with WWSetTraceCallback(WWTraceSinkEvent, sink). The file can
+ * be loaded into chrome://tracing or Perfetto, where every thread of a batch
+ * shows its queries and downloads as nested spans. Events are buffered and
+ * written in blocks; the file uses the JSON array form, which trace viewers
+ * accept even when the process ends before WWTraceSinkClose.
+ *
+ * @param path File to create; an existing file is replaced.
+ * @return Sink handle, or NULL on failure.
+ */
+WW_TRACESINK* WWTraceSinkOpenW(LPCWSTR path);
+
+/**
+ * @brief Trace callback writing the event to the WW_TRACESINK in userData.
+ */
+VOID WWTraceSinkEvent(const WW_TRACE_EVENT* event, LPVOID userData);
+
+/**
+ * @brief Write out buffered events, end the JSON and free the sink. It must
+ *        no longer be installed as the trace callback.
+ *
+ * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) if writing the file
+ *         failed at any point.
+ */
+INT WWTraceSinkClose(WW_TRACESINK* sink);
+
+/**
+ * @brief Read the process-wide metrics of all queries and downloads.
+ *
+ * The counters are always on. They are updated with interlocked operations
+ * only, so the hot path takes no lock, and a snapshot may catch a request
+ * between two of its counters. The ANSI functions are not counted.
+ *
+ * @return 0 (WW_SUCCESS) on success, or 1 (WW_FAILURE) if metrics is NULL.
+ */
+INT WWMetricsSnapshot(WW_METRICS* metrics);
+
+/**
+ * @brief Render metrics in the Prometheus text exposition format (0.0.4).
+ *
+ * Metric names start with winweb_; durations are in seconds. Pass
+ * bufferSize 0 to get the length needed.
+ *
+ * @param metrics    Snapshot to render, or NULL to take a fresh one.
+ * @param buffer     Receives the null-terminated text; may be NULL if
+ *                   bufferSize is 0.
+ * @param bufferSize Capacity of buffer in bytes.
+ * @return Length of the complete text without the terminating null. If it is
+ *         bufferSize or more, the text was truncated.
+ */
+SIZE_T WWMetricsFormatPrometheus(const WW_METRICS* metrics, LPSTR buffer,
+                                 SIZE_T bufferSize);
+
+/**
+ * @brief Parse an HTTP/1.1 response head incrementally.
+ *
+ * Call again with the same buffer (grown by newly received bytes) while the
+ * result is WW_PARSE_INCOMPLETE. CR/LF/colon boundaries are located with
+ * SSE4.2 or AVX2 when the CPU supports them.
+ *
+ * @param parser Parser state.
+ * @param buf    Receive buffer holding the response received so far.
+ * @param len    Number of valid bytes in buf.
+ * @return One of E_WW_PARSE_RESULT.
+ */
+INT WWHttpParseResponse(WW_HTTP_PARSER* parser, const CHAR* buf, SIZE_T len);
+
+/**
+ * @brief Find a parsed header by case-insensitive name.
+ *
+ * @return Pointer into parser->headers, or NULL if absent.
+ */
+const WW_HTTP_HEADER* WWHttpFindHeader(const WW_HTTP_PARSER* parser, LPCSTR name);
+
+/**
+ * @brief Decode chunked transfer encoding in place.
+ *
+ * On entry *len is the number of received body bytes in buf; on return it is
+ * the number of decoded payload bytes now stored at the start of buf. When
+ * WW_PARSE_OK is returned, decoder->trailing bytes after the payload belong
+ * to the next message. A chunk-size line must end in CRLF, and only
+ * whitespace may come between the size and ';' or the line end.
+ *
+ * @return One of E_WW_PARSE_RESULT.
+ */
+INT WWHttpDecodeChunked(WW_CHUNKED_DECODER* decoder, CHAR* buf, SIZE_T* len);
+
 #ifdef __cplusplus
 }
 #endif
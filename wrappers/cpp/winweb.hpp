@@ -135,6 +135,52 @@ public:
         return WWQueryExW(&request, &response);
     }
 
+    /**
+     * Fetch many URLs concurrently with GET, sharing connections per origin.
+     *
+     * @param urls           Request URLs (UTF-8).
+     * @param maxConcurrency Requests in flight at once; 0 = library default.
+     * @param timeoutMs      Connect/send/receive timeout per request; 0 = default.
+     * @return One Response per URL, in the same order.
+     */
+    static std::vector<Response> QueryBatch(const std::vector<std::string>& urls,
+                                            UINT maxConcurrency = 0,
+                                            DWORD timeoutMs = 0)
+    {
+        std::vector<std::wstring> wurls;
+        wurls.reserve(urls.size());
+        for (const std::string& url : urls)
+            wurls.push_back(s2w(url));
+
+        std::vector<WW_REQUESTW> requests(urls.size());
+        std::vector<WW_RESPONSEW> raw(urls.size());
+        for (size_t i = 0; i < urls.size(); ++i)
+        {
+            requests[i] = WW_REQUESTW{};
+            requests[i].url              = wurls[i].c_str();
+            requests[i].verb             = L"GET";
+            requests[i].connectTimeoutMs = timeoutMs;
+            requests[i].sendTimeoutMs    = timeoutMs;
+            requests[i].receiveTimeoutMs = timeoutMs;
+            raw[i] = WW_RESPONSEW{};
+        }
+
+        WW_BATCH_OPTIONS options{};
+        options.maxConcurrency = maxConcurrency;
+        WWQueryBatchW(requests.data(), raw.data(), requests.size(), &options);
+
+        std::vector<Response> out(urls.size());
+        for (size_t i = 0; i < urls.size(); ++i)
+        {
+            out[i].statusCode = raw[i].statusCode;
+            out[i].errorcode  = raw[i].errorcode;
+            if (raw[i].data != nullptr && raw[i].dataSize > 0)
+                out[i].data.assign(raw[i].data, raw[i].data + raw[i].dataSize);
+            WWFreeResponseW(&raw[i]);
+        }
+        return out;
+    }
+
     /** Return remote Content-Length via HEAD, following redirects. */
     static bool GetRemoteFileSize(const std::string& url,
                                   size_t& outSize,